@@ -8,14 +8,18 @@ from _cboar import (
     CBORDecodeError,
     CBOREncoder,
     CBORDecoder,
+    CBORSchema,
     CBORTag,
     CBORSimpleValue,
     undefined,
     break_marker,
     dump,
     dumps,
+    digest,
     load,
     loads,
+    loads_many,
+    compile_schema,
 )
 
 def shareable_encoder(func):
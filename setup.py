@@ -2,13 +2,16 @@ from setuptools import setup, Extension
 
 _cboar = Extension(
     '_cboar',
-    libraries=['m'],
+    libraries=['m', 'pthread'],
     sources=[
         'source/module.c',
         'source/encoder.c',
         'source/decoder.c',
         'source/tags.c',
         'source/halffloat.c',
+        'source/byteswap.c',
+        'source/tape.c',
+        'source/schema.c',
     ]
 )
 
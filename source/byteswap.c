@@ -0,0 +1,236 @@
+#include <stdint.h>
+#include <string.h>
+#include "byteswap.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BSWAP_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define BSWAP_NEON
+#include <arm_neon.h>
+#endif
+
+
+// Bulk byte-order reversal for typed array payloads. Each width has a scalar
+// implementation and, where the platform has them, vectorised variants
+// (SSSE3 and AVX2 on x86, NEON on ARM). Vector instruction sets on x86 can't
+// be assumed at compile time, so the implementation is selected on first use
+// by replacing the function pointer through which the public routines call
+
+
+// Scalar implementations ////////////////////////////////////////////////////
+
+static void bswap16_scalar(void *dest, const void *src, size_t count) {
+    uint16_t value;
+    size_t i;
+
+    for (i = 0; i < count; ++i) {
+        memcpy(&value, (const char *) src + i * 2, 2);
+        value = __builtin_bswap16(value);
+        memcpy((char *) dest + i * 2, &value, 2);
+    }
+}
+
+
+static void bswap32_scalar(void *dest, const void *src, size_t count) {
+    uint32_t value;
+    size_t i;
+
+    for (i = 0; i < count; ++i) {
+        memcpy(&value, (const char *) src + i * 4, 4);
+        value = __builtin_bswap32(value);
+        memcpy((char *) dest + i * 4, &value, 4);
+    }
+}
+
+
+static void bswap64_scalar(void *dest, const void *src, size_t count) {
+    uint64_t value;
+    size_t i;
+
+    for (i = 0; i < count; ++i) {
+        memcpy(&value, (const char *) src + i * 8, 8);
+        value = __builtin_bswap64(value);
+        memcpy((char *) dest + i * 8, &value, 8);
+    }
+}
+
+
+typedef void (bswap_func)(void *, const void *, size_t);
+
+#ifndef BSWAP_NEON
+static bswap_func *select_scalar(int bytes) {
+    switch (bytes) {
+        case 2: return bswap16_scalar;
+        case 4: return bswap32_scalar;
+        default: return bswap64_scalar;
+    }
+}
+#endif
+
+
+// x86 implementations ///////////////////////////////////////////////////////
+
+#ifdef BSWAP_X86
+
+// Byte shuffles reversing each 2, 4, and 8 byte group in a 16 byte lane
+#define SHUFFLE_16 \
+    1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14
+#define SHUFFLE_32 \
+    3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+#define SHUFFLE_64 \
+    7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8
+
+__attribute__((target("ssse3")))
+static size_t bswap_ssse3(char *dest, const char *src, size_t size,
+                          const __m128i mask) {
+    size_t i;
+
+    for (i = 0; i + 16 <= size; i += 16)
+        _mm_storeu_si128((__m128i *) (dest + i), _mm_shuffle_epi8(
+                    _mm_loadu_si128((const __m128i *) (src + i)), mask));
+    return i;
+}
+
+
+__attribute__((target("avx2")))
+static size_t bswap_avx2(char *dest, const char *src, size_t size,
+                         const __m256i mask) {
+    size_t i;
+
+    for (i = 0; i + 32 <= size; i += 32)
+        _mm256_storeu_si256((__m256i *) (dest + i), _mm256_shuffle_epi8(
+                    _mm256_loadu_si256((const __m256i *) (src + i)), mask));
+    return i;
+}
+
+
+// Each vectorised routine handles the bulk of the buffer, leaving any tail
+// shorter than a vector to the scalar routine
+
+#define BSWAP_X86_FUNCS(bits, bytes)                                          \
+__attribute__((target("ssse3")))                                              \
+static void bswap##bits##_ssse3(void *dest, const void *src, size_t count) {  \
+    size_t done;                                                              \
+                                                                              \
+    done = bswap_ssse3(dest, src, count * bytes,                              \
+            _mm_setr_epi8(SHUFFLE_##bits));                                   \
+    bswap##bits##_scalar((char *) dest + done, (const char *) src + done,     \
+            count - done / bytes);                                            \
+}                                                                             \
+                                                                              \
+__attribute__((target("avx2")))                                               \
+static void bswap##bits##_avx2(void *dest, const void *src, size_t count) {   \
+    size_t done;                                                              \
+                                                                              \
+    done = bswap_avx2(dest, src, count * bytes,                               \
+            _mm256_setr_epi8(SHUFFLE_##bits, SHUFFLE_##bits));                \
+    bswap##bits##_scalar((char *) dest + done, (const char *) src + done,     \
+            count - done / bytes);                                            \
+}
+
+BSWAP_X86_FUNCS(16, 2)
+BSWAP_X86_FUNCS(32, 4)
+BSWAP_X86_FUNCS(64, 8)
+
+#undef BSWAP_X86_FUNCS
+
+static bswap_func *select_func(int bytes) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        switch (bytes) {
+            case 2: return bswap16_avx2;
+            case 4: return bswap32_avx2;
+            case 8: return bswap64_avx2;
+        }
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        switch (bytes) {
+            case 2: return bswap16_ssse3;
+            case 4: return bswap32_ssse3;
+            case 8: return bswap64_ssse3;
+        }
+    }
+    return select_scalar(bytes);
+}
+
+
+// ARM implementations ///////////////////////////////////////////////////////
+
+#elif defined(BSWAP_NEON)
+
+#define BSWAP_NEON_FUNC(bits, bytes)                                          \
+static void bswap##bits##_neon(void *dest, const void *src, size_t count) {   \
+    size_t i, size = count * bytes;                                           \
+                                                                              \
+    for (i = 0; i + 16 <= size; i += 16)                                      \
+        vst1q_u8((uint8_t *) dest + i, vrev##bits##q_u8(                      \
+                    vld1q_u8((const uint8_t *) src + i)));                    \
+    bswap##bits##_scalar((char *) dest + i, (const char *) src + i,           \
+            count - i / bytes);                                               \
+}
+
+BSWAP_NEON_FUNC(16, 2)
+BSWAP_NEON_FUNC(32, 4)
+BSWAP_NEON_FUNC(64, 8)
+
+#undef BSWAP_NEON_FUNC
+
+static bswap_func *select_func(int bytes) {
+    switch (bytes) {
+        case 2: return bswap16_neon;
+        case 4: return bswap32_neon;
+        default: return bswap64_neon;
+    }
+}
+
+
+// Fallback //////////////////////////////////////////////////////////////////
+
+#else
+
+static bswap_func *select_func(int bytes) {
+    return select_scalar(bytes);
+}
+
+#endif
+
+
+// Public interface //////////////////////////////////////////////////////////
+
+// Each pointer initially refers to a routine which selects the best
+// implementation for the running CPU, replaces the pointer with it, then
+// calls it; the selection is idempotent so a race between threads on the
+// first call is harmless
+
+#define BSWAP_PUBLIC_FUNC(bits, bytes)                                        \
+static void bswap##bits##_init(void *, const void *, size_t);                 \
+static bswap_func *bswap##bits##_impl = bswap##bits##_init;                   \
+                                                                              \
+static void bswap##bits##_init(void *dest, const void *src, size_t count) {   \
+    bswap##bits##_impl = select_func(bytes);                                  \
+    bswap##bits##_impl(dest, src, count);                                     \
+}                                                                             \
+                                                                              \
+void bswap##bits##_array(void *dest, const void *src, size_t count) {         \
+    bswap##bits##_impl(dest, src, count);                                     \
+}
+
+BSWAP_PUBLIC_FUNC(16, 2)
+BSWAP_PUBLIC_FUNC(32, 4)
+BSWAP_PUBLIC_FUNC(64, 8)
+
+#undef BSWAP_PUBLIC_FUNC
+
+
+void bswap_array(void *dest, const void *src, size_t count, int itemsize) {
+    switch (itemsize) {
+        case 2: bswap16_array(dest, src, count); break;
+        case 4: bswap32_array(dest, src, count); break;
+        case 8: bswap64_array(dest, src, count); break;
+        default:
+            if (dest != src)
+                memcpy(dest, src, count * itemsize);
+            break;
+    }
+}
@@ -0,0 +1,11 @@
+#include <stddef.h>
+
+// Reverse the byte order of count 16, 32, or 64-bit items from src into dest
+// (which may be the same buffer as src, but must not otherwise overlap it)
+void bswap16_array(void *dest, const void *src, size_t count);
+void bswap32_array(void *dest, const void *src, size_t count);
+void bswap64_array(void *dest, const void *src, size_t count);
+
+// Reverse the byte order of count items of itemsize (1, 2, 4, or 8) bytes
+// from src into dest; items of a single byte are simply copied
+void bswap_array(void *dest, const void *src, size_t count, int itemsize);
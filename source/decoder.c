@@ -10,8 +10,10 @@
 #include <datetime.h>
 #include "module.h"
 #include "halffloat.h"
+#include "byteswap.h"
 #include "tags.h"
 #include "decoder.h"
+#include "schema.h"
 
 
 enum DecodeOption {
@@ -25,8 +27,19 @@ static int _CBORDecoder_set_fp(CBORDecoderObject *, PyObject *, void *);
 static int _CBORDecoder_set_tag_hook(CBORDecoderObject *, PyObject *, void *);
 static int _CBORDecoder_set_object_hook(CBORDecoderObject *, PyObject *, void *);
 static int _CBORDecoder_set_str_errors(CBORDecoderObject *, PyObject *, void *);
+static int _CBORDecoder_set_engine(CBORDecoderObject *, PyObject *, void *);
+static int _CBORDecoder_set_max_depth(CBORDecoderObject *, PyObject *, void *);
+static int _CBORDecoder_set_schemas(CBORDecoderObject *, PyObject *, void *);
+static void release_buffer(CBORDecoderObject *);
+static void clear_keys(CBORDecoderObject *);
+static void clear_shareables(CBORDecoderObject *);
+static void pop_stringrefs(CBORDecoderObject *);
+static void pop_packed(CBORDecoderObject *);
+static bool is_ascii(const char *, const Py_ssize_t);
+static bool utf8_complete(const char *, const Py_ssize_t);
 
 static PyObject * decode(CBORDecoderObject *, DecodeOptions);
+static PyObject * decode_lead(CBORDecoderObject *, LeadByte, DecodeOptions);
 static PyObject * decode_bytestring(CBORDecoderObject *, uint8_t);
 static PyObject * decode_string(CBORDecoderObject *, uint8_t);
 static PyObject * CBORDecoder_decode_datestr(CBORDecoderObject *);
@@ -46,9 +59,21 @@ static PyObject * CBORDecoder_decode_float64(CBORDecoderObject *);
 static PyObject * CBORDecoder_decode_ipaddress(CBORDecoderObject *);
 static PyObject * CBORDecoder_decode_ipnetwork(CBORDecoderObject *);
 
+static bool typed_array_format(const uint64_t, char *, int *, bool *);
+static PyObject * decode_typed_array(CBORDecoderObject *, const char,
+                                     const int, const bool);
+static PyObject * decode_typed_array_lead(CBORDecoderObject *, LeadByte,
+                                          const char, const int, const bool);
+
 static PyObject * CBORDecoder_decode_shareable(CBORDecoderObject *);
 static PyObject * CBORDecoder_decode_shared(CBORDecoderObject *);
+static PyObject * CBORDecoder_decode_stringref(CBORDecoderObject *);
+static PyObject * CBORDecoder_decode_stringref_namespace(CBORDecoderObject *);
+static PyObject * CBORDecoder_decode_packed(CBORDecoderObject *);
+static PyObject * CBORDecoder_decode_packed_reference(CBORDecoderObject *);
+static PyObject * decode_packed_item(CBORDecoderObject *, uint64_t);
 static PyObject * CBORDecoder_decode_set(CBORDecoderObject *);
+static PyObject * CBORDecoder_decode_columnar(CBORDecoderObject *);
 
 
 // Constructors and destructors //////////////////////////////////////////////
@@ -56,10 +81,15 @@ static PyObject * CBORDecoder_decode_set(CBORDecoderObject *);
 static int
 CBORDecoder_traverse(CBORDecoderObject *self, visitproc visit, void *arg)
 {
+    Py_ssize_t i;
+
     Py_VISIT(self->read);
     Py_VISIT(self->tag_hook);
     Py_VISIT(self->object_hook);
-    Py_VISIT(self->shareables);
+    Py_VISIT(self->schemas);
+    Py_VISIT(self->schema_index);
+    for (i = 0; i < self->shareables_len; ++i)
+        Py_VISIT(self->shareables[i]);
     // No need to visit str_errors; it's only a string and can't reference us
     // or other objects
     return 0;
@@ -71,8 +101,17 @@ CBORDecoder_clear(CBORDecoderObject *self)
     Py_CLEAR(self->read);
     Py_CLEAR(self->tag_hook);
     Py_CLEAR(self->object_hook);
-    Py_CLEAR(self->shareables);
+    Py_CLEAR(self->schemas);
+    Py_CLEAR(self->schema_index);
+    clear_shareables(self);
+    while (self->stringrefs)
+        pop_stringrefs(self);
+    while (self->packed)
+        pop_packed(self);
     Py_CLEAR(self->str_errors);
+    Py_CLEAR(self->buf_obj);
+    self->buf = NULL;
+    clear_keys(self);
     return 0;
 }
 
@@ -83,6 +122,7 @@ CBORDecoder_dealloc(CBORDecoderObject *self)
 {
     PyObject_GC_UnTrack(self);
     CBORDecoder_clear(self);
+    PyMem_Free(self->shareables);
     Py_TYPE(self)->tp_free((PyObject *) self);
 }
 
@@ -99,10 +139,9 @@ CBORDecoder_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
 
     self = (CBORDecoderObject *) type->tp_alloc(type, 0);
     if (self) {
-        // self.shareables = []
-        self->shareables = PyList_New(0);
-        if (!self->shareables)
-            goto error;
+        self->shareables = NULL;
+        self->shareables_len = 0;
+        self->shareables_size = 0;
         Py_INCREF(Py_None);
         self->read = Py_None;
         Py_INCREF(Py_None);
@@ -112,26 +151,45 @@ CBORDecoder_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
         self->str_errors = PyBytes_FromString("strict");
         self->immutable = false;
         self->shared_index = -1;
+        self->buf = NULL;
+        self->buf_len = 0;
+        self->buf_pos = 0;
+        self->buf_obj = NULL;
+        self->keys = NULL;
+        self->engine = ENGINE_STREAM;
+        self->max_depth = DEFAULT_MAX_DEPTH;
+        self->nesting = 0;
+        self->stringrefs = NULL;
+        self->packed = NULL;
+        self->packed_sharing = true;
+        self->packed_budget = 0;
+        self->presize_budget = MAP_PRESIZE_BUDGET;
+        Py_INCREF(Py_None);
+        self->schemas = Py_None;
+        self->schema_index = NULL;
+        self->schema_max = 0;
     }
     return (PyObject *) self;
-error:
-    Py_DECREF(self);
-    return NULL;
 }
 
 
-// CBORDecoder.__init__(self, fp=None, tag_hook=None, object_hook=None)
+// CBORDecoder.__init__(self, fp=None, tag_hook=None, object_hook=None,
+//                      str_errors='strict', engine='stream', max_depth=100000,
+//                      packed_sharing=True, schemas=None)
 int
 CBORDecoder_init(CBORDecoderObject *self, PyObject *args, PyObject *kwargs)
 {
     static char *keywords[] = {
-        "fp", "tag_hook", "object_hook", "str_errors", NULL
+        "fp", "tag_hook", "object_hook", "str_errors", "engine", "max_depth",
+        "packed_sharing", "schemas", NULL
     };
     PyObject *fp = NULL, *tag_hook = NULL, *object_hook = NULL,
-             *str_errors = NULL;
+             *str_errors = NULL, *engine = NULL, *max_depth = NULL,
+             *schemas = NULL;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OOO", keywords,
-                &fp, &tag_hook, &object_hook, &str_errors))
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OOOOOpO", keywords,
+                &fp, &tag_hook, &object_hook, &str_errors, &engine,
+                &max_depth, &self->packed_sharing, &schemas))
         return -1;
 
     if (_CBORDecoder_set_fp(self, fp, NULL) == -1)
@@ -142,6 +200,12 @@ CBORDecoder_init(CBORDecoderObject *self, PyObject *args, PyObject *kwargs)
         return -1;
     if (str_errors && _CBORDecoder_set_str_errors(self, str_errors, NULL) == -1)
         return -1;
+    if (engine && _CBORDecoder_set_engine(self, engine, NULL) == -1)
+        return -1;
+    if (max_depth && _CBORDecoder_set_max_depth(self, max_depth, NULL) == -1)
+        return -1;
+    if (schemas && _CBORDecoder_set_schemas(self, schemas, NULL) == -1)
+        return -1;
 
     return 0;
 }
@@ -180,6 +244,8 @@ _CBORDecoder_set_fp(CBORDecoderObject *self, PyObject *value, void *closure)
     tmp = self->read;
     self->read = read;
     Py_DECREF(tmp);
+    // Anything the tape engine read ahead came from the old fp
+    release_buffer(self);
     return 0;
 }
 
@@ -299,31 +365,223 @@ _CBORDecoder_set_str_errors(CBORDecoderObject *self, PyObject *value,
 }
 
 
-// Utility functions /////////////////////////////////////////////////////////
+// CBORDecoder._get_engine(self)
+static PyObject *
+_CBORDecoder_get_engine(CBORDecoderObject *self, void *closure)
+{
+    PyObject *ret;
+
+    switch (self->engine) {
+        case ENGINE_TAPE:      ret = _CBOAR_str_tape;      break;
+        case ENGINE_ITERATIVE: ret = _CBOAR_str_iterative; break;
+        default:               ret = _CBOAR_str_stream;    break;
+    }
+    Py_INCREF(ret);
+    return ret;
+}
+
 
+// CBORDecoder._set_engine(self, value)
 static int
-fp_read(CBORDecoderObject *self, char *buf, const uint64_t size)
+_CBORDecoder_set_engine(CBORDecoderObject *self, PyObject *value,
+                        void *closure)
+{
+    if (!value) {
+        PyErr_SetString(PyExc_TypeError,
+                        "cannot delete engine attribute");
+        return -1;
+    }
+    if (PyUnicode_Check(value)) {
+        if (!PyUnicode_Compare(value, _CBOAR_str_stream)) {
+            self->engine = ENGINE_STREAM;
+            return 0;
+        } else if (!PyUnicode_Compare(value, _CBOAR_str_tape)) {
+            self->engine = ENGINE_TAPE;
+            return 0;
+        } else if (!PyUnicode_Compare(value, _CBOAR_str_iterative)) {
+            self->engine = ENGINE_ITERATIVE;
+            return 0;
+        }
+    }
+    if (!PyErr_Occurred())
+        PyErr_Format(PyExc_ValueError,
+                "invalid engine value %R (must be one of 'stream', 'tape', "
+                "or 'iterative')", value);
+    return -1;
+}
+
+
+// CBORDecoder._get_max_depth(self)
+static PyObject *
+_CBORDecoder_get_max_depth(CBORDecoderObject *self, void *closure)
+{
+    return PyLong_FromSsize_t(self->max_depth);
+}
+
+
+// CBORDecoder._set_max_depth(self, value)
+static int
+_CBORDecoder_set_max_depth(CBORDecoderObject *self, PyObject *value,
+                           void *closure)
+{
+    Py_ssize_t max_depth;
+
+    if (!value) {
+        PyErr_SetString(PyExc_TypeError,
+                        "cannot delete max_depth attribute");
+        return -1;
+    }
+    if (PyLong_Check(value)) {
+        max_depth = PyLong_AsSsize_t(value);
+        if (max_depth > 0) {
+            self->max_depth = max_depth;
+            return 0;
+        }
+        PyErr_Clear();
+    }
+    PyErr_Format(PyExc_ValueError,
+            "invalid max_depth value %R (must be a positive integer)",
+            value);
+    return -1;
+}
+
+
+// CBORDecoder._get_schemas(self)
+static PyObject *
+_CBORDecoder_get_schemas(CBORDecoderObject *self, void *closure)
+{
+    Py_INCREF(self->schemas);
+    return self->schemas;
+}
+
+
+// Adds schema to the lists of schemas in index for each of its fields
+static int
+index_schema(PyObject *index, CBORSchemaObject *schema)
+{
+    PyObject *list;
+    Py_ssize_t i;
+
+    for (i = 0; i < schema->length; ++i) {
+        list = PyDict_GetItemWithError(index, schema->fields[i].name);
+        if (!list) {
+            if (PyErr_Occurred())
+                return -1;
+            list = PyList_New(0);
+            if (!list)
+                return -1;
+            if (PyDict_SetItem(index, schema->fields[i].name, list) == -1) {
+                Py_DECREF(list);
+                return -1;
+            }
+            Py_DECREF(list);
+        }
+        if (PyList_Append(list, (PyObject *) schema) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+
+// CBORDecoder._set_schemas(self, value)
+static int
+_CBORDecoder_set_schemas(CBORDecoderObject *self, PyObject *value,
+                         void *closure)
+{
+    PyObject *schemas, *index = NULL;
+    CBORSchemaObject *schema;
+    Py_ssize_t i, max = 0;
+
+    if (!value) {
+        PyErr_SetString(PyExc_TypeError,
+                        "cannot delete schemas attribute");
+        return -1;
+    }
+    if (value == Py_None) {
+        Py_INCREF(value);
+        schemas = value;
+    } else {
+        schemas = PySequence_Tuple(value);
+        if (!schemas)
+            return -1;
+        index = PyDict_New();
+        for (i = 0; index && i < PyTuple_GET_SIZE(schemas); ++i) {
+            schema = (CBORSchemaObject *) PyTuple_GET_ITEM(schemas, i);
+            if (!CBORSchema_CheckExact(schema)) {
+                PyErr_Format(PyExc_ValueError,
+                        "invalid schemas value %R (must be a sequence of "
+                        "CBORSchema or None)", value);
+                Py_CLEAR(index);
+            } else if (index_schema(index, schema) == -1)
+                Py_CLEAR(index);
+            else if (schema->length > max)
+                max = schema->length;
+        }
+        if (!index) {
+            Py_DECREF(schemas);
+            return -1;
+        }
+    }
+    Py_XSETREF(self->schemas, schemas);
+    Py_XSETREF(self->schema_index, index);
+    self->schema_max = max;
+    return 0;
+}
+
+
+// Utility functions /////////////////////////////////////////////////////////
+
+// Discards anything the tape engine read ahead from fp
+static void
+release_buffer(CBORDecoderObject *self)
+{
+    if (self->buf_obj) {
+        Py_CLEAR(self->buf_obj);
+        self->buf = NULL;
+        self->buf_len = 0;
+        self->buf_pos = 0;
+    }
+}
+
+
+static void
+premature_end(const uint64_t size, const Py_ssize_t got)
 {
-    PyObject *obj, *size_obj;
-    char *data;
-    int ret = -1;
+    PyErr_Format(
+        _CBOAR_CBORDecodeError,
+        "premature end of stream (expected to read %llu bytes, got %zd "
+        "instead)", size, got);
+}
+
+
+// Read exactly size bytes from the input, returning them as a new bytes
+// object
+static PyObject *
+fp_read_object(CBORDecoderObject *self, const uint64_t size)
+{
+    PyObject *obj, *size_obj, *ret = NULL;
 
+    if (self->buf) {
+        if (size > (uint64_t) (self->buf_len - self->buf_pos)) {
+            premature_end(size, self->buf_len - self->buf_pos);
+            return NULL;
+        }
+        ret = PyBytes_FromStringAndSize(self->buf + self->buf_pos, size);
+        if (ret)
+            self->buf_pos += size;
+        return ret;
+    }
     size_obj = PyLong_FromUnsignedLongLong(size);
     if (size_obj) {
         obj = PyObject_CallFunctionObjArgs(self->read, size_obj, NULL);
         if (obj) {
             assert(PyBytes_CheckExact(obj));
             if (PyBytes_GET_SIZE(obj) == size) {
-                data = PyBytes_AS_STRING(obj);
-                memcpy(buf, data, size);
-                ret = 0;
+                ret = obj;
             } else {
-                PyErr_Format(
-                    _CBOAR_CBORDecodeError,
-                    "premature end of stream (expected to read %d bytes, "
-                    "got %d instead)", size, PyBytes_GET_SIZE(obj));
+                premature_end(size, PyBytes_GET_SIZE(obj));
+                Py_DECREF(obj);
             }
-            Py_DECREF(obj);
         }
         Py_DECREF(size_obj);
     }
@@ -331,6 +589,30 @@ fp_read(CBORDecoderObject *self, char *buf, const uint64_t size)
 }
 
 
+static int
+fp_read(CBORDecoderObject *self, char *buf, const uint64_t size)
+{
+    PyObject *obj;
+
+    if (self->buf) {
+        if (size > (uint64_t) (self->buf_len - self->buf_pos)) {
+            premature_end(size, self->buf_len - self->buf_pos);
+            return -1;
+        }
+        memcpy(buf, self->buf + self->buf_pos, size);
+        self->buf_pos += size;
+        return 0;
+    }
+    obj = fp_read_object(self, size);
+    if (obj) {
+        memcpy(buf, PyBytes_AS_STRING(obj), size);
+        Py_DECREF(obj);
+        return 0;
+    }
+    return -1;
+}
+
+
 // CBORDecoder.read(self, length) -> bytes
 static PyObject *
 CBORDecoder_read(CBORDecoderObject *self, PyObject *length)
@@ -352,18 +634,236 @@ CBORDecoder_read(CBORDecoderObject *self, PyObject *length)
 }
 
 
+// Shareable values are held in a growable array which is emptied (but kept)
+// at the start of each top-level decode. Entries are NULL until their value
+// has been (at least partially) constructed
+
+// Reserves the next shareable entry, returning its index or -1 on error
+static Py_ssize_t
+new_shareable(CBORDecoderObject *self)
+{
+    PyObject **tmp;
+    Py_ssize_t size;
+
+    if (self->shareables_len == self->shareables_size) {
+        if (self->shareables_size >= INT32_MAX) {
+            PyErr_SetString(_CBOAR_CBORDecodeError, "too many shareables");
+            return -1;
+        }
+        size = self->shareables_size ? self->shareables_size * 2 : 16;
+        tmp = PyMem_Realloc(self->shareables, size * sizeof(PyObject *));
+        if (!tmp) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        self->shareables = tmp;
+        self->shareables_size = size;
+    }
+    self->shareables[self->shareables_len] = NULL;
+    return self->shareables_len++;
+}
+
+
 static inline void
 set_shareable(CBORDecoderObject *self, PyObject *value)
 {
+    PyObject *tmp;
+
     if (value && self->shared_index != -1) {
-        Py_INCREF(value);  // PyList_SetItem "steals" reference
-        // TODO use weakrefs? or explicitly empty list?
-#ifndef NDEBUG
-        int ret =
-#endif
-        PyList_SetItem(self->shareables, self->shared_index, value);
-        assert(!ret);
+        tmp = self->shareables[self->shared_index];
+        Py_INCREF(value);
+        self->shareables[self->shared_index] = value;
+        Py_XDECREF(tmp);
+    }
+}
+
+
+static void
+clear_shareables(CBORDecoderObject *self)
+{
+    PyObject **items = self->shareables;
+    Py_ssize_t len = self->shareables_len, size = self->shareables_size;
+
+    // Detach the array before releasing its values, as a finalizer may
+    // re-enter the decoder (which then starts a new one)
+    self->shareables = NULL;
+    self->shareables_len = 0;
+    self->shareables_size = 0;
+    while (len)
+        Py_XDECREF(items[--len]);
+    if (self->shareables)
+        PyMem_Free(items);
+    else {
+        self->shareables = items;
+        self->shareables_size = size;
+    }
+}
+
+
+// Opens a new stringref namespace within the current one
+static int
+push_stringrefs(CBORDecoderObject *self)
+{
+    StringRefs *refs;
+
+    refs = PyMem_Malloc(sizeof(StringRefs));
+    if (!refs) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    refs->items = NULL;
+    refs->length = 0;
+    refs->size = 0;
+    refs->outer = self->stringrefs;
+    self->stringrefs = refs;
+    return 0;
+}
+
+
+// Closes the innermost stringref namespace
+static void
+pop_stringrefs(CBORDecoderObject *self)
+{
+    StringRefs *refs = self->stringrefs;
+
+    self->stringrefs = refs->outer;
+    while (refs->length)
+        Py_DECREF(refs->items[--refs->length]);
+    PyMem_Free(refs->items);
+    PyMem_Free(refs);
+}
+
+
+// Adds value, decoded from a definite length string of length bytes, to the
+// innermost stringref namespace if it's long enough to be referenced
+static int
+add_stringref(CBORDecoderObject *self, PyObject *value, uint64_t length)
+{
+    StringRefs *refs = self->stringrefs;
+    PyObject **tmp;
+    Py_ssize_t size;
+
+    if (!stringref_eligible(refs->length, length))
+        return 0;
+    if (refs->length == refs->size) {
+        size = refs->size ? refs->size * 2 : 16;
+        tmp = PyMem_Realloc(refs->items, size * sizeof(PyObject *));
+        if (!tmp) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        refs->items = tmp;
+        refs->size = size;
+    }
+    Py_INCREF(value);
+    refs->items[refs->length++] = value;
+    return 0;
+}
+
+
+// Opens a new packed CBOR table of length items within the current one
+static int
+push_packed(CBORDecoderObject *self, Py_ssize_t length)
+{
+    PackedTable *table;
+
+    table = PyMem_Malloc(sizeof(PackedTable));
+    if (!table) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    table->items = PyList_New(0);
+    if (!table->items) {
+        PyMem_Free(table);
+        return -1;
+    }
+    table->length = length;
+    table->outer = self->packed;
+    if (!table->outer)
+        self->packed_budget = PACKED_EXPANSION_LIMIT;
+    self->packed = table;
+    return 0;
+}
+
+
+// Closes the innermost packed CBOR table
+static void
+pop_packed(CBORDecoderObject *self)
+{
+    PackedTable *table = self->packed;
+
+    self->packed = table->outer;
+    Py_DECREF(table->items);
+    PyMem_Free(table);
+}
+
+
+// Deducts the items of a container about to be copied by unpack_item from
+// the decoder's packed_budget, raising CBORDecodeError if it's exhausted
+static int
+charge_unpack(CBORDecoderObject *self, Py_ssize_t length)
+{
+    if (length >= self->packed_budget) {
+        self->packed_budget = 0;
+        PyErr_SetString(
+            _CBOAR_CBORDecodeError, "packed CBOR expansion limit exceeded");
+        return -1;
+    }
+    self->packed_budget -= length + 1;
+    return 0;
+}
+
+
+// Returns the value of a reference to the packed item (or a copy of it when
+// packed_sharing is off). Mutable containers are copied, and arrays and sets
+// are converted to their immutable forms where the decoder requires them
+static PyObject *
+unpack_item(CBORDecoderObject *self, PyObject *item, bool immutable,
+            bool copy)
+{
+    PyObject *key, *value, *ret = NULL;
+    Py_ssize_t i, length, pos = 0;
+
+    if (PyList_CheckExact(item) && (immutable || copy)) {
+        length = PyList_GET_SIZE(item);
+        if (charge_unpack(self, length) == -1)
+            return NULL;
+        if (Py_EnterRecursiveCall(" while unpacking a packed CBOR item"))
+            return NULL;
+        ret = immutable ? PyTuple_New(length) : PyList_New(length);
+        for (i = 0; ret && i < length; ++i) {
+            value = unpack_item(
+                    self, PyList_GET_ITEM(item, i), immutable, copy);
+            if (!value)
+                Py_CLEAR(ret);
+            else if (immutable)
+                PyTuple_SET_ITEM(ret, i, value);
+            else
+                PyList_SET_ITEM(ret, i, value);
+        }
+        Py_LeaveRecursiveCall();
+    } else if (PyDict_CheckExact(item) && copy && !immutable) {
+        if (charge_unpack(self, PyDict_GET_SIZE(item)) == -1)
+            return NULL;
+        if (Py_EnterRecursiveCall(" while unpacking a packed CBOR item"))
+            return NULL;
+        ret = PyDict_New();
+        while (ret && PyDict_Next(item, &pos, &key, &value)) {
+            value = unpack_item(self, value, false, true);
+            if (!value || PyDict_SetItem(ret, key, value) == -1)
+                Py_CLEAR(ret);
+            Py_XDECREF(value);
+        }
+        Py_LeaveRecursiveCall();
+    } else if (PySet_CheckExact(item) && (immutable || copy)) {
+        if (charge_unpack(self, PySet_GET_SIZE(item)) == -1)
+            return NULL;
+        ret = immutable ? PyFrozenSet_New(item) : PySet_New(item);
+    } else {
+        Py_INCREF(item);
+        ret = item;
     }
+    return ret;
 }
 
 
@@ -467,70 +967,182 @@ decode_negint(CBORDecoderObject *self, uint8_t subtype)
 static PyObject *
 decode_definite_bytestring(CBORDecoderObject *self, uint64_t length)
 {
-    PyObject *ret = NULL;
-
-    if (length > PY_SSIZE_T_MAX)
-        return NULL;
-    ret = PyBytes_FromStringAndSize(NULL, length);
-    if (!ret)
-        return NULL;
-    if (fp_read(self, PyBytes_AS_STRING(ret), length) == -1) {
-        Py_DECREF(ret);
+    // The object returned by read() is the result; no further copy is needed
+    if (length > PY_SSIZE_T_MAX) {
+        PyErr_Format(
+            _CBOAR_CBORDecodeError, "excessive bytestring length %llu", length);
         return NULL;
     }
-    return ret;
+    return fp_read_object(self, length);
 }
 
 
-static PyObject *
-decode_indefinite_bytestrings(CBORDecoderObject *self)
+// The chunks of an indefinite-length byte or text string are appended to a
+// single bytes object, grown as needed and trimmed to size at the end. Text
+// chunks are checked as they're added (see append_chunk), so the result needs
+// decoding just once
+typedef struct {
+    PyObject *bytes;
+    Py_ssize_t used;
+    bool ascii;  // all chunks so far were 7-bit ASCII
+} ChunkBuffer;
+
+
+// Returns a pointer to room for length more bytes in chunks
+static char *
+chunk_reserve(ChunkBuffer *chunks, const Py_ssize_t length)
 {
-    PyObject *list, *ret = NULL;
-    LeadByte lead;
+    Py_ssize_t size;
 
-    list = PyList_New(0);
-    if (list) {
-        while (1) {
-            if (fp_read(self, &lead.byte, 1) == -1)
-                break;
-            if (lead.major == 2) {
-                ret = decode_bytestring(self, lead.subtype);
-                if (ret) {
-                    PyList_Append(list, ret);
-                    Py_DECREF(ret);
-                    ret = NULL;
-                }
-            } else if (lead.major == 7 && lead.subtype == 31) { // break-code
-                ret = PyObject_CallMethodObjArgs(
-                        _CBOAR_empty_bytes, _CBOAR_str_join, list, NULL);
-                break;
-            } else {
-                PyErr_SetString(
-                    _CBOAR_CBORDecodeError,
-                    "non-bytestring found in indefinite length bytestring");
-                break;
+    if (!chunks->bytes) {
+        chunks->bytes = PyBytes_FromStringAndSize(
+                NULL, length > 1024 ? length * 2 : 1024);
+        if (!chunks->bytes)
+            return NULL;
+    } else if (PyBytes_GET_SIZE(chunks->bytes) - chunks->used < length) {
+        size = PyBytes_GET_SIZE(chunks->bytes);
+        size = size > PY_SSIZE_T_MAX / 2 ? PY_SSIZE_T_MAX : size * 2;
+        if (size - chunks->used < length)
+            size = chunks->used + length;
+        if (_PyBytes_Resize(&chunks->bytes, size) == -1)
+            return NULL;
+    }
+    return PyBytes_AS_STRING(chunks->bytes) + chunks->used;
+}
+
+
+// Reads a definite-length chunk of length bytes into chunks. Text chunks
+// must each be valid UTF-8 by themselves; in particular a character may not
+// be split between chunks, so one which ends part way through a character is
+// decoded by itself (according to str_errors), and the result added in its
+// place. Any other invalid UTF-8 is found when the whole string is decoded
+static int
+append_chunk(CBORDecoderObject *self, ChunkBuffer *chunks,
+             const uint8_t major, const uint64_t length)
+{
+    PyObject *obj = NULL;
+    const char *utf8;
+    char *dest;
+    Py_ssize_t size;
+
+    if (length > (uint64_t) (PY_SSIZE_T_MAX - chunks->used)) {
+        PyErr_Format(_CBOAR_CBORDecodeError, major == 2 ?
+                "excessive bytestring length %llu" :
+                "excessive string length %llu", length);
+        return -1;
+    }
+    // Check the input holds the chunk before growing the buffer for it
+    if (self->buf) {
+        if (length > (uint64_t) (self->buf_len - self->buf_pos)) {
+            premature_end(length, self->buf_len - self->buf_pos);
+            return -1;
+        }
+    } else if (!(obj = fp_read_object(self, length)))
+        return -1;
+    dest = chunk_reserve(chunks, length);
+    if (dest) {
+        if (obj)
+            memcpy(dest, PyBytes_AS_STRING(obj), length);
+        else {
+            memcpy(dest, self->buf + self->buf_pos, length);
+            self->buf_pos += length;
+        }
+    }
+    Py_XDECREF(obj);
+    if (!dest)
+        return -1;
+    if (major == 3 && !(chunks->ascii && is_ascii(dest, length))) {
+        chunks->ascii = false;
+        if (length && !utf8_complete(dest, length)) {
+            obj = PyUnicode_DecodeUTF8(
+                    dest, length, PyBytes_AS_STRING(self->str_errors));
+            if (!obj)
+                return -1;
+            utf8 = PyUnicode_AsUTF8AndSize(obj, &size);
+            if (utf8 && (dest = chunk_reserve(chunks, size))) {
+                memcpy(dest, utf8, size);
+                chunks->used += size;
             }
+            Py_DECREF(obj);
+            return utf8 && dest ? 0 : -1;
         }
-        Py_DECREF(list);
     }
-    return ret;
+    chunks->used += length;
+    return 0;
 }
 
 
-static PyObject *
-decode_bytestring(CBORDecoderObject *self, uint8_t subtype)
+// Reads the chunks of an indefinite-length string of the specified major type
+// up to its break marker. Chunks which are themselves indefinite-length
+// strings are accepted, and their content added in place
+static int
+read_chunks(CBORDecoderObject *self, ChunkBuffer *chunks, const uint8_t major)
 {
-    // major type 2
+    Py_ssize_t depth = 1;
+    LeadByte lead;
     uint64_t length;
-    bool indefinite = true;
-    PyObject *ret;
-
-    if (decode_length(self, subtype, &length, &indefinite) == -1)
-        return NULL;
-    if (indefinite)
-        ret = decode_indefinite_bytestrings(self);
-    else
+    bool indefinite;
+
+    while (depth) {
+        if (fp_read(self, &lead.byte, 1) == -1)
+            return -1;
+        if (lead.major == major) {
+            indefinite = true;
+            if (decode_length(self, lead.subtype, &length, &indefinite) == -1)
+                return -1;
+            if (indefinite)
+                depth++;
+            else if (append_chunk(self, chunks, major, length) == -1)
+                return -1;
+        } else if (lead.major == 7 && lead.subtype == 31) { // break-code
+            depth--;
+        } else {
+            PyErr_SetString(_CBOAR_CBORDecodeError, major == 2 ?
+                    "non-bytestring found in indefinite length bytestring" :
+                    "non-string found in indefinite length string");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+static PyObject *
+decode_indefinite_bytestrings(CBORDecoderObject *self)
+{
+    // Chunks are decoded directly (rather than by decode_bytestring) as they
+    // aren't added to any stringref namespace
+    ChunkBuffer chunks = {NULL, 0, true};
+
+    if (read_chunks(self, &chunks, 2) == -1) {
+        Py_XDECREF(chunks.bytes);
+        return NULL;
+    }
+    if (!chunks.bytes)
+        return PyBytes_FromStringAndSize(NULL, 0);
+    if (_PyBytes_Resize(&chunks.bytes, chunks.used) == -1)
+        return NULL;
+    return chunks.bytes;
+}
+
+
+static PyObject *
+decode_bytestring(CBORDecoderObject *self, uint8_t subtype)
+{
+    // major type 2
+    uint64_t length;
+    bool indefinite = true;
+    PyObject *ret;
+
+    if (decode_length(self, subtype, &length, &indefinite) == -1)
+        return NULL;
+    if (indefinite)
+        ret = decode_indefinite_bytestrings(self);
+    else {
         ret = decode_definite_bytestring(self, length);
+        if (ret && self->stringrefs && add_stringref(self, ret, length) == -1)
+            Py_CLEAR(ret);
+    }
     set_shareable(self, ret);
     return ret;
 }
@@ -550,22 +1162,90 @@ decode_bytestring(CBORDecoderObject *self, uint8_t subtype)
 // happily ignore UTF-8 characters split across chunks.
 
 
+// Returns true if the size bytes at buf are all 7-bit ASCII. The bulk of the
+// buffer is tested 32 bytes at a time (which compilers vectorise)
+static bool
+is_ascii(const char *buf, const Py_ssize_t size)
+{
+    const uint64_t high = 0x8080808080808080ULL;
+    uint64_t words[4];
+    Py_ssize_t i = 0;
+
+    for (; i + 32 <= size; i += 32) {
+        memcpy(words, buf + i, 32);
+        if ((words[0] | words[1] | words[2] | words[3]) & high)
+            return false;
+    }
+    for (; i < size; i++)
+        if (buf[i] & 0x80)
+            return false;
+    return true;
+}
+
+
+// Returns true if the (non-empty) UTF-8 at buf doesn't end part way through
+// a character, i.e. the last lead byte has all the continuation bytes it calls
+// for. Other errors are left to the decoder
+static bool
+utf8_complete(const char *buf, const Py_ssize_t size)
+{
+    const unsigned char *s = (const unsigned char *) buf + size;
+    Py_ssize_t trail;
+
+    for (trail = 0; trail < 4 && trail < size; trail++) {
+        s--;
+        if ((*s & 0xC0) != 0x80)
+            // A lead byte (or ASCII); the number of leading 1 bits gives the
+            // length of its sequence
+            return trail + 1 >= (
+                *s < 0x80 ? 1 : *s < 0xE0 ? 2 : *s < 0xF0 ? 3 : 4);
+    }
+    // Nothing but continuation bytes; they're invalid regardless
+    return true;
+}
+
+
+static PyObject *
+decode_utf8(CBORDecoderObject *self, const char *buf, const Py_ssize_t size)
+{
+    // Large strings are checked for (and, if they're pure ASCII, copied into
+    // the new str) with the GIL released; anything else is decoded by Python
+    PyObject *ret;
+    bool ascii;
+
+    if (size >= CBOAR_GIL_THRESHOLD) {
+        Py_BEGIN_ALLOW_THREADS
+        ascii = is_ascii(buf, size);
+        Py_END_ALLOW_THREADS
+        if (ascii) {
+            ret = PyUnicode_New(size, 127);
+            if (ret) {
+                Py_BEGIN_ALLOW_THREADS
+                memcpy(PyUnicode_1BYTE_DATA(ret), buf, size);
+                Py_END_ALLOW_THREADS
+            }
+            return ret;
+        }
+    }
+    return PyUnicode_DecodeUTF8(buf, size, PyBytes_AS_STRING(self->str_errors));
+}
+
+
 static PyObject *
 decode_definite_string(CBORDecoderObject *self, uint64_t length)
 {
-    PyObject *ret = NULL;
-    char *buf;
+    PyObject *bytes, *ret = NULL;
 
-    if (length > PY_SSIZE_T_MAX)
+    if (length > PY_SSIZE_T_MAX) {
+        PyErr_Format(
+            _CBOAR_CBORDecodeError, "excessive string length %llu", length);
         return NULL;
-    buf = PyMem_Malloc(length);
-    if (!buf)
-        return PyErr_NoMemory();
-
-    if (fp_read(self, buf, length) == 0)
-        ret = PyUnicode_DecodeUTF8(
-                buf, length, PyBytes_AS_STRING(self->str_errors));
-    PyMem_Free(buf);
+    }
+    bytes = fp_read_object(self, length);
+    if (bytes) {
+        ret = decode_utf8(self, PyBytes_AS_STRING(bytes), length);
+        Py_DECREF(bytes);
+    }
     return ret;
 }
 
@@ -573,34 +1253,26 @@ decode_definite_string(CBORDecoderObject *self, uint64_t length)
 static PyObject *
 decode_indefinite_strings(CBORDecoderObject *self)
 {
-    PyObject *list, *ret = NULL;
-    LeadByte lead;
+    // See decode_indefinite_bytestrings; if every chunk was ASCII the result
+    // can simply be copied into the new str
+    ChunkBuffer chunks = {NULL, 0, true};
+    PyObject *ret = NULL;
 
-    list = PyList_New(0);
-    if (list) {
-        while (1) {
-            if (fp_read(self, &lead.byte, 1) == -1)
-                break;
-            if (lead.major == 3) {
-                ret = decode_string(self, lead.subtype);
-                if (ret) {
-                    PyList_Append(list, ret);
-                    Py_DECREF(ret);
-                    ret = NULL;
-                }
-            } else if (lead.major == 7 && lead.subtype == 31) { // break-code
-                ret = PyObject_CallMethodObjArgs(
-                        _CBOAR_empty_str, _CBOAR_str_join, list, NULL);
-                break;
-            } else {
-                PyErr_SetString(
-                    _CBOAR_CBORDecodeError,
-                    "non-string found in indefinite length string");
-                break;
-            }
-        }
-        Py_DECREF(list);
+    if (read_chunks(self, &chunks, 3) == 0) {
+        if (!chunks.bytes) {
+            Py_INCREF(_CBOAR_empty_str);
+            ret = _CBOAR_empty_str;
+        } else if (chunks.ascii) {
+            ret = PyUnicode_New(chunks.used, 127);
+            if (ret)
+                memcpy(PyUnicode_1BYTE_DATA(ret),
+                       PyBytes_AS_STRING(chunks.bytes), chunks.used);
+        } else
+            ret = PyUnicode_DecodeUTF8(
+                    PyBytes_AS_STRING(chunks.bytes), chunks.used,
+                    PyBytes_AS_STRING(self->str_errors));
     }
+    Py_XDECREF(chunks.bytes);
     return ret;
 }
 
@@ -617,18 +1289,99 @@ decode_string(CBORDecoderObject *self, uint8_t subtype)
         return NULL;
     if (indefinite)
         ret = decode_indefinite_strings(self);
-    else
+    else {
         ret = decode_definite_string(self, length);
+        if (ret && self->stringrefs && add_stringref(self, ret, length) == -1)
+            Py_CLEAR(ret);
+    }
     set_shareable(self, ret);
     return ret;
 }
 
 
+// The items of an indefinite-length array which is to become a tuple are
+// gathered in a scratch vector, and moved into a tuple allocated (once) at the
+// break marker
+typedef struct {
+    PyObject **items;
+    Py_ssize_t length;
+    Py_ssize_t size;
+} ItemVector;
+
+
+// Appends item to vec, stealing the reference (even on failure)
+static int
+item_vector_append(ItemVector *vec, PyObject *item)
+{
+    PyObject **items;
+    Py_ssize_t size;
+
+    if (vec->length == vec->size) {
+        size = vec->size ? vec->size * 2 : 16;
+        items = PyMem_Realloc(vec->items, size * sizeof(PyObject *));
+        if (!items) {
+            Py_DECREF(item);
+            PyErr_NoMemory();
+            return -1;
+        }
+        vec->items = items;
+        vec->size = size;
+    }
+    vec->items[vec->length++] = item;
+    return 0;
+}
+
+
+// Returns a new tuple of the items of vec, which are moved into it
+static PyObject *
+item_vector_tuple(ItemVector *vec)
+{
+    PyObject *ret;
+    Py_ssize_t i;
+
+    ret = PyTuple_New(vec->length);
+    if (ret) {
+        for (i = 0; i < vec->length; ++i)
+            PyTuple_SET_ITEM(ret, i, vec->items[i]);
+        vec->length = 0;
+    }
+    return ret;
+}
+
+
+static void
+item_vector_clear(ItemVector *vec)
+{
+    while (vec->length)
+        Py_DECREF(vec->items[--vec->length]);
+    PyMem_Free(vec->items);
+    vec->items = NULL;
+    vec->size = 0;
+}
+
+
 static PyObject *
 decode_indefinite_array(CBORDecoderObject *self)
 {
+    // As with definite arrays, a tuple is only shared once it's complete;
+    // see decode_definite_array
     PyObject *array, *item, *ret = NULL;
+    ItemVector vec = {NULL, 0, 0};
 
+    if (self->immutable) {
+        while (1) {
+            item = decode(self, DECODE_UNSHARED);
+            if (item == break_marker) {
+                Py_DECREF(item);
+                ret = item_vector_tuple(&vec);
+                break;
+            } else if (!item || item_vector_append(&vec, item) == -1)
+                break;
+        }
+        item_vector_clear(&vec);
+        set_shareable(self, ret);
+        return ret;
+    }
     array = PyList_New(0);
     if (array) {
         ret = array;
@@ -645,20 +1398,6 @@ decode_indefinite_array(CBORDecoderObject *self)
             } else
                 ret = NULL;
         }
-        if (ret && self->immutable) {
-            ret = PyList_AsTuple(array);
-            if (ret) {
-                Py_DECREF(array);
-                // There's a potential here for an indefinite length recursive
-                // array to wind up with a strange representation (the outer
-                // being a tuple, the inners all being a list). However, a
-                // recursive tuple isn't valid in the first place so it's a bit
-                // of a waste of time searching for recursive references just
-                // to throw an error
-                set_shareable(self, ret);
-            } else
-                ret = NULL;
-        }
         if (!ret)
             Py_DECREF(array);
     }
@@ -709,7 +1448,7 @@ decode_definite_array(CBORDecoderObject *self, uint64_t length)
         }
     }
     if (!ret)
-        Py_DECREF(array);
+        Py_XDECREF(array);
     return ret;
 }
 
@@ -725,71 +1464,377 @@ decode_array(CBORDecoderObject *self, uint8_t subtype)
         return NULL;
     if (indefinite)
         return decode_indefinite_array(self);
-    else
+    else if (length > PY_SSIZE_T_MAX) {
+        PyErr_Format(
+            _CBOAR_CBORDecodeError, "excessive array length %llu", length);
+        return NULL;
+    } else
         return decode_definite_array(self, length);
 }
 
 
+// Map keys ////////////////////////////////////////////////////////////////
+
+// Maps in a message commonly repeat the same (short) keys, so ASCII strings
+// short enough to have their length in the lead byte are kept in a small
+// direct-mapped cache when they're decoded as keys. Repeated keys are then
+// shared rather than re-created, and always have their hash computed already
+
+#define KEY_CACHE_SIZE 256  // must be a power of 2
+#define KEY_CACHE_MAX_LEN 23
+
+
+static void
+clear_keys(CBORDecoderObject *self)
+{
+    int i;
+
+    if (self->keys) {
+        for (i = 0; i < KEY_CACHE_SIZE; ++i)
+            Py_XDECREF(self->keys[i]);
+        PyMem_Free(self->keys);
+        self->keys = NULL;
+    }
+}
+
+
+// Returns the str for the map key in the length bytes at buf, from the cache
+// if possible
+static PyObject *
+decode_cached_key(CBORDecoderObject *self, const char *buf,
+                  const Py_ssize_t length)
+{
+    uint32_t hash = 2166136261u;
+    Py_ssize_t i;
+    PyObject **slot, *ret;
+
+    if (!self->keys) {
+        self->keys = PyMem_Calloc(KEY_CACHE_SIZE, sizeof(PyObject *));
+        if (!self->keys) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+    }
+    // FNV-1a
+    for (i = 0; i < length; ++i)
+        hash = (hash ^ (uint8_t) buf[i]) * 16777619u;
+    slot = &self->keys[(hash ^ (hash >> 16)) & (KEY_CACHE_SIZE - 1)];
+    if (*slot && PyUnicode_GET_LENGTH(*slot) == length &&
+            !memcmp(PyUnicode_1BYTE_DATA(*slot), buf, length)) {
+        Py_INCREF(*slot);
+        return *slot;
+    }
+    if (!is_ascii(buf, length))
+        return decode_utf8(self, buf, length);
+    ret = PyUnicode_New(length, 127);
+    if (ret) {
+        memcpy(PyUnicode_1BYTE_DATA(ret), buf, length);
+        if (PyObject_Hash(ret) == -1) {
+            Py_DECREF(ret);
+            return NULL;
+        }
+        Py_INCREF(ret);
+        Py_XSETREF(*slot, ret);
+    }
+    return ret;
+}
+
+
+// Decodes the map key of length (at most KEY_CACHE_MAX_LEN) bytes which
+// follows a string lead byte
+static PyObject *
+decode_short_key(CBORDecoderObject *self, const uint8_t length)
+{
+    char buf[KEY_CACHE_MAX_LEN];
+
+    if (self->buf) {
+        // Read the key in place
+        if (length > self->buf_len - self->buf_pos) {
+            premature_end(length, self->buf_len - self->buf_pos);
+            return NULL;
+        }
+        self->buf_pos += length;
+        return decode_cached_key(
+                self, self->buf + self->buf_pos - length, length);
+    }
+    if (fp_read(self, buf, length) == -1)
+        return NULL;
+    return decode_cached_key(self, buf, length);
+}
+
+
+// Decodes the next map key from the input
+static PyObject *
+decode_map_key(CBORDecoderObject *self)
+{
+    LeadByte lead;
+
+    if (fp_read(self, &lead.byte, 1) == -1)
+        return NULL;
+    if (lead.major == 3 && lead.subtype <= KEY_CACHE_MAX_LEN &&
+            !self->stringrefs)
+        return decode_short_key(self, lead.subtype);
+    return decode_lead(self, lead, DECODE_IMMUTABLE | DECODE_UNSHARED);
+}
+
+
+// Inserts key, value into map, skipping the hash calculation for keys whose
+// hash is already known (which includes all cached keys)
+static inline int
+map_set_item(PyObject *map, PyObject *key, PyObject *value)
+{
+#if PY_VERSION_HEX < 0x030D0000
+    Py_hash_t hash;
+
+    if (PyUnicode_CheckExact(key)) {
+        hash = ((PyASCIIObject *) key)->hash;
+        if (hash != -1)
+            return _PyDict_SetItem_KnownHash(map, key, value, hash);
+    }
+#endif
+    return PyDict_SetItem(map, key, value);
+}
+
+
+// Returns a new dict presized for a map of length pairs. As the length comes
+// from the input, it's limited as described by MAP_PRESIZE_LIMIT; the number
+// of pairs actually presized for is stored in presized, and must be returned
+// to the budget (by end_map) once the map is filled
+static PyObject *
+new_map(CBORDecoderObject *self, uint64_t length, Py_ssize_t *presized)
+{
+    if (self->buf) {
+        // Every pair requires at least two bytes
+        if (length > (uint64_t) (self->buf_len - self->buf_pos) / 2)
+            length = (self->buf_len - self->buf_pos) / 2;
+        if (length > MAP_PRESIZE_LIMIT)
+            length = MAP_PRESIZE_LIMIT;
+    } else if (length > MAP_PRESIZE_STREAM_LIMIT)
+        length = MAP_PRESIZE_STREAM_LIMIT;
+    if (length > (uint64_t) self->presize_budget)
+        length = self->presize_budget;
+    self->presize_budget -= length;
+    *presized = length;
+    return _PyDict_NewPresized(length);
+}
+
+
+static inline void
+end_map(CBORDecoderObject *self, Py_ssize_t presized)
+{
+    self->presize_budget += presized;
+}
+
+
+// Resets the decoder for a new top-level message, which has its own set of
+// shared values and its own budget for presizing maps
+static void
+begin_message(CBORDecoderObject *self)
+{
+    clear_shareables(self);
+    self->presize_budget = MAP_PRESIZE_BUDGET;
+}
+
+
+// Records ///////////////////////////////////////////////////////////////////
+
+// With schemas, a map whose keys are exactly the fields of one of them is
+// decoded as an instance of the schema's type. Candidate schemas are found by
+// the map's first key (in schema_index), and the rest of its keys are matched
+// to their fields; a map which doesn't match is decoded as usual
+
+// Maps with up to this many pairs are gathered on the stack before matching
+#define RECORD_STACK_PAIRS 16
+
+static inline bool
+key_matches(PyObject *key, PyObject *name)
+{
+    return key == name || (
+        PyUnicode_CheckExact(key) &&
+        PyUnicode_GET_LENGTH(key) == PyUnicode_GET_LENGTH(name) &&
+        PyUnicode_KIND(key) == PyUnicode_KIND(name) &&
+        !memcmp(PyUnicode_DATA(key), PyUnicode_DATA(name),
+                PyUnicode_GET_LENGTH(key) * PyUnicode_KIND(key)));
+}
+
+
+// Returns the index of the field of schema named key, or -1 if there's none.
+// The key at position hint in a map is usually the field at the same position
+// in declared or canonical order, so those are tried first
+static Py_ssize_t
+find_field(CBORSchemaObject *schema, PyObject *key, Py_ssize_t hint)
+{
+    Py_ssize_t i;
+
+    if (key_matches(key, schema->fields[hint].name))
+        return hint;
+    if (key_matches(key, schema->fields[schema->canonical[hint]].name))
+        return schema->canonical[hint];
+    for (i = 0; i < schema->length; ++i)
+        if (key_matches(key, schema->fields[i].name))
+            return i;
+    return -1;
+}
+
+
+// Returns a new record for the length pairs (keys and values interleaved), or
+// NULL without an exception set if they don't match any schema
+static PyObject *
+match_record(CBORDecoderObject *self, PyObject **pairs, Py_ssize_t length)
+{
+    CBORSchemaObject *schema;
+    PyObject *candidates, *values, *ret = NULL;
+    Py_ssize_t i, j, field;
+
+    if (!PyUnicode_CheckExact(pairs[0]))
+        return NULL;
+    candidates = PyDict_GetItemWithError(self->schema_index, pairs[0]);
+    if (!candidates)
+        return NULL;
+    // Building a record may run arbitrary code (in __new__) which could
+    // replace the schemas
+    Py_INCREF(candidates);
+    for (i = 0; !ret && i < PyList_GET_SIZE(candidates); ++i) {
+        schema = (CBORSchemaObject *) PyList_GET_ITEM(candidates, i);
+        if (schema->length != length)
+            continue;
+        values = PyTuple_New(length);
+        if (!values)
+            break;
+        for (j = 0; j < length; ++j) {
+            field = find_field(schema, pairs[j * 2], j);
+            if (field == -1 || PyTuple_GET_ITEM(values, field))
+                break;
+            Py_INCREF(pairs[j * 2 + 1]);
+            PyTuple_SET_ITEM(values, field, pairs[j * 2 + 1]);
+        }
+        if (j == length)
+            ret = CBORSchema_Build(schema, values);
+        Py_DECREF(values);
+        if (PyErr_Occurred())
+            break;
+    }
+    Py_DECREF(candidates);
+    return ret;
+}
+
+
+// As match_record, for a map which has been decoded as a dict
+static PyObject *
+match_record_dict(CBORDecoderObject *self, PyObject *map)
+{
+    PyObject *stack[RECORD_STACK_PAIRS * 2], **pairs, *ret;
+    Py_ssize_t i = 0, pos = 0, length = PyDict_GET_SIZE(map);
+
+    if (!length || length > self->schema_max || self->shared_index != -1)
+        return NULL;
+    pairs = length <= RECORD_STACK_PAIRS ? stack :
+        PyMem_Malloc(length * 2 * sizeof(PyObject *));
+    if (!pairs)
+        return PyErr_NoMemory();
+    while (PyDict_Next(map, &pos, &pairs[i], &pairs[i + 1]))
+        i += 2;
+    ret = match_record(self, pairs, length);
+    if (pairs != stack)
+        PyMem_Free(pairs);
+    return ret;
+}
+
+
+// Decodes the length pairs of a definite map (with no more pairs than the
+// largest schema), returning a new record if they match a schema (and setting
+// *record), or a new dict of them otherwise
+static PyObject *
+decode_record_map(CBORDecoderObject *self, Py_ssize_t length, bool *record)
+{
+    PyObject *stack[RECORD_STACK_PAIRS * 2], **pairs, *ret = NULL;
+    Py_ssize_t i, count;
+
+    pairs = length <= RECORD_STACK_PAIRS ? stack :
+        PyMem_Malloc(length * 2 * sizeof(PyObject *));
+    if (!pairs)
+        return PyErr_NoMemory();
+    for (count = 0; count < length * 2; count += 2) {
+        pairs[count] = decode_map_key(self);
+        if (!pairs[count])
+            break;
+        pairs[count + 1] = decode(self, DECODE_UNSHARED);
+        if (!pairs[count + 1]) {
+            Py_DECREF(pairs[count]);
+            break;
+        }
+    }
+    if (count == length * 2) {
+        ret = match_record(self, pairs, length);
+        *record = ret != NULL;
+        if (!ret && !PyErr_Occurred()) {
+            // All the pairs exist, so the map can be presized for them
+            ret = _PyDict_NewPresized(length);
+            for (i = 0; ret && i < count; i += 2)
+                if (map_set_item(ret, pairs[i], pairs[i + 1]) == -1)
+                    Py_CLEAR(ret);
+        }
+    }
+    for (i = 0; i < count; ++i)
+        Py_DECREF(pairs[i]);
+    if (pairs != stack)
+        PyMem_Free(pairs);
+    return ret;
+}
+
+
 static PyObject *
 decode_map(CBORDecoderObject *self, uint8_t subtype)
 {
     // major type 5
     uint64_t length;
-    bool indefinite = true;
+    bool indefinite = true, record = false;
+    Py_ssize_t presized = 0;
     PyObject *map, *key, *value, *ret = NULL;
 
-    map = PyDict_New();
+    if (decode_length(self, subtype, &length, &indefinite) == -1)
+        return NULL;
+    // Maps which might be records are gathered before a dict is created; a
+    // shared map must exist before its values, so it can't be a record
+    if (self->schema_index && !indefinite && length &&
+            length <= (uint64_t) self->schema_max && self->shared_index == -1) {
+        ret = decode_record_map(self, length, &record);
+        if (!ret || record)
+            return ret;
+        map = NULL;
+    } else
+        map = indefinite ? PyDict_New() : new_map(self, length, &presized);
     if (map) {
         ret = map;
         set_shareable(self, map);
-        if (decode_length(self, subtype, &length, &indefinite) == 0) {
-            if (indefinite) {
-                while (ret) {
-                    key = decode(self, DECODE_IMMUTABLE | DECODE_UNSHARED);
-                    if (key == break_marker) {
-                        Py_DECREF(key);
-                        break;
-                    } else if (key) {
-                        value = decode(self, DECODE_UNSHARED);
-                        if (value) {
-                            if (PyDict_SetItem(map, key, value) == -1)
-                                ret = NULL;
-                            Py_DECREF(value);
-                        } else
-                            ret = NULL;
-                        Py_DECREF(key);
-                    } else
-                        ret = NULL;
-                }
-            } else {
-                while (ret && length--) {
-                    key = decode(self, DECODE_IMMUTABLE | DECODE_UNSHARED);
-                    if (key) {
-                        value = decode(self, DECODE_UNSHARED);
-                        if (value) {
-                            if (PyDict_SetItem(map, key, value) == -1)
-                                ret = NULL;
-                            Py_DECREF(value);
-                        } else
-                            ret = NULL;
-                        Py_DECREF(key);
-                    } else
+        while (ret && (indefinite || length--)) {
+            key = decode_map_key(self);
+            if (key == break_marker && indefinite) {
+                Py_DECREF(key);
+                break;
+            } else if (key) {
+                value = decode(self, DECODE_UNSHARED);
+                if (value) {
+                    if (map_set_item(map, key, value) == -1)
                         ret = NULL;
-                }
-            }
-        } else
-            ret = NULL;
+                    Py_DECREF(value);
+                } else
+                    ret = NULL;
+                Py_DECREF(key);
+            } else
+                ret = NULL;
+        }
+        end_map(self, presized);
         if (!ret)
             Py_DECREF(map);
     }
     if (ret && self->object_hook != Py_None) {
         map = PyObject_CallFunctionObjArgs(
                 self->object_hook, self, ret, NULL);
-        if (map) {
+        if (map)
             set_shareable(self, map);
-            Py_DECREF(ret);
-            ret = map;
-        }
+        Py_DECREF(ret);
+        ret = map;
     }
     return ret;
 }
@@ -797,6 +1842,72 @@ decode_map(CBORDecoderObject *self, uint8_t subtype)
 
 // Semantic decoders /////////////////////////////////////////////////////////
 
+// Decodes the content of semantic tag tagnum with the matching built-in
+// decoder, returning NULL without an exception set if there isn't one
+static PyObject *
+decode_builtin_tag(CBORDecoderObject *self, uint64_t tagnum)
+{
+    char typecode;
+    int itemsize;
+    bool little;
+    PyObject *ret = NULL;
+
+    switch (tagnum) {
+        case 0:   ret = CBORDecoder_decode_datestr(self);         break;
+        case 1:   ret = CBORDecoder_decode_timestamp(self);       break;
+        case 2:   ret = CBORDecoder_decode_positive_bignum(self); break;
+        case 3:   ret = CBORDecoder_decode_negative_bignum(self); break;
+        case 4:   ret = CBORDecoder_decode_fraction(self);        break;
+        case 5:   ret = CBORDecoder_decode_bigfloat(self);        break;
+        case 6:
+            if (self->packed)
+                ret = CBORDecoder_decode_packed_reference(self);
+            break;
+        case 25:  ret = CBORDecoder_decode_stringref(self);       break;
+        case 28:  ret = CBORDecoder_decode_shareable(self);       break;
+        case 29:  ret = CBORDecoder_decode_shared(self);          break;
+        case 30:  ret = CBORDecoder_decode_rational(self);        break;
+        case 35:  ret = CBORDecoder_decode_regexp(self);          break;
+        case 36:  ret = CBORDecoder_decode_mime(self);            break;
+        case 37:  ret = CBORDecoder_decode_uuid(self);            break;
+        case 113: ret = CBORDecoder_decode_packed(self);          break;
+        case 256: ret = CBORDecoder_decode_stringref_namespace(self); break;
+        case 258: ret = CBORDecoder_decode_set(self);             break;
+        case 260: ret = CBORDecoder_decode_ipaddress(self);       break;
+        case 261: ret = CBORDecoder_decode_ipnetwork(self);       break;
+        case CBOAR_COLUMNAR_TAG:
+            ret = CBORDecoder_decode_columnar(self);
+            break;
+        default:
+            if (typed_array_format(tagnum, &typecode, &itemsize, &little))
+                ret = decode_typed_array(self, typecode, itemsize, little);
+            break;
+    }
+    return ret;
+}
+
+
+// Completes a tag with no built-in decoder once its value has been decoded,
+// passing it to tag_hook (if set)
+static PyObject *
+finish_tag(CBORDecoderObject *self, PyObject *tag, PyObject *value)
+{
+    PyObject *ret = NULL;
+
+    if (CBORTag_SetValue(tag, value) == 0) {
+        if (self->tag_hook == Py_None) {
+            Py_INCREF(tag);
+            ret = tag;
+        } else {
+            ret = PyObject_CallFunctionObjArgs(
+                    self->tag_hook, self, tag, NULL);
+            set_shareable(self, ret);
+        }
+    }
+    return ret;
+}
+
+
 static PyObject *
 decode_semantic(CBORDecoderObject *self, uint8_t subtype)
 {
@@ -805,110 +1916,93 @@ decode_semantic(CBORDecoderObject *self, uint8_t subtype)
     PyObject *tag, *value, *ret = NULL;
 
     if (decode_length(self, subtype, &tagnum, NULL) == 0) {
-        switch (tagnum) {
-            case 0:   ret = CBORDecoder_decode_datestr(self);         break;
-            case 1:   ret = CBORDecoder_decode_timestamp(self);       break;
-            case 2:   ret = CBORDecoder_decode_positive_bignum(self); break;
-            case 3:   ret = CBORDecoder_decode_negative_bignum(self); break;
-            case 4:   ret = CBORDecoder_decode_fraction(self);        break;
-            case 5:   ret = CBORDecoder_decode_bigfloat(self);        break;
-            case 28:  ret = CBORDecoder_decode_shareable(self);       break;
-            case 29:  ret = CBORDecoder_decode_shared(self);          break;
-            case 30:  ret = CBORDecoder_decode_rational(self);        break;
-            case 35:  ret = CBORDecoder_decode_regexp(self);          break;
-            case 36:  ret = CBORDecoder_decode_mime(self);            break;
-            case 37:  ret = CBORDecoder_decode_uuid(self);            break;
-            case 258: ret = CBORDecoder_decode_set(self);             break;
-            case 260: ret = CBORDecoder_decode_ipaddress(self);       break;
-            case 261: ret = CBORDecoder_decode_ipnetwork(self);       break;
-            default:
-                tag = CBORTag_New(tagnum);
-                if (tag) {
-                    set_shareable(self, tag);
-                    value = decode(self, DECODE_UNSHARED);
-                    if (value) {
-                        if (CBORTag_SetValue(tag, value) == 0) {
-                            if (self->tag_hook == Py_None) {
-                                Py_INCREF(tag);
-                                ret = tag;
-                            } else {
-                                ret = PyObject_CallFunctionObjArgs(
-                                        self->tag_hook, self, tag, NULL);
-                                set_shareable(self, ret);
-                            }
-                        }
-                        Py_DECREF(value);
-                    }
-                    Py_DECREF(tag);
+        ret = decode_builtin_tag(self, tagnum);
+        if (!ret && !PyErr_Occurred()) {
+            tag = CBORTag_New(tagnum);
+            if (tag) {
+                set_shareable(self, tag);
+                value = decode(self, DECODE_UNSHARED);
+                if (value) {
+                    ret = finish_tag(self, tag, value);
+                    Py_DECREF(value);
                 }
-                break;
+                Py_DECREF(tag);
+            }
         }
     }
     return ret;
 }
 
 
+// Parse *n* ASCII digits from *buf* into *value*, returning false if any of
+// the characters isn't a digit
+static inline bool
+parse_digits(const char *buf, int n, int *value)
+{
+    int i;
+
+    *value = 0;
+    for (i = 0; i < n; ++i) {
+        if (buf[i] < '0' || buf[i] > '9')
+            return false;
+        *value = *value * 10 + (buf[i] - '0');
+    }
+    return true;
+}
+
+
+// Validate and parse the RFC 3339 date-time string in *buf* (which must
+// match YYYY-mm-ddTHH:MM:SS[.f+](Z|+HH:MM|-HH:MM)) in a single pass,
+// returning a new datetime. Returns NULL without setting an error if the
+// string doesn't match the format; errors in the values themselves (e.g.
+// month 13) are reported by the datetime constructor
 static PyObject *
-parse_datestr(CBORDecoderObject *self, PyObject *str)
+parse_datestr(CBORDecoderObject *self, const char *buf, Py_ssize_t size)
 {
-    char *buf, *p;
-    Py_ssize_t size;
-    PyObject *tz, *delta, *ret = NULL;
-    bool offset_sign;
-    uint16_t Y;
-    uint8_t m, d, H, M, S, offset_H, offset_M;
-    uint32_t uS;
+    const char *p, *end = buf + size;
+    int Y, m, d, H, M, S, uS, offset_H, offset_M, i;
+    PyObject *tz, *ret;
 
-    if (!_CBOAR_timezone_utc && _CBOAR_init_timezone_utc() == -1)
+    if (size < 20)
         return NULL;
-    buf = PyUnicode_AsUTF8AndSize(str, &size);
-    if (buf) {
-        Y = strtol(buf, NULL, 10);
-        m = strtol(buf + 5, NULL, 10);
-        d = strtol(buf + 8, NULL, 10);
-        H = strtol(buf + 11, NULL, 10);
-        M = strtol(buf + 14, NULL, 10);
-        S = strtol(buf + 17, &p, 10);
-        if (*p == '.') {
-            uS = strtol(buf + 20, &p, 10);
-            switch (p - (buf + 20)) {
-                case 1: uS *= 100000; break;
-                case 2: uS *= 10000; break;
-                case 3: uS *= 1000; break;
-                case 4: uS *= 100; break;
-                case 5: uS *= 10; break;
-            }
-        } else
-            uS = 0;
-        if (*p == 'Z') {
-            offset_sign = false;
-            Py_INCREF(_CBOAR_timezone_utc);
-            tz = _CBOAR_timezone_utc;
-        } else {
-            offset_sign = *p == '-';
-            offset_H = strtol(p, &p, 10);
-            offset_M = strtol(p + 1, &p, 10);
-            delta = PyDelta_FromDSU(0,
-                    (offset_sign ? -1 : 1) *
-                    (offset_H * 3600 + offset_M * 60), 0);
-            if (delta) {
-#if PY_VERSION_HEX >= 0x03070000
-                tz = PyTimeZone_FromOffset(delta);
-#else
-                tz = PyObject_CallFunctionObjArgs(
-                        _CBOAR_timezone, delta, NULL);
-#endif
-                Py_DECREF(delta);
-            } else {
-                tz = NULL;
-            }
-        }
-        if (tz) {
-            ret = PyDateTimeAPI->DateTime_FromDateAndTime(
-                    Y, m, d, H, M, S, uS, tz, PyDateTimeAPI->DateTimeType);
-            Py_DECREF(tz);
-        }
+    if (!(parse_digits(buf, 4, &Y) && buf[4] == '-' &&
+          parse_digits(buf + 5, 2, &m) && buf[7] == '-' &&
+          parse_digits(buf + 8, 2, &d) && buf[10] == 'T' &&
+          parse_digits(buf + 11, 2, &H) && buf[13] == ':' &&
+          parse_digits(buf + 14, 2, &M) && buf[16] == ':' &&
+          parse_digits(buf + 17, 2, &S)))
+        return NULL;
+    p = buf + 19;
+    uS = 0;
+    if (*p == '.') {
+        // Fractions beyond microsecond precision are truncated
+        for (i = 0, ++p; p < end && *p >= '0' && *p <= '9'; ++i, ++p)
+            if (i < 6)
+                uS = uS * 10 + (*p - '0');
+        if (!i)
+            return NULL;
+        for (; i < 6; ++i)
+            uS *= 10;
     }
+
+    if (p == end - 1 && *p == 'Z') {
+        if (!_CBOAR_timezone_utc && _CBOAR_init_timezone_utc() == -1)
+            return NULL;
+        Py_INCREF(_CBOAR_timezone_utc);
+        tz = _CBOAR_timezone_utc;
+    } else if (p == end - 6 && (*p == '+' || *p == '-') &&
+            parse_digits(p + 1, 2, &offset_H) && p[3] == ':' &&
+            parse_digits(p + 4, 2, &offset_M)) {
+        tz = _CBOAR_get_timezone(
+                (*p == '-' ? -1 : 1) * (offset_H * 60 + offset_M));
+        if (!tz)
+            return NULL;
+    } else
+        return NULL;
+
+    ret = PyDateTimeAPI->DateTime_FromDateAndTime(
+            Y, m, d, H, M, S, uS, tz, PyDateTimeAPI->DateTimeType);
+    Py_DECREF(tz);
     return ret;
 }
 
@@ -918,23 +2012,56 @@ static PyObject *
 CBORDecoder_decode_datestr(CBORDecoderObject *self)
 {
     // semantic type 0
-    PyObject *match, *str, *ret = NULL;
-
-    if (!_CBOAR_datestr_re && _CBOAR_init_re_compile() == -1)
+    LeadByte lead;
+    uint64_t length;
+    bool indefinite = true;
+    char buf[64];
+    const char *str_buf;
+    Py_ssize_t str_size;
+    PyObject *str, *ret = NULL;
+
+    // The common case (a short, definite length string) is parsed directly
+    // from the input without constructing an intermediate str; anything else
+    // (including any string within a stringref namespace) is decoded
+    // generically first
+    if (fp_read(self, &lead.byte, 1) == -1)
         return NULL;
-    str = decode(self, DECODE_NORMAL);
+    if (lead.major == 3 && !self->stringrefs) {
+        if (decode_length(self, lead.subtype, &length, &indefinite) == -1)
+            return NULL;
+        if (indefinite)
+            str = decode_indefinite_strings(self);
+        else if (length > sizeof(buf))
+            str = decode_definite_string(self, length);
+        else {
+            if (fp_read(self, buf, length) == 0) {
+                ret = parse_datestr(self, buf, length);
+                if (!ret && !PyErr_Occurred()) {
+                    str = PyUnicode_DecodeUTF8(
+                            buf, length, PyBytes_AS_STRING(self->str_errors));
+                    if (str) {
+                        PyErr_Format(
+                            _CBOAR_CBORDecodeError,
+                            "invalid datetime string %R", str);
+                        Py_DECREF(str);
+                    }
+                }
+            }
+            set_shareable(self, ret);
+            return ret;
+        }
+    } else
+        str = decode_lead(self, lead, DECODE_UNSHARED);
+
     if (str) {
         if (PyUnicode_Check(str)) {
-            match = PyObject_CallMethodObjArgs(
-                    _CBOAR_datestr_re, _CBOAR_str_match, str, NULL);
-            if (match) {
-                if (match != Py_None)
-                    ret = parse_datestr(self, str);
-                else
+            str_buf = PyUnicode_AsUTF8AndSize(str, &str_size);
+            if (str_buf) {
+                ret = parse_datestr(self, str_buf, str_size);
+                if (!ret && !PyErr_Occurred())
                     PyErr_Format(
                         _CBOAR_CBORDecodeError,
                         "invalid datetime string %R", str);
-                Py_DECREF(match);
             }
         } else
             PyErr_Format(
@@ -965,11 +2092,75 @@ CBORDecoder_decode_timestamp(CBORDecoderObject *self)
             }
         } else {
             PyErr_Format(
-                _CBOAR_CBORDecodeError, "invalid timestamp value %R", num);
+                _CBOAR_CBORDecodeError, "invalid timestamp value %R", num);
+        }
+        Py_DECREF(num);
+    }
+    set_shareable(self, ret);
+    return ret;
+}
+
+
+static PyObject *
+decode_bignum(CBORDecoderObject *self, bool negative)
+{
+    // semantic types 2 and 3
+    LeadByte lead;
+    uint64_t length;
+    bool indefinite = true;
+    unsigned char *buf;
+    Py_ssize_t i;
+    PyObject *bytes = NULL, *ret = NULL;
+
+    // Within a stringref namespace the payload is decoded generically as it
+    // may be (or be the target of) a reference
+    if (fp_read(self, &lead.byte, 1) == -1)
+        return NULL;
+    if (lead.major != 2 || self->stringrefs) {
+        bytes = decode_lead(self, lead, DECODE_UNSHARED);
+        if (!bytes)
+            return NULL;
+        if (!PyBytes_CheckExact(bytes)) {
+            PyErr_Format(
+                _CBOAR_CBORDecodeError, "invalid bignum value %R", bytes);
+            Py_DECREF(bytes);
+            return NULL;
         }
-        Py_DECREF(num);
+        length = PyBytes_GET_SIZE(bytes);
+    } else if (decode_length(self, lead.subtype, &length, &indefinite) == -1)
+        return NULL;
+    else if (indefinite) {
+        bytes = decode_indefinite_bytestrings(self);
+        if (!bytes)
+            return NULL;
+        length = PyBytes_GET_SIZE(bytes);
+    } else if (length >= PY_SSIZE_T_MAX) {
+        PyErr_Format(
+            _CBOAR_CBORDecodeError, "excessive bignum length %llu", length);
+        return NULL;
     }
-    set_shareable(self, ret);
+
+    // The payload is read into buf + 1, leaving a leading zero byte so that
+    // a negative bignum (-1 - n) can be produced in a single conversion: the
+    // bitwise inverse of the zero-extended magnitude is exactly the two's
+    // complement representation of -1 - n
+    buf = PyMem_Malloc(length + 1);
+    if (buf) {
+        buf[0] = 0;
+        if (bytes)
+            memcpy(buf + 1, PyBytes_AS_STRING(bytes), length);
+        if (bytes || fp_read(self, (char *) buf + 1, length) == 0) {
+            if (negative) {
+                for (i = 0; i <= (Py_ssize_t) length; ++i)
+                    buf[i] = ~buf[i];
+                ret = _PyLong_FromByteArray(buf, length + 1, 0, 1);
+            } else
+                ret = _PyLong_FromByteArray(buf + 1, length, 0, 0);
+        }
+        PyMem_Free(buf);
+    } else
+        PyErr_NoMemory();
+    Py_XDECREF(bytes);
     return ret;
 }
 
@@ -979,18 +2170,9 @@ static PyObject *
 CBORDecoder_decode_positive_bignum(CBORDecoderObject *self)
 {
     // semantic type 2
-    PyObject *bytes, *ret = NULL;
+    PyObject *ret;
 
-    bytes = decode(self, DECODE_NORMAL);
-    if (bytes) {
-        if (PyBytes_CheckExact(bytes))
-            ret = PyObject_CallMethod(
-                (PyObject*) &PyLong_Type, "from_bytes", "Os#", bytes, "big", 3);
-        else
-            PyErr_Format(
-                _CBOAR_CBORDecodeError, "invalid bignum value %R", bytes);
-        Py_DECREF(bytes);
-    }
+    ret = decode_bignum(self, false);
     set_shareable(self, ret);
     return ret;
 }
@@ -1001,52 +2183,99 @@ static PyObject *
 CBORDecoder_decode_negative_bignum(CBORDecoderObject *self)
 {
     // semantic type 3
-    PyObject *value, *one, *neg, *ret = NULL;
+    PyObject *ret;
 
-    value = CBORDecoder_decode_positive_bignum(self);
-    if (value) {
-        one = PyLong_FromLong(1);
-        if (one) {
-            neg = PyNumber_Negative(value);
-            if (neg) {
-                ret = PyNumber_Subtract(neg, one);
-                Py_DECREF(neg);
+    ret = decode_bignum(self, true);
+    set_shareable(self, ret);
+    return ret;
+}
+
+
+// Construct a decimal.Decimal exactly equal to sig * 10**exp. When both
+// parts fit in a long long the Decimal is parsed from a short string;
+// otherwise the digits of sig are combined with exp in a (sign, digits,
+// exponent) tuple. Neither path is subject to the context's precision
+static PyObject *
+decimal_from_parts(PyObject *sig, PyObject *exp)
+{
+    long long sig_val, exp_val;
+    int overflow;
+    PyObject *str, *dec, *tuple, *ret = NULL;
+
+    exp_val = PyLong_AsLongLongAndOverflow(exp, &overflow);
+    if (overflow || (exp_val == -1 && PyErr_Occurred()))
+        return NULL;
+    sig_val = PyLong_AsLongLongAndOverflow(sig, &overflow);
+    if (sig_val == -1 && PyErr_Occurred())
+        return NULL;
+    if (!overflow) {
+        str = PyUnicode_FromFormat("%lldE%lld", sig_val, exp_val);
+        if (str) {
+            ret = PyObject_CallFunctionObjArgs(_CBOAR_Decimal, str, NULL);
+            Py_DECREF(str);
+        }
+    } else {
+        dec = PyObject_CallFunctionObjArgs(_CBOAR_Decimal, sig, NULL);
+        if (dec) {
+            tuple = PyObject_CallMethodObjArgs(dec, _CBOAR_str_as_tuple, NULL);
+            if (tuple) {
+                str = Py_BuildValue(
+                    "(OOL)", PyTuple_GET_ITEM(tuple, 0),
+                    PyTuple_GET_ITEM(tuple, 1), exp_val);
+                if (str) {
+                    ret = PyObject_CallFunctionObjArgs(
+                        _CBOAR_Decimal, str, NULL);
+                    Py_DECREF(str);
+                }
+                Py_DECREF(tuple);
             }
-            Py_DECREF(one);
+            Py_DECREF(dec);
         }
-        Py_DECREF(value);
     }
-    set_shareable(self, ret);
     return ret;
 }
 
 
+// Decodes the [exponent, mantissa] array shared by semantic types 4 and 5,
+// returning the parts as borrowed references from *tuple* (which the caller
+// must release)
+static int
+decode_exponent_mantissa(CBORDecoderObject *self, const char *name,
+                         PyObject **tuple, PyObject **exp, PyObject **sig)
+{
+    // NOTE: There's no particular necessity for this to be immutable, it's
+    // just a performance choice
+    *tuple = decode(self, DECODE_IMMUTABLE | DECODE_UNSHARED);
+    if (!*tuple)
+        return -1;
+    if (PyTuple_CheckExact(*tuple) && PyTuple_GET_SIZE(*tuple) == 2) {
+        *exp = PyTuple_GET_ITEM(*tuple, 0);
+        *sig = PyTuple_GET_ITEM(*tuple, 1);
+        if (PyLong_CheckExact(*exp) && PyLong_CheckExact(*sig))
+            return 0;
+    }
+    PyErr_Format(_CBOAR_CBORDecodeError, "invalid %s value %R", name, *tuple);
+    Py_CLEAR(*tuple);
+    return -1;
+}
+
+
 // CBORDecoder.decode_fraction(self)
 static PyObject *
 CBORDecoder_decode_fraction(CBORDecoderObject *self)
 {
     // semantic type 4
-    PyObject *tuple, *tmp, *sig, *exp, *ten, *ret = NULL;
+    PyObject *tuple, *exp, *sig, *ret = NULL;
 
     if (!_CBOAR_Decimal && _CBOAR_init_Decimal() == -1)
         return NULL;
-    // NOTE: There's no particular necessity for this to be immutable, it's
-    // just a performance choice
-    tuple = decode(self, DECODE_IMMUTABLE | DECODE_UNSHARED);
-    if (tuple) {
-        if (PyTuple_CheckExact(tuple) && PyTuple_GET_SIZE(tuple) == 2) {
-            exp = PyTuple_GET_ITEM(tuple, 0);
-            sig = PyTuple_GET_ITEM(tuple, 1);
-            ten = PyObject_CallFunction(_CBOAR_Decimal, "i", 10);
-            if (ten) {
-                tmp = PyNumber_Power(ten, exp, Py_None);
-                if (tmp) {
-                    ret = PyNumber_Multiply(sig, tmp);
-                    Py_DECREF(tmp);
-                }
-                Py_DECREF(ten);
-            }
-        }
+    if (decode_exponent_mantissa(
+                self, "decimal fraction", &tuple, &exp, &sig) == 0) {
+        ret = decimal_from_parts(sig, exp);
+        if (!ret && !PyErr_Occurred())
+            PyErr_Format(
+                _CBOAR_CBORDecodeError,
+                "excessive decimal fraction exponent %R", exp);
         Py_DECREF(tuple);
     }
     set_shareable(self, ret);
@@ -1054,21 +2283,53 @@ CBORDecoder_decode_fraction(CBORDecoderObject *self)
 }
 
 
+// The largest magnitude of bigfloat exponent which will be decoded exactly;
+// beyond this the result is calculated (with rounding) in the decimal
+// context, to avoid constructing enormous intermediate ints
+#define BIGFLOAT_EXACT_EXP 4096
+
 // CBORDecoder.decode_bigfloat
 static PyObject *
 CBORDecoder_decode_bigfloat(CBORDecoderObject *self)
 {
     // semantic type 5
-    PyObject *tuple, *tmp, *sig, *exp, *two, *ret = NULL;
+    PyObject *tuple, *tmp, *sig, *exp, *two, *k, *zero, *ret = NULL;
+    long exp_val;
+    int overflow;
 
     if (!_CBOAR_Decimal && _CBOAR_init_Decimal() == -1)
         return NULL;
-    // NOTE: see semantic type 4
-    tuple = decode(self, DECODE_IMMUTABLE | DECODE_UNSHARED);
-    if (tuple) {
-        if (PyTuple_CheckExact(tuple) && PyTuple_GET_SIZE(tuple) == 2) {
-            exp = PyTuple_GET_ITEM(tuple, 0);
-            sig = PyTuple_GET_ITEM(tuple, 1);
+    if (decode_exponent_mantissa(self, "bigfloat", &tuple, &exp, &sig) == 0) {
+        exp_val = PyLong_AsLongAndOverflow(exp, &overflow);
+        if (!overflow && exp_val >= 0 && exp_val <= BIGFLOAT_EXACT_EXP) {
+            // sig * 2**exp == (sig << exp) * 10**0
+            tmp = PyNumber_Lshift(sig, exp);
+            if (tmp) {
+                zero = PyLong_FromLong(0);
+                if (zero) {
+                    ret = decimal_from_parts(tmp, zero);
+                    Py_DECREF(zero);
+                }
+                Py_DECREF(tmp);
+            }
+        } else if (!overflow && exp_val < 0 && exp_val >= -BIGFLOAT_EXACT_EXP) {
+            // sig * 2**-k == (sig * 5**k) * 10**-k
+            k = PyLong_FromLong(-exp_val);
+            if (k) {
+                tmp = PyLong_FromLong(5);
+                if (tmp) {
+                    Py_SETREF(tmp, PyNumber_Power(tmp, k, Py_None));
+                    if (tmp) {
+                        Py_SETREF(tmp, PyNumber_Multiply(sig, tmp));
+                        if (tmp) {
+                            ret = decimal_from_parts(tmp, exp);
+                            Py_DECREF(tmp);
+                        }
+                    }
+                }
+                Py_DECREF(k);
+            }
+        } else {
             two = PyObject_CallFunction(_CBOAR_Decimal, "i", 2);
             if (two) {
                 tmp = PyNumber_Power(two, exp, Py_None);
@@ -1092,13 +2353,16 @@ CBORDecoder_decode_shareable(CBORDecoderObject *self)
 {
     // semantic type 28
     int32_t old_index;
+    Py_ssize_t index;
     PyObject *ret = NULL;
 
-    old_index = self->shared_index;
-    self->shared_index = PyList_GET_SIZE(self->shareables);
-    if (PyList_Append(self->shareables, Py_None) == 0)
+    index = new_shareable(self);
+    if (index != -1) {
+        old_index = self->shared_index;
+        self->shared_index = index;
         ret = decode(self, DECODE_NORMAL);
-    self->shared_index = old_index;
+        self->shared_index = old_index;
+    }
     return ret;
 }
 
@@ -1109,31 +2373,237 @@ CBORDecoder_decode_shared(CBORDecoderObject *self)
 {
     // semantic type 29
     PyObject *index, *ret = NULL;
+    uint64_t length;
+    LeadByte lead;
 
-    index = decode(self, DECODE_UNSHARED);
-    if (index) {
-        if (PyLong_CheckExact(index)) {
-            ret = PyList_GetItem(self->shareables, PyLong_AsSsize_t(index));
-            if (ret) {
-                if (ret == Py_None) {
-                    PyErr_Format(
-                        _CBOAR_CBORDecodeError,
-                        "shared value %R has not been initialized", index);
-                    ret = NULL;
-                } else {
-                    // convert borrowed reference to new reference
-                    Py_INCREF(ret);
-                }
-            } else {
-                PyErr_Format(
-                    _CBOAR_CBORDecodeError,
-                    "shared reference %R not found", index);
-            }
-        } else {
+    if (fp_read(self, &lead.byte, 1) == -1)
+        return NULL;
+    if (lead.major == 0) {
+        // Read the index straight from the input rather than as an int
+        if (decode_length(self, lead.subtype, &length, NULL) == -1)
+            return NULL;
+        if (length >= (uint64_t) self->shareables_len)
+            PyErr_Format(
+                _CBOAR_CBORDecodeError,
+                "shared reference %llu not found", length);
+        else if (!self->shareables[length])
+            PyErr_Format(
+                _CBOAR_CBORDecodeError,
+                "shared value %llu has not been initialized", length);
+        else {
+            ret = self->shareables[length];
+            Py_INCREF(ret);
+        }
+    } else {
+        index = decode_lead(self, lead, DECODE_UNSHARED);
+        if (index) {
+            PyErr_Format(
+                _CBOAR_CBORDecodeError,
+                PyLong_CheckExact(index) ?
+                    "shared reference %R not found" :
+                    "invalid shared reference %R", index);
+            Py_DECREF(index);
+        }
+    }
+    return ret;
+}
+
+
+// CBORDecoder.decode_stringref(self)
+static PyObject *
+CBORDecoder_decode_stringref(CBORDecoderObject *self)
+{
+    // semantic type 25
+    PyObject *index, *ret = NULL;
+    uint64_t length;
+    LeadByte lead;
+
+    if (fp_read(self, &lead.byte, 1) == -1)
+        return NULL;
+    if (lead.major == 0) {
+        if (decode_length(self, lead.subtype, &length, NULL) == -1)
+            return NULL;
+        if (!self->stringrefs)
+            PyErr_Format(
+                _CBOAR_CBORDecodeError,
+                "string reference %llu outside of a namespace", length);
+        else if (length >= (uint64_t) self->stringrefs->length)
+            PyErr_Format(
+                _CBOAR_CBORDecodeError,
+                "string reference %llu not found", length);
+        else {
+            ret = self->stringrefs->items[length];
+            Py_INCREF(ret);
+        }
+    } else {
+        index = decode_lead(self, lead, DECODE_UNSHARED);
+        if (index) {
             PyErr_Format(
-                _CBOAR_CBORDecodeError, "invalid shared reference %R", index);
+                _CBOAR_CBORDecodeError, "invalid string reference %R", index);
+            Py_DECREF(index);
+        }
+    }
+    set_shareable(self, ret);
+    return ret;
+}
+
+
+// CBORDecoder.decode_stringref_namespace(self)
+static PyObject *
+CBORDecoder_decode_stringref_namespace(CBORDecoderObject *self)
+{
+    // semantic type 256
+    PyObject *ret = NULL;
+
+    if (push_stringrefs(self) == 0) {
+        ret = decode(self, DECODE_NORMAL);
+        pop_stringrefs(self);
+    }
+    return ret;
+}
+
+
+// Returns the value of packed item index, searching the tables from the
+// innermost outward
+static PyObject *
+decode_packed_item(CBORDecoderObject *self, uint64_t index)
+{
+    PackedTable *table;
+    uint64_t i = index;
+    PyObject *ret = NULL;
+
+    for (table = self->packed; table; table = table->outer) {
+        if (i < (uint64_t) table->length)
+            break;
+        i -= table->length;
+    }
+    if (!table)
+        PyErr_Format(
+            _CBOAR_CBORDecodeError, "shared item %llu not found", index);
+    else if (i >= (uint64_t) PyList_GET_SIZE(table->items))
+        PyErr_Format(
+            _CBOAR_CBORDecodeError,
+            "shared item %llu has not been defined", index);
+    else
+        ret = unpack_item(self, PyList_GET_ITEM(table->items, i),
+                          self->immutable, !self->packed_sharing);
+    set_shareable(self, ret);
+    return ret;
+}
+
+
+// CBORDecoder.decode_packed_reference(self)
+static PyObject *
+CBORDecoder_decode_packed_reference(CBORDecoderObject *self)
+{
+    // semantic type 6 (within a packed table); simple values 0 to 15 refer
+    // to the first 16 shared items, and this to the rest: an unsigned
+    // integer n to item 16 + 2n, and a negative integer -1 - n to item
+    // 17 + 2n
+    PyObject *value;
+    uint64_t length;
+    LeadByte lead;
+
+    if (fp_read(self, &lead.byte, 1) == -1)
+        return NULL;
+    if (lead.major == 0 || lead.major == 1) {
+        if (decode_length(self, lead.subtype, &length, NULL) == -1)
+            return NULL;
+        if (length > (UINT64_MAX - 17) / 2) {
+            PyErr_SetString(
+                _CBOAR_CBORDecodeError, "excessive shared item reference");
+            return NULL;
+        }
+        return decode_packed_item(self, 16 + length * 2 + lead.major);
+    }
+    // Argument (prefix and suffix) references aren't supported
+    value = decode_lead(self, lead, DECODE_UNSHARED);
+    if (value) {
+        PyErr_Format(
+            _CBOAR_CBORDecodeError, "invalid shared item reference %R", value);
+        Py_DECREF(value);
+    }
+    return NULL;
+}
+
+
+// Reads the header of an array within a packed table, which must have a
+// definite length
+static int
+decode_packed_array(CBORDecoderObject *self, uint64_t *length)
+{
+    LeadByte lead;
+
+    if (fp_read(self, &lead.byte, 1) == -1)
+        return -1;
+    if (lead.major != 4 || lead.subtype == 31) {
+        PyErr_SetString(_CBOAR_CBORDecodeError, "invalid packed CBOR table");
+        return -1;
+    }
+    return decode_length(self, lead.subtype, length, NULL);
+}
+
+
+// Reads the tables at the start of the content of semantic type 113 and opens
+// them (leaving the rump to be decoded)
+static int
+decode_packed_tables(CBORDecoderObject *self)
+{
+    uint64_t i, length;
+    PyObject *value;
+
+    if (decode_packed_array(self, &length) == -1)
+        return -1;
+    if (length != 3) {
+        PyErr_SetString(_CBOAR_CBORDecodeError, "invalid packed CBOR table");
+        return -1;
+    }
+    if (decode_packed_array(self, &length) == -1)
+        return -1;
+    if (length > PY_SSIZE_T_MAX) {
+        PyErr_Format(
+            _CBOAR_CBORDecodeError, "excessive shared items length %llu",
+            length);
+        return -1;
+    }
+    if (push_packed(self, length) == -1)
+        return -1;
+    // Shared items may refer to those before them in the table
+    for (i = 0; i < length; ++i) {
+        value = decode(self, DECODE_UNSHARED);
+        if (!value)
+            goto error;
+        if (PyList_Append(self->packed->items, value) == -1) {
+            Py_DECREF(value);
+            goto error;
         }
-        Py_DECREF(index);
+        Py_DECREF(value);
+    }
+    if (decode_packed_array(self, &length) == -1)
+        goto error;
+    if (length) {
+        PyErr_SetString(
+            _CBOAR_CBORDecodeError,
+            "packed CBOR argument tables are not supported");
+        goto error;
+    }
+    return 0;
+error:
+    pop_packed(self);
+    return -1;
+}
+
+
+// CBORDecoder.decode_packed(self)
+static PyObject *
+CBORDecoder_decode_packed(CBORDecoderObject *self)
+{
+    // semantic type 113
+    PyObject *ret = NULL;
+
+    if (decode_packed_tables(self) == 0) {
+        ret = decode(self, DECODE_NORMAL);
+        pop_packed(self);
     }
     return ret;
 }
@@ -1234,21 +2704,172 @@ CBORDecoder_decode_set(CBORDecoderObject *self)
     // semantic type 258
     PyObject *array, *ret = NULL;
 
-    array = decode(self, DECODE_IMMUTABLE);
-    if (array) {
-        if (PyList_CheckExact(array) || PyTuple_CheckExact(array)) {
-            if (self->immutable)
-                ret = PyFrozenSet_New(array);
-            else
-                ret = PySet_New(array);
-        } else
-            PyErr_Format(_CBOAR_CBORDecodeError, "invalid set array %R", array);
-        Py_DECREF(array);
+    array = decode(self, DECODE_IMMUTABLE);
+    if (array) {
+        if (PyList_CheckExact(array) || PyTuple_CheckExact(array)) {
+            if (self->immutable)
+                ret = PyFrozenSet_New(array);
+            else
+                ret = PySet_New(array);
+        } else
+            PyErr_Format(_CBOAR_CBORDecodeError, "invalid set array %R", array);
+        Py_DECREF(array);
+    }
+    // This can be done after construction of the set/frozenset because,
+    // unlike lists/dicts a set cannot contain a reference to itself (a set
+    // is unhashable). Nor can a frozenset contain a reference to itself
+    // because it can't refer to itself during its own construction.
+    set_shareable(self, ret);
+    return ret;
+}
+
+
+// Decodes a column of a columnar value as a list. Every row holds an item of
+// each column, so a column that was a reference (or a typed array of one)
+// could be repeated to build far more rows than the input holds; columns must
+// be literal arrays, or typed arrays of literal byte strings
+static PyObject *
+decode_column(CBORDecoderObject *self)
+{
+    LeadByte lead;
+    uint64_t tagnum;
+    char typecode;
+    int itemsize;
+    int32_t old_index;
+    bool little;
+    PyObject *column, *ret = NULL;
+
+    if (fp_read(self, &lead.byte, 1) == -1)
+        return NULL;
+    if (lead.major == 4) {
+        ret = decode_lead(self, lead, DECODE_UNSHARED);
+        if (ret && !PyList_CheckExact(ret)) {
+            PyErr_Format(
+                _CBOAR_CBORDecodeError, "invalid columnar column %R", ret);
+            Py_CLEAR(ret);
+        }
+        return ret;
+    }
+    if (lead.major == 6) {
+        if (decode_length(self, lead.subtype, &tagnum, NULL) == -1)
+            return NULL;
+        if (typed_array_format(tagnum, &typecode, &itemsize, &little)) {
+            if (fp_read(self, &lead.byte, 1) == -1)
+                return NULL;
+            if (lead.major == 2) {
+                old_index = self->shared_index;
+                self->shared_index = -1;
+                column = decode_typed_array_lead(
+                        self, lead, typecode, itemsize, little);
+                self->shared_index = old_index;
+                if (column) {
+                    ret = PySequence_List(column);
+                    Py_DECREF(column);
+                }
+                return ret;
+            }
+        }
+    }
+    PyErr_SetString(
+        _CBOAR_CBORDecodeError,
+        "invalid columnar value (columns must be literal arrays)");
+    return NULL;
+}
+
+
+// CBORDecoder.decode_columnar(self)
+static PyObject *
+CBORDecoder_decode_columnar(CBORDecoderObject *self)
+{
+    // private semantic type; see CBOAR_COLUMNAR_TAG
+    // The value is an array of keys followed by an array (or typed array) of
+    // the values of each key; each row is built as a map of those keys and
+    // values would be, so it may become a record or pass through object_hook
+    PyObject *keys, *row, *tmp, **columns = NULL,
+             *stack[RECORD_STACK_PAIRS * 2], **pairs = stack, *ret = NULL;
+    Py_ssize_t i, j, width, count = 0;
+    uint64_t length;
+    LeadByte lead;
+
+    if (fp_read(self, &lead.byte, 1) == -1)
+        return NULL;
+    if (lead.major != 4 || lead.subtype == 31) {
+        PyErr_SetString(_CBOAR_CBORDecodeError, "invalid columnar value");
+        return NULL;
+    }
+    if (decode_length(self, lead.subtype, &length, NULL) == -1)
+        return NULL;
+    if (length < 2) {
+        PyErr_SetString(_CBOAR_CBORDecodeError, "invalid columnar value");
+        return NULL;
+    }
+    keys = decode(self, DECODE_UNSHARED);
+    if (!keys)
+        return NULL;
+    if (!PyList_CheckExact(keys) ||
+            (uint64_t) PyList_GET_SIZE(keys) != length - 1) {
+        PyErr_Format(
+            _CBOAR_CBORDecodeError, "invalid columnar value (keys %R)", keys);
+        Py_DECREF(keys);
+        return NULL;
+    }
+    width = PyList_GET_SIZE(keys);
+    columns = PyMem_Calloc(width, sizeof(PyObject *));
+    if (width > RECORD_STACK_PAIRS)
+        pairs = PyMem_Malloc(width * 2 * sizeof(PyObject *));
+    if (!columns || !pairs) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    for (j = 0; j < width; ++j) {
+        columns[j] = decode_column(self);
+        if (!columns[j])
+            goto error;
+        if (j && PyList_GET_SIZE(columns[j]) != count) {
+            PyErr_SetString(
+                _CBOAR_CBORDecodeError,
+                "invalid columnar value (columns differ in length)");
+            goto error;
+        }
+        count = PyList_GET_SIZE(columns[j]);
+    }
+
+    ret = PyList_New(count);
+    for (i = 0; ret && i < count; ++i) {
+        for (j = 0; j < width; ++j) {
+            pairs[j * 2] = PyList_GET_ITEM(keys, j);
+            pairs[j * 2 + 1] = PyList_GET_ITEM(columns[j], i);
+        }
+        row = NULL;
+        if (self->schema_index && width <= self->schema_max)
+            row = match_record(self, pairs, width);
+        if (!row && !PyErr_Occurred()) {
+            // The width is the number of keys actually decoded
+            row = _PyDict_NewPresized(width);
+            for (j = 0; row && j < width; ++j)
+                if (map_set_item(row, pairs[j * 2], pairs[j * 2 + 1]) == -1)
+                    Py_CLEAR(row);
+            if (row && self->object_hook != Py_None) {
+                tmp = PyObject_CallFunctionObjArgs(
+                        self->object_hook, self, row, NULL);
+                Py_DECREF(row);
+                row = tmp;
+            }
+        }
+        if (row)
+            PyList_SET_ITEM(ret, i, row);
+        else
+            Py_CLEAR(ret);
     }
-    // This can be done after construction of the set/frozenset because,
-    // unlike lists/dicts a set cannot contain a reference to itself (a set
-    // is unhashable). Nor can a frozenset contain a reference to itself
-    // because it can't refer to itself during its own construction.
+error:
+    if (columns) {
+        for (j = 0; j < width; ++j)
+            Py_XDECREF(columns[j]);
+        PyMem_Free(columns);
+    }
+    if (pairs && pairs != stack)
+        PyMem_Free(pairs);
+    Py_DECREF(keys);
     set_shareable(self, ret);
     return ret;
 }
@@ -1340,6 +2961,140 @@ CBORDecoder_decode_ipnetwork(CBORDecoderObject *self)
 }
 
 
+// Determine the array.array typecode (and the source item size and byte
+// order) for the RFC 8746 typed array tag tagnum. Returns false if the tag
+// isn't a typed array that can be represented by array.array (e.g. 128-bit
+// floats and reserved tags)
+static bool
+typed_array_format(const uint64_t tagnum, char *typecode, int *itemsize,
+                   bool *little)
+{
+    // tag bits are 0b010fsell: float, signed, little-endian, log2(size)
+    bool f, s;
+    int ll;
+
+    if (tagnum < 64 || tagnum > 87)
+        return false;
+    f = tagnum & 0x10;
+    s = tagnum & 0x08;
+    *little = tagnum & 0x04;
+    ll = tagnum & 0x03;
+    *itemsize = 1 << ll;
+    if (f) {
+        // float16, float32, float64 (float128 is unsupported); half floats
+        // are expanded to single precision as array has no half type
+        *itemsize = 2 << ll;
+        switch (ll) {
+            case 0: *typecode = 'f'; return true;
+            case 1: *typecode = 'f'; return true;
+            case 2: *typecode = 'd'; return true;
+            default: return false;
+        }
+    }
+    switch (ll) {
+        case 0:
+            // 68 is "clamped" uint8 which is identical for decoding purposes;
+            // 76 is reserved
+            if (s && *little)
+                return false;
+            *typecode = s ? 'b' : 'B';
+            *little = false;
+            return true;
+        case 1: *typecode = s ? 'h' : 'H'; return true;
+        case 2: *typecode = s ? 'i' : 'I'; return true;
+        case 3: *typecode = s ? 'q' : 'Q'; return true;
+    }
+    return false;
+}
+
+
+// Decodes the content of a typed array, introduced by lead which has already
+// been read from the input
+static PyObject *
+decode_typed_array_lead(CBORDecoderObject *self, LeadByte lead,
+                        const char typecode, const int itemsize,
+                        const bool little)
+{
+    uint64_t length;
+    bool indefinite = true, native;
+    Py_buffer view;
+    Py_ssize_t count;
+    PyObject *bytes, *floats, *ret = NULL;
+
+    if (!_CBOAR_array && _CBOAR_init_array() == -1)
+        return NULL;
+#if BYTE_ORDER == LITTLE_ENDIAN
+    native = little;
+#else
+    native = !little;
+#endif
+    // See decode_bignum
+    if (lead.major != 2 || self->stringrefs) {
+        bytes = decode_lead(self, lead, DECODE_UNSHARED);
+        if (bytes && !PyBytes_CheckExact(bytes)) {
+            PyErr_Format(
+                _CBOAR_CBORDecodeError, "invalid typed array value %R", bytes);
+            Py_CLEAR(bytes);
+        }
+    } else if (decode_length(self, lead.subtype, &length, &indefinite) == -1)
+        return NULL;
+    else if (indefinite)
+        bytes = decode_indefinite_bytestrings(self);
+    else
+        bytes = fp_read_object(self, length);
+    if (!bytes)
+        return NULL;
+
+    length = PyBytes_GET_SIZE(bytes);
+    count = length / itemsize;
+    if (length % itemsize)
+        PyErr_Format(
+            _CBOAR_CBORDecodeError,
+            "invalid typed array length %llu (must be a multiple of %d)",
+            length, itemsize);
+    else if (itemsize == 2 && typecode == 'f') {
+        // Expand half-floats into a new buffer of single-precision floats
+        floats = PyBytes_FromStringAndSize(NULL, count * sizeof(float));
+        if (floats) {
+            CBOAR_BEGIN_ALLOW_THREADS_IF(length >= CBOAR_GIL_THRESHOLD)
+            unpack_float16_array(
+                    (float *) PyBytes_AS_STRING(floats),
+                    PyBytes_AS_STRING(bytes), count, !little);
+            CBOAR_END_ALLOW_THREADS_IF
+            ret = PyObject_CallFunction(_CBOAR_array, "CO", typecode, floats);
+            Py_DECREF(floats);
+        }
+    } else {
+        ret = PyObject_CallFunction(_CBOAR_array, "CO", typecode, bytes);
+        if (ret && itemsize > 1 && !native) {
+            if (PyObject_GetBuffer(ret, &view, PyBUF_WRITABLE) == 0) {
+                CBOAR_BEGIN_ALLOW_THREADS_IF(length >= CBOAR_GIL_THRESHOLD)
+                bswap_array(view.buf, view.buf, count, itemsize);
+                CBOAR_END_ALLOW_THREADS_IF
+                PyBuffer_Release(&view);
+            } else
+                Py_CLEAR(ret);
+        }
+    }
+    Py_DECREF(bytes);
+    set_shareable(self, ret);
+    return ret;
+}
+
+
+static PyObject *
+decode_typed_array(CBORDecoderObject *self, const char typecode,
+                   const int itemsize, const bool little)
+{
+    // semantic types 64-87
+    LeadByte lead;
+
+    if (fp_read(self, &lead.byte, 1) == -1)
+        return NULL;
+    return decode_typed_array_lead(self, lead, typecode, itemsize, little);
+}
+
+
 // Special decoders //////////////////////////////////////////////////////////
 
 static PyObject *
@@ -1348,7 +3103,9 @@ decode_special(CBORDecoderObject *self, uint8_t subtype)
     // major type 7
     PyObject *tag, *ret = NULL;
 
-    if ((subtype) < 20) {
+    if (subtype < 16 && self->packed)
+        return decode_packed_item(self, subtype);
+    else if ((subtype) < 20) {
         tag = PyStructSequence_New(&CBORSimpleValueType);
         if (tag) {
             PyStructSequence_SET_ITEM(tag, 0, PyLong_FromLong(subtype));
@@ -1371,7 +3128,9 @@ decode_special(CBORDecoderObject *self, uint8_t subtype)
             case 27: return CBORDecoder_decode_float64(self);
             case 31: CBOAR_RETURN_BREAK;
             default:
-                // XXX Raise exception?
+                PyErr_Format(
+                    _CBOAR_CBORDecodeError,
+                    "undefined reserved major type 7 subtype 0x%x", subtype);
                 break;
         }
     }
@@ -1459,13 +3218,18 @@ CBORDecoder_decode_float64(CBORDecoderObject *self)
 }
 
 
-PyObject *
-decode(CBORDecoderObject *self, DecodeOptions options)
+static PyObject *
+decode_lead(CBORDecoderObject *self, LeadByte lead, DecodeOptions options)
 {
+    // Decode the item introduced by the lead-byte *lead* which has already
+    // been read from the input; this is split out of decode() for the
+    // benefit of routines that need to peek at the lead-byte first
     bool old_immutable;
     int32_t old_index;
     PyObject *ret = NULL;
-    LeadByte lead;
+
+    if (Py_EnterRecursiveCall(" in CBORDecoder.decode"))
+        return NULL;
 
     if (options & DECODE_IMMUTABLE) {
         old_immutable = self->immutable;
@@ -1476,28 +3240,450 @@ decode(CBORDecoderObject *self, DecodeOptions options)
         self->shared_index = -1;
     }
 
-    if (Py_EnterRecursiveCall(" in CBORDecoder.decode"))
-        return NULL;
-
-    if (fp_read(self, &lead.byte, 1) == 0) {
-        switch (lead.major) {
-            case 0: ret = decode_uint(self, lead.subtype);       break;
-            case 1: ret = decode_negint(self, lead.subtype);     break;
-            case 2: ret = decode_bytestring(self, lead.subtype); break;
-            case 3: ret = decode_string(self, lead.subtype);     break;
-            case 4: ret = decode_array(self, lead.subtype);      break;
-            case 5: ret = decode_map(self, lead.subtype);        break;
-            case 6: ret = decode_semantic(self, lead.subtype);   break;
-            case 7: ret = decode_special(self, lead.subtype);    break;
-            default: assert(0);
-        }
+    switch (lead.major) {
+        case 0: ret = decode_uint(self, lead.subtype);       break;
+        case 1: ret = decode_negint(self, lead.subtype);     break;
+        case 2: ret = decode_bytestring(self, lead.subtype); break;
+        case 3: ret = decode_string(self, lead.subtype);     break;
+        case 4: ret = decode_array(self, lead.subtype);      break;
+        case 5: ret = decode_map(self, lead.subtype);        break;
+        case 6: ret = decode_semantic(self, lead.subtype);   break;
+        case 7: ret = decode_special(self, lead.subtype);    break;
+        default: assert(0);
     }
 
-    Py_LeaveRecursiveCall();
     if (options & DECODE_IMMUTABLE)
         self->immutable = old_immutable;
     if (options & DECODE_UNSHARED)
         self->shared_index = old_index;
+    Py_LeaveRecursiveCall();
+    return ret;
+}
+
+
+PyObject *
+decode(CBORDecoderObject *self, DecodeOptions options)
+{
+    LeadByte lead;
+
+    if (fp_read(self, &lead.byte, 1) == -1)
+        return NULL;
+    return decode_lead(self, lead, options);
+}
+
+
+// Iterative decoding ////////////////////////////////////////////////////////
+
+// The iterative engine decodes containers (arrays, maps, sets, shareables,
+// stringref namespaces, the rumps of packed values and tags without a
+// built-in decoder) with an explicit stack of frames rather than recursion,
+// so nesting is limited only by max_depth. Everything else is decoded by the regular routines. Each frame
+// records the decoder's immutable and shared_index state for its own item;
+// the state for each of its children is derived from that before the child
+// is read (mirroring the options the recursive decoder passes), and restored
+// when the frame completes
+
+enum DecodeFrameKind {
+    FRAME_ARRAY,
+    FRAME_MAP,
+    FRAME_TAG,
+    FRAME_SHAREABLE,
+    FRAME_SET,
+    FRAME_NAMESPACE,
+    FRAME_PACKED,
+};
+
+typedef struct {
+    uint8_t kind;
+    bool indefinite;
+    bool immutable;
+    int32_t shared_index;
+    int32_t child_index;  // shared_index of a shareable's value
+    uint64_t remaining;   // items still to come (pairs, for maps)
+    Py_ssize_t index;     // next item of a definite array
+    PyObject *container;  // list, tuple, dict, or CBORTag
+    PyObject *item;       // pending map key, or the value of a tag
+    ItemVector scratch;   // items of an indefinite array to become a tuple
+    Py_ssize_t presized;  // pairs a map was presized for (see new_map)
+} DecodeFrame;
+
+// Frames held on the C stack before resorting to the heap
+#define DECODE_STACK_SIZE 32
+
+
+// Sets up the decoder's state for the next child of frame
+static inline void
+frame_child_state(CBORDecoderObject *self, const DecodeFrame *frame)
+{
+    switch (frame->kind) {
+        case FRAME_MAP:
+            self->immutable = frame->item ? frame->immutable : true;
+            self->shared_index = -1;
+            break;
+        case FRAME_SHAREABLE:
+            self->immutable = frame->immutable;
+            self->shared_index = frame->child_index;
+            break;
+        case FRAME_SET:
+            self->immutable = true;
+            self->shared_index = frame->shared_index;
+            break;
+        case FRAME_NAMESPACE:
+        case FRAME_PACKED:
+            self->immutable = frame->immutable;
+            self->shared_index = frame->shared_index;
+            break;
+        default:
+            self->immutable = frame->immutable;
+            self->shared_index = -1;
+            break;
+    }
+}
+
+
+// Opens the container for frame, which has its kind, indefinite, and
+// remaining fields set; the decoder's state is that of the frame's item
+static int
+frame_open(CBORDecoderObject *self, DecodeFrame *frame, uint64_t tagnum)
+{
+    frame->immutable = self->immutable;
+    frame->shared_index = self->shared_index;
+    frame->index = 0;
+    frame->container = NULL;
+    frame->item = NULL;
+    frame->scratch = (ItemVector) {NULL, 0, 0};
+    frame->presized = 0;
+    switch (frame->kind) {
+        case FRAME_ARRAY:
+            if (frame->indefinite && self->immutable)
+                return 0;  // see decode_indefinite_array
+            else if (frame->indefinite)
+                frame->container = PyList_New(0);
+            else if (frame->remaining > PY_SSIZE_T_MAX)
+                PyErr_Format(_CBOAR_CBORDecodeError,
+                        "excessive array length %llu", frame->remaining);
+            else if (self->immutable)
+                frame->container = PyTuple_New(frame->remaining);
+            else
+                frame->container = PyList_New(frame->remaining);
+            // Tuples are shared once complete; see decode_definite_array
+            if (frame->container && !PyTuple_CheckExact(frame->container))
+                set_shareable(self, frame->container);
+            break;
+        case FRAME_MAP:
+            frame->container = frame->indefinite ?
+                PyDict_New() :
+                new_map(self, frame->remaining, &frame->presized);
+            set_shareable(self, frame->container);
+            break;
+        case FRAME_TAG:
+            frame->container = CBORTag_New(tagnum);
+            set_shareable(self, frame->container);
+            break;
+        case FRAME_SHAREABLE:
+            frame->child_index = new_shareable(self);
+            return frame->child_index == -1 ? -1 : 0;
+        case FRAME_SET:
+            return 0;
+        case FRAME_NAMESPACE:
+            return push_stringrefs(self);
+        case FRAME_PACKED:
+            return decode_packed_tables(self);
+    }
+    return frame->container ? 0 : -1;
+}
+
+
+// Adds value (stealing the reference) to frame
+static int
+frame_add(DecodeFrame *frame, PyObject *value)
+{
+    int ret = 0;
+
+    switch (frame->kind) {
+        case FRAME_ARRAY:
+            if (!frame->indefinite) {
+                if (PyTuple_CheckExact(frame->container))
+                    PyTuple_SET_ITEM(frame->container, frame->index++, value);
+                else
+                    PyList_SET_ITEM(frame->container, frame->index++, value);
+                frame->remaining--;
+                return 0;
+            }
+            if (value == break_marker)
+                frame->indefinite = false;
+            else if (!frame->container)
+                return item_vector_append(&frame->scratch, value);
+            else
+                ret = PyList_Append(frame->container, value);
+            break;
+        case FRAME_MAP:
+            if (!frame->item) {
+                if (value == break_marker && frame->indefinite) {
+                    frame->indefinite = false;
+                    break;
+                }
+                frame->item = value;
+                return 0;
+            }
+            ret = map_set_item(frame->container, frame->item, value);
+            Py_CLEAR(frame->item);
+            if (!frame->indefinite)
+                frame->remaining--;
+            break;
+        default:
+            frame->item = value;
+            frame->remaining = 0;
+            return 0;
+    }
+    Py_DECREF(value);
+    return ret;
+}
+
+
+// Restores the decoder's state for frame's item, and returns that item
+static PyObject *
+frame_finish(CBORDecoderObject *self, DecodeFrame *frame)
+{
+    PyObject *ret = NULL;
+
+    self->immutable = frame->immutable;
+    self->shared_index = frame->shared_index;
+    switch (frame->kind) {
+        case FRAME_ARRAY:
+            if (!frame->container) {
+                ret = item_vector_tuple(&frame->scratch);
+                set_shareable(self, ret);
+            } else {
+                Py_INCREF(frame->container);
+                ret = frame->container;
+                if (PyTuple_CheckExact(ret))
+                    set_shareable(self, ret);
+            }
+            break;
+        case FRAME_MAP:
+            end_map(self, frame->presized);
+            if (self->schema_index) {
+                ret = match_record_dict(self, frame->container);
+                if (ret || PyErr_Occurred())
+                    break;
+            }
+            if (self->object_hook == Py_None) {
+                Py_INCREF(frame->container);
+                ret = frame->container;
+            } else {
+                ret = PyObject_CallFunctionObjArgs(
+                        self->object_hook, self, frame->container, NULL);
+                set_shareable(self, ret);
+            }
+            break;
+        case FRAME_TAG:
+            ret = finish_tag(self, frame->container, frame->item);
+            break;
+        case FRAME_SHAREABLE:
+            Py_INCREF(frame->item);
+            ret = frame->item;
+            break;
+        case FRAME_NAMESPACE:
+            pop_stringrefs(self);
+            Py_INCREF(frame->item);
+            ret = frame->item;
+            break;
+        case FRAME_PACKED:
+            pop_packed(self);
+            Py_INCREF(frame->item);
+            ret = frame->item;
+            break;
+        case FRAME_SET:
+            if (PyList_CheckExact(frame->item) ||
+                    PyTuple_CheckExact(frame->item)) {
+                if (self->immutable)
+                    ret = PyFrozenSet_New(frame->item);
+                else
+                    ret = PySet_New(frame->item);
+            } else
+                PyErr_Format(_CBOAR_CBORDecodeError,
+                        "invalid set array %R", frame->item);
+            set_shareable(self, ret);
+            break;
+    }
+    return ret;
+}
+
+
+static void
+frame_clear(DecodeFrame *frame)
+{
+    Py_CLEAR(frame->container);
+    Py_CLEAR(frame->item);
+    item_vector_clear(&frame->scratch);
+}
+
+
+static PyObject *
+decode_iterative(CBORDecoderObject *self)
+{
+    DecodeFrame stack[DECODE_STACK_SIZE], *frames = stack, *frame, *tmp;
+    Py_ssize_t depth = 0, allocated = DECODE_STACK_SIZE;
+    bool old_immutable = self->immutable;
+    int32_t old_index = self->shared_index;
+    StringRefs *old_refs = self->stringrefs;
+    PackedTable *old_packed = self->packed;
+    uint64_t length, tagnum = 0;
+    bool indefinite;
+    LeadByte lead;
+    PyObject *value;
+
+    for (;;) {
+        frame = depth ? &frames[depth - 1] : NULL;
+        if (frame)
+            frame_child_state(self, frame);
+        if (fp_read(self, &lead.byte, 1) == -1)
+            goto error;
+        value = NULL;
+        indefinite = false;
+        switch (lead.major) {
+            case 0: value = decode_uint(self, lead.subtype);       break;
+            case 1: value = decode_negint(self, lead.subtype);     break;
+            case 2: value = decode_bytestring(self, lead.subtype); break;
+            case 3:
+                if (frame && frame->kind == FRAME_MAP && !frame->item &&
+                        lead.subtype <= KEY_CACHE_MAX_LEN &&
+                        !self->stringrefs) {
+                    value = decode_short_key(self, lead.subtype);
+                } else
+                    value = decode_string(self, lead.subtype);
+                break;
+            case 4:
+            case 5:
+                indefinite = true;
+                if (decode_length(self, lead.subtype, &length, &indefinite) == -1)
+                    goto error;
+                break;
+            case 6:
+                if (decode_length(self, lead.subtype, &tagnum, NULL) == -1)
+                    goto error;
+                if (tagnum != 28 && tagnum != 113 && tagnum != 256 &&
+                        tagnum != 258) {
+                    value = decode_builtin_tag(self, tagnum);
+                    if (!value && PyErr_Occurred())
+                        goto error;
+                }
+                length = 1;
+                break;
+            case 7: value = decode_special(self, lead.subtype);    break;
+        }
+        if (!value) {
+            if (lead.major != 4 && lead.major != 5 && lead.major != 6)
+                goto error;
+            // Push a frame for the new container
+            if (depth >= self->max_depth) {
+                PyErr_Format(_CBOAR_CBORDecodeError,
+                        "maximum nesting depth %zd exceeded", self->max_depth);
+                goto error;
+            }
+            if (depth == allocated) {
+                allocated *= 2;
+                if (frames == stack) {
+                    tmp = PyMem_Malloc(allocated * sizeof(DecodeFrame));
+                    if (tmp)
+                        memcpy(tmp, stack, sizeof(stack));
+                } else
+                    tmp = PyMem_Realloc(frames, allocated * sizeof(DecodeFrame));
+                if (!tmp) {
+                    PyErr_NoMemory();
+                    goto error;
+                }
+                frames = tmp;
+            }
+            frame = &frames[depth];
+            frame->kind =
+                lead.major == 4 ? FRAME_ARRAY :
+                lead.major == 5 ? FRAME_MAP :
+                tagnum == 28 ? FRAME_SHAREABLE :
+                tagnum == 113 ? FRAME_PACKED :
+                tagnum == 256 ? FRAME_NAMESPACE :
+                tagnum == 258 ? FRAME_SET : FRAME_TAG;
+            frame->indefinite = indefinite;
+            frame->remaining = indefinite ? 0 : length;
+            if (frame_open(self, frame, tagnum) == -1) {
+                frame_clear(frame);
+                goto error;
+            }
+            depth++;
+        }
+        // Pass the value up through the frames, finishing any completed
+        for (;;) {
+            if (value) {
+                if (!depth)
+                    goto done;
+                if (frame_add(&frames[depth - 1], value) == -1)
+                    goto error;
+            }
+            frame = &frames[depth - 1];
+            if (frame->indefinite || frame->remaining)
+                break;
+            value = frame_finish(self, frame);
+            frame_clear(frame);
+            depth--;
+            if (!value)
+                goto error;
+        }
+    }
+error:
+    value = NULL;
+    while (depth)
+        frame_clear(&frames[--depth]);
+    while (self->stringrefs != old_refs)
+        pop_stringrefs(self);
+    while (self->packed != old_packed)
+        pop_packed(self);
+done:
+    if (frames != stack)
+        PyMem_Free(frames);
+    self->immutable = old_immutable;
+    self->shared_index = old_index;
+    return value;
+}
+
+
+static PyObject * decode_tape_buffer(CBORDecoderObject *, const char *,
+                                     Py_ssize_t, Py_ssize_t *);
+
+// The tape engine can only scan a message held in memory, so it reads all
+// remaining input from fp on the first call and decodes each message from
+// that buffer in turn, until it's exhausted
+static PyObject *
+decode_tape_engine(CBORDecoderObject *self)
+{
+    PyObject *data, *owner, *ret;
+    Py_ssize_t length;
+
+    if (!self->buf) {
+        data = PyObject_CallFunctionObjArgs(self->read, NULL);
+        if (!data)
+            return NULL;
+        if (!PyBytes_Check(data)) {
+            PyErr_Format(PyExc_TypeError,
+                    "fp.read() returned %R (expected bytes)", data);
+            Py_DECREF(data);
+            return NULL;
+        }
+        self->buf_obj = data;
+        self->buf = PyBytes_AS_STRING(data);
+        self->buf_len = PyBytes_GET_SIZE(data);
+        self->buf_pos = 0;
+    }
+    // Hooks may replace fp (or decode the rest of the buffer) while the
+    // message is decoded, releasing the buffer; keep it alive until the end,
+    // and only advance through it if it's still the decoder's
+    owner = self->buf_obj;
+    Py_XINCREF(owner);
+    ret = decode_tape_buffer(self, self->buf + self->buf_pos,
+                             self->buf_len - self->buf_pos, &length);
+    if (ret && self->buf_obj == owner)
+        self->buf_pos += length;
+    Py_XDECREF(owner);
     return ret;
 }
 
@@ -1506,7 +3692,22 @@ decode(CBORDecoderObject *self, DecodeOptions options)
 PyObject *
 CBORDecoder_decode(CBORDecoderObject *self)
 {
-    return decode(self, DECODE_NORMAL);
+    PyObject *ret;
+
+    // Once a read-ahead buffer is exhausted, go back to reading fp (which
+    // may since have grown)
+    if (self->buf_obj && self->buf_pos >= self->buf_len)
+        release_buffer(self);
+    if (!self->nesting)
+        begin_message(self);
+    self->nesting++;
+    switch (self->engine) {
+        case ENGINE_TAPE:      ret = decode_tape_engine(self);        break;
+        case ENGINE_ITERATIVE: ret = decode_iterative(self);          break;
+        default:               ret = decode(self, DECODE_NORMAL);     break;
+    }
+    self->nesting--;
+    return ret;
 }
 
 
@@ -1515,6 +3716,16 @@ static PyObject *
 CBORDecoder_decode_from_bytes(CBORDecoderObject *self, PyObject *data)
 {
     PyObject *save_read, *buf, *ret = NULL;
+    Py_buffer view;
+    Py_ssize_t length;
+
+    if (self->engine == ENGINE_TAPE) {
+        if (PyObject_GetBuffer(data, &view, PyBUF_SIMPLE) == -1)
+            return NULL;
+        ret = decode_tape_buffer(self, view.buf, view.len, &length);
+        PyBuffer_Release(&view);
+        return ret;
+    }
 
     if (!_CBOAR_BytesIO && _CBOAR_init_BytesIO() == -1)
         return NULL;
@@ -1524,7 +3735,12 @@ CBORDecoder_decode_from_bytes(CBORDecoderObject *self, PyObject *data)
     if (buf) {
         self->read = PyObject_GetAttr(buf, _CBOAR_str_read);
         if (self->read) {
-            ret = decode(self, DECODE_NORMAL);
+            if (!self->nesting)
+                begin_message(self);
+            self->nesting++;
+            ret = self->engine == ENGINE_ITERATIVE ?
+                decode_iterative(self) : decode(self, DECODE_NORMAL);
+            self->nesting--;
             Py_DECREF(self->read);
         }
         Py_DECREF(buf);
@@ -1534,6 +3750,245 @@ CBORDecoder_decode_from_bytes(CBORDecoderObject *self, PyObject *data)
 }
 
 
+// Tape decoding /////////////////////////////////////////////////////////////
+
+static PyObject * decode_tape_item(CBORDecoderObject *, const Tape *, size_t *,
+                                   bool);
+
+
+// Decodes the map key at tape->items[*index], advancing *index past it
+static PyObject *
+decode_tape_key(CBORDecoderObject *self, const Tape *tape, size_t *index)
+{
+    const TapeItem *item = &tape->items[*index];
+
+    if (item->kind == TAPE_STRING && item->ascii &&
+            item->value <= KEY_CACHE_MAX_LEN) {
+        (*index)++;
+        return decode_cached_key(self, tape->buf + item->offset, item->value);
+    }
+    return decode_tape_item(self, tape, index, true);
+}
+
+
+// As decode_record_map, for the length pairs of a map on the tape. Maps which
+// don't match a schema are passed to object_hook as usual
+static PyObject *
+decode_tape_record(CBORDecoderObject *self, const Tape *tape, size_t *index,
+                   Py_ssize_t length, bool immutable)
+{
+    PyObject *stack[RECORD_STACK_PAIRS * 2], **pairs, *map, *ret = NULL;
+    Py_ssize_t i, count;
+
+    pairs = length <= RECORD_STACK_PAIRS ? stack :
+        PyMem_Malloc(length * 2 * sizeof(PyObject *));
+    if (!pairs)
+        return PyErr_NoMemory();
+    for (count = 0; count < length * 2; count += 2) {
+        pairs[count] = decode_tape_key(self, tape, index);
+        if (!pairs[count])
+            break;
+        pairs[count + 1] = decode_tape_item(self, tape, index, immutable);
+        if (!pairs[count + 1]) {
+            Py_DECREF(pairs[count]);
+            break;
+        }
+    }
+    if (count == length * 2) {
+        ret = match_record(self, pairs, length);
+        if (!ret && !PyErr_Occurred()) {
+            map = _PyDict_NewPresized(length);
+            for (i = 0; map && i < count; i += 2)
+                if (map_set_item(map, pairs[i], pairs[i + 1]) == -1)
+                    Py_CLEAR(map);
+            if (map && self->object_hook != Py_None) {
+                ret = PyObject_CallFunctionObjArgs(
+                        self->object_hook, self, map, NULL);
+                Py_DECREF(map);
+            } else
+                ret = map;
+        }
+    }
+    for (i = 0; i < count; ++i)
+        Py_DECREF(pairs[i]);
+    if (pairs != stack)
+        PyMem_Free(pairs);
+    return ret;
+}
+
+
+// Decodes the item at tape->items[*index] (and, for containers, the items
+// following it), advancing *index past them. TAPE_OTHER items are decoded
+// from the tape's buffer by the regular decoder, which self->buf must be set
+// up to read
+static PyObject *
+decode_tape_item(CBORDecoderObject *self, const Tape *tape, size_t *index,
+                 bool immutable)
+{
+    const TapeItem *item = &tape->items[(*index)++];
+    const char *buf = tape->buf + item->offset;
+    PyObject *key, *value, *ret = NULL;
+    uint64_t i;
+
+    if (Py_EnterRecursiveCall(" in CBORDecoder.decode"))
+        return NULL;
+    switch (item->kind) {
+        case TAPE_UINT:
+            ret = PyLong_FromUnsignedLongLong(item->value);
+            break;
+        case TAPE_NEGINT:
+            if (item->value <= LLONG_MAX)
+                ret = PyLong_FromLongLong(-1 - (long long) item->value);
+            else {
+                value = PyLong_FromUnsignedLongLong(item->value);
+                if (value) {
+                    ret = PyNumber_Invert(value);
+                    Py_DECREF(value);
+                }
+            }
+            break;
+        case TAPE_BYTES:
+            ret = PyBytes_FromStringAndSize(buf, item->value);
+            break;
+        case TAPE_STRING:
+            if (item->ascii) {
+                ret = PyUnicode_New(item->value, 127);
+                if (ret)
+                    memcpy(PyUnicode_1BYTE_DATA(ret), buf, item->value);
+            } else
+                ret = PyUnicode_DecodeUTF8(buf, item->value,
+                        PyBytes_AS_STRING(self->str_errors));
+            break;
+        case TAPE_ARRAY:
+            ret = immutable ?
+                PyTuple_New(item->value) : PyList_New(item->value);
+            for (i = 0; ret && i < item->value; ++i) {
+                value = decode_tape_item(self, tape, index, immutable);
+                if (!value)
+                    Py_CLEAR(ret);
+                else if (immutable)
+                    PyTuple_SET_ITEM(ret, i, value);
+                else
+                    PyList_SET_ITEM(ret, i, value);
+            }
+            break;
+        case TAPE_MAP:
+            if (self->schema_index && item->value &&
+                    item->value <= (uint64_t) self->schema_max) {
+                ret = decode_tape_record(
+                        self, tape, index, item->value, immutable);
+                break;
+            }
+            ret = _PyDict_NewPresized(item->value);
+            for (i = 0; ret && i < item->value; ++i) {
+                key = decode_tape_key(self, tape, index);
+                if (key) {
+                    value = decode_tape_item(self, tape, index, immutable);
+                    if (value) {
+                        if (map_set_item(ret, key, value) == -1)
+                            Py_CLEAR(ret);
+                        Py_DECREF(value);
+                    } else
+                        Py_CLEAR(ret);
+                    Py_DECREF(key);
+                } else
+                    Py_CLEAR(ret);
+            }
+            if (ret && self->object_hook != Py_None) {
+                value = PyObject_CallFunctionObjArgs(
+                        self->object_hook, self, ret, NULL);
+                Py_DECREF(ret);
+                ret = value;
+            }
+            break;
+        case TAPE_FALSE:
+            ret = Py_False;
+            Py_INCREF(ret);
+            break;
+        case TAPE_TRUE:
+            ret = Py_True;
+            Py_INCREF(ret);
+            break;
+        case TAPE_NULL:
+            ret = Py_None;
+            Py_INCREF(ret);
+            break;
+        case TAPE_UNDEFINED:
+            ret = undefined;
+            Py_INCREF(ret);
+            break;
+        case TAPE_FLOAT:
+            ret = PyFloat_FromDouble(item->f);
+            break;
+        default:
+            self->buf_pos = item->offset;
+            ret = decode(self, immutable ?
+                    DECODE_IMMUTABLE | DECODE_UNSHARED : DECODE_UNSHARED);
+            break;
+    }
+    Py_LeaveRecursiveCall();
+    return ret;
+}
+
+
+// Decodes the message described by the (successfully scanned) tape
+PyObject *
+CBORDecoder_decode_tape(CBORDecoderObject *self, const Tape *tape)
+{
+    const char *save_buf = self->buf;
+    Py_ssize_t save_len = self->buf_len, save_pos = self->buf_pos;
+    size_t index = 0;
+    PyObject *owner, *ret;
+
+    if (!self->nesting)
+        begin_message(self);
+    self->nesting++;
+    owner = self->buf_obj;
+    Py_XINCREF(owner);
+    self->buf = tape->buf;
+    self->buf_len = tape->size;
+    self->buf_pos = 0;
+    ret = decode_tape_item(self, tape, &index, false);
+    self->nesting--;
+    // The saved buffer is only restored if a hook didn't release or replace
+    // it in the meantime
+    if (self->buf_obj == owner) {
+        self->buf = save_buf;
+        self->buf_len = save_len;
+        self->buf_pos = save_pos;
+    }
+    Py_XDECREF(owner);
+    return ret;
+}
+
+
+// Scans the message at the start of buf into a tape and decodes it, storing
+// the length of the message in *length. The scan doesn't need the GIL, so
+// it's released for large inputs
+static PyObject *
+decode_tape_buffer(CBORDecoderObject *self, const char *buf, Py_ssize_t size,
+                   Py_ssize_t *length)
+{
+    Tape tape;
+    PyObject *ret = NULL;
+    int result;
+
+    tape_init(&tape, buf, size);
+    CBOAR_BEGIN_ALLOW_THREADS_IF(size >= CBOAR_GIL_THRESHOLD)
+    result = tape_scan(&tape);
+    CBOAR_END_ALLOW_THREADS_IF
+    if (result == TAPE_OK) {
+        ret = CBORDecoder_decode_tape(self, &tape);
+        *length = tape.length;
+    } else if (result == TAPE_NOMEM)
+        PyErr_NoMemory();
+    else
+        PyErr_SetString(_CBOAR_CBORDecodeError, tape.error);
+    tape_free(&tape);
+    return ret;
+}
+
+
 // Decoder class definition //////////////////////////////////////////////////
 
 #define PUBLIC_MAJOR(type)                                                   \
@@ -1554,6 +4009,12 @@ PUBLIC_MAJOR(special);
 
 #undef PUBLIC_MAJOR
 
+static PyMemberDef CBORDecoder_members[] = {
+    {"packed_sharing", T_BOOL, offsetof(CBORDecoderObject, packed_sharing), 0,
+        "if True, then references to packed CBOR items share the same object"},
+    {NULL}
+};
+
 static PyGetSetDef CBORDecoder_getsetters[] = {
     {"fp",
         (getter) _CBORDecoder_get_fp, (setter) _CBORDecoder_set_fp,
@@ -1567,6 +4028,15 @@ static PyGetSetDef CBORDecoder_getsetters[] = {
     {"str_errors",
         (getter) _CBORDecoder_get_str_errors, (setter) _CBORDecoder_set_str_errors,
         "the error mode to use when decoding UTF-8 encoded strings"},
+    {"engine",
+        (getter) _CBORDecoder_get_engine, (setter) _CBORDecoder_set_engine,
+        "the decoding engine to use ('stream', 'tape', or 'iterative')"},
+    {"max_depth",
+        (getter) _CBORDecoder_get_max_depth, (setter) _CBORDecoder_set_max_depth,
+        "the maximum nesting of containers with the iterative engine"},
+    {"schemas",
+        (getter) _CBORDecoder_get_schemas, (setter) _CBORDecoder_set_schemas,
+        "the compiled schemas of the records to decode maps as"},
     {NULL}
 };
 
@@ -1609,8 +4079,21 @@ static PyMethodDef CBORDecoder_methods[] = {
         "decode a shareable value from the input"},
     {"decode_shared", (PyCFunction) CBORDecoder_decode_shared, METH_NOARGS,
         "decode a shared reference from the input"},
+    {"decode_stringref",
+        (PyCFunction) CBORDecoder_decode_stringref, METH_NOARGS,
+        "decode a string reference from the input"},
+    {"decode_stringref_namespace",
+        (PyCFunction) CBORDecoder_decode_stringref_namespace, METH_NOARGS,
+        "decode a string reference namespace from the input"},
+    {"decode_packed", (PyCFunction) CBORDecoder_decode_packed, METH_NOARGS,
+        "decode a packed CBOR value from the input"},
+    {"decode_packed_reference",
+        (PyCFunction) CBORDecoder_decode_packed_reference, METH_NOARGS,
+        "decode a reference to a packed CBOR shared item from the input"},
     {"decode_set", (PyCFunction) CBORDecoder_decode_set, METH_NOARGS,
         "decode a set or frozenset from the input"},
+    {"decode_columnar", (PyCFunction) CBORDecoder_decode_columnar, METH_NOARGS,
+        "decode a list of records encoded column by column from the input"},
     {"decode_ipaddress", (PyCFunction) CBORDecoder_decode_ipaddress, METH_NOARGS,
         "decode an IPv4Address or IPv6Address from the input"},
     {"decode_simplevalue",
@@ -1648,6 +4131,36 @@ PyDoc_STRVAR(CBORDecoder__doc__,
 "    dictionary. This callback is invoked for each deserialized\n"
 "    :class:`dict` object. The return value is substituted for the dict\n"
 "    in the deserialized output.\n"
+":param str_errors:\n"
+"    the error mode to use when decoding UTF-8 encoded strings; one of\n"
+"    ``'strict'`` (the default), ``'error'``, or ``'replace'``.\n"
+":param engine:\n"
+"    ``'stream'`` (the default) decodes values as they are read from the\n"
+"    input. ``'tape'`` first scans each message into a flat array of\n"
+"    tokens (recording the size of every container) without reference\n"
+"    to any Python objects, then builds the result from that. Because\n"
+"    messages must be scanned in memory, the tape engine reads all\n"
+"    remaining input from *fp* on the first call to :meth:`decode`.\n"
+"    ``'iterative'`` produces the same results as ``'stream'``, but\n"
+"    decodes containers with an explicit stack rather than recursion, so\n"
+"    the nesting of the input is limited only by *max_depth*.\n"
+":param max_depth:\n"
+"    the maximum nesting of containers (including tags) accepted by the\n"
+"    iterative engine; defaults to 100000.\n"
+":param bool packed_sharing:\n"
+"    by default each reference to a packed CBOR (tag 113) shared item\n"
+"    returns that same object. Set to ``False`` to have references to\n"
+"    lists, dicts, and sets return copies so they may be modified\n"
+"    independently. Copies (and the tuples and frozensets that\n"
+"    references produce where the decoder requires immutable values)\n"
+"    are limited to about a million items per packed value.\n"
+":param schemas:\n"
+"    a sequence of :class:`CBORSchema` (see :func:`compile_schema`). A\n"
+"    map whose keys are exactly the fields of one of these is decoded\n"
+"    as an instance of the schema's type, built directly from the\n"
+"    values without an intermediate dict or a call to *object_hook*.\n"
+"    Instances are created as :mod:`pickle` does, without calling\n"
+"    ``__init__``. Any other map is decoded as usual.\n"
 "\n"
 ".. _CBOR: https://cbor.io/\n"
 );
@@ -1664,6 +4177,7 @@ PyTypeObject CBORDecoderType = {
     .tp_dealloc = (destructor) CBORDecoder_dealloc,
     .tp_traverse = (traverseproc) CBORDecoder_traverse,
     .tp_clear = (inquiry) CBORDecoder_clear,
+    .tp_members = CBORDecoder_members,
     .tp_getset = CBORDecoder_getsetters,
     .tp_methods = CBORDecoder_methods,
 };
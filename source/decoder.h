@@ -2,16 +2,71 @@
 #include <Python.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include "tape.h"
+
+// Default limit on the nesting of containers with the iterative engine
+#define DEFAULT_MAX_DEPTH 100000
+
+// Limit on the number of items that references to packed CBOR items may copy
+// (or convert to their immutable forms) within the outermost table. Tables
+// whose items refer to those before them can otherwise expand exponentially
+#define PACKED_EXPANSION_LIMIT (1024 * 1024)
+
+// Limits on the number of pairs a dict is presized for from the (untrusted)
+// length of a map: when the input is in memory, a map can't claim more pairs
+// than the remaining bytes could hold (up to MAP_PRESIZE_LIMIT), otherwise
+// it's presized for no more than MAP_PRESIZE_STREAM_LIMIT. Nested maps may
+// all claim the same bytes, so the pairs presized for the maps still being
+// filled are limited to MAP_PRESIZE_BUDGET in total too. Larger maps simply
+// grow as they are filled
+#define MAP_PRESIZE_LIMIT (64 * 1024)
+#define MAP_PRESIZE_STREAM_LIMIT 256
+#define MAP_PRESIZE_BUDGET (256 * 1024)
+
+// A stringref namespace (semantic type 256): the strings which may be
+// referenced by semantic type 25, within the enclosing namespace (if any)
+typedef struct StringRefs {
+    PyObject **items;
+    Py_ssize_t length;
+    Py_ssize_t size;
+    struct StringRefs *outer;
+} StringRefs;
+
+// The shared items of a packed CBOR table (semantic type 113), which precede
+// those of any enclosing table when referenced
+typedef struct PackedTable {
+    PyObject *items;    // list of the items decoded so far
+    Py_ssize_t length;  // number of items in the table
+    struct PackedTable *outer;
+} PackedTable;
 
 typedef struct {
     PyObject_HEAD
     PyObject *read;    // cached read() method of fp
     PyObject *tag_hook;
     PyObject *object_hook;
-    PyObject *shareables;
+    PyObject **shareables; // values of shareable items (NULL until set)
+    Py_ssize_t shareables_len;
+    Py_ssize_t shareables_size;
     PyObject *str_errors;
     bool immutable;
     int32_t shared_index;
+    const char *buf;   // in-memory input, read in place of fp when not NULL
+    Py_ssize_t buf_len;
+    Py_ssize_t buf_pos;
+    PyObject *buf_obj; // owner of buf when the tape engine has read ahead
+    PyObject **keys;   // cache of short ASCII map keys, allocated on first use
+    uint8_t engine;
+    Py_ssize_t max_depth;
+    Py_ssize_t nesting;  // depth of calls to decode; 0 at the top level
+    StringRefs *stringrefs; // the innermost stringref namespace, or NULL
+    PackedTable *packed;    // the innermost packed CBOR table, or NULL
+    bool packed_sharing;    // if true, references to packed items share them
+    Py_ssize_t packed_budget; // items references may still copy (see above)
+    Py_ssize_t presize_budget; // pairs unfilled maps may be presized for
+    PyObject *schemas;      // tuple of CBORSchemas for records, or None
+    PyObject *schema_index; // maps field names to lists of schemas, or NULL
+    Py_ssize_t schema_max;  // largest number of fields in the schemas
 } CBORDecoderObject;
 
 PyTypeObject CBORDecoderType;
@@ -19,3 +74,4 @@ PyTypeObject CBORDecoderType;
 PyObject * CBORDecoder_new(PyTypeObject *, PyObject *, PyObject *);
 int CBORDecoder_init(CBORDecoderObject *, PyObject *, PyObject *);
 PyObject * CBORDecoder_decode(CBORDecoderObject *);
+PyObject * CBORDecoder_decode_tape(CBORDecoderObject *, const Tape *);
@@ -9,22 +9,31 @@
 #include <datetime.h>
 #include "module.h"
 #include "halffloat.h"
+#include "byteswap.h"
 #include "tags.h"
 #include "encoder.h"
+#include "schema.h"
 
 
 typedef PyObject * (EncodeFunction)(CBOREncoderObject *, PyObject *);
 
 static int encode_semantic(CBOREncoderObject *, const uint64_t, PyObject *);
 static PyObject * encode_shared(CBOREncoderObject *, EncodeFunction *, PyObject *);
+static PyObject * encode(CBOREncoderObject *, PyObject *);
+static PyObject * encode_iterative(CBOREncoderObject *, PyObject *);
+static PyObject * encode_array(CBOREncoderObject *, PyObject *);
+static void shared_clear(CBOREncoderObject *);
+static void stringrefs_clear(CBOREncoderObject *);
 
 static PyObject * CBOREncoder_encode_to_bytes(CBOREncoderObject *, PyObject *);
 static PyObject * CBOREncoder_encode_int(CBOREncoderObject *, PyObject *);
 static PyObject * CBOREncoder_encode_float(CBOREncoderObject *, PyObject *);
+static PyObject * CBOREncoder_encode_minimal_float(CBOREncoderObject *, PyObject *);
 
 static int _CBOREncoder_set_fp(CBOREncoderObject *, PyObject *, void *);
 static int _CBOREncoder_set_default(CBOREncoderObject *, PyObject *, void *);
 static int _CBOREncoder_set_timezone(CBOREncoderObject *, PyObject *, void *);
+static int _CBOREncoder_set_engine(CBOREncoderObject *, PyObject *, void *);
 
 
 // Constructors and destructors //////////////////////////////////////////////
@@ -32,12 +41,18 @@ static int _CBOREncoder_set_timezone(CBOREncoderObject *, PyObject *, void *);
 static int
 CBOREncoder_traverse(CBOREncoderObject *self, visitproc visit, void *arg)
 {
+    size_t i;
+
     Py_VISIT(self->write);
     Py_VISIT(self->encoders);
     Py_VISIT(self->default_handler);
-    Py_VISIT(self->shared);
     Py_VISIT(self->timezone);
     Py_VISIT(self->shared_handler);
+    Py_VISIT(self->pack_refs);
+    if (self->shared_count)
+        for (i = 0; i <= self->shared_mask; ++i)
+            if (self->shared[i].value && self->shared[i].index != -1)
+                Py_VISIT(self->shared[i].value);
     return 0;
 }
 
@@ -47,7 +62,9 @@ CBOREncoder_clear(CBOREncoderObject *self)
     Py_CLEAR(self->write);
     Py_CLEAR(self->encoders);
     Py_CLEAR(self->default_handler);
-    Py_CLEAR(self->shared);
+    shared_clear(self);
+    stringrefs_clear(self);
+    Py_CLEAR(self->pack_refs);
     Py_CLEAR(self->timezone);
     Py_CLEAR(self->shared_handler);
     return 0;
@@ -59,6 +76,8 @@ CBOREncoder_dealloc(CBOREncoderObject *self)
 {
     PyObject_GC_UnTrack(self);
     CBOREncoder_clear(self);
+    PyMem_Free(self->shared);
+    PyMem_Free(self->stringrefs);
     Py_TYPE(self)->tp_free((PyObject *) self);
 }
 
@@ -82,8 +101,6 @@ CBOREncoder_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
         Py_INCREF(Py_None);
         self->encoders = Py_None;
         Py_INCREF(Py_None);
-        self->shared = Py_None;
-        Py_INCREF(Py_None);
         self->write = Py_None;
         Py_INCREF(Py_None);
         self->default_handler = Py_None;
@@ -92,6 +109,25 @@ CBOREncoder_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
         self->enc_style = 0;
         self->timestamp_format = false;
         self->value_sharing = false;
+        self->float16_arrays = false;
+        self->string_referencing = false;
+        self->string_namespace = false;
+        self->packed = false;
+        self->columnar = false;
+        self->deterministic = false;
+        self->engine = ENGINE_STREAM;
+        self->shared = NULL;
+        self->shared_mask = 0;
+        self->shared_count = 0;
+        self->nesting = 0;
+        self->streaming = 0;
+        self->stringrefs = NULL;
+        self->stringrefs_mask = 0;
+        self->stringrefs_count = 0;
+        self->stringrefs_next = 0;
+        self->pack_refs = NULL;
+        self->pack_limit = 0;
+        self->capture = NULL;
         self->shared_handler = NULL;
     }
     return (PyObject *) self;
@@ -99,20 +135,29 @@ CBOREncoder_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
 
 
 // CBOREncoder.__init__(self, fp=None, default_handler=None,
-//                      timestamp_format=0, value_sharing=False)
+//                      timestamp_format=0, value_sharing=False,
+//                      float16_arrays=False, engine='stream',
+//                      string_referencing=False, packed=False,
+//                      columnar=False, deterministic=False)
 int
 CBOREncoder_init(CBOREncoderObject *self, PyObject *args, PyObject *kwargs)
 {
     static char *keywords[] = {
         "fp", "datetime_as_timestamp", "timezone", "value_sharing", "default",
-        "canonical", NULL
+        "canonical", "float16_arrays", "engine", "string_referencing",
+        "packed", "columnar", "deterministic", NULL
     };
-    PyObject *tmp, *fp = NULL, *default_handler = NULL, *timezone = NULL;
+    PyObject *tmp, *fp = NULL, *default_handler = NULL, *timezone = NULL,
+             *engine = NULL;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|pOpOB", keywords,
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|pOpOBpOpppp", keywords,
                 &fp, &self->timestamp_format, &timezone, &self->value_sharing,
-                &default_handler, &self->enc_style))
+                &default_handler, &self->enc_style, &self->float16_arrays,
+                &engine, &self->string_referencing, &self->packed,
+                &self->columnar, &self->deterministic))
         return -1;
+    if (self->deterministic)
+        self->enc_style = 1;
 
     if (_CBOREncoder_set_fp(self, fp, NULL) == -1)
         return -1;
@@ -120,11 +165,11 @@ CBOREncoder_init(CBOREncoderObject *self, PyObject *args, PyObject *kwargs)
         return -1;
     if (timezone && _CBOREncoder_set_timezone(self, timezone, NULL) == -1)
         return -1;
-
-    self->shared = PyDict_New();
-    if (!self->shared)
+    if (engine && _CBOREncoder_set_engine(self, engine, NULL) == -1)
         return -1;
 
+    shared_clear(self);
+
     tmp = self->encoders;
     self->encoders = PyObject_CallMethodObjArgs(
         _CBOAR_default_encoders, _CBOAR_str_copy, NULL);
@@ -252,21 +297,334 @@ _CBOREncoder_set_timezone(CBOREncoderObject *self, PyObject *value,
     return 0;
 }
 
+
+// CBOREncoder._get_shared(self)
+static PyObject *
+_CBOREncoder_get_shared(CBOREncoderObject *self, void *closure)
+{
+    // Builds a snapshot of the shared table in the layout of the dict this
+    // attribute used to be: id(value) -> (value, index or None)
+    PyObject *id, *index, *tuple, *ret;
+    SharedEntry *entry;
+    size_t i;
+
+    ret = PyDict_New();
+    for (i = 0; ret && self->shared_count && i <= self->shared_mask; ++i) {
+        entry = &self->shared[i];
+        if (!entry->value)
+            continue;
+        tuple = NULL;
+        id = PyLong_FromVoidPtr(entry->value);
+        if (id) {
+            if (entry->index == -1) {
+                Py_INCREF(Py_None);
+                index = Py_None;
+            } else
+                index = PyLong_FromSsize_t(entry->index);
+            if (index) {
+                tuple = PyTuple_Pack(2, entry->value, index);
+                if (tuple && PyDict_SetItem(ret, id, tuple) == -1)
+                    Py_CLEAR(tuple);
+                Py_DECREF(index);
+            }
+            Py_DECREF(id);
+        }
+        if (tuple)
+            Py_DECREF(tuple);
+        else
+            Py_CLEAR(ret);
+    }
+    return ret;
+}
+
+
+// CBOREncoder._get_engine(self)
+static PyObject *
+_CBOREncoder_get_engine(CBOREncoderObject *self, void *closure)
+{
+    PyObject *ret;
+
+    if (self->engine == ENGINE_ITERATIVE)
+        ret = _CBOAR_str_iterative;
+    else
+        ret = _CBOAR_str_stream;
+    Py_INCREF(ret);
+    return ret;
+}
+
+
+// CBOREncoder._set_engine(self, value)
+static int
+_CBOREncoder_set_engine(CBOREncoderObject *self, PyObject *value,
+                        void *closure)
+{
+    if (!value) {
+        PyErr_SetString(PyExc_TypeError,
+                        "cannot delete engine attribute");
+        return -1;
+    }
+    if (PyUnicode_Check(value)) {
+        if (!PyUnicode_Compare(value, _CBOAR_str_stream)) {
+            self->engine = ENGINE_STREAM;
+            return 0;
+        } else if (!PyUnicode_Compare(value, _CBOAR_str_iterative)) {
+            self->engine = ENGINE_ITERATIVE;
+            return 0;
+        }
+    }
+    if (!PyErr_Occurred())
+        PyErr_Format(PyExc_ValueError,
+                "invalid engine value %R (must be one of 'stream' or "
+                "'iterative')", value);
+    return -1;
+}
+
 
+// Shared values /////////////////////////////////////////////////////////////
+
+// The containers seen by the encoder are tracked in a hash table keyed on
+// their addresses (see SharedEntry) for value sharing and cycle detection.
+// Entries are only removed in the reverse order they were added (when value
+// sharing is off), or all at once at the start of a top-level encode, so the
+// table is kept at most half full and removal just closes the gap
+
+#define SHARED_INITIAL_SIZE 64
+
+static inline size_t
+shared_hash(const PyObject *value)
+{
+    return ((uintptr_t) value >> 4) * 0x9E3779B97F4A7C15ULL;
+}
+
+
+// Returns the entry for value, which is empty (has a NULL value) if value
+// hasn't been seen. The table is grown if necessary so that an empty entry
+// can be filled by shared_add. Returns NULL on error
+static SharedEntry *
+shared_find(CBOREncoderObject *self, PyObject *value)
+{
+    SharedEntry *old = self->shared, *entry;
+    size_t i, size, old_size = old ? self->shared_mask + 1 : 0;
+
+    if ((self->shared_count + 1) * 2 > old_size) {
+        size = old_size ? old_size * 2 : SHARED_INITIAL_SIZE;
+        self->shared = PyMem_Calloc(size, sizeof(SharedEntry));
+        if (!self->shared) {
+            self->shared = old;
+            PyErr_NoMemory();
+            return NULL;
+        }
+        self->shared_mask = size - 1;
+        for (i = 0; i < old_size; ++i) {
+            if (old[i].value) {
+                entry = shared_find(self, old[i].value);
+                *entry = old[i];
+            }
+        }
+        PyMem_Free(old);
+    }
+    for (i = shared_hash(value);; ++i) {
+        entry = &self->shared[i & self->shared_mask];
+        if (!entry->value || entry->value == value)
+            return entry;
+    }
+}
+
+
+// Fills the empty entry (from shared_find) with value, returning its index
+// (or -1 without value sharing)
+static inline Py_ssize_t
+shared_add(CBOREncoderObject *self, SharedEntry *entry, PyObject *value)
+{
+    entry->value = value;
+    if (self->value_sharing) {
+        Py_INCREF(value);
+        entry->index = self->shared_count;
+    } else
+        entry->index = -1;
+    self->shared_count++;
+    return entry->index;
+}
+
+
+// Removes value, which must have been the last value added without value
+// sharing
+static void
+shared_remove(CBOREncoderObject *self, PyObject *value)
+{
+    SharedEntry *table = self->shared;
+    size_t i, j, k, mask = self->shared_mask;
+
+    for (i = shared_hash(value) & mask; table[i].value != value;
+            i = (i + 1) & mask)
+        if (!table[i].value)
+            return;
+    // Shift back any later entries in the same run which would no longer be
+    // reachable from their home slots
+    for (j = (i + 1) & mask; table[j].value; j = (j + 1) & mask) {
+        k = shared_hash(table[j].value) & mask;
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        table[i] = table[j];
+        i = j;
+    }
+    table[i].value = NULL;
+    self->shared_count--;
+}
+
+
+static void
+shared_clear(CBOREncoderObject *self)
+{
+    SharedEntry *table = self->shared;
+    size_t i, size = self->shared_mask + 1;
+
+    if (self->shared_count) {
+        // The table is detached before its references are dropped, as a
+        // finalizer may re-enter the encoder (which then starts a new one)
+        self->shared = NULL;
+        self->shared_mask = 0;
+        self->shared_count = 0;
+        for (i = 0; i < size; ++i)
+            if (table[i].value && table[i].index != -1)
+                Py_DECREF(table[i].value);
+        if (self->shared)
+            PyMem_Free(table);
+        else {
+            memset(table, 0, size * sizeof(SharedEntry));
+            self->shared = table;
+            self->shared_mask = size - 1;
+        }
+    }
+}
+
+
 // Utility methods ///////////////////////////////////////////////////////////
 
+// Passes bytes (which the sink may keep) to the capture buffer's sink
 static int
-fp_write(CBOREncoderObject *self, const char *buf, const int length)
+capture_send_object(CaptureBuffer *capture, PyObject *bytes)
 {
-    PyObject *bytes, *ret = NULL;
+    PyObject *ret;
+
+    ret = PyObject_CallFunctionObjArgs(capture->sink, bytes, NULL);
+    Py_XDECREF(ret);
+    return ret ? 0 : -1;
+}
+
+
+// Passes a copy of length bytes from buf to the capture buffer's sink; buf is
+// the reusable buffer itself, or borrowed, so it can't be handed over as is
+static int
+capture_send(CaptureBuffer *capture, const char *buf, const Py_ssize_t length)
+{
+    PyObject *bytes;
+    int ret;
 
     bytes = PyBytes_FromStringAndSize(buf, length);
+    if (!bytes)
+        return -1;
+    ret = capture_send_object(capture, bytes);
+    Py_DECREF(bytes);
+    return ret;
+}
+
+
+// Empties the capture buffer into its sink
+static int
+capture_flush(CaptureBuffer *capture)
+{
+    Py_ssize_t used = capture->used;
+
+    capture->used = 0;
+    return used ? capture_send(capture, capture->data, used) : 0;
+}
+
+
+// Appends length bytes from buf to the capture buffer, growing it as needed
+// or, when it has a sink, flushing it (writes too large to buffer are passed
+// straight to the sink)
+static int
+capture_write(CaptureBuffer *capture, const char *buf, const Py_ssize_t length)
+{
+    char *data;
+    Py_ssize_t size;
+
+    if (capture->size - capture->used < length) {
+        if (capture->sink) {
+            if (capture_flush(capture) == -1)
+                return -1;
+            if (length >= capture->size)
+                return capture_send(capture, buf, length);
+        } else {
+            size = capture->size ? capture->size : 256;
+            while (size - capture->used < length)
+                size *= 2;
+            data = PyMem_Realloc(capture->data, size);
+            if (!data) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            capture->data = data;
+            capture->size = size;
+        }
+    }
+    memcpy(capture->data + capture->used, buf, length);
+    capture->used += length;
+    return 0;
+}
+
+
+static int
+fp_write_object(CBOREncoderObject *self, PyObject *bytes)
+{
+    PyObject *ret;
+
+    if (self->capture) {
+        // Bytes too large to buffer are immutable, so a sink can have them
+        // without a copy
+        if (self->capture->sink &&
+                PyBytes_GET_SIZE(bytes) >= self->capture->size) {
+            if (capture_flush(self->capture) == -1)
+                return -1;
+            return capture_send_object(self->capture, bytes);
+        }
+        return capture_write(self->capture,
+                PyBytes_AS_STRING(bytes), PyBytes_GET_SIZE(bytes));
+    }
+    ret = PyObject_CallFunctionObjArgs(self->write, bytes, NULL);
+    Py_XDECREF(ret);
+    return ret ? 0 : -1;
+}
+
+
+// Large buffers are copied into the bytes object passed to write() with the
+// GIL released, so buf must not be freed or resized by another thread during
+// the call (i.e. it's local, owned by an immutable object, or an exported
+// buffer). While a capture buffer is set, the output is appended to it instead
+static int
+fp_write(CBOREncoderObject *self, const char *buf, const Py_ssize_t length)
+{
+    PyObject *bytes;
+    int ret = -1;
+
+    if (self->capture)
+        return capture_write(self->capture, buf, length);
+    if (length < CBOAR_GIL_THRESHOLD)
+        bytes = PyBytes_FromStringAndSize(buf, length);
+    else {
+        bytes = PyBytes_FromStringAndSize(NULL, length);
+        if (bytes) {
+            Py_BEGIN_ALLOW_THREADS
+            memcpy(PyBytes_AS_STRING(bytes), buf, length);
+            Py_END_ALLOW_THREADS
+        }
+    }
     if (bytes) {
-        ret = PyObject_CallFunctionObjArgs(self->write, bytes, NULL);
-        Py_XDECREF(ret);
+        ret = fp_write_object(self, bytes);
         Py_DECREF(bytes);
     }
-    return ret ? 0 : -1;
+    return ret;
 }
 
 
@@ -278,44 +636,126 @@ CBOREncoder_write(CBOREncoderObject *self, PyObject *data)
         PyErr_SetString(_CBOAR_CBOREncodeError, "expected bytes for writing");
         return NULL;
     }
-    if (fp_write(self, PyBytes_AS_STRING(data), PyBytes_GET_SIZE(data)) == -1)
+    if (PyBytes_CheckExact(data)) {
+        if (fp_write_object(self, data) == -1)
+            return NULL;
+    } else if (fp_write(self, PyBytes_AS_STRING(data),
+                        PyBytes_GET_SIZE(data)) == -1)
         return NULL;
     Py_RETURN_NONE;
 }
 
 
+// Writes the lead-byte and length for the specified major_tag into buf
+// (which must have room for at least 9 bytes), returning the number of bytes
+// written
 static int
-encode_length(CBOREncoderObject *self, const uint8_t major_tag,
-              const uint64_t length)
+pack_length(char *buf, const uint8_t major_tag, const uint64_t length)
 {
     LeadByte *lead;
-    char buf[sizeof(LeadByte) + sizeof(uint64_t)];
 
     lead = (LeadByte*)buf;
     lead->major = major_tag;
     if (length < 24) {
         lead->subtype = length;
-        return fp_write(self, buf, 1);
+        return 1;
     } else if (length <= UCHAR_MAX) {
         lead->subtype = 24;
         buf[1] = length;
-        return fp_write(self, buf, sizeof(uint8_t) + 1);
+        return sizeof(uint8_t) + 1;
     } else if (length <= USHRT_MAX) {
         lead->subtype = 25;
         *((uint16_t*)(buf + 1)) = htobe16(length);
-        return fp_write(self, buf, sizeof(uint16_t) + 1);
+        return sizeof(uint16_t) + 1;
     } else if (length <= UINT_MAX) {
         lead->subtype = 26;
         *((uint32_t*)(buf + 1)) = htobe32(length);
-        return fp_write(self, buf, sizeof(uint32_t) + 1);
+        return sizeof(uint32_t) + 1;
     } else {
         lead->subtype = 27;
         *((uint64_t*)(buf + 1)) = htobe64(length);
-        return fp_write(self, buf, sizeof(uint64_t) + 1);
+        return sizeof(uint64_t) + 1;
+    }
+}
+
+
+// Packs the signed integer value into buf as major type 0 or 1, returning the
+// number of bytes written
+static int
+pack_int(char *buf, const long long value)
+{
+    if (value >= 0)
+        return pack_length(buf, 0, value);
+    else
+        // avoid overflow in the case where value == -2^63
+        return pack_length(buf, 1, -(value + 1));
+}
+
+
+// Writes value into buf (which must have room for at least 9 bytes) as a
+// CBOR float, returning the number of bytes written. If minimal is true, the
+// smallest representation that preserves the value exactly is used
+static int
+pack_float(char *buf, const double value, const bool minimal)
+{
+    union {
+        double f;
+        uint64_t i;
+    } u_double;
+
+    union {
+        float f;
+        uint32_t i;
+    } u_single;
+
+    uint16_t half;
+
+    u_double.f = value;
+    switch (fpclassify(u_double.f)) {
+        case FP_NAN:
+            memcpy(buf, "\xF9\x7E\x00", 3);
+            return 3;
+        case FP_INFINITE:
+            if (u_double.f > 0)
+                memcpy(buf, "\xF9\x7C\x00", 3);
+            else
+                memcpy(buf, "\xF9\xFC\x00", 3);
+            return 3;
+        default:
+            if (minimal) {
+                u_single.f = u_double.f;
+                if (u_single.f == u_double.f) {
+                    half = pack_float16(u_single.f);
+                    if (unpack_float16(half) == u_single.f) {
+                        buf[0] = '\xF9';
+                        memcpy(buf + 1, &half, sizeof(uint16_t));
+                        return sizeof(uint16_t) + 1;
+                    } else {
+                        buf[0] = '\xFA';
+                        u_single.i = htobe32(u_single.i);
+                        memcpy(buf + 1, &u_single.i, sizeof(float));
+                        return sizeof(float) + 1;
+                    }
+                }
+            }
+            buf[0] = '\xFB';
+            u_double.i = htobe64(u_double.i);
+            memcpy(buf + 1, &u_double.i, sizeof(double));
+            return sizeof(double) + 1;
     }
 }
 
 
+static int
+encode_length(CBOREncoderObject *self, const uint8_t major_tag,
+              const uint64_t length)
+{
+    char buf[sizeof(LeadByte) + sizeof(uint64_t)];
+
+    return fp_write(self, buf, pack_length(buf, major_tag, length));
+}
+
+
 // CBOREncoder.encode_length(self, major_tag, length)
 static PyObject *
 CBOREncoder_encode_length(CBOREncoderObject *self, PyObject *args)
@@ -443,6 +883,121 @@ CBOREncoder_find_encoder(CBOREncoderObject *self, PyObject *type)
 }
 
 
+// String references ///////////////////////////////////////////////////////
+
+// With string_referencing, each top-level value is wrapped in a stringref
+// namespace (tag 256) and strings repeated within it are replaced by
+// references (tag 25) to their first occurrence. Every string long enough to
+// be worth referencing (see stringref_eligible) is numbered in the order it
+// is written, so those which can't be stored (anything other than exact str
+// and bytes objects) must still be counted to keep the numbering in step
+// with the decoder
+
+#define STRINGREFS_INITIAL_SIZE 64
+
+// Returns the entry for value, which is empty (has a NULL value) if an equal
+// string hasn't been stored. The table is grown if necessary so that an empty
+// entry can be filled. Returns NULL on error
+static StringRefEntry *
+stringrefs_find(CBOREncoderObject *self, PyObject *value, Py_hash_t hash)
+{
+    StringRefEntry *old = self->stringrefs, *entry;
+    size_t i, size, old_size = old ? self->stringrefs_mask + 1 : 0;
+
+    if ((self->stringrefs_count + 1) * 2 > old_size) {
+        size = old_size ? old_size * 2 : STRINGREFS_INITIAL_SIZE;
+        self->stringrefs = PyMem_Calloc(size, sizeof(StringRefEntry));
+        if (!self->stringrefs) {
+            self->stringrefs = old;
+            PyErr_NoMemory();
+            return NULL;
+        }
+        self->stringrefs_mask = size - 1;
+        for (i = 0; i < old_size; ++i) {
+            if (old[i].value) {
+                entry = stringrefs_find(self, old[i].value, old[i].hash);
+                *entry = old[i];
+            }
+        }
+        PyMem_Free(old);
+    }
+    for (i = hash;; ++i) {
+        entry = &self->stringrefs[i & self->stringrefs_mask];
+        if (!entry->value)
+            return entry;
+        // Equal str and bytes values hash the same, so the type must match
+        // as well
+        if (entry->hash == hash && Py_TYPE(entry->value) == Py_TYPE(value)) {
+            switch (PyObject_RichCompareBool(entry->value, value, Py_EQ)) {
+                case 1: return entry;
+                case -1: return NULL;
+            }
+        }
+    }
+}
+
+
+// Called before a string of length bytes is written. If the namespace is
+// active and value (which may be NULL when it isn't an exact str or bytes
+// object) has been written before, writes a reference to it instead and
+// returns 1. Otherwise numbers (and if possible stores) the string when it is
+// eligible and returns 0 so that it's written as usual. Returns -1 on error
+static int
+stringref_encode(CBOREncoderObject *self, PyObject *value,
+                 const uint64_t length)
+{
+    StringRefEntry *entry = NULL;
+    Py_hash_t hash;
+    char buf[11];
+    int size;
+
+    // Strings shorter than 3 bytes are never eligible, so they can't have
+    // been stored either
+    if (!self->string_namespace || length < 3)
+        return 0;
+    if (value) {
+        hash = PyObject_Hash(value);
+        if (hash == -1)
+            return -1;
+        entry = stringrefs_find(self, value, hash);
+        if (!entry)
+            return -1;
+        if (entry->value) {
+            size = pack_length(buf, 6, 25);
+            size += pack_length(buf + size, 0, entry->index);
+            return fp_write(self, buf, size) == -1 ? -1 : 1;
+        }
+    }
+    if (stringref_eligible(self->stringrefs_next, length)) {
+        if (entry) {
+            Py_INCREF(value);
+            entry->value = value;
+            entry->hash = hash;
+            entry->index = self->stringrefs_next;
+            self->stringrefs_count++;
+        }
+        self->stringrefs_next++;
+    }
+    return 0;
+}
+
+
+static void
+stringrefs_clear(CBOREncoderObject *self)
+{
+    size_t i;
+
+    if (self->stringrefs_count) {
+        for (i = 0; i <= self->stringrefs_mask; ++i)
+            Py_XDECREF(self->stringrefs[i].value);
+        memset(self->stringrefs, 0,
+               (self->stringrefs_mask + 1) * sizeof(StringRefEntry));
+        self->stringrefs_count = 0;
+    }
+    self->stringrefs_next = 0;
+}
+
+
 // Major encoders ////////////////////////////////////////////////////////////
 
 static PyObject *
@@ -575,9 +1130,18 @@ CBOREncoder_encode_bytes(CBOREncoderObject *self, PyObject *value)
 
     if (PyBytes_AsStringAndSize(value, &buf, &length) == -1)
         return NULL;
+    switch (stringref_encode(self,
+                PyBytes_CheckExact(value) ? value : NULL, length)) {
+        case -1: return NULL;
+        case 1:  Py_RETURN_NONE;
+    }
     if (encode_length(self, 2, length) == -1)
         return NULL;
-    if (fp_write(self, buf, length) == -1)
+    // Exact bytes objects are passed to write() as-is rather than copied
+    if (PyBytes_CheckExact(value)) {
+        if (fp_write_object(self, value) == -1)
+            return NULL;
+    } else if (fp_write(self, buf, length) == -1)
         return NULL;
     Py_RETURN_NONE;
 }
@@ -588,19 +1152,26 @@ static PyObject *
 CBOREncoder_encode_bytearray(CBOREncoderObject *self, PyObject *value)
 {
     // major type 2 (again)
-    Py_ssize_t length;
+    Py_buffer view;
+    PyObject *ret = NULL;
 
     if (!PyByteArray_Check(value)) {
         PyErr_Format(_CBOAR_CBOREncodeError,
                 "invalid bytearray value %R", value);
         return NULL;
     }
-    length = PyByteArray_GET_SIZE(value);
-    if (encode_length(self, 2, length) == -1)
+    // The buffer is exported for the duration of the write so that the
+    // bytearray can't be resized while it's copied (see fp_write)
+    if (PyObject_GetBuffer(value, &view, PyBUF_SIMPLE) == -1)
         return NULL;
-    if (fp_write(self, PyByteArray_AS_STRING(value), length) == -1)
-        return NULL;
-    Py_RETURN_NONE;
+    if (stringref_encode(self, NULL, view.len) == 0)
+        if (encode_length(self, 2, view.len) == 0)
+            if (fp_write(self, view.buf, view.len) == 0) {
+                Py_INCREF(Py_None);
+                ret = Py_None;
+            }
+    PyBuffer_Release(&view);
+    return ret;
 }
 
 
@@ -615,6 +1186,11 @@ CBOREncoder_encode_string(CBOREncoderObject *self, PyObject *value)
     buf = PyUnicode_AsUTF8AndSize(value, &length);
     if (!buf)
         return NULL;
+    switch (stringref_encode(self,
+                PyUnicode_CheckExact(value) ? value : NULL, length)) {
+        case -1: return NULL;
+        case 1:  Py_RETURN_NONE;
+    }
     if (encode_length(self, 3, length) == -1)
         return NULL;
     if (fp_write(self, buf, length) == -1)
@@ -623,52 +1199,561 @@ CBOREncoder_encode_string(CBOREncoderObject *self, PyObject *value)
 }
 
 
-static PyObject *
-encode_array(CBOREncoderObject *self, PyObject *value)
+// Size of the buffer used by encode_array to batch writes of simple items, and
+// the longest str that will be batched (longer ones are written directly)
+#define ARRAY_BUFFER_SIZE 1024
+#define ARRAY_SHORT_STRING 64
+
+// Packs value into buf if it's one of the "simple" types which encode() would
+// handle without recursion or dispatch (exact ints that fit in a long long,
+// exact floats, short strs, None, and bools), returning the number of bytes
+// written. Returns 0 if value isn't a simple type (or is too large to pack),
+// and -1 on error. buf must have room for at least ARRAY_SHORT_STRING + 9
+// bytes
+static int
+pack_simple(CBOREncoderObject *self, PyObject *value, char *buf)
 {
-    PyObject **items, *fast, *ret = NULL;
+    const char *str;
     Py_ssize_t length;
+    long long val;
+    double f;
+    int overflow, size;
+
+    if (PyLong_CheckExact(value)) {
+        val = PyLong_AsLongLongAndOverflow(value, &overflow);
+        if (overflow)
+            return 0;
+        if (val == -1 && PyErr_Occurred())
+            return -1;
+        return pack_int(buf, val);
+    } else if (PyFloat_CheckExact(value)) {
+        f = PyFloat_AS_DOUBLE(value);
+        return pack_float(buf, f, self->enc_style == 1);
+    } else if (PyUnicode_CheckExact(value)) {
+        if (PyUnicode_GET_LENGTH(value) > ARRAY_SHORT_STRING)
+            return 0;
+        str = PyUnicode_AsUTF8AndSize(value, &length);
+        if (!str)
+            return -1;
+        if ((size_t) length > ARRAY_SHORT_STRING)
+            return 0;
+        // Strings that may be referenced are left to encode_string
+        if (self->string_namespace && length >= 3)
+            return 0;
+        size = pack_length(buf, 3, length);
+        memcpy(buf + size, str, length);
+        return size + length;
+    } else if (value == Py_None) {
+        buf[0] = '\xF6';
+        return 1;
+    } else if (value == Py_True) {
+        buf[0] = '\xF5';
+        return 1;
+    } else if (value == Py_False) {
+        buf[0] = '\xF4';
+        return 1;
+    }
+    return 0;
+}
 
-    fast = PySequence_Fast(value, "argument must be iterable");
-    if (fast) {
-        length = PySequence_Fast_GET_SIZE(fast);
-        items = PySequence_Fast_ITEMS(fast);
-        if (encode_length(self, 4, length) == 0) {
-            while (length) {
-                ret = CBOREncoder_encode(self, *items);
-                if (ret)
-                    Py_DECREF(ret);
-                else
-                    goto error;
-                items++;
-                length--;
-            }
-            Py_INCREF(Py_None);
-            ret = Py_None;
+
+// Number of consecutive floats that encode_array converts together when
+// finding their minimal representations in the canonical style
+#define ARRAY_FLOAT_RUN 32
+
+// Packs the run of exact floats at the start of items (at most count, and no
+// more than ARRAY_FLOAT_RUN) with their minimal representations, storing the
+// number of items packed in consumed and returning the number of bytes
+// written. This is equivalent to calling pack_float on each item, but narrows
+// and re-expands the whole run together with the bulk half-float routines.
+// buf must have room for ARRAY_FLOAT_RUN * 9 bytes
+static int
+pack_minimal_floats(char *buf, PyObject **items, const Py_ssize_t count,
+                    Py_ssize_t *consumed)
+{
+    double doubles[ARRAY_FLOAT_RUN];
+    // Only the first n items are read, but zeroing singles lets the compiler
+    // see that pack_float16_array never reads uninitialized floats
+    float singles[ARRAY_FLOAT_RUN] = {0}, expanded[ARRAY_FLOAT_RUN];
+    uint16_t halves[ARRAY_FLOAT_RUN];
+    uint32_t single;
+    Py_ssize_t i, n;
+    int size = 0;
+
+    for (n = 0; n < count && n < ARRAY_FLOAT_RUN; n++) {
+        if (!PyFloat_CheckExact(items[n]))
+            break;
+        doubles[n] = PyFloat_AS_DOUBLE(items[n]);
+        singles[n] = isfinite(doubles[n]) ? (float) doubles[n] : 0.0f;
+    }
+    pack_float16_array(halves, singles, n, true);
+    unpack_float16_array(expanded, halves, n, true);
+    for (i = 0; i < n; i++) {
+        if (!isfinite(doubles[i]) || singles[i] != doubles[i])
+            size += pack_float(buf + size, doubles[i], true);
+        else if (expanded[i] == singles[i]) {
+            buf[size] = '\xF9';
+            memcpy(buf + size + 1, &halves[i], sizeof(uint16_t));
+            size += sizeof(uint16_t) + 1;
+        } else {
+            buf[size] = '\xFA';
+            memcpy(&single, &singles[i], sizeof(float));
+            single = htobe32(single);
+            memcpy(buf + size + 1, &single, sizeof(float));
+            size += sizeof(float) + 1;
         }
-error:
-        Py_DECREF(fast);
     }
-    return ret;
+    *consumed = n;
+    return size;
 }
 
 
-// CBOREncoder.encode_array(self, value)
-static PyObject *
-CBOREncoder_encode_array(CBOREncoderObject *self, PyObject *value)
+// Columnar encoding /////////////////////////////////////////////////////////
+
+// With columnar set, a list of records which all have the same fields (dicts
+// with identical str keys in the same order, or instances of one type with a
+// compiled schema) is written as the private columnar tag wrapping an array of
+// the keys followed by an array of each field's values. Columns of ints or
+// floats are written as typed arrays (RFC 8746) of the narrowest suitable
+// type. Only the regular style is affected; with value sharing or packing
+// the identity of each record matters so they're encoded as usual
+
+// Lists with fewer rows than this aren't worth splitting into columns
+#define COLUMNAR_MIN_ROWS 4
+
+static inline bool
+columnar_candidate(CBOREncoderObject *self, PyObject *value)
 {
-    // major type 4
-    return encode_shared(self, &encode_array, value);
+    return self->columnar && self->enc_style == 0 && !self->value_sharing &&
+        !self->pack_refs && PyList_CheckExact(value) &&
+        PyList_GET_SIZE(value) >= COLUMNAR_MIN_ROWS;
 }
 
 
+static inline bool
+same_key(PyObject *key, PyObject *name)
+{
+    return key == name || (
+        PyUnicode_CheckExact(key) &&
+        PyUnicode_GET_LENGTH(key) == PyUnicode_GET_LENGTH(name) &&
+        PyUnicode_KIND(key) == PyUnicode_KIND(name) &&
+        !memcmp(PyUnicode_DATA(key), PyUnicode_DATA(name),
+                PyUnicode_GET_LENGTH(key) * PyUnicode_KIND(key)));
+}
+
+
+// Returns the keys of the first row (a dict or a record) as a new tuple, and
+// the record's schema (as a new reference) in *schema, or NULL without an
+// exception set if it can't lead a columnar list
 static PyObject *
-encode_dict(CBOREncoderObject *self, PyObject *value)
+columnar_keys(CBOREncoderObject *self, PyObject *row, CBORSchemaObject **schema)
 {
-    PyObject *key, *val, *ret;
-    Py_ssize_t pos = 0;
+    PyObject *encoder, *key, *value, *ret;
+    Py_ssize_t i, pos = 0;
 
-    if (encode_length(self, 5, PyDict_Size(value)) == 0) {
+    *schema = NULL;
+    if (PyDict_CheckExact(row)) {
+        if (!PyDict_GET_SIZE(row))
+            return NULL;
+        ret = PyTuple_New(PyDict_GET_SIZE(row));
+        for (i = 0; ret && PyDict_Next(row, &pos, &key, &value); ++i) {
+            if (!PyUnicode_CheckExact(key)) {
+                Py_CLEAR(ret);
+                break;
+            }
+            Py_INCREF(key);
+            PyTuple_SET_ITEM(ret, i, key);
+        }
+        return ret;
+    }
+    encoder = CBOREncoder_find_encoder(self, (PyObject *) Py_TYPE(row));
+    if (!encoder)
+        return NULL;
+    ret = NULL;
+    if (CBORSchema_CheckExact(encoder) &&
+            ((CBORSchemaObject *) encoder)->length &&
+            PyObject_TypeCheck(row, ((CBORSchemaObject *) encoder)->type)) {
+        *schema = (CBORSchemaObject *) encoder;
+        ret = PyTuple_New((*schema)->length);
+        for (i = 0; ret && i < (*schema)->length; ++i) {
+            key = (*schema)->fields[i].name;
+            Py_INCREF(key);
+            PyTuple_SET_ITEM(ret, i, key);
+        }
+        if (ret)
+            return ret;
+        *schema = NULL;
+    }
+    Py_DECREF(encoder);
+    return ret;
+}
+
+
+// Returns a new list of the rows of value (as a tuple), their keys (as a
+// tuple), and a list of the values of each key, or NULL without an exception
+// set if value isn't a list of records which all have the same fields. A row
+// which is already being encoded can't be split; that's left to the usual
+// encoding which will report the cycle
+static PyObject *
+columnar_split(CBOREncoderObject *self, PyObject *value)
+{
+    CBORSchemaObject *schema;
+    SharedEntry *entry;
+    PyObject *rows, *row, *keys, *key, *item, *ret = NULL;
+    Py_ssize_t i, j, pos, width, count = PyList_GET_SIZE(value);
+
+    // Reading fields may run arbitrary code, so the rows are copied
+    rows = PyList_AsTuple(value);
+    if (!rows)
+        return NULL;
+    keys = columnar_keys(self, PyTuple_GET_ITEM(rows, 0), &schema);
+    if (keys) {
+        width = PyTuple_GET_SIZE(keys);
+        ret = PyList_New(width + 2);
+        if (ret) {
+            PyList_SET_ITEM(ret, 0, rows);
+            PyList_SET_ITEM(ret, 1, keys);
+            Py_INCREF(rows);
+            Py_INCREF(keys);
+            for (j = 0; j < width; ++j) {
+                item = PyList_New(count);
+                if (!item)
+                    goto error;
+                PyList_SET_ITEM(ret, j + 2, item);
+            }
+            for (i = 0; i < count; ++i) {
+                row = PyTuple_GET_ITEM(rows, i);
+                entry = shared_find(self, row);
+                if (!entry)
+                    goto error;
+                if (entry->value)
+                    goto mismatch;
+                if (schema) {
+                    if (Py_TYPE(row) != Py_TYPE(PyTuple_GET_ITEM(rows, 0)))
+                        goto mismatch;
+                    for (j = 0; j < width; ++j) {
+                        item = CBORSchema_GetField(&schema->fields[j], row);
+                        if (!item)
+                            goto error;
+                        PyList_SET_ITEM(PyList_GET_ITEM(ret, j + 2), i, item);
+                    }
+                } else {
+                    if (!PyDict_CheckExact(row) ||
+                            PyDict_GET_SIZE(row) != width)
+                        goto mismatch;
+                    for (j = 0, pos = 0; PyDict_Next(row, &pos, &key, &item);
+                            ++j) {
+                        if (!same_key(key, PyTuple_GET_ITEM(keys, j)))
+                            goto mismatch;
+                        Py_INCREF(item);
+                        PyList_SET_ITEM(PyList_GET_ITEM(ret, j + 2), i, item);
+                    }
+                }
+            }
+        }
+        Py_DECREF(keys);
+        Py_XDECREF(schema);
+    }
+    Py_DECREF(rows);
+    return ret;
+
+mismatch:
+error:
+    Py_DECREF(ret);
+    Py_DECREF(keys);
+    Py_XDECREF(schema);
+    Py_DECREF(rows);
+    return NULL;
+}
+
+
+// Writes column as a typed array if it's made up entirely of exact ints
+// (which fit in 64 bits) or exact floats, returning 1 if it was written, 0 if
+// it wasn't (as it's not numeric, or its values are all small enough that a
+// typed array would be no shorter), and -1 on error
+static int
+encode_numeric_column(CBOREncoderObject *self, PyObject *column)
+{
+    PyObject **items = PySequence_Fast_ITEMS(column);
+    Py_ssize_t i, count = PyList_GET_SIZE(column);
+    long long l, low = 0, high = 0;
+    double d;
+    float f;
+    uint16_t u16;
+    uint32_t u32;
+    uint64_t u64;
+    char *buf;
+    int overflow, size, tag, ret = 0;
+
+    if (PyLong_CheckExact(items[0])) {
+        for (i = 0; i < count; ++i) {
+            if (!PyLong_CheckExact(items[i]))
+                return 0;
+            l = PyLong_AsLongLongAndOverflow(items[i], &overflow);
+            if (overflow)
+                return 0;
+            if (l == -1 && PyErr_Occurred())
+                return -1;
+            if (!i || l < low)
+                low = l;
+            if (!i || l > high)
+                high = l;
+        }
+        if (low >= -24 && high < 24)
+            return 0;
+        if (low >= 0) {
+            size = high <= UINT8_MAX ? 1 : high <= UINT16_MAX ? 2 :
+                high <= UINT32_MAX ? 4 : 8;
+            tag = size == 1 ? 64 : size == 2 ? 69 : size == 4 ? 70 : 71;
+        } else {
+            size = low >= INT8_MIN && high <= INT8_MAX ? 1 :
+                low >= INT16_MIN && high <= INT16_MAX ? 2 :
+                low >= INT32_MIN && high <= INT32_MAX ? 4 : 8;
+            tag = size == 1 ? 72 : size == 2 ? 77 : size == 4 ? 78 : 79;
+        }
+    } else if (PyFloat_CheckExact(items[0])) {
+        // Single precision is used if it holds every value exactly
+        size = 4;
+        for (i = 0; i < count; ++i) {
+            if (!PyFloat_CheckExact(items[i]))
+                return 0;
+            d = PyFloat_AS_DOUBLE(items[i]);
+            if ((double) (float) d != d)
+                size = 8;
+        }
+        tag = size == 4 ? 85 : 86;
+    } else
+        return 0;
+
+    buf = PyMem_Malloc(count * size);
+    if (!buf) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (i = 0; i < count; ++i) {
+        if (tag == 85 || tag == 86) {
+            d = PyFloat_AS_DOUBLE(items[i]);
+            if (size == 4) {
+                f = (float) d;
+                memcpy(&u32, &f, sizeof(float));
+                u32 = htole32(u32);
+                memcpy(buf + i * size, &u32, size);
+            } else {
+                memcpy(&u64, &d, sizeof(double));
+                u64 = htole64(u64);
+                memcpy(buf + i * size, &u64, size);
+            }
+            continue;
+        }
+        l = PyLong_AsLongLong(items[i]);
+        switch (size) {
+            case 1:
+                buf[i] = (char) l;
+                break;
+            case 2:
+                u16 = htole16((uint16_t) l);
+                memcpy(buf + i * size, &u16, size);
+                break;
+            case 4:
+                u32 = htole32((uint32_t) l);
+                memcpy(buf + i * size, &u32, size);
+                break;
+            default:
+                u64 = htole64((uint64_t) l);
+                memcpy(buf + i * size, &u64, size);
+                break;
+        }
+    }
+    if (encode_length(self, 6, tag) == 0)
+        if (stringref_encode(self, NULL, count * size) == 0)
+            if (encode_length(self, 2, count * size) == 0)
+                if (fp_write(self, buf, count * size) == 0)
+                    ret = 1;
+    if (ret == 0)
+        ret = -1;
+    PyMem_Free(buf);
+    return ret;
+}
+
+
+// Writes the columns (from columnar_split) of a list of records. While the
+// columns are encoded, each row is tracked as though it was being encoded, so
+// that a row which contains itself is still reported as a cycle
+static PyObject *
+encode_columnar(CBOREncoderObject *self, PyObject *columns)
+{
+    PyObject *rows, *keys, *column, *tmp, *ret = NULL;
+    SharedEntry *entry;
+    Py_ssize_t i, width, count;
+
+    rows = PyList_GET_ITEM(columns, 0);
+    keys = PyList_GET_ITEM(columns, 1);
+    count = PyTuple_GET_SIZE(rows);
+    width = PyTuple_GET_SIZE(keys);
+    if (Py_EnterRecursiveCall(" in CBOREncoder.encode"))
+        return NULL;
+    for (i = 0; i < count; ++i) {
+        entry = shared_find(self, PyTuple_GET_ITEM(rows, i));
+        if (!entry)
+            goto error;
+        if (!entry->value)
+            shared_add(self, entry, PyTuple_GET_ITEM(rows, i));
+    }
+    if (encode_length(self, 6, CBOAR_COLUMNAR_TAG) == -1 ||
+            encode_length(self, 4, width + 1) == -1 ||
+            encode_length(self, 4, width) == -1)
+        goto error;
+    for (i = 0; i < width; ++i) {
+        tmp = CBOREncoder_encode(self, PyTuple_GET_ITEM(keys, i));
+        if (!tmp)
+            goto error;
+        Py_DECREF(tmp);
+    }
+    for (i = 0; i < width; ++i) {
+        column = PyList_GET_ITEM(columns, i + 2);
+        switch (encode_numeric_column(self, column)) {
+            case 0:
+                tmp = encode_array(self, column);
+                if (!tmp)
+                    goto error;
+                Py_DECREF(tmp);
+                break;
+            case -1:
+                goto error;
+        }
+    }
+    Py_INCREF(Py_None);
+    ret = Py_None;
+error:
+    for (i = 0; i < count; ++i)
+        shared_remove(self, PyTuple_GET_ITEM(rows, i));
+    Py_LeaveRecursiveCall();
+    return ret;
+}
+
+
+static PyObject *
+encode_stashed_columns(CBOREncoderObject *self, PyObject *value)
+{
+    return encode_columnar(self, self->shared_handler);
+}
+
+
+// Encodes value (a list, which columnar_split has divided into columns) with
+// the same tracking as any other list; the columns are passed to
+// encode_columnar in shared_handler, as for CBOREncoder_encode_record
+static PyObject *
+encode_columnar_shared(CBOREncoderObject *self, PyObject *value,
+                       PyObject *columns)
+{
+    PyObject *tmp, *ret;
+
+    Py_INCREF(columns);
+    tmp = self->shared_handler;
+    self->shared_handler = columns;
+    ret = encode_shared(self, &encode_stashed_columns, value);
+    self->shared_handler = tmp;
+    Py_DECREF(columns);
+    return ret;
+}
+
+
+static PyObject *
+encode_array(CBOREncoderObject *self, PyObject *value)
+{
+    // Runs of simple items are packed into a local buffer and written in a
+    // single call, bypassing the recursion guard and type dispatch of
+    // CBOREncoder_encode; anything else flushes the buffer and is encoded
+    // as normal. This only applies to the regular and canonical styles as
+    // custom styles may override the encoding of any type. In the canonical
+    // style, runs of floats are packed together by pack_minimal_floats. None
+    // of this applies while packing, as any item may be a packed reference
+    PyObject **items, *fast, *tmp, *ret = NULL;
+    Py_ssize_t length, count;
+    char buf[ARRAY_BUFFER_SIZE];
+    int used, size;
+    bool simple;
+
+    if (columnar_candidate(self, value)) {
+        tmp = columnar_split(self, value);
+        if (tmp) {
+            ret = encode_columnar(self, tmp);
+            Py_DECREF(tmp);
+            return ret;
+        } else if (PyErr_Occurred())
+            return NULL;
+    }
+    fast = PySequence_Fast(value, "argument must be iterable");
+    if (fast) {
+        length = PySequence_Fast_GET_SIZE(fast);
+        items = PySequence_Fast_ITEMS(fast);
+        simple = (self->enc_style == 0 || self->enc_style == 1) &&
+            !self->pack_refs;
+        used = pack_length(buf, 4, length);
+        while (length) {
+            if (ARRAY_BUFFER_SIZE - used < ARRAY_SHORT_STRING + 9) {
+                if (fp_write(self, buf, used) == -1)
+                    goto error;
+                used = 0;
+            }
+            if (self->enc_style == 1 && PyFloat_CheckExact(*items)) {
+                if (ARRAY_BUFFER_SIZE - used < ARRAY_FLOAT_RUN * 9) {
+                    if (fp_write(self, buf, used) == -1)
+                        goto error;
+                    used = 0;
+                }
+                used += pack_minimal_floats(buf + used, items, length, &count);
+                items += count;
+                length -= count;
+                continue;
+            }
+            size = simple ? pack_simple(self, *items, buf + used) : 0;
+            if (size == -1)
+                goto error;
+            else if (size)
+                used += size;
+            else {
+                if (used) {
+                    if (fp_write(self, buf, used) == -1)
+                        goto error;
+                    used = 0;
+                }
+                tmp = CBOREncoder_encode(self, *items);
+                if (tmp)
+                    Py_DECREF(tmp);
+                else
+                    goto error;
+            }
+            items++;
+            length--;
+        }
+        if (!used || fp_write(self, buf, used) == 0) {
+            Py_INCREF(Py_None);
+            ret = Py_None;
+        }
+error:
+        Py_DECREF(fast);
+    }
+    return ret;
+}
+
+
+// CBOREncoder.encode_array(self, value)
+static PyObject *
+CBOREncoder_encode_array(CBOREncoderObject *self, PyObject *value)
+{
+    // major type 4
+    return encode_shared(self, &encode_array, value);
+}
+
+
+static PyObject *
+encode_dict(CBOREncoderObject *self, PyObject *value)
+{
+    PyObject *key, *val, *ret;
+    Py_ssize_t pos = 0;
+
+    if (encode_length(self, 5, PyDict_Size(value)) == 0) {
         while (PyDict_Next(value, &pos, &key, &val)) {
             Py_INCREF(key);
             ret = CBOREncoder_encode(self, key);
@@ -747,265 +1832,697 @@ CBOREncoder_encode_map(CBOREncoderObject *self, PyObject *value)
     return encode_shared(self, &CBOREncoder__encode_map, value);
 }
 
-
-// Semantic encoders /////////////////////////////////////////////////////////
 
+// Indefinite-length containers //////////////////////////////////////////////
+
+// An indefinite-length container counts as a level of nesting until it's
+// closed, so that the values within it are encoded as part of one top-level
+// value (sharing one set of shared values and string references). At the top
+// level this starts the value as encode_top_level would, but values within
+// the container are never packed as it can't be scanned ahead of time
 static int
-encode_semantic(CBOREncoderObject *self, const uint64_t tag, PyObject *value)
+stream_begin(CBOREncoderObject *self, const uint8_t lead_byte)
 {
-    PyObject *obj;
-
-    if (encode_length(self, 6, tag) == -1)
+    if (self->enc_style == 1) {
+        PyErr_SetString(_CBOAR_CBOREncodeError,
+                "indefinite-length containers cannot be encoded canonically");
         return -1;
-    obj = CBOREncoder_encode(self, value);
-    Py_XDECREF(obj);
-    return obj == NULL ? -1 : 0;
+    }
+    if (!self->nesting) {
+        shared_clear(self);
+        if (self->string_referencing) {
+            if (encode_length(self, 6, 256) == -1)
+                return -1;
+            self->string_namespace = true;
+        }
+    }
+    self->nesting++;
+    if (fp_write(self, (const char *) &lead_byte, 1) == -1) {
+        self->nesting--;
+        return -1;
+    }
+    return 0;
 }
 
 
-// CBOREncoder.encode_semantic(self, tag)
+// Closes the innermost indefinite-length container, writing the break marker
+// unless an error has occurred
+static int
+stream_end(CBOREncoderObject *self, const bool ok)
+{
+    int ret = ok ? fp_write(self, "\xFF", 1) : -1;
+
+    if (!--self->nesting && self->string_namespace) {
+        self->string_namespace = false;
+        stringrefs_clear(self);
+    }
+    return ret;
+}
+
+
+// CBOREncoder.encode_iter(self, iterable)
 static PyObject *
-CBOREncoder_encode_semantic(CBOREncoderObject *self, PyObject *value)
+CBOREncoder_encode_iter(CBOREncoderObject *self, PyObject *value)
 {
-    // major type 6
-    CBORTagObject *tag;
+    // major type 4, indefinite length; items are consumed as they're encoded
+    PyObject *iter, *item, *tmp;
+    bool ok = true;
 
-    if (!CBORTag_CheckExact(value))
+    iter = PyObject_GetIter(value);
+    if (!iter)
         return NULL;
-    tag = (CBORTagObject *) value;
-    if (encode_semantic(self, tag->tag, tag->value) == -1)
+    if (stream_begin(self, 0x9F) == -1) {
+        Py_DECREF(iter);
+        return NULL;
+    }
+    while (ok && (item = PyIter_Next(iter))) {
+        tmp = CBOREncoder_encode(self, item);
+        Py_DECREF(item);
+        if (tmp)
+            Py_DECREF(tmp);
+        else
+            ok = false;
+    }
+    Py_DECREF(iter);
+    if (stream_end(self, ok && !PyErr_Occurred()) == -1)
         return NULL;
     Py_RETURN_NONE;
 }
 
 
-static PyObject *
-encode_datestr(CBOREncoderObject *self, PyObject *datestr)
+// Encodes a (key, value) pair of encode_items
+static int
+encode_pair(CBOREncoderObject *self, PyObject *pair)
 {
-    char *buf;
-    Py_ssize_t length, match;
-
-    match = PyUnicode_Tailmatch(
-        datestr, _CBOAR_str_utc_suffix, PyUnicode_GET_LENGTH(datestr) - 6,
-        PyUnicode_GET_LENGTH(datestr), 1);
-    if (match != -1) {
-        buf = PyUnicode_AsUTF8AndSize(datestr, &length);
-        if (buf) {
-            if (fp_write(self, "\xC0", 1) == 0) {
-                if (match) {
-                    if (encode_length(self, 3, length - 5) == 0)
-                        if (fp_write(self, buf, length - 6) == 0)
-                            if (fp_write(self, "Z", 1) == 0)
-                                Py_RETURN_NONE;
-                } else {
-                    if (encode_length(self, 3, length) == 0)
-                        if (fp_write(self, buf, length) == 0)
-                            Py_RETURN_NONE;
+    PyObject *fast, *tmp;
+    int ret = -1;
+
+    fast = PySequence_Fast(pair, "encode_items expects (key, value) pairs");
+    if (fast) {
+        if (PySequence_Fast_GET_SIZE(fast) != 2)
+            PyErr_Format(_CBOAR_CBOREncodeError,
+                    "expected a (key, value) pair, not %R", pair);
+        else {
+            tmp = CBOREncoder_encode(self, PySequence_Fast_GET_ITEM(fast, 0));
+            if (tmp) {
+                Py_DECREF(tmp);
+                tmp = CBOREncoder_encode(
+                        self, PySequence_Fast_GET_ITEM(fast, 1));
+                if (tmp) {
+                    Py_DECREF(tmp);
+                    ret = 0;
                 }
             }
         }
+        Py_DECREF(fast);
     }
-    return NULL;
+    return ret;
 }
 
 
+// CBOREncoder.encode_items(self, iterable)
 static PyObject *
-encode_timestamp(CBOREncoderObject *self, PyObject *timestamp)
+CBOREncoder_encode_items(CBOREncoderObject *self, PyObject *value)
 {
-    PyObject *ret = NULL;
+    // major type 5, indefinite length; pairs are consumed as they're encoded
+    PyObject *iter, *item;
+    bool ok = true;
 
-    if (fp_write(self, "\xC1", 1) == 0) {
-        double d = PyFloat_AS_DOUBLE(timestamp);
-        if (d == trunc(d)) {
-            PyObject *i = PyLong_FromDouble(d);
-            if (i) {
-                ret = CBOREncoder_encode_int(self, i);
-                Py_DECREF(i);
-            }
-        } else {
-            ret = CBOREncoder_encode_float(self, timestamp);
-        }
+    iter = PyObject_GetIter(value);
+    if (!iter)
+        return NULL;
+    if (stream_begin(self, 0xBF) == -1) {
+        Py_DECREF(iter);
+        return NULL;
     }
-    return ret;
+    while (ok && (item = PyIter_Next(iter))) {
+        ok = encode_pair(self, item) == 0;
+        Py_DECREF(item);
+    }
+    Py_DECREF(iter);
+    if (stream_end(self, ok && !PyErr_Occurred()) == -1)
+        return NULL;
+    Py_RETURN_NONE;
 }
 
 
-// CBOREncoder.encode_datetime(self, value)
+// CBOREncoder.begin_array(self)
 static PyObject *
-CBOREncoder_encode_datetime(CBOREncoderObject *self, PyObject *value)
+CBOREncoder_begin_array(CBOREncoderObject *self)
 {
-    // semantic type 0 or 1
-    PyObject *tmp, *ret = NULL;
+    if (stream_begin(self, 0x9F) == -1)
+        return NULL;
+    self->streaming++;
+    Py_RETURN_NONE;
+}
 
-    if (PyDateTime_Check(value)) {
-        if (!((PyDateTime_DateTime*)value)->hastzinfo) {
-            if (self->timezone != Py_None) {
-                value = PyDateTimeAPI->DateTime_FromDateAndTime(
-                        PyDateTime_GET_YEAR(value),
-                        PyDateTime_GET_MONTH(value),
-                        PyDateTime_GET_DAY(value),
-                        PyDateTime_DATE_GET_HOUR(value),
-                        PyDateTime_DATE_GET_MINUTE(value),
-                        PyDateTime_DATE_GET_SECOND(value),
-                        PyDateTime_DATE_GET_MICROSECOND(value),
-                        self->timezone,
-                        PyDateTimeAPI->DateTimeType);
-            } else {
-                PyErr_Format(_CBOAR_CBOREncodeError,
-                                "naive datetime %R encountered and no default "
-                                "timezone has been set", value);
-                value = NULL;
-            }
-        } else {
-            // convert value from borrowed to a new reference to simplify our
-            // cleanup later
-            Py_INCREF(value);
-        }
 
-        if (value) {
-            if (self->timestamp_format) {
-                tmp = PyObject_CallMethodObjArgs(
-                        value, _CBOAR_str_timestamp, NULL);
-                if (tmp)
-                    ret = encode_timestamp(self, tmp);
-            } else {
-                tmp = PyObject_CallMethodObjArgs(
-                        value, _CBOAR_str_isoformat, NULL);
-                if (tmp)
-                    ret = encode_datestr(self, tmp);
-            }
-            Py_XDECREF(tmp);
-            Py_DECREF(value);
-        }
-    }
-    return ret;
+// CBOREncoder.begin_map(self)
+static PyObject *
+CBOREncoder_begin_map(CBOREncoderObject *self)
+{
+    if (stream_begin(self, 0xBF) == -1)
+        return NULL;
+    self->streaming++;
+    Py_RETURN_NONE;
 }
 
 
-// CBOREncoder.encode_date(self, value)
+// CBOREncoder.end(self)
 static PyObject *
-CBOREncoder_encode_date(CBOREncoderObject *self, PyObject *value)
+CBOREncoder_end(CBOREncoderObject *self)
 {
-    PyObject *datetime, *ret = NULL;
-
-    if (PyDate_Check(value)) {
-        datetime = PyDateTimeAPI->DateTime_FromDateAndTime(
-                PyDateTime_GET_YEAR(value),
-                PyDateTime_GET_MONTH(value),
-                PyDateTime_GET_DAY(value),
-                0, 0, 0, 0, self->timezone,
-                PyDateTimeAPI->DateTimeType);
-        if (datetime) {
-            ret = CBOREncoder_encode_datetime(self, datetime);
-            Py_DECREF(datetime);
-            return ret;
-        }
+    if (!self->streaming) {
+        PyErr_SetString(_CBOAR_CBOREncodeError,
+                "end() called with no container left open by begin_array() "
+                "or begin_map()");
+        return NULL;
     }
-    return NULL;
+    self->streaming--;
+    if (stream_end(self, true) == -1)
+        return NULL;
+    Py_RETURN_NONE;
 }
 
 
-// A variant of fp_classify for the decimal.Decimal type
-static int
-decimal_classify(PyObject *value)
-{
-    PyObject *tmp;
+// Longest key (in bytes, including its header) that encode_record batches;
+// longer ones are written directly
+#define RECORD_SHORT_KEY (ARRAY_SHORT_STRING + 9)
 
-    tmp = PyObject_CallMethodObjArgs(value, _CBOAR_str_is_nan, NULL);
-    if (tmp) {
-        if (PyObject_IsTrue(tmp)) {
-            Py_DECREF(tmp);
-            return DC_NAN;
+static PyObject *
+encode_record(CBOREncoderObject *self, PyObject *value)
+{
+    // The schema is passed in shared_handler (as for encode_shared). Keys
+    // are copied from the schema and fields which are simple values packed
+    // along with them, as in encode_array; keys which may be referenced, or
+    // custom styles, go through the usual encode path
+    CBORSchemaObject *schema = (CBORSchemaObject *) self->shared_handler;
+    SchemaField *field;
+    PyObject *item, *tmp, *ret = NULL;
+    Py_ssize_t i, length;
+    char buf[ARRAY_BUFFER_SIZE];
+    int used, size;
+    bool simple;
+
+    simple = (self->enc_style == 0 || self->enc_style == 1) &&
+        !self->pack_refs;
+    used = pack_length(buf, 5, schema->length);
+    for (i = 0; i < schema->length; ++i) {
+        field = &schema->fields[
+            self->enc_style == 1 ? schema->canonical[i] : i];
+        if (ARRAY_BUFFER_SIZE - used < RECORD_SHORT_KEY * 2) {
+            if (fp_write(self, buf, used) == -1)
+                return NULL;
+            used = 0;
+        }
+        length = PyBytes_GET_SIZE(field->key);
+        if (simple && !self->string_namespace && length <= RECORD_SHORT_KEY) {
+            memcpy(buf + used, PyBytes_AS_STRING(field->key), length);
+            used += length;
         } else {
-            Py_DECREF(tmp);
-            tmp = PyObject_CallMethodObjArgs(
-                    value, _CBOAR_str_is_infinite, NULL);
-            if (tmp) {
-                if (PyObject_IsTrue(tmp)) {
-                    Py_DECREF(tmp);
-                    return DC_INFINITE;
-                } else {
-                    Py_DECREF(tmp);
-                    return DC_NORMAL;
-                }
+            if (used) {
+                if (fp_write(self, buf, used) == -1)
+                    return NULL;
+                used = 0;
+            }
+            tmp = CBOREncoder_encode(self, field->name);
+            if (!tmp)
+                return NULL;
+            Py_DECREF(tmp);
+        }
+        item = CBORSchema_GetField(field, value);
+        if (!item)
+            return NULL;
+        size = simple ? pack_simple(self, item, buf + used) : 0;
+        if (size == -1)
+            goto error;
+        else if (size)
+            used += size;
+        else {
+            if (used) {
+                if (fp_write(self, buf, used) == -1)
+                    goto error;
+                used = 0;
             }
+            tmp = CBOREncoder_encode(self, item);
+            if (!tmp)
+                goto error;
+            Py_DECREF(tmp);
         }
+        Py_DECREF(item);
+    }
+    if (!used || fp_write(self, buf, used) == 0) {
+        Py_INCREF(Py_None);
+        ret = Py_None;
+    }
+    return ret;
+error:
+    Py_DECREF(item);
+    return NULL;
+}
+
+
+// Encodes value, an instance of the type of schema (a CBORSchema), as a map
+// of its fields
+PyObject *
+CBOREncoder_encode_record(CBOREncoderObject *self, PyObject *schema,
+                          PyObject *value)
+{
+    PyObject *tmp, *ret;
+
+    // Fields may be read directly from the object's layout, so it must
+    // really be an instance of the schema's type
+    if (!PyObject_TypeCheck(value, ((CBORSchemaObject *) schema)->type)) {
+        PyErr_Format(_CBOAR_CBOREncodeError,
+                "cannot serialize %R with the schema for %R", value,
+                ((CBORSchemaObject *) schema)->type);
+        return NULL;
     }
-    return DC_ERROR;
+    Py_INCREF(schema);
+    tmp = self->shared_handler;
+    self->shared_handler = schema;
+    ret = encode_shared(self, &encode_record, value);
+    self->shared_handler = tmp;
+    Py_DECREF(schema);
+    return ret;
 }
 
+
+// Semantic encoders /////////////////////////////////////////////////////////
 
-// Returns 1 if the decimal.Decimal value is < 0, 0 if it's >= 0, and -1 on
-// error
 static int
-decimal_negative(PyObject *value)
+encode_semantic(CBOREncoderObject *self, const uint64_t tag, PyObject *value)
+{
+    PyObject *obj;
+
+    if (encode_length(self, 6, tag) == -1)
+        return -1;
+    obj = CBOREncoder_encode(self, value);
+    Py_XDECREF(obj);
+    return obj == NULL ? -1 : 0;
+}
+
+
+// CBOREncoder.encode_semantic(self, tag)
+static PyObject *
+CBOREncoder_encode_semantic(CBOREncoderObject *self, PyObject *value)
+{
+    // major type 6
+    CBORTagObject *tag;
+
+    if (!CBORTag_CheckExact(value))
+        return NULL;
+    tag = (CBORTagObject *) value;
+    if (encode_semantic(self, tag->tag, tag->value) == -1)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+
+// Returns the UTC offset (in microseconds) of the datetime *value* when
+// interpreted in *tzinfo*, storing it in *offset*. Returns 1 if the tzinfo
+// has an offset, 0 if tzinfo.utcoffset() returned None, and -1 on error
+static int
+datetime_utcoffset(PyObject *value, PyObject *tzinfo, int64_t *offset)
 {
-    PyObject *zero;
-    int ret = -1;
+    PyObject *delta;
 
-    zero = PyLong_FromLong(0);
-    if (zero) {
-        ret = PyObject_RichCompareBool(value, zero, Py_GT);
-        Py_DECREF(zero);
+    if (!_CBOAR_timezone_utc && _CBOAR_init_timezone_utc() == -1)
+        return -1;
+    if (tzinfo == _CBOAR_timezone_utc) {
+        *offset = 0;
+        return 1;
+    }
+    delta = PyObject_CallMethodObjArgs(tzinfo, _CBOAR_str_utcoffset, value, NULL);
+    if (!delta)
+        return -1;
+    if (delta == Py_None) {
+        Py_DECREF(delta);
+        return 0;
+    }
+    if (!PyDelta_Check(delta)) {
+        PyErr_Format(PyExc_TypeError,
+                "tzinfo.utcoffset() must return None or timedelta, not %R",
+                delta);
+        Py_DECREF(delta);
+        return -1;
+    }
+    *offset = ((int64_t) PyDateTime_DELTA_GET_DAYS(delta) * 86400 +
+            PyDateTime_DELTA_GET_SECONDS(delta)) * 1000000 +
+        PyDateTime_DELTA_GET_MICROSECONDS(delta);
+    Py_DECREF(delta);
+    return 1;
+}
+
+
+// Days since 1970-01-01 of the proleptic Gregorian date year-month-day
+static int64_t
+days_from_civil(int year, int month, int day)
+{
+    int64_t era, yoe, doy, doe;
+
+    year -= month <= 2;
+    era = year / 400;
+    yoe = year - era * 400;
+    doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+
+static PyObject *
+encode_datestr(CBOREncoderObject *self, PyObject *value, bool has_offset,
+               int64_t offset)
+{
+    // Formats value in the same manner as datetime.isoformat() except that a
+    // zero UTC offset is represented as "Z"; the result is built directly in
+    // the output buffer, behind the tag and string length
+    char buf[64], *s;
+    int length, microsecond;
+    int64_t seconds;
+
+    s = buf + 3;
+    s += sprintf(s, "%04d-%02d-%02dT%02d:%02d:%02d",
+            PyDateTime_GET_YEAR(value),
+            PyDateTime_GET_MONTH(value),
+            PyDateTime_GET_DAY(value),
+            PyDateTime_DATE_GET_HOUR(value),
+            PyDateTime_DATE_GET_MINUTE(value),
+            PyDateTime_DATE_GET_SECOND(value));
+    microsecond = PyDateTime_DATE_GET_MICROSECOND(value);
+    if (microsecond)
+        s += sprintf(s, ".%06d", microsecond);
+    if (has_offset) {
+        if (offset == 0)
+            *s++ = 'Z';
+        else {
+            *s++ = offset < 0 ? '-' : '+';
+            if (offset < 0)
+                offset = -offset;
+            microsecond = offset % 1000000;
+            seconds = offset / 1000000;
+            s += sprintf(s, "%02d:%02d",
+                    (int) (seconds / 3600), (int) (seconds / 60 % 60));
+            if (seconds % 60 || microsecond)
+                s += sprintf(s, ":%02d", (int) (seconds % 60));
+            if (microsecond)
+                s += sprintf(s, ".%06d", microsecond);
+        }
+    }
+
+    length = s - (buf + 3);
+    if (stringref_encode(self, NULL, length) == -1)
+        return NULL;
+    if (length < 24) {
+        buf[1] = '\xC0';
+        buf[2] = 0x60 | length;
+        if (fp_write(self, buf + 1, length + 2) == -1)
+            return NULL;
+    } else {
+        buf[0] = '\xC0';
+        buf[1] = '\x78';
+        buf[2] = length;
+        if (fp_write(self, buf, length + 3) == -1)
+            return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+long_true_divide(int64_t n, int64_t d)
+{
+    PyObject *num, *den, *ret = NULL;
+
+    num = PyLong_FromLongLong(n);
+    if (num) {
+        den = PyLong_FromLongLong(d);
+        if (den) {
+            ret = PyNumber_TrueDivide(num, den);
+            Py_DECREF(den);
+        }
+        Py_DECREF(num);
     }
     return ret;
 }
 
 
 static PyObject *
-encode_decimal_digits(CBOREncoderObject *self, PyObject *value)
+encode_timestamp(CBOREncoderObject *self, PyObject *value, int64_t offset)
 {
-    PyObject *tuple, *digits, *exp, *sig, *ten, *tmp, *ret = NULL;
-    bool sign, sharing;
+    // The timestamp is calculated in integer microseconds, which is exact for
+    // all representable datetimes; the division to seconds is then the same
+    // correctly rounded division as performed by datetime.timestamp() (when
+    // the microseconds exceed the precision of a double, the division is
+    // left to Python's int to guarantee this)
+    int64_t micros;
+    PyObject *tmp, *ret = NULL;
 
-    tuple = PyObject_CallMethodObjArgs(value, _CBOAR_str_as_tuple, NULL);
-    if (tuple) {
-        if (PyArg_ParseTuple(tuple, "pOO", &sign, &digits, &exp)) {
-            sig = PyLong_FromLong(0);
-            if (sig) {
-                ten = PyLong_FromLong(10);
-                if (ten) {
-                    Py_ssize_t length = PyTuple_GET_SIZE(digits);
-                    // for digit in digits: sig = (sig * 10) + digit
-                    for (Py_ssize_t i = 0; i < length; ++i) {
-                        tmp = PyNumber_Multiply(sig, ten);
-                        if (!tmp)
-                            break;
-                        Py_DECREF(sig);
-                        sig = tmp;
-                        tmp = PyNumber_Add(sig, PyTuple_GET_ITEM(digits, i));
-                        if (!tmp)
-                            break;
-                        Py_DECREF(sig);
-                        sig = tmp;
-                    }
-                    Py_DECREF(ten);
-                    // if sign: sig = -sig
-                    if (tmp && sign) {
-                        tmp = PyNumber_Negative(sig);
-                        if (tmp) {
-                            Py_DECREF(sig);
-                            sig = tmp;
-                        }
-                    }
-                    if (tmp) {
-                        sharing = self->value_sharing;
-                        self->value_sharing = false;
-                        value = PyTuple_Pack(2, exp, sig);
-                        if (value) {
-                            if (encode_semantic(self, 4, value) == 0) {
-                                Py_INCREF(Py_None);
-                                ret = Py_None;
-                            }
-                            Py_DECREF(value);
-                        }
-                        self->value_sharing = sharing;
-                    }
+    micros = (days_from_civil(
+                PyDateTime_GET_YEAR(value),
+                PyDateTime_GET_MONTH(value),
+                PyDateTime_GET_DAY(value)) * 86400 +
+            PyDateTime_DATE_GET_HOUR(value) * 3600 +
+            PyDateTime_DATE_GET_MINUTE(value) * 60 +
+            PyDateTime_DATE_GET_SECOND(value)) * 1000000 +
+        PyDateTime_DATE_GET_MICROSECOND(value) - offset;
+    if (fp_write(self, "\xC1", 1) == 0) {
+        if (micros % 1000000 == 0)
+            tmp = PyLong_FromLongLong(micros / 1000000);
+        else if (micros > -(1LL << 53) && micros < (1LL << 53))
+            tmp = PyFloat_FromDouble((double) micros / 1000000.0);
+        else
+            tmp = long_true_divide(micros, 1000000);
+        if (tmp) {
+            if (PyLong_CheckExact(tmp))
+                ret = CBOREncoder_encode_int(self, tmp);
+            else if (self->deterministic)
+                ret = CBOREncoder_encode_minimal_float(self, tmp);
+            else
+                ret = CBOREncoder_encode_float(self, tmp);
+            Py_DECREF(tmp);
+        }
+    }
+    return ret;
+}
+
+
+static PyObject *
+encode_local_timestamp(CBOREncoderObject *self, PyObject *value)
+{
+    // Fallback for aware datetimes whose tzinfo doesn't provide an offset, in
+    // which case datetime.timestamp() treats them as local times
+    PyObject *tmp, *i, *ret = NULL;
+
+    tmp = PyObject_CallMethodObjArgs(value, _CBOAR_str_timestamp, NULL);
+    if (tmp) {
+        if (fp_write(self, "\xC1", 1) == 0) {
+            double d = PyFloat_AS_DOUBLE(tmp);
+            if (d == trunc(d)) {
+                i = PyLong_FromDouble(d);
+                if (i) {
+                    ret = CBOREncoder_encode_int(self, i);
+                    Py_DECREF(i);
                 }
-                Py_DECREF(sig);
+            } else {
+                ret = CBOREncoder_encode_float(self, tmp);
+            }
+        }
+        Py_DECREF(tmp);
+    }
+    return ret;
+}
+
+
+// CBOREncoder.encode_datetime(self, value)
+static PyObject *
+CBOREncoder_encode_datetime(CBOREncoderObject *self, PyObject *value)
+{
+    // semantic type 0 or 1
+    PyObject *tzinfo;
+    int64_t offset = 0;
+    int has_offset;
+
+    if (!PyDateTime_Check(value))
+        return NULL;
+    if (((PyDateTime_DateTime*)value)->hastzinfo &&
+            ((PyDateTime_DateTime*)value)->tzinfo != Py_None)
+        tzinfo = ((PyDateTime_DateTime*)value)->tzinfo;
+    else if (self->timezone != Py_None)
+        tzinfo = self->timezone;
+    else {
+        PyErr_Format(_CBOAR_CBOREncodeError,
+                        "naive datetime %R encountered and no default "
+                        "timezone has been set", value);
+        return NULL;
+    }
+
+    has_offset = datetime_utcoffset(value, tzinfo, &offset);
+    if (has_offset == -1)
+        return NULL;
+    if (!self->timestamp_format)
+        return encode_datestr(self, value, has_offset, offset);
+    else if (has_offset)
+        return encode_timestamp(self, value, offset);
+    else if (self->deterministic) {
+        // The result would depend on the local timezone of the host
+        PyErr_Format(_CBOAR_CBOREncodeError,
+                "cannot deterministically encode %R as a timestamp (its "
+                "timezone provides no UTC offset)", value);
+        return NULL;
+    } else
+        return encode_local_timestamp(self, value);
+}
+
+
+// CBOREncoder.encode_date(self, value)
+static PyObject *
+CBOREncoder_encode_date(CBOREncoderObject *self, PyObject *value)
+{
+    PyObject *datetime, *ret = NULL;
+
+    if (PyDate_Check(value)) {
+        datetime = PyDateTimeAPI->DateTime_FromDateAndTime(
+                PyDateTime_GET_YEAR(value),
+                PyDateTime_GET_MONTH(value),
+                PyDateTime_GET_DAY(value),
+                0, 0, 0, 0, self->timezone,
+                PyDateTimeAPI->DateTimeType);
+        if (datetime) {
+            ret = CBOREncoder_encode_datetime(self, datetime);
+            Py_DECREF(datetime);
+            return ret;
+        }
+    }
+    return NULL;
+}
+
+
+// The lowest limit sys.set_int_max_str_digits accepts; strings of decimal
+// digits no longer than this always convert to an int
+#define DECIMAL_DIGITS_PIECE 640
+
+// Converts the length decimal digits in buf (which must be writable, and NUL
+// terminated) to an int a piece at a time. Only used when the interpreter's
+// int max str digits limit refuses to convert them in one go
+static PyObject *
+decimal_pieces_to_long(char *buf, const Py_ssize_t length)
+{
+    Py_ssize_t start, end;
+    char c;
+    PyObject *ten, *scale = NULL, *piece, *tmp, *ret = NULL;
+
+    ten = PyLong_FromLong(10);
+    if (ten) {
+        tmp = PyLong_FromLong(DECIMAL_DIGITS_PIECE);
+        if (tmp) {
+            scale = PyNumber_Power(ten, tmp, Py_None);
+            Py_DECREF(tmp);
+        }
+        Py_DECREF(ten);
+    }
+    if (!scale)
+        return NULL;
+    // The first piece takes the remainder so the rest are all full size
+    end = length % DECIMAL_DIGITS_PIECE;
+    if (!end)
+        end = DECIMAL_DIGITS_PIECE;
+    for (start = 0; start < length;
+            start = end, end += DECIMAL_DIGITS_PIECE) {
+        c = buf[end];
+        buf[end] = '\0';
+        piece = PyLong_FromString(buf + start, NULL, 10);
+        buf[end] = c;
+        if (!piece) {
+            Py_CLEAR(ret);
+            break;
+        }
+        if (ret) {
+            // ret = ret * scale + piece
+            tmp = PyNumber_Multiply(ret, scale);
+            Py_SETREF(ret, tmp ? PyNumber_Add(tmp, piece) : NULL);
+            Py_XDECREF(tmp);
+            Py_DECREF(piece);
+            if (!ret)
+                break;
+        } else
+            ret = piece;
+    }
+    Py_DECREF(scale);
+    return ret;
+}
+
+
+// Builds the (unsigned) significand of a decimal.Decimal from its digit tuple
+// as a Python int, by writing the digits out as a string and converting it
+// with a single PyLong_FromString call
+static PyObject *
+decimal_digits_to_long(PyObject *digits)
+{
+    Py_ssize_t i, length;
+    char *buf;
+    PyObject *ret;
+
+    length = PyTuple_GET_SIZE(digits);
+    buf = PyMem_Malloc(length + 1);
+    if (!buf)
+        return PyErr_NoMemory();
+    for (i = 0; i < length; ++i)
+        buf[i] = '0' + PyLong_AsLong(PyTuple_GET_ITEM(digits, i));
+    buf[length] = '\0';
+    ret = PyLong_FromString(buf, NULL, 10);
+    if (!ret && length > DECIMAL_DIGITS_PIECE &&
+            PyErr_ExceptionMatches(PyExc_ValueError)) {
+        PyErr_Clear();
+        ret = decimal_pieces_to_long(buf, length);
+    }
+    PyMem_Free(buf);
+    return ret;
+}
+
+
+static PyObject *
+encode_decimal_digits(CBOREncoderObject *self, bool sign, PyObject *digits,
+                      PyObject *exp)
+{
+    // The tag, array header and exponent are written together, followed by
+    // the significand which is written in the same buffer if it fits in a
+    // uint64 (the vast majority of cases), or via encode_int otherwise
+    char buf[2 + 9 + 9];
+    int length;
+    long long exponent;
+    uint64_t sig;
+    Py_ssize_t i, count;
+    PyObject *tmp, *ret = NULL;
+
+    exponent = PyLong_AsLongLong(exp);
+    if (exponent == -1 && PyErr_Occurred())
+        return NULL;
+    buf[0] = '\xC4';
+    buf[1] = '\x82';
+    length = 2 + pack_int(buf + 2, exponent);
+
+    count = PyTuple_GET_SIZE(digits);
+    if (count <= 19) {
+        for (i = 0, sig = 0; i < count; ++i)
+            sig = sig * 10 + PyLong_AsLong(PyTuple_GET_ITEM(digits, i));
+        if (sign && sig)
+            length += pack_length(buf + length, 1, sig - 1);
+        else
+            length += pack_length(buf + length, 0, sig);
+        if (fp_write(self, buf, length) == 0)
+            Py_RETURN_NONE;
+    } else {
+        tmp = decimal_digits_to_long(digits);
+        if (tmp) {
+            if (sign)
+                Py_SETREF(tmp, PyNumber_Negative(tmp));
+            if (tmp) {
+                if (fp_write(self, buf, length) == 0)
+                    ret = CBOREncoder_encode_int(self, tmp);
+                Py_DECREF(tmp);
             }
         }
-        Py_DECREF(tuple);
     }
     return ret;
 }
@@ -1016,35 +2533,32 @@ static PyObject *
 CBOREncoder_encode_decimal(CBOREncoderObject *self, PyObject *value)
 {
     // semantic type 4
-    switch (decimal_classify(value)) {
-        case DC_NAN:
-            if (fp_write(self, "\xF9\x7E\x00", 3) == -1)
-                return NULL;
-            break;
-        case DC_INFINITE:
-            switch (decimal_negative(value)) {
-                case 1:
-                    if (fp_write(self, "\xF9\x7C\x00", 3) == -1)
-                        return NULL;
-                    break;
-                case 0:
-                    if (fp_write(self, "\xF9\xFC\x00", 3) == -1)
-                        return NULL;
-                    break;
-                case -1:
-                    return NULL;
-                default:
-                    assert(0);
+    PyObject *tuple, *digits, *exp, *ret = NULL;
+    const char *special;
+    bool sign;
+
+    // Decimal.as_tuple() tells us everything we need: the exponent of a
+    // special value is a str ('n' or 'N' for NaNs, 'F' for infinities)
+    tuple = PyObject_CallMethodObjArgs(value, _CBOAR_str_as_tuple, NULL);
+    if (tuple) {
+        if (PyArg_ParseTuple(tuple, "pO!O", &sign, &PyTuple_Type, &digits, &exp)) {
+            if (PyLong_Check(exp))
+                ret = encode_decimal_digits(self, sign, digits, exp);
+            else {
+                if (PyUnicode_Check(exp) &&
+                        PyUnicode_CompareWithASCIIString(exp, "F") == 0)
+                    special = sign ? "\xF9\xFC\x00" : "\xF9\x7C\x00";
+                else
+                    special = "\xF9\x7E\x00";
+                if (fp_write(self, special, 3) == 0) {
+                    Py_INCREF(Py_None);
+                    ret = Py_None;
+                }
             }
-            break;
-        case DC_NORMAL:
-            return encode_decimal_digits(self, value);
-        case DC_ERROR:
-            return NULL;
-        default:
-            assert(0);
+        }
+        Py_DECREF(tuple);
     }
-    Py_RETURN_NONE;
+    return ret;
 }
 
 
@@ -1052,46 +2566,42 @@ static PyObject *
 encode_shared(CBOREncoderObject *self, EncodeFunction *encoder,
               PyObject *value)
 {
-    PyObject *id, *index, *tuple, *ret = NULL;
+    SharedEntry *entry;
+    PyObject *ret = NULL;
+    char buf[11];
+    int size;
 
-    id = PyLong_FromVoidPtr(value);
-    if (id) {
-        tuple = PyDict_GetItem(self->shared, id);
+    entry = shared_find(self, value);
+    if (entry) {
         if (self->value_sharing) {
-            if (tuple) {
-                if (encode_length(self, 6, 29) == 0)
-                    ret = CBOREncoder_encode_int(
-                            self, PyTuple_GET_ITEM(tuple, 1));
+            if (entry->value) {
+                size = pack_length(buf, 6, 29);
+                size += pack_length(buf + size, 0, entry->index);
+                if (fp_write(self, buf, size) == 0) {
+                    Py_INCREF(Py_None);
+                    ret = Py_None;
+                }
             } else {
-                index = PyLong_FromSsize_t(PyDict_Size(self->shared));
-                if (index) {
-                    tuple = PyTuple_Pack(2, value, index);
-                    if (tuple) {
-                        if (PyDict_SetItem(self->shared, id, tuple) == 0)
-                            if (encode_length(self, 6, 28) == 0)
-                                ret = encoder(self, value);
-                        Py_DECREF(tuple);
-                    }
-                    Py_DECREF(index);
+                shared_add(self, entry, value);
+                if (encode_length(self, 6, 28) == 0) {
+                    self->nesting++;
+                    ret = encoder(self, value);
+                    self->nesting--;
                 }
             }
         } else {
-            if (tuple) {
+            if (entry->value) {
                 PyErr_SetString(
                     _CBOAR_CBOREncodeError,
                     "cyclic data structure detected but value_sharing is False");
             } else {
-                tuple = PyTuple_Pack(2, value, Py_None);
-                if (tuple) {
-                    if (PyDict_SetItem(self->shared, id, tuple) == 0) {
-                        ret = encoder(self, value);
-                        PyDict_DelItem(self->shared, id);
-                    }
-                    Py_DECREF(tuple);
-                }
+                shared_add(self, entry, value);
+                self->nesting++;
+                ret = encoder(self, value);
+                self->nesting--;
+                shared_remove(self, value);
             }
         }
-        Py_DECREF(id);
     }
     return ret;
 }
@@ -1328,44 +2838,193 @@ CBOREncoder_encode_ipnetwork(CBOREncoderObject *self, PyObject *value)
 }
 
 
-// Special encoders //////////////////////////////////////////////////////////
-
-// CBOREncoder.encode_float(self, value)
-static PyObject *
-CBOREncoder_encode_float(CBOREncoderObject *self, PyObject *value)
+// Determine the RFC 8746 typed array tag for a buffer with the specified
+// struct-module format (which may be NULL, meaning unsigned bytes) and
+// itemsize. The tag returned is for the big-endian variant; *little* is set if
+// the buffer's content is little-endian. Returns -1 if the format isn't
+// supported
+static int
+typed_array_tag(const char *format, const Py_ssize_t itemsize, bool *little)
 {
-    // major type 7
-    union {
-        double f;
-        uint64_t i;
-        char buf[sizeof(double)];
-    } u;
-
-    u.f = PyFloat_AS_DOUBLE(value);
-    if (u.f == -1.0 && PyErr_Occurred())
-        return NULL;
-    switch (fpclassify(u.f)) {
-        case FP_NAN:
-            if (fp_write(self, "\xF9\x7E\x00", 3) == -1)
-                return NULL;
-            break;
-        case FP_INFINITE:
-            if (u.f > 0) {
-                if (fp_write(self, "\xF9\x7C\x00", 3) == -1)
-                    return NULL;
-            } else {
-                if (fp_write(self, "\xF9\xFC\x00", 3) == -1)
-                    return NULL;
-            }
-            break;
+    int ll;
+
+#if BYTE_ORDER == LITTLE_ENDIAN
+    *little = true;
+#else
+    *little = false;
+#endif
+    if (!format)
+        format = "B";
+    switch (*format) {
+        case '@': case '=':          format++; break;
+        case '<':   *little = true;  format++; break;
+        case '>': case '!':
+                    *little = false; format++; break;
+    }
+    if (!format[0] || format[1])
+        return -1;
+    switch (itemsize) {
+        case 1: ll = 0; break;
+        case 2: ll = 1; break;
+        case 4: ll = 2; break;
+        case 8: ll = 3; break;
+        default: return -1;
+    }
+    switch (*format) {
+        case 'B': case 'H': case 'I': case 'L': case 'Q':
+            return 64 + ll;
+        case 'b': case 'h': case 'i': case 'l': case 'q':
+            return 72 + ll;
+        case 'e': case 'f': case 'd':
+            return ll ? 80 + ll - 1 : -1;
         default:
-            if (fp_write(self, "\xFB", 1) == -1)
-                return NULL;
-            u.i = htobe64(u.i);
-            if (fp_write(self, u.buf, sizeof(double)) == -1)
-                return NULL;
-            break;
+            return -1;
+    }
+}
+
+
+// Writes the single or double-precision values of view (which are stored
+// little-endian if little is true) as a half-precision typed array (tag 80
+// or 84). Doubles are narrowed to single-precision first. The output is in
+// native byte order, or big-endian in the canonical style
+static int
+encode_float16_array(CBOREncoderObject *self, Py_buffer *view,
+                     const bool little)
+{
+    Py_ssize_t i, count;
+    uint64_t value;
+    double f;
+    float *singles;
+    char *halves;
+    bool native, big_endian;
+    int ret = -1;
+
+#if BYTE_ORDER == LITTLE_ENDIAN
+    native = little;
+    big_endian = self->enc_style == 1;
+#else
+    native = !little;
+    big_endian = true;
+#endif
+    count = view->len / view->itemsize;
+    singles = PyMem_Malloc(count * sizeof(float) + count * sizeof(uint16_t));
+    if (!singles) {
+        PyErr_NoMemory();
+        return -1;
     }
+    halves = (char *) (singles + count);
+    CBOAR_BEGIN_ALLOW_THREADS_IF(view->len >= CBOAR_GIL_THRESHOLD)
+    if (view->itemsize == sizeof(float)) {
+        if (native)
+            memcpy(singles, view->buf, view->len);
+        else
+            bswap32_array(singles, view->buf, count);
+    } else {
+        for (i = 0; i < count; i++) {
+            memcpy(&value, (char *) view->buf + i * sizeof(double),
+                   sizeof(double));
+            if (!native)
+                value = __builtin_bswap64(value);
+            memcpy(&f, &value, sizeof(double));
+            singles[i] = f;
+        }
+    }
+    pack_float16_array(halves, singles, count, big_endian);
+    CBOAR_END_ALLOW_THREADS_IF
+    if (encode_length(self, 6, big_endian ? 80 : 84) == 0)
+        if (stringref_encode(self, NULL, count * sizeof(uint16_t)) == 0)
+            if (encode_length(self, 2, count * sizeof(uint16_t)) == 0)
+                ret = fp_write(self, halves, count * sizeof(uint16_t));
+    PyMem_Free(singles);
+    return ret;
+}
+
+
+static PyObject *
+encode_typed_array(CBOREncoderObject *self, PyObject *value)
+{
+    // The buffer is written as-is (in its own byte order) in a single call,
+    // except in the canonical style which always uses big-endian so that the
+    // output doesn't vary between platforms, and when float16_arrays is set
+    // in which case floats are narrowed to half-precision
+    Py_buffer view;
+    char *swapped;
+    bool little;
+    int tag;
+    PyObject *ret = NULL;
+
+    if (PyObject_GetBuffer(value, &view, PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) == -1)
+        return NULL;
+    if (view.ndim > 1)
+        PyErr_Format(_CBOAR_CBOREncodeError,
+                "unable to encode %d-dimensional typed array %R",
+                view.ndim, value);
+    else if ((tag = typed_array_tag(view.format, view.itemsize, &little)) == -1)
+        PyErr_Format(_CBOAR_CBOREncodeError,
+                "unsupported typed array format '%s' in %R",
+                view.format ? view.format : "B", value);
+    else if (self->float16_arrays && (tag == 81 || tag == 82)) {
+        if (encode_float16_array(self, &view, little) == 0) {
+            Py_INCREF(Py_None);
+            ret = Py_None;
+        }
+    } else if (view.itemsize > 1 && little && self->enc_style == 1) {
+        swapped = PyMem_Malloc(view.len);
+        if (swapped) {
+            CBOAR_BEGIN_ALLOW_THREADS_IF(view.len >= CBOAR_GIL_THRESHOLD)
+            bswap_array(swapped, view.buf, view.len / view.itemsize,
+                    view.itemsize);
+            CBOAR_END_ALLOW_THREADS_IF
+            if (encode_length(self, 6, tag) == 0)
+                if (stringref_encode(self, NULL, view.len) == 0)
+                    if (encode_length(self, 2, view.len) == 0)
+                        if (fp_write(self, swapped, view.len) == 0) {
+                            Py_INCREF(Py_None);
+                            ret = Py_None;
+                        }
+            PyMem_Free(swapped);
+        } else
+            PyErr_NoMemory();
+    } else {
+        if (view.itemsize > 1 && little)
+            tag += 4;
+        if (encode_length(self, 6, tag) == 0)
+            if (stringref_encode(self, NULL, view.len) == 0)
+                if (encode_length(self, 2, view.len) == 0)
+                    if (fp_write(self, view.buf, view.len) == 0) {
+                        Py_INCREF(Py_None);
+                        ret = Py_None;
+                    }
+    }
+    PyBuffer_Release(&view);
+    return ret;
+}
+
+
+// CBOREncoder.encode_typed_array(self, value)
+static PyObject *
+CBOREncoder_encode_typed_array(CBOREncoderObject *self, PyObject *value)
+{
+    // semantic types 64-87
+    return encode_shared(self, &encode_typed_array, value);
+}
+
+
+// Special encoders //////////////////////////////////////////////////////////
+
+// CBOREncoder.encode_float(self, value)
+static PyObject *
+CBOREncoder_encode_float(CBOREncoderObject *self, PyObject *value)
+{
+    // major type 7
+    char buf[sizeof(double) + 1];
+    double f;
+
+    f = PyFloat_AsDouble(value);
+    if (f == -1.0 && PyErr_Occurred())
+        return NULL;
+    if (fp_write(self, buf, pack_float(buf, f, false)) == -1)
+        return NULL;
     Py_RETURN_NONE;
 }
 
@@ -1437,289 +3096,1312 @@ CBOREncoder_encode_simple(CBOREncoderObject *self, PyObject *args)
 static PyObject *
 CBOREncoder_encode_minimal_float(CBOREncoderObject *self, PyObject *value)
 {
-    union {
-        double f;
-        uint64_t i;
-        char buf[sizeof(double)];
-    } u_double;
+    char buf[sizeof(double) + 1];
+    double f;
 
-    union {
-        float f;
-        uint32_t i;
-        char buf[sizeof(float)];
-    } u_single;
+    f = PyFloat_AsDouble(value);
+    if (f == -1.0 && PyErr_Occurred())
+        return NULL;
+    if (fp_write(self, buf, pack_float(buf, f, true)) == -1)
+        return NULL;
+    Py_RETURN_NONE;
+}
 
-    union {
-        uint16_t i;
-        char buf[sizeof(uint16_t)];
-    } u_half;
 
-    u_double.f = PyFloat_AS_DOUBLE(value);
-    if (u_double.f == -1.0 && PyErr_Occurred())
+// Deterministic encoding ////////////////////////////////////////////////////
+
+// With deterministic set (which implies the canonical style), the output
+// meets the core deterministic encoding requirements of RFC 8949 §4.2.1. On
+// top of the canonical style's preferred serialization, the keys of maps
+// (and items of sets) are sorted bytewise on their encoded form rather than
+// shortest first, and keys which encode identically are rejected. Timestamps
+// are also written as minimal floats, and those which would depend on the
+// host's timezone are refused (see CBOREncoder_encode_datetime).
+//
+// The keys of a map are encoded one after another into a single capture
+// buffer (see fp_write), and sorted as slices of it
+
+typedef struct {
+    PyObject *key;
+    PyObject *value;     // NULL for the items of a set
+    Py_ssize_t offset;   // of the encoded key in the capture buffer
+    Py_ssize_t length;
+    const char *data;    // the encoded key, once the buffer is complete
+} SortedKey;
+
+typedef struct {
+    CaptureBuffer encoded;
+    SortedKey *keys;
+    Py_ssize_t length;
+} SortedKeys;
+
+
+static void
+sorted_keys_free(SortedKeys *sorted)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < sorted->length; ++i) {
+        Py_DECREF(sorted->keys[i].key);
+        Py_XDECREF(sorted->keys[i].value);
+    }
+    PyMem_Free(sorted->keys);
+    PyMem_Free(sorted->encoded.data);
+}
+
+
+static int
+sorted_key_compare(const void *a, const void *b)
+{
+    const SortedKey *x = a, *y = b;
+    int ret;
+
+    ret = memcmp(x->data, y->data,
+            x->length < y->length ? x->length : y->length);
+    if (ret)
+        return ret;
+    return x->length < y->length ? -1 : x->length > y->length;
+}
+
+
+// Fills sorted with the keys and values of value (a dict, another mapping,
+// or a set when kind is "set item"), in deterministic order. The items are
+// gathered before any key is encoded, as that may run arbitrary code.
+// sorted must be freed with sorted_keys_free, even on error
+static int
+sorted_keys_init(CBOREncoderObject *self, SortedKeys *sorted, PyObject *value,
+                 const char *kind)
+{
+    PyObject *items = NULL, *iter, *item, *key, *val, *ret;
+    PyObject *save_refs = self->pack_refs;
+    CaptureBuffer *save_capture = self->capture;
+    bool save_namespace = self->string_namespace;
+    Py_ssize_t i, count, pos = 0;
+
+    sorted->encoded.data = NULL;
+    sorted->encoded.used = sorted->encoded.size = 0;
+    sorted->encoded.sink = NULL;
+    sorted->keys = NULL;
+    sorted->length = 0;
+    if (PyDict_Check(value))
+        count = PyDict_GET_SIZE(value);
+    else if (PyAnySet_Check(value))
+        count = PySet_GET_SIZE(value);
+    else {
+        items = PyMapping_Items(value);
+        if (!items)
+            return -1;
+        count = PyList_GET_SIZE(items);
+    }
+    sorted->keys = PyMem_New(SortedKey, count ? count : 1);
+    if (!sorted->keys) {
+        Py_XDECREF(items);
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (items) {
+        for (i = 0; i < count; ++i) {
+            item = PyList_GET_ITEM(items, i);
+            if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2) {
+                PyErr_Format(_CBOAR_CBOREncodeError,
+                        "invalid mapping item %R", item);
+                break;
+            }
+            sorted->keys[i].key = PyTuple_GET_ITEM(item, 0);
+            sorted->keys[i].value = PyTuple_GET_ITEM(item, 1);
+            Py_INCREF(sorted->keys[i].key);
+            Py_INCREF(sorted->keys[i].value);
+            sorted->length++;
+        }
+        Py_DECREF(items);
+    } else if (PyDict_Check(value)) {
+        while (sorted->length < count &&
+                PyDict_Next(value, &pos, &key, &val)) {
+            Py_INCREF(key);
+            Py_INCREF(val);
+            sorted->keys[sorted->length].key = key;
+            sorted->keys[sorted->length++].value = val;
+        }
+    } else {
+        iter = PyObject_GetIter(value);
+        if (!iter)
+            return -1;
+        while (sorted->length < count && (item = PyIter_Next(iter))) {
+            sorted->keys[sorted->length].key = item;
+            sorted->keys[sorted->length++].value = NULL;
+        }
+        Py_DECREF(iter);
+    }
+    if (PyErr_Occurred())
+        return -1;
+
+    // Strings (and packed items) within the keys aren't referenced here;
+    // the keys are encoded again when they're written if they may be
+    self->string_namespace = false;
+    self->pack_refs = NULL;
+    self->capture = &sorted->encoded;
+    for (i = 0, ret = Py_None; ret && i < sorted->length; ++i) {
+        sorted->keys[i].offset = sorted->encoded.used;
+        ret = CBOREncoder_encode(self, sorted->keys[i].key);
+        Py_XDECREF(ret);
+        sorted->keys[i].length =
+            sorted->encoded.used - sorted->keys[i].offset;
+    }
+    self->string_namespace = save_namespace;
+    self->pack_refs = save_refs;
+    self->capture = save_capture;
+    if (!ret)
+        return -1;
+    // The buffer doesn't move once all the keys are in it
+    for (i = 0; i < sorted->length; ++i)
+        sorted->keys[i].data = sorted->encoded.data + sorted->keys[i].offset;
+
+    qsort(sorted->keys, sorted->length, sizeof(SortedKey), sorted_key_compare);
+    for (i = 1; i < sorted->length; ++i) {
+        if (!sorted_key_compare(&sorted->keys[i - 1], &sorted->keys[i])) {
+            PyErr_Format(_CBOAR_CBOREncodeError,
+                    "duplicate %s %R (%R encodes identically)", kind,
+                    sorted->keys[i].key, sorted->keys[i - 1].key);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+// Writes the encoded key from sorted (or encodes it again if strings or
+// packed items within it may be referenced)
+static int
+sorted_key_write(CBOREncoderObject *self, SortedKey *key)
+{
+    PyObject *ret;
+
+    if (self->string_namespace || self->pack_refs) {
+        ret = CBOREncoder_encode(self, key->key);
+        Py_XDECREF(ret);
+        return ret ? 0 : -1;
+    }
+    return fp_write(self, key->data, key->length);
+}
+
+
+static PyObject *
+encode_deterministic_map(CBOREncoderObject *self, PyObject *value)
+{
+    SortedKeys sorted;
+    PyObject *ret = NULL;
+    Py_ssize_t i;
+
+    if (sorted_keys_init(self, &sorted, value, "map key") == 0 &&
+            encode_length(self, 5, sorted.length) == 0) {
+        for (i = 0, ret = Py_None; ret && i < sorted.length; ++i) {
+            if (sorted_key_write(self, &sorted.keys[i]) == -1)
+                ret = NULL;
+            else {
+                ret = CBOREncoder_encode(self, sorted.keys[i].value);
+                Py_XDECREF(ret);
+            }
+        }
+        Py_XINCREF(ret);
+    }
+    sorted_keys_free(&sorted);
+    return ret;
+}
+
+
+static PyObject *
+encode_deterministic_set(CBOREncoderObject *self, PyObject *value)
+{
+    SortedKeys sorted;
+    PyObject *ret = NULL;
+    Py_ssize_t i;
+
+    if (sorted_keys_init(self, &sorted, value, "set item") == 0 &&
+            encode_length(self, 6, 258) == 0 &&
+            encode_length(self, 4, sorted.length) == 0) {
+        Py_INCREF(Py_None);
+        ret = Py_None;
+        for (i = 0; i < sorted.length; ++i)
+            if (sorted_key_write(self, &sorted.keys[i]) == -1) {
+                Py_CLEAR(ret);
+                break;
+            }
+    }
+    sorted_keys_free(&sorted);
+    return ret;
+}
+
+
+static PyObject *
+encode_canonical_map_list(CBOREncoderObject *self, PyObject *list)
+{
+    PyObject *bytes, *ret;
+    Py_ssize_t index;
+
+    if (PyList_Sort(list) == -1)
         return NULL;
-    switch (fpclassify(u_double.f)) {
-        case FP_NAN:
-            if (fp_write(self, "\xF9\x7E\x00", 3) == -1)
+    if (encode_length(self, 5, PyList_GET_SIZE(list)) == -1)
+        return NULL;
+    for (index = 0; index < PyList_GET_SIZE(list); ++index) {
+        // We already have the encoded form of the key so just write it out,
+        // unless it (or strings within it) may need to be referenced
+        if (self->string_namespace || self->pack_refs) {
+            ret = CBOREncoder_encode(self,
+                    PyTuple_GET_ITEM(PyList_GET_ITEM(list, index), 2));
+            if (ret)
+                Py_DECREF(ret);
+            else
                 return NULL;
+        } else {
+            bytes = PyTuple_GET_ITEM(PyList_GET_ITEM(list, index), 1);
+            if (fp_write(self, PyBytes_AS_STRING(bytes), PyBytes_GET_SIZE(bytes)) == -1)
+                return NULL;
+        }
+        ret = CBOREncoder_encode(self,
+                PyTuple_GET_ITEM(PyList_GET_ITEM(list, index), 3));
+        if (ret)
+            Py_DECREF(ret);
+        else
+            return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+dict_to_canonical_list(CBOREncoderObject *self, PyObject *value)
+{
+    PyObject *bytes, *length, *key, *val, *tuple, *ret, *list;
+    Py_ssize_t index, pos;
+
+    ret = list = PyList_New(PyDict_Size(value));
+    if (list) {
+        pos = 0;
+        index = 0;
+        while (ret && PyDict_Next(value, &pos, &key, &val)) {
+            Py_INCREF(key);
+            bytes = CBOREncoder_encode_to_bytes(self, key);
+            Py_DECREF(key);
+            if (bytes) {
+                length = PyLong_FromSsize_t(PyBytes_GET_SIZE(bytes));
+                if (length) {
+                    tuple = PyTuple_Pack(4, length, bytes, key, val);
+                    if (tuple)
+                        PyList_SET_ITEM(list, index, tuple); // steals ref
+                    else
+                        ret = NULL;
+                    index++;
+                    Py_DECREF(length);
+                } else
+                    ret = NULL;
+                Py_DECREF(bytes);
+            } else
+                ret = NULL;
+        }
+        if (!ret)
+            Py_DECREF(list);
+    }
+    return ret;
+}
+
+
+static PyObject *
+mapping_to_canonical_list(CBOREncoderObject *self, PyObject *value)
+{
+    PyObject **items, *map_items, *fast, *bytes, *length, *tuple, *ret, *list;
+    Py_ssize_t fast_len, index;
+
+    ret = list = PyList_New(PyMapping_Size(value));
+    if (list) {
+        map_items = PyMapping_Items(value);
+        if (map_items) {
+            fast = PySequence_Fast(map_items, "internal error");
+            if (fast) {
+                index = 0;
+                fast_len = PySequence_Fast_GET_SIZE(fast);
+                items = PySequence_Fast_ITEMS(fast);
+                while (ret && fast_len) {
+                    bytes = CBOREncoder_encode_to_bytes(self,
+                        PyTuple_GET_ITEM(*items, 0));
+                    if (bytes) {
+                        length = PyLong_FromSsize_t(PyBytes_GET_SIZE(bytes));
+                        if (length) {
+                            tuple = PyTuple_Pack(4,
+                                length, bytes,
+                                PyTuple_GET_ITEM(*items, 0),
+                                PyTuple_GET_ITEM(*items, 1));
+                            if (tuple)
+                                PyList_SET_ITEM(list, index, tuple); // steals ref
+                            else
+                                ret = NULL;
+                            Py_DECREF(length);
+                        } else
+                            ret = NULL;
+                        Py_DECREF(bytes);
+                    } else
+                        ret = NULL;
+                    items++;
+                    fast_len--;
+                }
+                Py_DECREF(fast);
+            } else
+                ret = NULL;
+            Py_DECREF(map_items);
+        } else
+            ret = NULL;
+        if (!ret)
+            Py_DECREF(list);
+    }
+    return ret;
+}
+
+
+static PyObject *
+encode_canonical_map(CBOREncoderObject *self, PyObject *value)
+{
+    PyObject *list, *ret = NULL;
+
+    if (self->deterministic)
+        return encode_deterministic_map(self, value);
+    if (PyDict_Check(value))
+        list = dict_to_canonical_list(self, value);
+    else
+        list = mapping_to_canonical_list(self, value);
+    if (list) {
+        ret = encode_canonical_map_list(self, list);
+        Py_DECREF(list);
+    }
+    return ret;
+}
+
+
+static PyObject *
+CBOREncoder_encode_canonical_map(CBOREncoderObject *self, PyObject *value)
+{
+    return encode_shared(self, &encode_canonical_map, value);
+}
+
+
+static PyObject *
+encode_canonical_set_list(CBOREncoderObject *self, PyObject *list)
+{
+    PyObject *bytes, *ret;
+    Py_ssize_t index;
+
+    if (PyList_Sort(list) == -1)
+        return NULL;
+    if (encode_length(self, 6, 258) == -1)
+        return NULL;
+    if (encode_length(self, 4, PyList_GET_SIZE(list)) == -1)
+        return NULL;
+    for (index = 0; index < PyList_GET_SIZE(list); ++index) {
+        // We already have the encoded form, so just write it out (unless
+        // it, or strings within it, may need to be referenced)
+        if (self->string_namespace || self->pack_refs) {
+            ret = CBOREncoder_encode(self,
+                    PyTuple_GET_ITEM(PyList_GET_ITEM(list, index), 2));
+            if (ret)
+                Py_DECREF(ret);
+            else
+                return NULL;
+        } else {
+            bytes = PyTuple_GET_ITEM(PyList_GET_ITEM(list, index), 1);
+            if (fp_write(self, PyBytes_AS_STRING(bytes), PyBytes_GET_SIZE(bytes)) == -1)
+                return NULL;
+        }
+    }
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+set_to_canonical_list(CBOREncoderObject *self, PyObject *value)
+{
+    PyObject *iter, *bytes, *length, *item, *tuple, *list, *ret;
+    Py_ssize_t index;
+
+    ret = list = PyList_New(PySet_GET_SIZE(value));
+    if (list) {
+        iter = PyObject_GetIter(value);
+        if (iter) {
+            index = 0;
+            while (ret && (item = PyIter_Next(iter))) {
+                bytes = CBOREncoder_encode_to_bytes(self, item);
+                if (bytes) {
+                    length = PyLong_FromSsize_t(PyBytes_GET_SIZE(bytes));
+                    if (length) {
+                        tuple = PyTuple_Pack(3, length, bytes, item);
+                        if (tuple)
+                            PyList_SET_ITEM(list, index, tuple); // steals ref
+                        else
+                            ret = NULL;
+                        index++;
+                        Py_DECREF(length);
+                    } else
+                        ret = NULL;
+                    Py_DECREF(bytes);
+                } else
+                    ret = NULL;
+                Py_DECREF(item);
+            }
+            Py_DECREF(iter);
+        }
+        if (!ret)
+            Py_DECREF(list);
+    }
+    return ret;
+}
+
+
+static PyObject *
+encode_canonical_set(CBOREncoderObject *self, PyObject *value)
+{
+    PyObject *list, *ret = NULL;
+
+    if (self->deterministic)
+        return encode_deterministic_set(self, value);
+    list = set_to_canonical_list(self, value);
+    if (list) {
+        ret = encode_canonical_set_list(self, list);
+        Py_DECREF(list);
+    }
+    return ret;
+}
+
+
+static PyObject *
+CBOREncoder_encode_canonical_set(CBOREncoderObject *self, PyObject *value)
+{
+    return encode_shared(self, &encode_canonical_set, value);
+}
+
+
+// Iterative encoding ////////////////////////////////////////////////////////
+
+// The iterative engine encodes lists, tuples and dicts with an explicit stack
+// of frames rather than recursion, so they can be nested arbitrarily deep.
+// The output of every level is gathered in one buffer so that runs of simple
+// items, and the headers of the containers around them, are written
+// together. Anything else flushes the buffer and is encoded by encode() as
+// usual. Only the regular and canonical styles are handled this way, as
+// custom styles may override the encoding of any type. Containers are
+// tracked for value sharing and cycle detection just as encode_shared does
+
+#define ENCODE_BUFFER_SIZE 4096
+// Frames held on the C stack before resorting to the heap
+#define ENCODE_STACK_SIZE 32
+
+enum EncodeFrameKind {
+    FRAME_ARRAY,
+    FRAME_DICT,
+    FRAME_SORTED_MAP,  // a canonical dict; items is the sorted list
+    FRAME_DETERMINISTIC_MAP,  // a deterministic dict; see sorted
+};
+
+typedef struct {
+    uint8_t kind;
+    bool active;          // value is in the shared table until closed
+    PyObject *value;      // the container being encoded
+    PyObject *items;      // sequence of an array, or the sorted list of a map
+    PyObject **next;      // next item of an array
+    Py_ssize_t remaining; // items still to come in an array
+    Py_ssize_t pos;       // position in a dict or sorted list
+    PyObject *pending;    // the value to follow a key
+    SortedKeys *sorted;   // the sorted keys of a deterministic map
+} EncodeFrame;
+
+typedef struct {
+    int used;
+    char data[ENCODE_BUFFER_SIZE];
+} EncodeBuffer;
+
+
+static int
+buffer_flush(CBOREncoderObject *self, EncodeBuffer *buf)
+{
+    int used = buf->used;
+
+    buf->used = 0;
+    return used ? fp_write(self, buf->data, used) : 0;
+}
+
+
+// Ensures buf has room for size more bytes
+static inline int
+buffer_reserve(CBOREncoderObject *self, EncodeBuffer *buf, const int size)
+{
+    if (ENCODE_BUFFER_SIZE - buf->used < size)
+        return buffer_flush(self, buf);
+    return 0;
+}
+
+
+static int
+buffer_write(CBOREncoderObject *self, EncodeBuffer *buf, const char *data,
+             const Py_ssize_t length)
+{
+    if (length > ENCODE_BUFFER_SIZE / 4) {
+        if (buffer_flush(self, buf) == -1)
+            return -1;
+        return fp_write(self, data, length);
+    }
+    if (buffer_reserve(self, buf, length) == -1)
+        return -1;
+    memcpy(buf->data + buf->used, data, length);
+    buf->used += length;
+    return 0;
+}
+
+
+// Deals with value sharing and cycle detection for the container value. If
+// it has been encoded already (with value sharing), writes a reference to it
+// and returns 0. Otherwise returns 1 when the container should be encoded,
+// storing whether it must be removed from the shared table afterward in
+// *active
+static int
+frame_share(CBOREncoderObject *self, EncodeBuffer *buf, PyObject *value,
+            bool *active)
+{
+    SharedEntry *entry;
+
+    *active = false;
+    entry = shared_find(self, value);
+    if (!entry)
+        return -1;
+    if (entry->value && !self->value_sharing) {
+        PyErr_SetString(
+            _CBOAR_CBOREncodeError,
+            "cyclic data structure detected but value_sharing is False");
+        return -1;
+    }
+    if (buffer_reserve(self, buf, 11) == -1)
+        return -1;
+    if (entry->value) {
+        buf->used += pack_length(buf->data + buf->used, 6, 29);
+        buf->used += pack_length(buf->data + buf->used, 0, entry->index);
+        return 0;
+    }
+    if (shared_add(self, entry, value) == -1)
+        *active = true;
+    else
+        buf->used += pack_length(buf->data + buf->used, 6, 28);
+    return 1;
+}
+
+
+// Opens frame for the container value, writing its header. Returns 0 if the
+// frame is ready (which may mean it's empty already), 1 if nothing more is
+// required (a shared reference was written), and -1 on error
+static int
+frame_open(CBOREncoderObject *self, EncodeBuffer *buf, EncodeFrame *frame,
+           PyObject *value)
+{
+    Py_ssize_t length;
+    int ret;
+
+    ret = frame_share(self, buf, value, &frame->active);
+    if (ret < 1)
+        return ret == 0 ? 1 : -1;
+    Py_INCREF(value);
+    frame->value = value;
+    frame->items = NULL;
+    frame->pending = NULL;
+    frame->sorted = NULL;
+    frame->pos = 0;
+    if (buffer_reserve(self, buf, 9) == -1)
+        return -1;
+    if (PyList_CheckExact(value) || PyTuple_CheckExact(value)) {
+        frame->kind = FRAME_ARRAY;
+        frame->items = PySequence_Fast(value, "argument must be iterable");
+        if (!frame->items)
+            return -1;
+        frame->remaining = PySequence_Fast_GET_SIZE(frame->items);
+        frame->next = PySequence_Fast_ITEMS(frame->items);
+        buf->used += pack_length(buf->data + buf->used, 4, frame->remaining);
+    } else if (PyDict_CheckExact(value) && self->deterministic) {
+        frame->kind = FRAME_DETERMINISTIC_MAP;
+        frame->sorted = PyMem_New(SortedKeys, 1);
+        if (!frame->sorted) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        if (sorted_keys_init(self, frame->sorted, value, "map key") == -1)
+            return -1;
+        length = frame->sorted->length;
+        buf->used += pack_length(buf->data + buf->used, 5, length);
+    } else if (PyDict_CheckExact(value) && self->enc_style == 1) {
+        frame->kind = FRAME_SORTED_MAP;
+        frame->items = dict_to_canonical_list(self, value);
+        if (!frame->items || PyList_Sort(frame->items) == -1)
+            return -1;
+        length = PyList_GET_SIZE(frame->items);
+        buf->used += pack_length(buf->data + buf->used, 5, length);
+    } else {
+        frame->kind = FRAME_DICT;
+        length = PyDict_GET_SIZE(value);
+        buf->used += pack_length(buf->data + buf->used, 5, length);
+    }
+    return 0;
+}
+
+
+static void
+frame_close(CBOREncoderObject *self, EncodeFrame *frame)
+{
+    if (frame->active)
+        shared_remove(self, frame->value);
+    Py_CLEAR(frame->value);
+    Py_CLEAR(frame->items);
+    Py_CLEAR(frame->pending);
+    if (frame->sorted) {
+        sorted_keys_free(frame->sorted);
+        PyMem_Free(frame->sorted);
+        frame->sorted = NULL;
+    }
+}
+
+
+// Stores the next item to encode from frame in *item (as a new reference),
+// or NULL if the frame is complete. Canonical runs of floats in arrays are
+// packed directly into buf
+static int
+frame_next(CBOREncoderObject *self, EncodeBuffer *buf, EncodeFrame *frame,
+           PyObject **item)
+{
+    PyObject *key, *value, *tuple;
+    SortedKey *sorted;
+    Py_ssize_t count;
+
+    *item = NULL;
+    switch (frame->kind) {
+        case FRAME_ARRAY:
+            while (self->enc_style == 1 && frame->remaining &&
+                    PyFloat_CheckExact(*frame->next)) {
+                if (buffer_reserve(self, buf, ARRAY_FLOAT_RUN * 9) == -1)
+                    return -1;
+                buf->used += pack_minimal_floats(buf->data + buf->used,
+                        frame->next, frame->remaining, &count);
+                frame->next += count;
+                frame->remaining -= count;
+            }
+            if (frame->remaining) {
+                *item = *frame->next++;
+                frame->remaining--;
+            }
             break;
-        case FP_INFINITE:
-            if (u_double.f > 0) {
-                if (fp_write(self, "\xF9\x7C\x00", 3) == -1)
-                    return NULL;
-            } else {
-                if (fp_write(self, "\xF9\xFC\x00", 3) == -1)
-                    return NULL;
+        case FRAME_DICT:
+            if (frame->pending) {
+                *item = frame->pending;
+                frame->pending = NULL;
+                return 0;
+            }
+            if (PyDict_Next(frame->value, &frame->pos, &key, &value)) {
+                Py_INCREF(value);
+                frame->pending = value;
+                *item = key;
             }
             break;
-        default:
-            u_single.f = u_double.f;
-            if (u_single.f == u_double.f) {
-                u_half.i = pack_float16(u_single.f);
-                if (unpack_float16(u_half.i) == u_single.f) {
-                    if (fp_write(self, "\xF9", 1) == -1)
-                        return NULL;
-                    if (fp_write(self, u_half.buf, sizeof(uint16_t)) == -1)
-                        return NULL;
-                } else {
-                    if (fp_write(self, "\xFA", 1) == -1)
-                        return NULL;
-                    u_single.i = htobe32(u_single.i);
-                    if (fp_write(self, u_single.buf, sizeof(float)) == -1)
-                        return NULL;
+        case FRAME_SORTED_MAP:
+            if (frame->pending) {
+                *item = frame->pending;
+                frame->pending = NULL;
+                return 0;
+            }
+            if (frame->pos < PyList_GET_SIZE(frame->items)) {
+                // We already have the encoded form of the key so just write
+                // it out; see encode_canonical_map_list
+                tuple = PyList_GET_ITEM(frame->items, frame->pos++);
+                if (self->string_namespace || self->pack_refs) {
+                    value = PyTuple_GET_ITEM(tuple, 3);
+                    Py_INCREF(value);
+                    frame->pending = value;
+                    *item = PyTuple_GET_ITEM(tuple, 2);
+                    break;
                 }
-            } else {
-                if (fp_write(self, "\xFB", 1) == -1)
-                    return NULL;
-                u_double.i = htobe64(u_double.i);
-                if (fp_write(self, u_double.buf, sizeof(double)) == -1)
-                    return NULL;
+                key = PyTuple_GET_ITEM(tuple, 1);
+                if (buffer_write(self, buf, PyBytes_AS_STRING(key),
+                                 PyBytes_GET_SIZE(key)) == -1)
+                    return -1;
+                *item = PyTuple_GET_ITEM(tuple, 3);
+            }
+            break;
+        case FRAME_DETERMINISTIC_MAP:
+            if (frame->pending) {
+                *item = frame->pending;
+                frame->pending = NULL;
+                return 0;
+            }
+            if (frame->pos < frame->sorted->length) {
+                sorted = &frame->sorted->keys[frame->pos++];
+                if (self->string_namespace || self->pack_refs) {
+                    Py_INCREF(sorted->value);
+                    frame->pending = sorted->value;
+                    *item = sorted->key;
+                    break;
+                }
+                if (buffer_write(self, buf, sorted->data,
+                                 sorted->length) == -1)
+                    return -1;
+                *item = sorted->value;
             }
             break;
     }
+    Py_XINCREF(*item);
+    return 0;
+}
+
+
+static PyObject *
+encode_iterative(CBOREncoderObject *self, PyObject *value)
+{
+    EncodeFrame stack[ENCODE_STACK_SIZE], *frames = stack, *tmp;
+    Py_ssize_t depth = 0, allocated = ENCODE_STACK_SIZE;
+    EncodeBuffer buf;
+    PyObject *item, *columns, *ret;
+    int size;
+
+    if ((self->enc_style != 0 && self->enc_style != 1) || self->pack_refs)
+        return encode(self, value);
+
+    buf.used = 0;
+    Py_INCREF(value);
+    item = value;
+    for (;;) {
+        // Find the next item, closing any completed frames
+        while (!item && depth) {
+            if (frame_next(self, &buf, &frames[depth - 1], &item) == -1)
+                goto error;
+            if (!item)
+                frame_close(self, &frames[--depth]);
+        }
+        if (!item)
+            break;
+
+        if (buffer_reserve(self, &buf, ARRAY_SHORT_STRING + 9) == -1)
+            goto error;
+        size = pack_simple(self, item, buf.data + buf.used);
+        if (size == -1)
+            goto error;
+        else if (size)
+            buf.used += size;
+        else if (columnar_candidate(self, item) &&
+                ((columns = columnar_split(self, item)) || PyErr_Occurred())) {
+            // Lists of records are split into columns by the stream encoder
+            if (!columns || buffer_flush(self, &buf) == -1)
+                goto error;
+            ret = encode_columnar_shared(self, item, columns);
+            Py_DECREF(columns);
+            if (!ret)
+                goto error;
+            Py_DECREF(ret);
+        } else if (PyList_CheckExact(item) || PyTuple_CheckExact(item) ||
+                PyDict_CheckExact(item)) {
+            if (depth == allocated) {
+                allocated *= 2;
+                if (frames == stack) {
+                    tmp = PyMem_Malloc(allocated * sizeof(EncodeFrame));
+                    if (tmp)
+                        memcpy(tmp, stack, sizeof(stack));
+                } else
+                    tmp = PyMem_Realloc(frames, allocated * sizeof(EncodeFrame));
+                if (!tmp) {
+                    PyErr_NoMemory();
+                    goto error;
+                }
+                frames = tmp;
+            }
+            frames[depth].value = NULL;
+            switch (frame_open(self, &buf, &frames[depth], item)) {
+                case 0:
+                    depth++;
+                    break;
+                case 1:
+                    break;
+                default:
+                    if (frames[depth].value)
+                        frame_close(self, &frames[depth]);
+                    goto error;
+            }
+        } else {
+            if (buffer_flush(self, &buf) == -1)
+                goto error;
+            if (Py_EnterRecursiveCall(" in CBOREncoder.encode"))
+                goto error;
+            ret = encode(self, item);
+            Py_LeaveRecursiveCall();
+            if (!ret)
+                goto error;
+            Py_DECREF(ret);
+        }
+        Py_CLEAR(item);
+    }
+    if (frames != stack)
+        PyMem_Free(frames);
+    if (buffer_flush(self, &buf) == -1)
+        return NULL;
     Py_RETURN_NONE;
+
+error:
+    Py_XDECREF(item);
+    while (depth)
+        frame_close(self, &frames[--depth]);
+    if (frames != stack)
+        PyMem_Free(frames);
+    return NULL;
+}
+
+
+// Packed encoding ///////////////////////////////////////////////////////////
+
+// With packed set, each top-level value is written as packed CBOR (tag 113):
+// a table of shared items followed by the value itself (the "rump") in which
+// repeated subtrees are replaced by references to those items. The first 16
+// items are referred to by the simple values 0 to 15, and the rest by tag 6
+// (see pack_reference). Only the shared item table is used; the argument
+// table (for prefix and suffix references) is always empty.
+//
+// The value is first scanned into a flat array of nodes in pre-order, each
+// with its plain encoding so that equal subtrees can be found. Occurrences of
+// each distinct subtree are then counted, skipping the contents of repeats
+// (which will become references themselves), and those worth sharing are
+// chosen and numbered so that no item refers to a later one. Finally the
+// nodes of the chosen subtrees are mapped to their items by address, which
+// CBOREncoder_encode consults for every value while the table and rump are
+// written
+
+typedef struct {
+    PyObject *value;    // borrowed from the top-level value
+    PyObject *key;      // the plain encoding of value
+    Py_ssize_t end;     // index of the node following value's subtree
+    Py_ssize_t item;    // index of the distinct subtree in the items
+} PackNode;
+
+typedef struct {
+    Py_ssize_t count;   // occurrences, excluding those within repeats
+    Py_ssize_t first;   // node of the first occurrence
+    Py_ssize_t index;   // shared item index, -1 if unshared (-2 if unnumbered)
+} PackItem;
+
+typedef struct {
+    PackNode *nodes;
+    Py_ssize_t nodes_len;
+    Py_ssize_t nodes_size;
+    PackItem *items;
+    Py_ssize_t items_len;
+    Py_ssize_t items_size;
+    PyObject *keys;     // maps plain encodings to indexes of items
+    Py_ssize_t *table;  // index of the item for each shared item
+    Py_ssize_t table_len;
+} PackState;
+
+
+// Grows the array *buf of *size elements of itemsize bytes to hold at least
+// one more than length
+static int
+pack_grow(void **buf, Py_ssize_t *size, const Py_ssize_t length,
+          const size_t itemsize)
+{
+    Py_ssize_t new_size;
+    void *tmp;
+
+    if (length < *size)
+        return 0;
+    new_size = *size ? *size * 2 : 64;
+    tmp = PyMem_Realloc(*buf, new_size * itemsize);
+    if (!tmp) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    *buf = tmp;
+    *size = new_size;
+    return 0;
 }
 
 
+// Returns the plain encoding of value, which is not scanned further
 static PyObject *
-encode_canonical_map_list(CBOREncoderObject *self, PyObject *list)
+pack_leaf(CBOREncoderObject *self, PyObject *value)
 {
-    PyObject *bytes, *ret;
-    Py_ssize_t index;
+    char buf[ARRAY_SHORT_STRING + 9];
+    int size;
+    PyObject *ret;
 
-    if (PyList_Sort(list) == -1)
-        return NULL;
-    if (encode_length(self, 5, PyList_GET_SIZE(list)) == -1)
+    size = pack_simple(self, value, buf);
+    if (size == -1)
         return NULL;
-    for (index = 0; index < PyList_GET_SIZE(list); ++index) {
-        // We already have the encoded form of the key so just write it out
-        bytes = PyTuple_GET_ITEM(PyList_GET_ITEM(list, index), 1);
-        if (fp_write(self, PyBytes_AS_STRING(bytes), PyBytes_GET_SIZE(bytes)) == -1)
-            return NULL;
-        ret = CBOREncoder_encode(self,
-                PyTuple_GET_ITEM(PyList_GET_ITEM(list, index), 3));
-        if (ret)
-            Py_DECREF(ret);
-        else
-            return NULL;
+    ret = size ?
+        PyBytes_FromStringAndSize(buf, size) :
+        CBOREncoder_encode_to_bytes(self, value);
+    // Simple values 0 to 15 and tag 6 would be read as references
+    if (ret && PyBytes_GET_SIZE(ret) && (
+            (PyBytes_AS_STRING(ret)[0] & 0xF0) == 0xE0 ||
+            PyBytes_AS_STRING(ret)[0] == '\xC6')) {
+        PyErr_Format(_CBOAR_CBOREncodeError,
+                "unable to pack %R (conflicts with packed references)", value);
+        Py_CLEAR(ret);
     }
-    Py_RETURN_NONE;
+    return ret;
 }
 
 
+// Returns the plain encoding of a container from its header (of major_tag
+// and length) and the encodings of its children, which are the nodes from
+// first to the end of the array
 static PyObject *
-dict_to_canonical_list(CBOREncoderObject *self, PyObject *value)
+pack_concat(PackState *state, const Py_ssize_t first, const uint8_t major_tag,
+            const Py_ssize_t length)
 {
-    PyObject *bytes, *length, *key, *val, *tuple, *ret, *list;
-    Py_ssize_t index, pos;
-
-    ret = list = PyList_New(PyDict_Size(value));
-    if (list) {
-        pos = 0;
-        index = 0;
-        while (ret && PyDict_Next(value, &pos, &key, &val)) {
-            Py_INCREF(key);
-            bytes = CBOREncoder_encode_to_bytes(self, key);
-            Py_DECREF(key);
-            if (bytes) {
-                length = PyLong_FromSsize_t(PyBytes_GET_SIZE(bytes));
-                if (length) {
-                    tuple = PyTuple_Pack(4, length, bytes, key, val);
-                    if (tuple)
-                        PyList_SET_ITEM(list, index, tuple); // steals ref
-                    else
-                        ret = NULL;
-                    index++;
-                    Py_DECREF(length);
-                } else
-                    ret = NULL;
-                Py_DECREF(bytes);
-            } else
-                ret = NULL;
+    PyObject *ret, *key;
+    Py_ssize_t i, size;
+    char header[9], *p;
+
+    size = pack_length(header, major_tag, length);
+    for (i = first; i < state->nodes_len; i = state->nodes[i].end)
+        size += PyBytes_GET_SIZE(state->nodes[i].key);
+    ret = PyBytes_FromStringAndSize(NULL, size);
+    if (ret) {
+        p = PyBytes_AS_STRING(ret);
+        size = pack_length(p, major_tag, length);
+        for (i = first; i < state->nodes_len; i = state->nodes[i].end) {
+            key = state->nodes[i].key;
+            memcpy(p + size, PyBytes_AS_STRING(key), PyBytes_GET_SIZE(key));
+            size += PyBytes_GET_SIZE(key);
         }
-        if (!ret)
-            Py_DECREF(list);
     }
     return ret;
 }
 
 
-static PyObject *
-mapping_to_canonical_list(CBOREncoderObject *self, PyObject *value)
+// Adds the node for value (and its subtree) to the state, returning its index
+// or -1 on error. Maps are concatenated in their iteration order even in the
+// canonical style; equal maps in different orders just aren't recognized as
+// equal, which costs nothing but the chance to share them
+static Py_ssize_t
+pack_scan(CBOREncoderObject *self, PackState *state, PyObject *value)
 {
-    PyObject **items, *map_items, *fast, *bytes, *length, *tuple, *ret, *list;
-    Py_ssize_t fast_len, index;
+    SharedEntry *entry;
+    PyObject **items, *fast, *key, *val, *item;
+    Py_ssize_t i, index, length, pos = 0;
+    uint8_t major_tag;
 
-    ret = list = PyList_New(PyMapping_Size(value));
-    if (list) {
-        map_items = PyMapping_Items(value);
-        if (map_items) {
-            fast = PySequence_Fast(map_items, "internal error");
-            if (fast) {
-                index = 0;
-                fast_len = PySequence_Fast_GET_SIZE(fast);
-                items = PySequence_Fast_ITEMS(fast);
-                while (ret && fast_len) {
-                    bytes = CBOREncoder_encode_to_bytes(self,
-                        PyTuple_GET_ITEM(*items, 0));
-                    if (bytes) {
-                        length = PyLong_FromSsize_t(PyBytes_GET_SIZE(bytes));
-                        if (length) {
-                            tuple = PyTuple_Pack(4,
-                                length, bytes,
-                                PyTuple_GET_ITEM(*items, 0),
-                                PyTuple_GET_ITEM(*items, 1));
-                            if (tuple)
-                                PyList_SET_ITEM(list, index, tuple); // steals ref
-                            else
-                                ret = NULL;
-                            Py_DECREF(length);
-                        } else
-                            ret = NULL;
-                        Py_DECREF(bytes);
-                    } else
-                        ret = NULL;
-                    items++;
-                    fast_len--;
-                }
-                Py_DECREF(fast);
-            } else
-                ret = NULL;
-            Py_DECREF(map_items);
-        } else
-            ret = NULL;
-        if (!ret)
-            Py_DECREF(list);
+    if (pack_grow((void **) &state->nodes, &state->nodes_size,
+                  state->nodes_len, sizeof(PackNode)) == -1)
+        return -1;
+    index = state->nodes_len++;
+    state->nodes[index].value = value;
+    state->nodes[index].key = NULL;
+    state->nodes[index].end = -1;
+
+    if (PyList_CheckExact(value) || PyTuple_CheckExact(value) ||
+            PyDict_CheckExact(value)) {
+        // Containers are tracked just as encode_shared does (without value
+        // sharing) to detect cycles
+        entry = shared_find(self, value);
+        if (!entry)
+            return -1;
+        if (entry->value) {
+            PyErr_SetString(
+                _CBOAR_CBOREncodeError,
+                "cyclic data structure detected but value_sharing is False");
+            return -1;
+        }
+        shared_add(self, entry, value);
+        if (Py_EnterRecursiveCall(" in CBOREncoder.encode")) {
+            shared_remove(self, value);
+            return -1;
+        }
+        key = NULL;
+        if (PyDict_CheckExact(value)) {
+            major_tag = 5;
+            length = PyDict_GET_SIZE(value);
+            while (PyDict_Next(value, &pos, &item, &val))
+                if (pack_scan(self, state, item) == -1 ||
+                        pack_scan(self, state, val) == -1)
+                    goto done;
+        } else {
+            major_tag = 4;
+            fast = PySequence_Fast(value, "argument must be iterable");
+            if (!fast)
+                goto done;
+            length = PySequence_Fast_GET_SIZE(fast);
+            items = PySequence_Fast_ITEMS(fast);
+            for (i = 0; i < length; ++i)
+                if (pack_scan(self, state, items[i]) == -1)
+                    break;
+            Py_DECREF(fast);
+            if (i < length)
+                goto done;
+        }
+        key = pack_concat(state, index + 1, major_tag, length);
+done:
+        Py_LeaveRecursiveCall();
+        shared_remove(self, value);
+    } else
+        key = pack_leaf(self, value);
+    if (!key)
+        return -1;
+    state->nodes[index].key = key;
+    state->nodes[index].end = state->nodes_len;
+
+    // Find (or add) the distinct subtree
+    item = PyDict_GetItemWithError(state->keys, key);
+    if (item)
+        state->nodes[index].item = PyLong_AsSsize_t(item);
+    else if (PyErr_Occurred())
+        return -1;
+    else {
+        if (pack_grow((void **) &state->items, &state->items_size,
+                      state->items_len, sizeof(PackItem)) == -1)
+            return -1;
+        item = PyLong_FromSsize_t(state->items_len);
+        if (!item)
+            return -1;
+        if (PyDict_SetItem(state->keys, key, item) == -1) {
+            Py_DECREF(item);
+            return -1;
+        }
+        Py_DECREF(item);
+        state->items[state->items_len].count = 0;
+        state->items[state->items_len].first = -1;
+        state->items[state->items_len].index = -1;
+        state->nodes[index].item = state->items_len++;
     }
-    return ret;
+    return index;
 }
 
 
-static PyObject *
-encode_canonical_map(CBOREncoderObject *self, PyObject *value)
+// Returns the size of a reference to shared item index
+static inline int
+pack_reference_size(const Py_ssize_t index)
 {
-    PyObject *list, *ret = NULL;
+    char buf[9];
 
-    if (PyDict_Check(value))
-        list = dict_to_canonical_list(self, value);
-    else
-        list = mapping_to_canonical_list(self, value);
-    if (list) {
-        ret = encode_canonical_map_list(self, list);
-        Py_DECREF(list);
-    }
-    return ret;
+    if (index < 16)
+        return 1;
+    return 1 + pack_length(buf, 0, (index - 16) / 2);
 }
 
 
-static PyObject *
-CBOREncoder_encode_canonical_map(CBOREncoderObject *self, PyObject *value)
+typedef struct {
+    Py_ssize_t count;
+    Py_ssize_t first;
+    Py_ssize_t item;
+} PackCandidate;
+
+static int
+pack_candidate_cmp(const void *a, const void *b)
 {
-    return encode_shared(self, &encode_canonical_map, value);
+    const PackCandidate *x = a, *y = b;
+
+    // Most frequent first, then in order of appearance
+    if (x->count != y->count)
+        return x->count > y->count ? -1 : 1;
+    return x->first < y->first ? -1 : x->first > y->first;
 }
 
 
-static PyObject *
-encode_canonical_set_list(CBOREncoderObject *self, PyObject *list)
+// Numbers the chosen item, after any chosen items within it
+static void
+pack_number(PackState *state, const Py_ssize_t item)
 {
-    PyObject *bytes;
-    Py_ssize_t index;
+    PackNode *nodes = state->nodes;
+    Py_ssize_t i, first = state->items[item].first, sub;
+
+    for (i = first + 1; i < nodes[first].end; ) {
+        sub = nodes[i].item;
+        if (state->items[sub].index == -2)
+            pack_number(state, sub);
+        i = state->items[sub].index >= 0 ? nodes[i].end : i + 1;
+    }
+    state->items[item].index = state->table_len;
+    state->table[state->table_len++] = item;
+}
 
-    if (PyList_Sort(list) == -1)
-        return NULL;
-    if (encode_length(self, 6, 258) == -1)
-        return NULL;
-    if (encode_length(self, 4, PyList_GET_SIZE(list)) == -1)
-        return NULL;
-    for (index = 0; index < PyList_GET_SIZE(list); ++index) {
-        // We already have the encoded form, so just write it out
-        bytes = PyTuple_GET_ITEM(PyList_GET_ITEM(list, index), 1);
-        if (fp_write(self, PyBytes_AS_STRING(bytes), PyBytes_GET_SIZE(bytes)) == -1)
-            return NULL;
+
+// Chooses and numbers the shared items, returning the number chosen (or -1
+// on error)
+static Py_ssize_t
+pack_choose(PackState *state)
+{
+    PackNode *nodes = state->nodes;
+    PackItem *item;
+    PackCandidate *candidates;
+    Py_ssize_t i, count = 0, chosen = 0, length, saved = 0;
+    char buf[9];
+
+    for (i = 0; i < state->nodes_len; ) {
+        item = &state->items[nodes[i].item];
+        if (item->count++) {
+            if (item->count == 2)
+                count++;
+            i = nodes[i].end;
+        } else {
+            item->first = i;
+            i++;
+        }
     }
-    Py_RETURN_NONE;
+    if (!count)
+        return 0;
+    candidates = PyMem_Malloc(count * sizeof(PackCandidate));
+    state->table = PyMem_Malloc(count * sizeof(Py_ssize_t));
+    if (!candidates || !state->table) {
+        PyMem_Free(candidates);
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (i = 0, count = 0; i < state->items_len; ++i) {
+        if (state->items[i].count > 1) {
+            candidates[count].count = state->items[i].count;
+            candidates[count].first = state->items[i].first;
+            candidates[count].item = i;
+            count++;
+        }
+    }
+    qsort(candidates, count, sizeof(PackCandidate), pack_candidate_cmp);
+    // An item saves a copy of its encoding for every occurrence after the
+    // first, but costs a reference for every occurrence
+    for (i = 0; i < count; ++i) {
+        length = PyBytes_GET_SIZE(nodes[candidates[i].first].key);
+        length = (candidates[i].count - 1) * length -
+            candidates[i].count * pack_reference_size(chosen);
+        if (length > 0) {
+            state->items[candidates[i].item].index = -2;
+            saved += length;
+            chosen++;
+        }
+    }
+    // The savings must also pay for the tag and the tables around the value
+    // (an estimate, as nested items save less than their full encoding)
+    if (chosen && saved <= 4 + pack_length(buf, 4, chosen)) {
+        for (i = 0; i < count; ++i)
+            state->items[candidates[i].item].index = -1;
+        chosen = 0;
+    }
+    for (i = 0; i < count; ++i)
+        if (state->items[candidates[i].item].index == -2)
+            pack_number(state, candidates[i].item);
+    PyMem_Free(candidates);
+    return chosen;
 }
 
 
-static PyObject *
-set_to_canonical_list(CBOREncoderObject *self, PyObject *value)
+// If value is a shared item that may be referenced (one written already),
+// writes a reference to it and returns 1; returns 0 otherwise and -1 on
+// error
+static int
+pack_reference(CBOREncoderObject *self, PyObject *value)
 {
-    PyObject *iter, *bytes, *length, *item, *tuple, *list, *ret;
+    PyObject *id, *item;
     Py_ssize_t index;
+    char buf[10];
+    int size;
 
-    ret = list = PyList_New(PySet_GET_SIZE(value));
-    if (list) {
-        iter = PyObject_GetIter(value);
-        if (iter) {
-            index = 0;
-            while (ret && (item = PyIter_Next(iter))) {
-                bytes = CBOREncoder_encode_to_bytes(self, item);
-                if (bytes) {
-                    length = PyLong_FromSsize_t(PyBytes_GET_SIZE(bytes));
-                    if (length) {
-                        tuple = PyTuple_Pack(3, length, bytes, item);
-                        if (tuple)
-                            PyList_SET_ITEM(list, index, tuple); // steals ref
-                        else
-                            ret = NULL;
-                        index++;
-                        Py_DECREF(length);
-                    } else
-                        ret = NULL;
-                    Py_DECREF(bytes);
-                } else
-                    ret = NULL;
-                Py_DECREF(item);
-            }
-            Py_DECREF(iter);
-        }
-        if (!ret)
-            Py_DECREF(list);
+    id = PyLong_FromVoidPtr(value);
+    if (!id)
+        return -1;
+    item = PyDict_GetItemWithError(self->pack_refs, id);
+    Py_DECREF(id);
+    if (!item)
+        return PyErr_Occurred() ? -1 : 0;
+    index = PyLong_AsSsize_t(item);
+    if (index >= self->pack_limit)
+        return 0;
+    if (index < 16) {
+        buf[0] = 0xE0 | index;
+        size = 1;
+    } else {
+        // An unsigned integer n refers to item 16 + 2n, and a negative
+        // integer -1 - n to item 17 + 2n
+        index -= 16;
+        buf[0] = '\xC6';
+        size = 1 + pack_length(buf + 1, index % 2, index / 2);
     }
-    return ret;
+    return fp_write(self, buf, size) == -1 ? -1 : 1;
 }
 
 
+// Maps the nodes of the chosen subtrees to their shared items
 static PyObject *
-encode_canonical_set(CBOREncoderObject *self, PyObject *value)
+pack_map(PackState *state)
 {
-    PyObject *list, *ret = NULL;
-
-    list = set_to_canonical_list(self, value);
-    if (list) {
-        ret = encode_canonical_set_list(self, list);
-        Py_DECREF(list);
+    PyObject *ret, *id, *index;
+    Py_ssize_t i, item;
+
+    ret = PyDict_New();
+    for (i = 0; ret && i < state->nodes_len; ++i) {
+        item = state->items[state->nodes[i].item].index;
+        if (item < 0)
+            continue;
+        id = PyLong_FromVoidPtr(state->nodes[i].value);
+        index = PyLong_FromSsize_t(item);
+        if (!id || !index || PyDict_SetItem(ret, id, index) == -1)
+            Py_CLEAR(ret);
+        Py_XDECREF(id);
+        Py_XDECREF(index);
     }
     return ret;
 }
 
 
 static PyObject *
-CBOREncoder_encode_canonical_set(CBOREncoderObject *self, PyObject *value)
+encode_packed(CBOREncoderObject *self, PyObject *value)
 {
-    return encode_shared(self, &encode_canonical_set, value);
+    PackState state = {0};
+    PyObject *ret = NULL, *tmp;
+    Py_ssize_t i, chosen;
+    bool save_namespace = self->string_namespace;
+
+    state.keys = PyDict_New();
+    if (!state.keys)
+        return NULL;
+    // The scan needs plain encodings, without string references
+    self->string_namespace = false;
+    i = pack_scan(self, &state, value);
+    self->string_namespace = save_namespace;
+    if (i == -1)
+        goto done;
+    chosen = pack_choose(&state);
+    if (chosen == -1)
+        goto done;
+    if (!chosen) {
+        // Nothing is worth sharing, so the value is written as usual
+        ret = self->engine == ENGINE_ITERATIVE ?
+            encode_iterative(self, value) : encode(self, value);
+        goto done;
+    }
+    self->pack_refs = pack_map(&state);
+    if (!self->pack_refs)
+        goto done;
+    if (encode_length(self, 6, 113) == 0 &&
+            encode_length(self, 4, 3) == 0 &&
+            encode_length(self, 4, chosen) == 0) {
+        // Items may only refer to those before them. The items within
+        // scanned subtrees are numbered accordingly, but others (such as
+        // the members of sets) are simply written in full
+        for (i = 0; i < chosen; ++i) {
+            self->pack_limit = i;
+            tmp = encode(self,
+                    state.nodes[state.items[state.table[i]].first].value);
+            if (!tmp)
+                break;
+            Py_DECREF(tmp);
+        }
+        self->pack_limit = chosen;
+        if (i == chosen && encode_length(self, 4, 0) == 0)
+            ret = encode(self, value);
+    }
+    Py_CLEAR(self->pack_refs);
+done:
+    for (i = 0; i < state.nodes_len; ++i)
+        Py_XDECREF(state.nodes[i].key);
+    PyMem_Free(state.nodes);
+    PyMem_Free(state.items);
+    PyMem_Free(state.table);
+    Py_DECREF(state.keys);
+    return ret;
 }
 
-
+
 // Main entry points /////////////////////////////////////////////////////////
 
 static inline PyObject *
@@ -1772,7 +4454,11 @@ encode(CBOREncoderObject *self, PyObject *value)
             // lookup type (or subclass) in self->encoders
             encoder = CBOREncoder_find_encoder(self, (PyObject *)Py_TYPE(value));
             if (encoder) {
-                if (encoder != Py_None)
+                // Compiled schemas are called directly rather than through
+                // their __call__
+                if (CBORSchema_CheckExact(encoder))
+                    ret = CBOREncoder_encode_record(self, encoder, value);
+                else if (encoder != Py_None)
                     ret = PyObject_CallFunctionObjArgs(
                             encoder, self, value, NULL);
                 else if (self->default_handler != Py_None)
@@ -1789,16 +4475,63 @@ encode(CBOREncoderObject *self, PyObject *value)
 }
 
 
+// Encodes the top-level value, within a stringref namespace and as packed
+// CBOR if enabled
+static PyObject *
+encode_top_level(CBOREncoderObject *self, PyObject *value)
+{
+    PyObject *ret = NULL;
+
+    if (self->string_referencing) {
+        if (encode_length(self, 6, 256) == -1)
+            return NULL;
+        self->string_namespace = true;
+    }
+    // Packing relies on the same tracking of containers as value sharing,
+    // and is only possible where the encoding of containers is known
+    if (self->packed && !self->value_sharing &&
+            (self->enc_style == 0 || self->enc_style == 1))
+        ret = encode_packed(self, value);
+    else if (self->engine == ENGINE_ITERATIVE)
+        ret = encode_iterative(self, value);
+    else
+        ret = encode(self, value);
+    if (self->string_namespace) {
+        self->string_namespace = false;
+        stringrefs_clear(self);
+    }
+    return ret;
+}
+
+
 // CBOREncoder.encode(self, value)
 PyObject *
 CBOREncoder_encode(CBOREncoderObject *self, PyObject *value)
 {
-    PyObject *ret;
+    PyObject *ret = NULL;
 
-    // TODO reset shared dict?
+    // Each top-level value has its own set of shared values
+    if (!self->nesting)
+        shared_clear(self);
     if (Py_EnterRecursiveCall(" in CBOREncoder.encode"))
         return NULL;
-    ret = encode(self, value);
+    if (!self->nesting++)
+        ret = encode_top_level(self, value);
+    else {
+        switch (self->pack_refs ? pack_reference(self, value) : 0) {
+            case 0:
+                if (self->engine == ENGINE_ITERATIVE)
+                    ret = encode_iterative(self, value);
+                else
+                    ret = encode(self, value);
+                break;
+            case 1:
+                Py_INCREF(Py_None);
+                ret = Py_None;
+                break;
+        }
+    }
+    self->nesting--;
     Py_LeaveRecursiveCall();
     return ret;
 }
@@ -1807,17 +4540,31 @@ CBOREncoder_encode(CBOREncoderObject *self, PyObject *value)
 static PyObject *
 CBOREncoder_encode_to_bytes(CBOREncoderObject *self, PyObject *value)
 {
-    PyObject *save_write, *buf, *ret = NULL;
+    PyObject *save_write, *save_refs, *buf, *ret = NULL;
+    CaptureBuffer *save_capture;
+    bool save_namespace;
 
     if (!_CBOAR_BytesIO && _CBOAR_init_BytesIO() == -1)
         return NULL;
 
+    // Strings (and packed items) within a nested value aren't referenced as
+    // the result may be written anywhere (or nowhere, as when sorting
+    // canonical keys)
     save_write = self->write;
+    save_namespace = self->string_namespace;
+    save_refs = self->pack_refs;
+    save_capture = self->capture;
     buf = PyObject_CallFunctionObjArgs(_CBOAR_BytesIO, NULL);
     if (buf) {
         self->write = PyObject_GetAttr(buf, _CBOAR_str_write);
         if (self->write) {
+            self->string_namespace = false;
+            self->pack_refs = NULL;
+            self->capture = NULL;
             ret = CBOREncoder_encode(self, value);
+            self->string_namespace = save_namespace;
+            self->pack_refs = save_refs;
+            self->capture = save_capture;
             if (ret) {
                 assert(ret == Py_None);
                 Py_DECREF(ret);
@@ -1831,6 +4578,34 @@ CBOREncoder_encode_to_bytes(CBOREncoderObject *self, PyObject *value)
     return ret;
 }
 
+
+// Encodes value with the output passed to sink (a callable such as a hash's
+// update method) instead of fp.write, in bytes objects of up to size bytes
+// (or larger bytes values as they are). Memory used is bounded by size
+// regardless of the length of the encoding
+PyObject *
+CBOREncoder_encode_to_sink(CBOREncoderObject *self, PyObject *value,
+                           PyObject *sink, Py_ssize_t size)
+{
+    CaptureBuffer chunk, *save_capture;
+    PyObject *ret;
+
+    chunk.data = PyMem_Malloc(size);
+    if (!chunk.data)
+        return PyErr_NoMemory();
+    chunk.used = 0;
+    chunk.size = size;
+    chunk.sink = sink;
+    save_capture = self->capture;
+    self->capture = &chunk;
+    ret = CBOREncoder_encode(self, value);
+    self->capture = save_capture;
+    if (ret && capture_flush(&chunk) == -1)
+        Py_CLEAR(ret);
+    PyMem_Free(chunk.data);
+    return ret;
+}
+
 
 // Encoder class definition //////////////////////////////////////////////////
 
@@ -1844,6 +4619,18 @@ static PyMemberDef CBOREncoder_members[] = {
         "the sub-type to use when encoding datetime objects"},
     {"value_sharing", T_BOOL, offsetof(CBOREncoderObject, value_sharing), 0,
         "if True, then efficiently encode recursive structures"},
+    {"float16_arrays", T_BOOL, offsetof(CBOREncoderObject, float16_arrays), 0,
+        "if True, then encode floating-point typed arrays at half-precision"},
+    {"string_referencing", T_BOOL,
+        offsetof(CBOREncoderObject, string_referencing), 0,
+        "if True, then encode repeated strings as references"},
+    {"packed", T_BOOL, offsetof(CBOREncoderObject, packed), 0,
+        "if True, then encode repeated values as packed CBOR references"},
+    {"columnar", T_BOOL, offsetof(CBOREncoderObject, columnar), 0,
+        "if True, then encode lists of similar records column by column"},
+    {"deterministic", T_BOOL, offsetof(CBOREncoderObject, deterministic),
+        READONLY, "if True, then follow the RFC 8949 deterministic encoding "
+        "requirements"},
     {NULL}
 };
 
@@ -1857,6 +4644,13 @@ static PyGetSetDef CBOREncoder_getsetters[] = {
     {"timezone",
         (getter) _CBOREncoder_get_timezone, (setter) _CBOREncoder_set_timezone,
         "the timezone to use when encoding naive datetime objects", NULL},
+    {"shared",
+        (getter) _CBOREncoder_get_shared, NULL,
+        "a snapshot of the values tracked for value sharing (read-only)",
+        NULL},
+    {"engine",
+        (getter) _CBOREncoder_get_engine, (setter) _CBOREncoder_set_engine,
+        "the encoding engine to use ('stream' or 'iterative')", NULL},
     {NULL}
 };
 
@@ -1897,6 +4691,22 @@ static PyMethodDef CBOREncoder_methods[] = {
         "encode the specified sequence *value* to the output"},
     {"encode_map", (PyCFunction) CBOREncoder_encode_map, METH_O,
         "encode the specified mapping *value* to the output"},
+    {"encode_iter", (PyCFunction) CBOREncoder_encode_iter, METH_O,
+        "encode the items of the specified iterable *value* to the output "
+        "as an indefinite-length array, consuming them one at a time"},
+    {"encode_items", (PyCFunction) CBOREncoder_encode_items, METH_O,
+        "encode the (key, value) pairs of the specified iterable *value* to "
+        "the output as an indefinite-length map, consuming them one at a "
+        "time"},
+    {"begin_array", (PyCFunction) CBOREncoder_begin_array, METH_NOARGS,
+        "start an indefinite-length array in the output; subsequently "
+        "encoded values are its items until end() is called"},
+    {"begin_map", (PyCFunction) CBOREncoder_begin_map, METH_NOARGS,
+        "start an indefinite-length map in the output; subsequently encoded "
+        "values are its alternating keys and values until end() is called"},
+    {"end", (PyCFunction) CBOREncoder_end, METH_NOARGS,
+        "close the innermost array or map started by begin_array() or "
+        "begin_map()"},
     {"encode_semantic", (PyCFunction) CBOREncoder_encode_semantic, METH_O,
         "encode the specified CBORTag to the output"},
     {"encode_simple", (PyCFunction) CBOREncoder_encode_simple, METH_O,
@@ -1917,6 +4727,9 @@ static PyMethodDef CBOREncoder_methods[] = {
         "encode the specified IPv4 or IPv6 address to the output"},
     {"encode_ipnetwork", (PyCFunction) CBOREncoder_encode_ipnetwork, METH_O,
         "encode the specified IPv4 or IPv6 network prefix to the output"},
+    {"encode_typed_array", (PyCFunction) CBOREncoder_encode_typed_array, METH_O,
+        "encode the specified array or buffer to the output as an RFC 8746 "
+        "typed array"},
     {"encode_shared", (PyCFunction) CBOREncoder_encode_shared, METH_VARARGS,
         "encode the specified CBORTag to the output"},
     // Canonical encoding methods
@@ -1966,6 +4779,39 @@ PyDoc_STRVAR(CBOREncoder__doc__,
 "    value), ignores the optimized tables and relies entirely on the\n"
 "    :attr:`encoders` dict to lookup encoding methods (note: this is\n"
 "    considerably slower but the most flexible option)\n"
+":param bool float16_arrays:\n"
+"    set to ``True`` to encode single and double-precision typed arrays\n"
+"    (e.g. :class:`array.array` of ``'f'`` or ``'d'``) as half-precision\n"
+"    typed arrays; values are rounded to the nearest half-precision value\n"
+"    (out of range values become infinite) so this is lossy\n"
+":param str engine:\n"
+"    ``'stream'`` (the default) encodes containers recursively;\n"
+"    ``'iterative'`` encodes lists, tuples, and dicts with an explicit\n"
+"    stack so they may be nested to any depth (and is usually faster on\n"
+"    nested data); the output is identical\n"
+":param bool string_referencing:\n"
+"    set to ``True`` to wrap each top-level value in a stringref namespace\n"
+"    (tag 256) and encode repeated text and byte strings within it as\n"
+"    references (tag 25) to their first occurrence\n"
+":param bool packed:\n"
+"    set to ``True`` to encode each top-level value as packed CBOR (tag\n"
+"    113), in which repeated values (strings, numbers, or whole lists and\n"
+"    dicts) are written once in a table and referred to thereafter; this\n"
+"    is ignored with *value_sharing* or a custom *enc_style*\n"
+":param bool columnar:\n"
+"    set to ``True`` to encode lists of records which all have the same\n"
+"    keys (dicts, or values with a compiled schema) as a list of the keys\n"
+"    followed by a list of the values of each key, in a private tag which\n"
+"    the decoder turns back into the list of records; numeric columns are\n"
+"    written as typed arrays. This is ignored with *value_sharing*,\n"
+"    *packed*, or any style but the regular one\n"
+":param bool deterministic:\n"
+"    set to ``True`` to produce the core deterministic encoding of RFC\n"
+"    8949 (section 4.2.1); this implies *canonical*, but orders map keys\n"
+"    (and set items) bytewise on their encoded form rather than shortest\n"
+"    first, rejects keys which encode identically, writes timestamps as\n"
+"    minimal floats, and refuses timestamps which would depend on the\n"
+"    local timezone\n"
 "\n"
 ".. _CBOR: https://cbor.io/\n"
 );
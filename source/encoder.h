@@ -2,23 +2,62 @@
 #include <Python.h>
 #include <stdbool.h>
 
-// Constants for decimal_classify
-#define DC_NORMAL 0
-#define DC_INFINITE 1
-#define DC_NAN 2
-#define DC_ERROR -1
+// An entry in the table of containers seen by the encoder, keyed on the
+// object's address. With value sharing, index is the value's position in the
+// shared values and the table holds a reference to it; otherwise index is -1
+// and the entry only lasts while the container is being encoded
+typedef struct {
+    PyObject *value;
+    Py_ssize_t index;
+} SharedEntry;
+
+// An entry in the table of strings emitted in the current stringref
+// namespace, keyed on the string's value. Only exact str and bytes objects
+// are stored (holding a reference); index is the string's position in the
+// namespace
+typedef struct {
+    PyObject *value;
+    Py_hash_t hash;
+    Py_ssize_t index;
+} StringRefEntry;
+
+// Output gathered in memory instead of being written to fp; see fp_write
+typedef struct {
+    char *data;
+    Py_ssize_t used;
+    Py_ssize_t size;
+    PyObject *sink;  // when set, the full buffer is passed here, not grown
+} CaptureBuffer;
 
 typedef struct {
     PyObject_HEAD
     PyObject *write;    // cached write() method of fp
     PyObject *encoders;
     PyObject *default_handler;
-    PyObject *shared;
     PyObject *timezone;
     PyObject *shared_handler;
     uint8_t enc_style;  // 0=regular, 1=canonical, 2=custom
     bool timestamp_format;
     bool value_sharing;
+    bool float16_arrays;
+    bool string_referencing;
+    bool string_namespace; // true while strings may be referenced
+    bool packed;
+    bool columnar;
+    bool deterministic;  // canonical style, with RFC 8949 key order
+    uint8_t engine;
+    SharedEntry *shared;  // open-addressed, sized to a power of 2
+    size_t shared_mask;
+    size_t shared_count;
+    Py_ssize_t nesting;   // depth of calls to encode; 0 at the top level
+    Py_ssize_t streaming; // containers left open by begin_array/begin_map
+    StringRefEntry *stringrefs;  // open-addressed, sized to a power of 2
+    size_t stringrefs_mask;
+    size_t stringrefs_count;
+    Py_ssize_t stringrefs_next;  // index of the next string in the namespace
+    PyObject *pack_refs;  // maps id() of values to packed items, while packing
+    Py_ssize_t pack_limit;  // number of packed items that may be referenced
+    CaptureBuffer *capture; // while set, output is appended here
 } CBOREncoderObject;
 
 PyTypeObject CBOREncoderType;
@@ -26,3 +65,5 @@ PyTypeObject CBOREncoderType;
 PyObject * CBOREncoder_new(PyTypeObject *, PyObject *, PyObject *);
 int CBOREncoder_init(CBOREncoderObject *, PyObject *, PyObject *);
 PyObject * CBOREncoder_encode(CBOREncoderObject *, PyObject *);
+PyObject * CBOREncoder_encode_to_sink(CBOREncoderObject *, PyObject *, PyObject *, Py_ssize_t);
+PyObject * CBOREncoder_encode_record(CBOREncoderObject *, PyObject *, PyObject *);
@@ -1,9 +1,18 @@
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include <math.h>
 #include <endian.h>
 #include "halffloat.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HALF_F16C
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define HALF_NEON
+#include <arm_neon.h>
+#endif
+
 
 // Based upon ftp://ftp.fox-toolkit.org/pub/fasthalffloatconversion.pdf ("Fast
 // Half Float Conversions") referenced by the Wikipedia article on
@@ -310,7 +319,7 @@ static const uint16_t basetable[] = {
     0x0200, 0x0400, 0x0800, 0x0c00, 0x1000, 0x1400, 0x1800, 0x1c00,
     0x2000, 0x2400, 0x2800, 0x2c00, 0x3000, 0x3400, 0x3800, 0x3c00,
     0x4000, 0x4400, 0x4800, 0x4c00, 0x5000, 0x5400, 0x5800, 0x5c00,
-    0x6000, 0x6400, 0x6800, 0x6c00, 0x7000, 0x7400, 0x7c00, 0x7c00,
+    0x6000, 0x6400, 0x6800, 0x6c00, 0x7000, 0x7400, 0x7800, 0x7c00,
     0x7c00, 0x7c00, 0x7c00, 0x7c00, 0x7c00, 0x7c00, 0x7c00, 0x7c00,
     0x7c00, 0x7c00, 0x7c00, 0x7c00, 0x7c00, 0x7c00, 0x7c00, 0x7c00,
     0x7c00, 0x7c00, 0x7c00, 0x7c00, 0x7c00, 0x7c00, 0x7c00, 0x7c00,
@@ -342,7 +351,7 @@ static const uint16_t basetable[] = {
     0x8200, 0x8400, 0x8800, 0x8c00, 0x9000, 0x9400, 0x9800, 0x9c00,
     0xa000, 0xa400, 0xa800, 0xac00, 0xb000, 0xb400, 0xb800, 0xbc00,
     0xc000, 0xc400, 0xc800, 0xcc00, 0xd000, 0xd400, 0xd800, 0xdc00,
-    0xe000, 0xe400, 0xe800, 0xec00, 0xf000, 0xf400, 0xfc00, 0xfc00,
+    0xe000, 0xe400, 0xe800, 0xec00, 0xf000, 0xf400, 0xf800, 0xfc00,
     0xfc00, 0xfc00, 0xfc00, 0xfc00, 0xfc00, 0xfc00, 0xfc00, 0xfc00,
     0xfc00, 0xfc00, 0xfc00, 0xfc00, 0xfc00, 0xfc00, 0xfc00, 0xfc00,
     0xfc00, 0xfc00, 0xfc00, 0xfc00, 0xfc00, 0xfc00, 0xfc00, 0xfc00,
@@ -377,7 +386,7 @@ static const uint16_t shifttable[] = {
     0x000e, 0x000d, 0x000d, 0x000d, 0x000d, 0x000d, 0x000d, 0x000d,
     0x000d, 0x000d, 0x000d, 0x000d, 0x000d, 0x000d, 0x000d, 0x000d,
     0x000d, 0x000d, 0x000d, 0x000d, 0x000d, 0x000d, 0x000d, 0x000d,
-    0x000d, 0x000d, 0x000d, 0x000d, 0x000d, 0x000d, 0x0018, 0x0018,
+    0x000d, 0x000d, 0x000d, 0x000d, 0x000d, 0x000d, 0x000d, 0x0018,
     0x0018, 0x0018, 0x0018, 0x0018, 0x0018, 0x0018, 0x0018, 0x0018,
     0x0018, 0x0018, 0x0018, 0x0018, 0x0018, 0x0018, 0x0018, 0x0018,
     0x0018, 0x0018, 0x0018, 0x0018, 0x0018, 0x0018, 0x0018, 0x0018,
@@ -409,7 +418,7 @@ static const uint16_t shifttable[] = {
     0x000e, 0x000d, 0x000d, 0x000d, 0x000d, 0x000d, 0x000d, 0x000d,
     0x000d, 0x000d, 0x000d, 0x000d, 0x000d, 0x000d, 0x000d, 0x000d,
     0x000d, 0x000d, 0x000d, 0x000d, 0x000d, 0x000d, 0x000d, 0x000d,
-    0x000d, 0x000d, 0x000d, 0x000d, 0x000d, 0x000d, 0x0018, 0x0018,
+    0x000d, 0x000d, 0x000d, 0x000d, 0x000d, 0x000d, 0x000d, 0x0018,
     0x0018, 0x0018, 0x0018, 0x0018, 0x0018, 0x0018, 0x0018, 0x0018,
     0x0018, 0x0018, 0x0018, 0x0018, 0x0018, 0x0018, 0x0018, 0x0018,
     0x0018, 0x0018, 0x0018, 0x0018, 0x0018, 0x0018, 0x0018, 0x0018,
@@ -467,3 +476,211 @@ uint16_t pack_float16(float f) {
     ret = basetable[in.exp] + (in.sig >> shifttable[in.exp]);
     return htobe16(ret);
 }
+
+
+// Bulk conversions //////////////////////////////////////////////////////////
+
+// Typed arrays of half-floats are converted in bulk: with F16C on x86 (where
+// it must be detected at runtime), with the native fp16 conversions of
+// AArch64, and otherwise with the tables above. The hardware rounds to
+// nearest-even when narrowing, which the table method above does not (it
+// truncates), so the scalar packing routine here does its own rounding to
+// give identical output on every platform
+
+static uint16_t pack_float16_rounded(float f) {
+    uint32_t in, sign;
+    uint16_t ret;
+    float denorm;
+
+    memcpy(&in, &f, sizeof(float));
+    sign = in & 0x80000000u;
+    in ^= sign;
+    if (in >= 0x47800000u) {
+        // Overflow (including infinity) or NaN
+        ret = in > 0x7f800000u ? 0x7e00 | ((in >> 13) & 0x3ff) : 0x7c00;
+    } else if (in < 0x38800000u) {
+        // Sub-normal result; adding a magic value shifts the significand into
+        // place letting the FPU round it
+        memcpy(&denorm, &in, sizeof(float));
+        denorm += 0.5f;
+        memcpy(&in, &denorm, sizeof(float));
+        ret = in - 0x3f000000u;
+    } else {
+        // Normal result; re-bias the exponent and round to nearest-even
+        in += 0xc8000fffu + ((in >> 13) & 1);
+        ret = in >> 13;
+    }
+    return ret | (sign >> 16);
+}
+
+
+static void unpack_float16_scalar(float *dest, const uint16_t *src,
+                                  size_t count, bool big_endian) {
+    uint16_t value;
+    size_t i;
+
+    // unpack_float16 expects the in-memory value of a big-endian half
+    for (i = 0; i < count; ++i) {
+        memcpy(&value, src + i, sizeof(uint16_t));
+        dest[i] = unpack_float16(big_endian ? value : htobe16(le16toh(value)));
+    }
+}
+
+
+static void pack_float16_scalar(uint16_t *dest, const float *src,
+                                size_t count, bool big_endian) {
+    uint16_t value;
+    size_t i;
+
+    for (i = 0; i < count; ++i) {
+        value = pack_float16_rounded(src[i]);
+        value = big_endian ? htobe16(value) : htole16(value);
+        memcpy(dest + i, &value, sizeof(uint16_t));
+    }
+}
+
+
+typedef void (unpack_func)(float *, const uint16_t *, size_t, bool);
+typedef void (pack_func)(uint16_t *, const float *, size_t, bool);
+
+#if defined(HALF_F16C)
+
+// F16C converts eight values at a time; big-endian input is byte-swapped
+// first (the AVX target implies SSSE3 for the shuffle)
+
+#define SHUFFLE_16 \
+    1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14
+
+__attribute__((target("avx,f16c")))
+static void unpack_float16_f16c(float *dest, const uint16_t *src,
+                                size_t count, bool big_endian) {
+    const __m128i mask = _mm_setr_epi8(SHUFFLE_16);
+    __m128i half;
+    size_t i;
+
+    for (i = 0; i + 8 <= count; i += 8) {
+        half = _mm_loadu_si128((const __m128i *) (src + i));
+        if (big_endian)
+            half = _mm_shuffle_epi8(half, mask);
+        _mm256_storeu_ps(dest + i, _mm256_cvtph_ps(half));
+    }
+    unpack_float16_scalar(dest + i, src + i, count - i, big_endian);
+}
+
+
+__attribute__((target("avx,f16c")))
+static void pack_float16_f16c(uint16_t *dest, const float *src,
+                              size_t count, bool big_endian) {
+    const __m128i mask = _mm_setr_epi8(SHUFFLE_16);
+    __m128i half;
+    size_t i;
+
+    for (i = 0; i + 8 <= count; i += 8) {
+        half = _mm256_cvtps_ph(_mm256_loadu_ps(src + i),
+                _MM_FROUND_TO_NEAREST_INT);
+        if (big_endian)
+            half = _mm_shuffle_epi8(half, mask);
+        _mm_storeu_si128((__m128i *) (dest + i), half);
+    }
+    pack_float16_scalar(dest + i, src + i, count - i, big_endian);
+}
+
+#undef SHUFFLE_16
+
+static bool have_f16c(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+}
+
+static unpack_func *select_unpack(void) {
+    return have_f16c() ? unpack_float16_f16c : unpack_float16_scalar;
+}
+
+static pack_func *select_pack(void) {
+    return have_f16c() ? pack_float16_f16c : pack_float16_scalar;
+}
+
+#elif defined(HALF_NEON)
+
+static void unpack_float16_neon(float *dest, const uint16_t *src,
+                                size_t count, bool big_endian) {
+    uint16x4_t half;
+    size_t i;
+
+    for (i = 0; i + 4 <= count; i += 4) {
+        half = vld1_u16(src + i);
+        if (big_endian)
+            half = vreinterpret_u16_u8(vrev16_u8(vreinterpret_u8_u16(half)));
+        vst1q_f32(dest + i, vcvt_f32_f16(vreinterpret_f16_u16(half)));
+    }
+    unpack_float16_scalar(dest + i, src + i, count - i, big_endian);
+}
+
+
+static void pack_float16_neon(uint16_t *dest, const float *src,
+                              size_t count, bool big_endian) {
+    uint16x4_t half;
+    size_t i;
+
+    for (i = 0; i + 4 <= count; i += 4) {
+        half = vreinterpret_u16_f16(vcvt_f16_f32(vld1q_f32(src + i)));
+        if (big_endian)
+            half = vreinterpret_u16_u8(vrev16_u8(vreinterpret_u8_u16(half)));
+        vst1_u16(dest + i, half);
+    }
+    pack_float16_scalar(dest + i, src + i, count - i, big_endian);
+}
+
+static unpack_func *select_unpack(void) {
+    return unpack_float16_neon;
+}
+
+static pack_func *select_pack(void) {
+    return pack_float16_neon;
+}
+
+#else
+
+static unpack_func *select_unpack(void) {
+    return unpack_float16_scalar;
+}
+
+static pack_func *select_pack(void) {
+    return pack_float16_scalar;
+}
+
+#endif
+
+
+// As in byteswap.c, the implementation is selected on first use by replacing
+// the function pointer through which the public routines call
+
+static void unpack_float16_init(float *, const uint16_t *, size_t, bool);
+static void pack_float16_init(uint16_t *, const float *, size_t, bool);
+static unpack_func *unpack_float16_impl = unpack_float16_init;
+static pack_func *pack_float16_impl = pack_float16_init;
+
+static void unpack_float16_init(float *dest, const uint16_t *src,
+                                size_t count, bool big_endian) {
+    unpack_float16_impl = select_unpack();
+    unpack_float16_impl(dest, src, count, big_endian);
+}
+
+
+static void pack_float16_init(uint16_t *dest, const float *src,
+                              size_t count, bool big_endian) {
+    pack_float16_impl = select_pack();
+    pack_float16_impl(dest, src, count, big_endian);
+}
+
+
+void unpack_float16_array(float *dest, const void *src, size_t count,
+                          bool big_endian) {
+    unpack_float16_impl(dest, src, count, big_endian);
+}
+
+
+void pack_float16_array(void *dest, const float *src, size_t count,
+                        bool big_endian) {
+    pack_float16_impl(dest, src, count, big_endian);
+}
@@ -1,4 +1,16 @@
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 float unpack_float16(uint16_t);
 uint16_t pack_float16(float f);
+
+// Convert count IEEE754 16-bit values (stored big or little-endian) at src
+// into single-precision floats at dest
+void unpack_float16_array(float *dest, const void *src, size_t count,
+                          bool big_endian);
+// Convert count single-precision floats at src into IEEE754 16-bit values
+// (stored big or little-endian) at dest, rounding to nearest-even; overflow
+// returns infinity and NaNs are quietened
+void pack_float16_array(void *dest, const float *src, size_t count,
+                        bool big_endian);
@@ -1,10 +1,12 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 #include <datetime.h>
+#include <unistd.h>
 #include "module.h"
 #include "tags.h"
 #include "encoder.h"
 #include "decoder.h"
+#include "schema.h"
 
 
 // Some notes on conventions in this code. All methods conform to a couple of
@@ -280,6 +282,111 @@ CBOAR_dumps(PyObject *module, PyObject *args, PyObject *kwargs)
 }
 
 
+// Output is hashed in chunks of this size, so memory use doesn't grow with
+// the size of the value being digested
+#define DIGEST_CHUNK_SIZE 65536
+
+static PyObject *
+CBOAR_digest(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    PyObject *obj = NULL, *algorithm = NULL, *hasher = NULL, *update, *fp,
+             *enc_args, *ret = NULL;
+    CBOREncoderObject *self;
+
+    // digest(obj, algorithm='sha256', canonical=True, **kwargs); the other
+    // keyword arguments are passed to the encoder
+    if (PyTuple_GET_SIZE(args) > 2) {
+        PyErr_SetString(PyExc_TypeError,
+                "digest takes at most 2 positional arguments");
+        return NULL;
+    }
+    kwargs = kwargs ? PyDict_Copy(kwargs) : PyDict_New();
+    if (!kwargs)
+        return NULL;
+    if (PyTuple_GET_SIZE(args) > 0) {
+        obj = PyTuple_GET_ITEM(args, 0);
+        Py_INCREF(obj);
+    } else {
+        obj = PyDict_GetItem(kwargs, _CBOAR_str_obj);
+        if (!obj) {
+            PyErr_SetString(PyExc_TypeError,
+                    "digest missing 1 required argument: 'obj'");
+            goto out;
+        }
+        Py_INCREF(obj);
+        if (PyDict_DelItem(kwargs, _CBOAR_str_obj) == -1)
+            goto out;
+    }
+    if (PyTuple_GET_SIZE(args) > 1) {
+        algorithm = PyTuple_GET_ITEM(args, 1);
+        Py_INCREF(algorithm);
+    } else {
+        algorithm = PyDict_GetItem(kwargs, _CBOAR_str_algorithm);
+        if (algorithm) {
+            Py_INCREF(algorithm);
+            if (PyDict_DelItem(kwargs, _CBOAR_str_algorithm) == -1)
+                goto out;
+        } else {
+            algorithm = _CBOAR_str_sha256;
+            Py_INCREF(algorithm);
+        }
+    }
+    if (!PyDict_GetItem(kwargs, _CBOAR_str_canonical) &&
+            PyDict_SetItem(kwargs, _CBOAR_str_canonical, Py_True) == -1)
+        goto out;
+
+    // algorithm is either the name of a hashlib algorithm, or a constructor
+    // (like hashlib.blake2b) for the hash object to use
+    if (PyUnicode_Check(algorithm)) {
+        if (!_CBOAR_hashlib_new && _CBOAR_init_hashlib_new() == -1)
+            goto out;
+        hasher = PyObject_CallFunctionObjArgs(
+                _CBOAR_hashlib_new, algorithm, NULL);
+    } else
+        hasher = PyObject_CallFunctionObjArgs(algorithm, NULL);
+    if (!hasher)
+        goto out;
+    update = PyObject_GetAttr(hasher, _CBOAR_str_update);
+    if (!update)
+        goto out;
+
+    // The encoder requires a file-like object, but with its output passed to
+    // the hash nothing is ever written to it
+    if (!_CBOAR_BytesIO && _CBOAR_init_BytesIO() == -1)
+        fp = NULL;
+    else
+        fp = PyObject_CallFunctionObjArgs(_CBOAR_BytesIO, NULL);
+    if (fp) {
+        enc_args = PyTuple_Pack(1, fp);
+        if (enc_args) {
+            self = (CBOREncoderObject *)CBOREncoder_new(
+                    &CBOREncoderType, NULL, NULL);
+            if (self) {
+                if (CBOREncoder_init(self, enc_args, kwargs) == 0) {
+                    ret = CBOREncoder_encode_to_sink(
+                            self, obj, update, DIGEST_CHUNK_SIZE);
+                    if (ret) {
+                        Py_DECREF(ret);
+                        ret = PyObject_CallMethodObjArgs(
+                                hasher, _CBOAR_str_digest, NULL);
+                    }
+                }
+                Py_DECREF(self);
+            }
+            Py_DECREF(enc_args);
+        }
+        Py_DECREF(fp);
+    }
+    Py_DECREF(update);
+out:
+    Py_XDECREF(hasher);
+    Py_XDECREF(algorithm);
+    Py_XDECREF(obj);
+    Py_DECREF(kwargs);
+    return ret;
+}
+
+
 static PyObject *
 CBOAR_load(PyObject *module, PyObject *args, PyObject *kwargs)
 {
@@ -344,6 +451,7 @@ CBOAR_loads(PyObject *module, PyObject *args, PyObject *kwargs)
         // no need to dec. ref fp here because SET_ITEM above stole the ref
     }
     Py_DECREF(new_args);
+    Py_DECREF(buf);
     return ret;
 error:
     Py_DECREF(buf);
@@ -351,6 +459,164 @@ error:
 }
 
 
+static int
+loads_many_set_options(CBORDecoderObject *decoder, PyObject *tag_hook,
+                       PyObject *object_hook, PyObject *str_errors)
+{
+    if (tag_hook && PyObject_SetAttr(
+                (PyObject *) decoder, _CBOAR_str_tag_hook, tag_hook) == -1)
+        return -1;
+    if (object_hook && PyObject_SetAttr(
+                (PyObject *) decoder, _CBOAR_str_object_hook, object_hook) == -1)
+        return -1;
+    if (str_errors && PyObject_SetAttr(
+                (PyObject *) decoder, _CBOAR_str_str_errors, str_errors) == -1)
+        return -1;
+    return 0;
+}
+
+
+static PyObject *
+loads_many(CBORDecoderObject *decoder, Py_buffer *views, Py_ssize_t count,
+           int threads)
+{
+    // Worker threads scan each buffer into a tape without the GIL while
+    // this thread decodes the tapes, in order, as they become available
+    Tape *tapes;
+    TapeBatch *batch;
+    PyObject *value, *ret;
+    Py_ssize_t i;
+    int result;
+
+    tapes = PyMem_Malloc(count * sizeof(Tape) + 1);
+    if (!tapes)
+        return PyErr_NoMemory();
+    for (i = 0; i < count; ++i)
+        tape_init(&tapes[i], views[i].buf, views[i].len);
+    ret = PyList_New(count);
+    if (ret) {
+        batch = tape_batch_new(tapes, count, threads);
+        if (batch) {
+            for (i = 0; ret && i < count; ++i) {
+                Py_BEGIN_ALLOW_THREADS
+                result = tape_batch_wait(batch, i);
+                Py_END_ALLOW_THREADS
+                if (result == TAPE_OK) {
+                    // Each message has its own set of shared values; see
+                    // CBORDecoder_decode_tape
+                    value = CBORDecoder_decode_tape(decoder, &tapes[i]);
+                } else {
+                    value = NULL;
+                    if (result == TAPE_NOMEM)
+                        PyErr_NoMemory();
+                    else
+                        PyErr_SetString(
+                            _CBOAR_CBORDecodeError, tapes[i].error);
+                }
+                tape_free(&tapes[i]);
+                if (value)
+                    PyList_SET_ITEM(ret, i, value);
+                else
+                    Py_CLEAR(ret);
+            }
+            Py_BEGIN_ALLOW_THREADS
+            tape_batch_free(batch);
+            Py_END_ALLOW_THREADS
+        } else {
+            PyErr_NoMemory();
+            Py_CLEAR(ret);
+        }
+    }
+    for (i = 0; i < count; ++i)
+        tape_free(&tapes[i]);
+    PyMem_Free(tapes);
+    return ret;
+}
+
+
+static PyObject *
+CBOAR_loads_many(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {
+        "buffers", "threads", "tag_hook", "object_hook", "str_errors", NULL
+    };
+    PyObject *buffers, *fast, *threads_obj = Py_None, *tag_hook = NULL,
+             *object_hook = NULL, *str_errors = NULL, *ret = NULL;
+    CBORDecoderObject *decoder;
+    Py_buffer *views;
+    Py_ssize_t i, count;
+    long threads;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OOOO", keywords,
+                &buffers, &threads_obj, &tag_hook, &object_hook, &str_errors))
+        return NULL;
+    if (threads_obj == Py_None)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    else {
+        threads = PyLong_AsLong(threads_obj);
+        if (threads == -1 && PyErr_Occurred())
+            return NULL;
+        if (threads < 0 || threads > INT_MAX) {
+            PyErr_Format(PyExc_ValueError,
+                    "invalid threads value %R (must be 0 or more)",
+                    threads_obj);
+            return NULL;
+        }
+    }
+
+    fast = PySequence_Fast(buffers, "buffers must be iterable");
+    if (!fast)
+        return NULL;
+    count = PySequence_Fast_GET_SIZE(fast);
+    // The buffers are exported for the duration so that none of them can be
+    // resized while the workers are scanning them
+    views = PyMem_Calloc(count + 1, sizeof(Py_buffer));
+    if (views) {
+        for (i = 0; i < count; ++i)
+            if (PyObject_GetBuffer(PySequence_Fast_GET_ITEM(fast, i),
+                        &views[i], PyBUF_SIMPLE) == -1)
+                break;
+        if (i == count) {
+            decoder = (CBORDecoderObject *)
+                CBORDecoder_new(&CBORDecoderType, NULL, NULL);
+            if (decoder) {
+                if (loads_many_set_options(
+                            decoder, tag_hook, object_hook, str_errors) == 0)
+                    ret = loads_many(decoder, views, count,
+                                     threads > 0 ? threads : 0);
+                Py_DECREF(decoder);
+            }
+        }
+        while (i--)
+            PyBuffer_Release(&views[i]);
+        PyMem_Free(views);
+    } else
+        PyErr_NoMemory();
+    Py_DECREF(fast);
+    return ret;
+}
+
+
+static PyObject *
+CBOAR_compile_schema(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {"type", "fields", "register", NULL};
+    PyObject *type, *fields = Py_None, *ret;
+    int reg = 1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O!|Op", keywords,
+                &PyType_Type, &type, &fields, &reg))
+        return NULL;
+    ret = CBORSchema_New((PyTypeObject *) type, fields);
+    // Registering in the default encoders makes the schema available to
+    // every encoder created subsequently
+    if (ret && reg &&
+            PyObject_SetItem(_CBOAR_default_encoders, type, ret) == -1)
+        Py_CLEAR(ret);
+    return ret;
+}
+
+
 // Cache-init functions //////////////////////////////////////////////////////
 
 int
@@ -459,8 +725,7 @@ _CBOAR_init_re_compile(void)
 {
     PyObject *re;
 
-    // import re
-    // datestr_re = re.compile("long-date-time-regex...")
+    // from re import compile
     re = PyImport_ImportModule("re");
     if (!re)
         goto error;
@@ -468,10 +733,6 @@ _CBOAR_init_re_compile(void)
     Py_DECREF(re);
     if (!_CBOAR_re_compile)
         goto error;
-    _CBOAR_datestr_re = PyObject_CallFunctionObjArgs(
-            _CBOAR_re_compile, _CBOAR_str_datestr_re, NULL);
-    if (!_CBOAR_datestr_re)
-        goto error;
     return 0;
 error:
     PyErr_SetString(PyExc_ImportError, "unable to import compile from re");
@@ -551,36 +812,130 @@ error:
     return -1;
 }
 
+
+int
+_CBOAR_init_array(void)
+{
+    PyObject *array;
+
+    // from array import array
+    array = PyImport_ImportModule("array");
+    if (!array)
+        goto error;
+    _CBOAR_array = PyObject_GetAttr(array, _CBOAR_str_array);
+    Py_DECREF(array);
+    if (!_CBOAR_array)
+        goto error;
+    return 0;
+error:
+    PyErr_SetString(PyExc_ImportError, "unable to import array from array");
+    return -1;
+}
+
+
+int
+_CBOAR_init_hashlib_new(void)
+{
+    PyObject *hashlib;
+
+    // from hashlib import new
+    hashlib = PyImport_ImportModule("hashlib");
+    if (!hashlib)
+        goto error;
+    _CBOAR_hashlib_new = PyObject_GetAttr(hashlib, _CBOAR_str_new);
+    Py_DECREF(hashlib);
+    if (!_CBOAR_hashlib_new)
+        goto error;
+    return 0;
+error:
+    PyErr_SetString(PyExc_ImportError, "unable to import new from hashlib");
+    return -1;
+}
+
+
+// Timezone cache ////////////////////////////////////////////////////////////
+
+// Most documents only use a handful of distinct UTC offsets, so a small
+// direct-mapped cache is sufficient to avoid constructing a new timedelta and
+// timezone for every decoded datetime string
+#define TIMEZONE_CACHE_SIZE 32
+
+static PyObject *timezone_cache[TIMEZONE_CACHE_SIZE];
+static int timezone_cache_keys[TIMEZONE_CACHE_SIZE];
+
+PyObject *
+_CBOAR_get_timezone(int minutes)
+{
+    PyObject *delta, *ret;
+    int slot;
+
+    slot = (unsigned int) minutes % TIMEZONE_CACHE_SIZE;
+    if (timezone_cache[slot] && timezone_cache_keys[slot] == minutes) {
+        Py_INCREF(timezone_cache[slot]);
+        return timezone_cache[slot];
+    }
+    delta = PyDelta_FromDSU(0, minutes * 60, 0);
+    if (!delta)
+        return NULL;
+#if PY_VERSION_HEX >= 0x03070000
+    ret = PyTimeZone_FromOffset(delta);
+#else
+    if (!_CBOAR_timezone && _CBOAR_init_timezone_utc() == -1)
+        ret = NULL;
+    else
+        ret = PyObject_CallFunctionObjArgs(_CBOAR_timezone, delta, NULL);
+#endif
+    Py_DECREF(delta);
+    if (ret) {
+        Py_XDECREF(timezone_cache[slot]);
+        Py_INCREF(ret);
+        timezone_cache[slot] = ret;
+        timezone_cache_keys[slot] = minutes;
+    }
+    return ret;
+}
+
+
+static void
+clear_timezones(void)
+{
+    int slot;
+
+    for (slot = 0; slot < TIMEZONE_CACHE_SIZE; ++slot)
+        Py_CLEAR(timezone_cache[slot]);
+}
+
 
 // Module definition /////////////////////////////////////////////////////////
 
 PyObject *_CBOAR_empty_bytes = NULL;
 PyObject *_CBOAR_empty_str = NULL;
+PyObject *_CBOAR_str_array = NULL;
+PyObject *_CBOAR_str_algorithm = NULL;
 PyObject *_CBOAR_str_as_string = NULL;
 PyObject *_CBOAR_str_as_tuple = NULL;
 PyObject *_CBOAR_str_bit_length = NULL;
 PyObject *_CBOAR_str_buf = NULL;
 PyObject *_CBOAR_str_bytes = NULL;
+PyObject *_CBOAR_str_canonical = NULL;
 PyObject *_CBOAR_str_BytesIO = NULL;
 PyObject *_CBOAR_str_compile = NULL;
 PyObject *_CBOAR_str_copy = NULL;
-PyObject *_CBOAR_str_datestr_re = NULL;
 PyObject *_CBOAR_str_Decimal = NULL;
 PyObject *_CBOAR_str_denominator = NULL;
+PyObject *_CBOAR_str_digest = NULL;
 PyObject *_CBOAR_str_Fraction = NULL;
 PyObject *_CBOAR_str_fromtimestamp = NULL;
 PyObject *_CBOAR_str_getvalue = NULL;
 PyObject *_CBOAR_str_groups = NULL;
 PyObject *_CBOAR_str_ip_address = NULL;
 PyObject *_CBOAR_str_ip_network = NULL;
-PyObject *_CBOAR_str_is_infinite = NULL;
-PyObject *_CBOAR_str_is_nan = NULL;
-PyObject *_CBOAR_str_isoformat = NULL;
-PyObject *_CBOAR_str_join = NULL;
-PyObject *_CBOAR_str_match = NULL;
+PyObject *_CBOAR_str_iterative = NULL;
 PyObject *_CBOAR_str_network_address = NULL;
+PyObject *_CBOAR_str_new = NULL;
 PyObject *_CBOAR_str_numerator = NULL;
 PyObject *_CBOAR_str_obj = NULL;
+PyObject *_CBOAR_str_object_hook = NULL;
 PyObject *_CBOAR_str_OrderedDict = NULL;
 PyObject *_CBOAR_str_packed = NULL;
 PyObject *_CBOAR_str_Parser = NULL;
@@ -588,11 +943,16 @@ PyObject *_CBOAR_str_parsestr = NULL;
 PyObject *_CBOAR_str_pattern = NULL;
 PyObject *_CBOAR_str_prefixlen = NULL;
 PyObject *_CBOAR_str_read = NULL;
+PyObject *_CBOAR_str_sha256 = NULL;
+PyObject *_CBOAR_str_str_errors = NULL;
+PyObject *_CBOAR_str_stream = NULL;
+PyObject *_CBOAR_str_tag_hook = NULL;
+PyObject *_CBOAR_str_tape = NULL;
 PyObject *_CBOAR_str_timestamp = NULL;
 PyObject *_CBOAR_str_timezone = NULL;
 PyObject *_CBOAR_str_update = NULL;
 PyObject *_CBOAR_str_utc = NULL;
-PyObject *_CBOAR_str_utc_suffix = NULL;
+PyObject *_CBOAR_str_utcoffset = NULL;
 PyObject *_CBOAR_str_UUID = NULL;
 PyObject *_CBOAR_str_write = NULL;
 
@@ -609,9 +969,10 @@ PyObject *_CBOAR_Fraction = NULL;
 PyObject *_CBOAR_UUID = NULL;
 PyObject *_CBOAR_Parser = NULL;
 PyObject *_CBOAR_re_compile = NULL;
-PyObject *_CBOAR_datestr_re = NULL;
 PyObject *_CBOAR_ip_address = NULL;
 PyObject *_CBOAR_ip_network = NULL;
+PyObject *_CBOAR_array = NULL;
+PyObject *_CBOAR_hashlib_new = NULL;
 
 PyObject *_CBOAR_default_encoders = NULL;
 PyObject *_CBOAR_canonical_encoders = NULL;
@@ -705,6 +1066,8 @@ init_default_encoders(PyObject *m)
         ADD_MAPPING((PyObject *) &CBORTagType,                 "encode_semantic");
         ADD_MAPPING((PyObject *) &PySet_Type,                  "encode_set");
         ADD_MAPPING((PyObject *) &PyFrozenSet_Type,            "encode_set");
+        ADD_DEFERRED("array", "array",                         "encode_typed_array");
+        ADD_MAPPING((PyObject *) &PyMemoryView_Type,           "encode_typed_array");
     }
     return ret;
 error:
@@ -751,9 +1114,11 @@ cboar_free(PyObject *m)
     Py_CLEAR(_CBOAR_UUID);
     Py_CLEAR(_CBOAR_Parser);
     Py_CLEAR(_CBOAR_re_compile);
-    Py_CLEAR(_CBOAR_datestr_re);
+    clear_timezones();
     Py_CLEAR(_CBOAR_ip_address);
     Py_CLEAR(_CBOAR_ip_network);
+    Py_CLEAR(_CBOAR_array);
+    Py_CLEAR(_CBOAR_hashlib_new);
     Py_CLEAR(_CBOAR_CBOREncodeError);
     Py_CLEAR(_CBOAR_CBORDecodeError);
     Py_CLEAR(_CBOAR_CBORError);
@@ -766,10 +1131,21 @@ static PyMethodDef _cboarmethods[] = {
         "encode a value to the stream"},
     {"dumps", (PyCFunction) CBOAR_dumps, METH_VARARGS | METH_KEYWORDS,
         "encode a value to a byte-string"},
+    {"digest", (PyCFunction) CBOAR_digest, METH_VARARGS | METH_KEYWORDS,
+        "hash the (canonical) encoding of a value without building it in "
+        "memory"},
     {"load", (PyCFunction) CBOAR_load, METH_VARARGS | METH_KEYWORDS,
         "decode a value from the stream"},
     {"loads", (PyCFunction) CBOAR_loads, METH_VARARGS | METH_KEYWORDS,
         "decode a value from a byte-string"},
+    {"loads_many", (PyCFunction) CBOAR_loads_many,
+        METH_VARARGS | METH_KEYWORDS,
+        "decode a list of values from a sequence of byte-strings, scanning "
+        "them in parallel"},
+    {"compile_schema", (PyCFunction) CBOAR_compile_schema,
+        METH_VARARGS | METH_KEYWORDS,
+        "compile the encoding schema for a namedtuple, dataclass or __slots__ "
+        "class, and register it with the default encoders"},
     {NULL}
 };
 
@@ -818,6 +1194,8 @@ PyInit__cboar(void)
         return NULL;
     if (PyType_Ready(&CBORDecoderType) < 0)
         return NULL;
+    if (PyType_Ready(&CBORSchemaType) < 0)
+        return NULL;
 
     module = PyModule_Create(&_cboarmodule);
     if (!module)
@@ -873,6 +1251,10 @@ PyInit__cboar(void)
     if (PyModule_AddObject(module, "CBORDecoder", (PyObject *) &CBORDecoderType) == -1)
         goto error;
 
+    Py_INCREF(&CBORSchemaType);
+    if (PyModule_AddObject(module, "CBORSchema", (PyObject *) &CBORSchemaType) == -1)
+        goto error;
+
     Py_INCREF(break_marker);
     if (PyModule_AddObject(module, "break_marker", break_marker) == -1)
         goto error;
@@ -886,30 +1268,32 @@ PyInit__cboar(void)
             !(_CBOAR_str_##name = PyUnicode_InternFromString(#name))) \
         goto error;
 
+    INTERN_STRING(array);
+    INTERN_STRING(algorithm);
     INTERN_STRING(as_string);
     INTERN_STRING(as_tuple);
     INTERN_STRING(bit_length);
     INTERN_STRING(buf);
     INTERN_STRING(bytes);
+    INTERN_STRING(canonical);
     INTERN_STRING(BytesIO);
     INTERN_STRING(compile);
     INTERN_STRING(copy);
     INTERN_STRING(Decimal);
     INTERN_STRING(denominator);
+    INTERN_STRING(digest);
     INTERN_STRING(Fraction);
     INTERN_STRING(fromtimestamp);
     INTERN_STRING(getvalue);
     INTERN_STRING(groups);
     INTERN_STRING(ip_address);
     INTERN_STRING(ip_network);
-    INTERN_STRING(is_infinite);
-    INTERN_STRING(is_nan);
-    INTERN_STRING(isoformat);
-    INTERN_STRING(join);
-    INTERN_STRING(match);
+    INTERN_STRING(iterative);
     INTERN_STRING(network_address);
+    INTERN_STRING(new);
     INTERN_STRING(numerator);
     INTERN_STRING(obj);
+    INTERN_STRING(object_hook);
     INTERN_STRING(OrderedDict);
     INTERN_STRING(packed);
     INTERN_STRING(Parser);
@@ -917,25 +1301,21 @@ PyInit__cboar(void)
     INTERN_STRING(pattern);
     INTERN_STRING(prefixlen);
     INTERN_STRING(read);
+    INTERN_STRING(sha256);
+    INTERN_STRING(str_errors);
+    INTERN_STRING(stream);
+    INTERN_STRING(tag_hook);
+    INTERN_STRING(tape);
     INTERN_STRING(timestamp);
     INTERN_STRING(timezone);
     INTERN_STRING(update);
     INTERN_STRING(utc);
+    INTERN_STRING(utcoffset);
     INTERN_STRING(UUID);
     INTERN_STRING(write);
 
 #undef INTERN_STRING
 
-    if (!_CBOAR_str_utc_suffix &&
-            !(_CBOAR_str_utc_suffix = PyUnicode_InternFromString("+00:00")))
-        goto error;
-    if (!_CBOAR_str_datestr_re &&
-            !(_CBOAR_str_datestr_re = PyUnicode_InternFromString(
-                    "^(\\d{4})-(\\d\\d)-(\\d\\d)T"     // Y-m-d
-                    "(\\d\\d):(\\d\\d):(\\d\\d)"       // H:M:S
-                    "(?:\\.(\\d+))?"                   // .uS
-                    "(?:Z|([+-]\\d\\d):(\\d\\d))$")))  // +-TZ
-        goto error;
     if (!_CBOAR_empty_bytes &&
             !(_CBOAR_empty_bytes = PyBytes_FromStringAndSize(NULL, 0)))
         goto error;
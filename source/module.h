@@ -1,4 +1,6 @@
 #include <Python.h>
+#include <stdbool.h>
+#include <stdint.h>
 #if PY_MAJOR_VERSION < 3
 #error "cboar doesn't support the Python 2.x API"
 #elif PY_MAJOR_VERSION == 3 && PY_MAJOR_VERSION < 3
@@ -15,6 +17,41 @@ typedef
         char byte;
     } LeadByte;
 
+// Payload size (in bytes) above which bulk copies and conversions that don't
+// touch Python objects are performed with the GIL released
+#define CBOAR_GIL_THRESHOLD (64 * 1024)
+
+// As Py_BEGIN_ALLOW_THREADS and Py_END_ALLOW_THREADS, but the GIL is only
+// released if cond is true
+#define CBOAR_BEGIN_ALLOW_THREADS_IF(cond) \
+    { PyThreadState *_save = (cond) ? PyEval_SaveThread() : NULL;
+#define CBOAR_END_ALLOW_THREADS_IF \
+    if (_save) PyEval_RestoreThread(_save); }
+
+// Encoding and decoding engines; see CBOREncoder.engine and CBORDecoder.engine
+// (the tape engine only applies to decoding)
+#define ENGINE_STREAM 0
+#define ENGINE_TAPE 1
+#define ENGINE_ITERATIVE 2
+
+// The private tag of lists of records encoded column by column; see
+// CBOREncoder.columnar. It's in the first-come-first-served range, and spells
+// "col" in ASCII
+#define CBOAR_COLUMNAR_TAG 0x636F6C
+
+// Returns true if a string of length bytes is added to a stringref namespace
+// (semantic type 256) which already holds count strings; only strings that
+// are longer than a reference to them (semantic type 25) are added
+static inline bool
+stringref_eligible(const Py_ssize_t count, const uint64_t length)
+{
+    return length >= (
+        count < 24 ? 3 :
+        count < 256 ? 4 :
+        count < 65536 ? 5 :
+        count < 4294967296LL ? 7 : 11);
+}
+
 // break_marker singleton
 extern PyObject _break_marker_obj;
 #define break_marker (&_break_marker_obj)
@@ -31,31 +68,32 @@ extern PyTypeObject CBORSimpleValueType;
 // Various interned strings
 extern PyObject *_CBOAR_empty_bytes;
 extern PyObject *_CBOAR_empty_str;
+extern PyObject *_CBOAR_str_array;
+extern PyObject *_CBOAR_str_algorithm;
 extern PyObject *_CBOAR_str_as_string;
 extern PyObject *_CBOAR_str_as_tuple;
 extern PyObject *_CBOAR_str_bit_length;
 extern PyObject *_CBOAR_str_buf;
 extern PyObject *_CBOAR_str_bytes;
+extern PyObject *_CBOAR_str_canonical;
 extern PyObject *_CBOAR_str_BytesIO;
 extern PyObject *_CBOAR_str_compile;
 extern PyObject *_CBOAR_str_copy;
-extern PyObject *_CBOAR_str_datestr_re;
 extern PyObject *_CBOAR_str_Decimal;
 extern PyObject *_CBOAR_str_denominator;
+extern PyObject *_CBOAR_str_digest;
 extern PyObject *_CBOAR_str_Fraction;
 extern PyObject *_CBOAR_str_fromtimestamp;
 extern PyObject *_CBOAR_str_getvalue;
 extern PyObject *_CBOAR_str_groups;
 extern PyObject *_CBOAR_str_ip_address;
 extern PyObject *_CBOAR_str_ip_network;
-extern PyObject *_CBOAR_str_is_infinite;
-extern PyObject *_CBOAR_str_is_nan;
-extern PyObject *_CBOAR_str_isoformat;
-extern PyObject *_CBOAR_str_join;
-extern PyObject *_CBOAR_str_match;
+extern PyObject *_CBOAR_str_iterative;
 extern PyObject *_CBOAR_str_network_address;
+extern PyObject *_CBOAR_str_new;
 extern PyObject *_CBOAR_str_numerator;
 extern PyObject *_CBOAR_str_obj;
+extern PyObject *_CBOAR_str_object_hook;
 extern PyObject *_CBOAR_str_OrderedDict;
 extern PyObject *_CBOAR_str_packed;
 extern PyObject *_CBOAR_str_Parser;
@@ -63,11 +101,16 @@ extern PyObject *_CBOAR_str_parsestr;
 extern PyObject *_CBOAR_str_pattern;
 extern PyObject *_CBOAR_str_prefixlen;
 extern PyObject *_CBOAR_str_read;
+extern PyObject *_CBOAR_str_sha256;
+extern PyObject *_CBOAR_str_str_errors;
+extern PyObject *_CBOAR_str_stream;
+extern PyObject *_CBOAR_str_tag_hook;
+extern PyObject *_CBOAR_str_tape;
 extern PyObject *_CBOAR_str_timestamp;
 extern PyObject *_CBOAR_str_timezone;
 extern PyObject *_CBOAR_str_update;
 extern PyObject *_CBOAR_str_utc;
-extern PyObject *_CBOAR_str_utc_suffix;
+extern PyObject *_CBOAR_str_utcoffset;
 extern PyObject *_CBOAR_str_UUID;
 extern PyObject *_CBOAR_str_write;
 
@@ -86,9 +129,10 @@ extern PyObject *_CBOAR_Fraction;
 extern PyObject *_CBOAR_UUID;
 extern PyObject *_CBOAR_Parser;
 extern PyObject *_CBOAR_re_compile;
-extern PyObject *_CBOAR_datestr_re;
 extern PyObject *_CBOAR_ip_address;
 extern PyObject *_CBOAR_ip_network;
+extern PyObject *_CBOAR_array;
+extern PyObject *_CBOAR_hashlib_new;
 
 // Initializers for the cached references above
 int _CBOAR_init_timezone_utc(void); // also handles timezone
@@ -98,8 +142,14 @@ int _CBOAR_init_Decimal(void);
 int _CBOAR_init_Fraction(void);
 int _CBOAR_init_UUID(void);
 int _CBOAR_init_Parser(void);
-int _CBOAR_init_re_compile(void); // also handles datestr_re
+int _CBOAR_init_re_compile(void);
 int _CBOAR_init_ip_address(void);
+int _CBOAR_init_array(void);
+int _CBOAR_init_hashlib_new(void);
+
+// Cache of fixed-offset timezones (keyed by offset in minutes) for the
+// datetime string decoder; returns a new reference
+PyObject * _CBOAR_get_timezone(int minutes);
 
 // Encoder registries
 extern PyObject *_CBOAR_default_encoders;
@@ -0,0 +1,555 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <stdbool.h>
+#include <string.h>
+#include <structmember.h>
+#include "module.h"
+#include "encoder.h"
+#include "schema.h"
+
+
+// Constructors and destructors //////////////////////////////////////////////
+
+static int
+CBORSchema_traverse(CBORSchemaObject *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->type);
+    return 0;
+}
+
+static int
+CBORSchema_clear(CBORSchemaObject *self)
+{
+    Py_ssize_t i;
+
+    Py_CLEAR(self->type);
+    if (self->fields) {
+        for (i = 0; i < self->length; ++i) {
+            Py_XDECREF(self->fields[i].name);
+            Py_XDECREF(self->fields[i].attr);
+            Py_XDECREF(self->fields[i].key);
+        }
+        PyMem_Free(self->fields);
+        self->fields = NULL;
+    }
+    PyMem_Free(self->canonical);
+    self->canonical = NULL;
+    self->length = 0;
+    return 0;
+}
+
+// CBORSchema.__del__(self)
+static void
+CBORSchema_dealloc(CBORSchemaObject *self)
+{
+    PyObject_GC_UnTrack(self);
+    CBORSchema_clear(self);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+
+// CBORSchema.__new__(cls, type, fields=None)
+static PyObject *
+CBORSchema_new(PyTypeObject *cls, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {"type", "fields", NULL};
+    PyObject *type, *fields = Py_None;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O!|O", keywords,
+                &PyType_Type, &type, &fields))
+        return NULL;
+    return CBORSchema_New((PyTypeObject *) type, fields);
+}
+
+
+// Field discovery ///////////////////////////////////////////////////////////
+
+// Returns the name of the attribute holding the __slots__ member name, which
+// was declared by cls: private names are mangled with the class name
+static PyObject *
+slot_attribute(PyTypeObject *cls, PyObject *name)
+{
+    const char *owner = cls->tp_name;
+    Py_ssize_t length = PyUnicode_GET_LENGTH(name);
+
+    if (length < 3 ||
+            PyUnicode_READ_CHAR(name, 0) != '_' ||
+            PyUnicode_READ_CHAR(name, 1) != '_' ||
+            (PyUnicode_READ_CHAR(name, length - 1) == '_' &&
+             PyUnicode_READ_CHAR(name, length - 2) == '_')) {
+        Py_INCREF(name);
+        return name;
+    }
+    if (strrchr(owner, '.'))
+        owner = strrchr(owner, '.') + 1;
+    while (*owner == '_')
+        owner++;
+    return PyUnicode_FromFormat("_%s%U", owner, name);
+}
+
+
+// Appends the (name, attr) pairs for the __slots__ declared by cls to list
+static int
+append_slots(PyObject *list, PyTypeObject *cls)
+{
+    PyObject *slots, *iter, *name, *attr, *pair;
+    int ret = -1;
+
+    slots = PyDict_GetItemString(cls->tp_dict, "__slots__");
+    if (!slots)
+        return 0;
+    // A single slot may be given as a str
+    if (PyUnicode_Check(slots))
+        slots = PyTuple_Pack(1, slots);
+    else
+        Py_INCREF(slots);
+    if (!slots)
+        return -1;
+    iter = PyObject_GetIter(slots);
+    Py_DECREF(slots);
+    if (iter) {
+        while ((name = PyIter_Next(iter))) {
+            if (!PyUnicode_Check(name)) {
+                PyErr_Format(PyExc_TypeError,
+                        "__slots__ items must be strings, not %R", name);
+                Py_DECREF(name);
+                break;
+            }
+            if (PyUnicode_CompareWithASCIIString(name, "__dict__") != 0 &&
+                    PyUnicode_CompareWithASCIIString(name, "__weakref__") != 0) {
+                attr = slot_attribute(cls, name);
+                if (!attr) {
+                    Py_DECREF(name);
+                    break;
+                }
+                pair = PyTuple_Pack(2, name, attr);
+                Py_DECREF(attr);
+                if (!pair || PyList_Append(list, pair) == -1) {
+                    Py_XDECREF(pair);
+                    Py_DECREF(name);
+                    break;
+                }
+                Py_DECREF(pair);
+            }
+            Py_DECREF(name);
+        }
+        if (!PyErr_Occurred())
+            ret = 0;
+        Py_DECREF(iter);
+    }
+    return ret;
+}
+
+
+// Returns a new list of the (name, attr) pairs of the fields of type: the
+// _fields of a namedtuple (setting *is_tuple), the fields of a dataclass, or
+// the __slots__ of a class and its bases (in that order). An empty list is
+// returned if none of these apply
+static PyObject *
+discover_fields(PyTypeObject *type, bool *is_tuple)
+{
+    PyObject *module, *names = NULL, *name, *pair, *ret;
+    Py_ssize_t i;
+
+    *is_tuple = false;
+    ret = PyList_New(0);
+    if (!ret)
+        return NULL;
+    if (PyType_IsSubtype(type, &PyTuple_Type) &&
+            PyObject_HasAttrString((PyObject *) type, "_fields")) {
+        *is_tuple = true;
+        names = PyObject_GetAttrString((PyObject *) type, "_fields");
+    } else if (PyObject_HasAttrString((PyObject *) type,
+                "__dataclass_fields__")) {
+        module = PyImport_ImportModule("dataclasses");
+        if (module) {
+            names = PyObject_CallMethod(module, "fields", "O", type);
+            Py_DECREF(module);
+        }
+    } else {
+        for (i = PyTuple_GET_SIZE(type->tp_mro) - 1; i >= 0; --i) {
+            if (append_slots(ret, (PyTypeObject *)
+                        PyTuple_GET_ITEM(type->tp_mro, i)) == -1)
+                goto error;
+        }
+        return ret;
+    }
+    if (!names)
+        goto error;
+    for (i = 0; i < PySequence_Length(names); ++i) {
+        name = PySequence_GetItem(names, i);
+        if (!name)
+            goto error;
+        // The fields of a dataclass are Field objects
+        if (!PyUnicode_Check(name)) {
+            Py_SETREF(name, PyObject_GetAttrString(name, "name"));
+            if (!name)
+                goto error;
+        }
+        pair = PyTuple_Pack(2, name, name);
+        Py_DECREF(name);
+        if (!pair || PyList_Append(ret, pair) == -1) {
+            Py_XDECREF(pair);
+            goto error;
+        }
+        Py_DECREF(pair);
+    }
+    if (!PyErr_Occurred()) {
+        Py_DECREF(names);
+        return ret;
+    }
+error:
+    Py_XDECREF(names);
+    Py_DECREF(ret);
+    return NULL;
+}
+
+
+// Returns the encoded form of the str name (major type 3)
+static PyObject *
+encode_key(PyObject *name)
+{
+    PyObject *ret;
+    const char *str;
+    char *buf;
+    Py_ssize_t length;
+    int size;
+
+    str = PyUnicode_AsUTF8AndSize(name, &length);
+    if (!str)
+        return NULL;
+    ret = PyBytes_FromStringAndSize(NULL, length + 9);
+    if (ret) {
+        buf = PyBytes_AS_STRING(ret);
+        if (length < 24) {
+            buf[0] = 0x60 | length;
+            size = 1;
+        } else if (length <= UINT8_MAX) {
+            buf[0] = 0x78;
+            buf[1] = length;
+            size = 2;
+        } else if (length <= UINT16_MAX) {
+            buf[0] = 0x79;
+            buf[1] = length >> 8;
+            buf[2] = length;
+            size = 3;
+        } else {
+            buf[0] = 0x7A;
+            buf[1] = length >> 24;
+            buf[2] = length >> 16;
+            buf[3] = length >> 8;
+            buf[4] = length;
+            size = 5;
+        }
+        memcpy(buf + size, str, length);
+        _PyBytes_Resize(&ret, size + length);
+    }
+    return ret;
+}
+
+
+// Fills in field for the (name, attr) pair at position index of the
+// schema's type
+static int
+init_field(CBORSchemaObject *self, SchemaField *field, PyObject *pair,
+           Py_ssize_t index, bool is_tuple)
+{
+    PyObject *descr;
+
+    field->name = PyTuple_GET_ITEM(pair, 0);
+    field->attr = PyTuple_GET_ITEM(pair, 1);
+    if (!PyUnicode_Check(field->name) || !PyUnicode_Check(field->attr)) {
+        PyErr_Format(PyExc_TypeError,
+                "field names must be strings, not %R", field->name);
+        field->name = field->attr = NULL;
+        return -1;
+    }
+    Py_INCREF(field->name);
+    Py_INCREF(field->attr);
+    PyUnicode_InternInPlace(&field->name);
+    PyUnicode_InternInPlace(&field->attr);
+    field->key = encode_key(field->name);
+    if (!field->key)
+        return -1;
+    if (is_tuple) {
+        field->access = FIELD_INDEX;
+        field->index = index;
+        return 0;
+    }
+    // Members of __slots__ are read straight from the object, anything else
+    // (properties, instance attributes, or members of other classes that were
+    // merely assigned to this one) by getattr
+    field->access = FIELD_ATTR;
+    field->index = -1;
+    descr = PyObject_GetAttr((PyObject *) self->type, field->attr);
+    if (!descr) {
+        if (!PyErr_ExceptionMatches(PyExc_AttributeError))
+            return -1;
+        PyErr_Clear();
+    } else {
+        if (Py_TYPE(descr) == &PyMemberDescr_Type &&
+                ((PyMemberDescrObject *) descr)->d_member->type == T_OBJECT_EX &&
+                PyType_IsSubtype(self->type, PyDescr_TYPE(descr))) {
+            field->access = FIELD_SLOT;
+            field->index = ((PyMemberDescrObject *) descr)->d_member->offset;
+        }
+        Py_DECREF(descr);
+    }
+    return 0;
+}
+
+
+// Orders the fields by their encoded keys as canonical maps do: shortest
+// first, then bytewise
+static void
+sort_canonical(CBORSchemaObject *self)
+{
+    PyObject *a, *b;
+    Py_ssize_t i, j, tmp;
+
+    for (i = 0; i < self->length; ++i)
+        self->canonical[i] = i;
+    for (i = 1; i < self->length; ++i) {
+        for (j = i; j > 0; --j) {
+            a = self->fields[self->canonical[j - 1]].key;
+            b = self->fields[self->canonical[j]].key;
+            if (PyBytes_GET_SIZE(a) < PyBytes_GET_SIZE(b) ||
+                    (PyBytes_GET_SIZE(a) == PyBytes_GET_SIZE(b) &&
+                     memcmp(PyBytes_AS_STRING(a), PyBytes_AS_STRING(b),
+                            PyBytes_GET_SIZE(a)) < 0))
+                break;
+            tmp = self->canonical[j];
+            self->canonical[j] = self->canonical[j - 1];
+            self->canonical[j - 1] = tmp;
+        }
+    }
+}
+
+
+// Special methods ///////////////////////////////////////////////////////////
+
+// CBORSchema.__call__(self, encoder, value)
+static PyObject *
+CBORSchema_call(CBORSchemaObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {"encoder", "value", NULL};
+    PyObject *encoder, *value;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O!O", keywords,
+                &CBOREncoderType, &encoder, &value))
+        return NULL;
+    return CBOREncoder_encode_record(
+            (CBOREncoderObject *) encoder, (PyObject *) self, value);
+}
+
+
+// CBORSchema.fields
+static PyObject *
+CBORSchema_get_fields(CBORSchemaObject *self, void *closure)
+{
+    PyObject *ret;
+    Py_ssize_t i;
+
+    ret = PyTuple_New(self->length);
+    if (ret) {
+        for (i = 0; i < self->length; ++i) {
+            Py_INCREF(self->fields[i].name);
+            PyTuple_SET_ITEM(ret, i, self->fields[i].name);
+        }
+    }
+    return ret;
+}
+
+
+static PyObject *
+CBORSchema_repr(CBORSchemaObject *self)
+{
+    PyObject *fields, *ret = NULL;
+
+    fields = CBORSchema_get_fields(self, NULL);
+    if (fields) {
+        ret = PyUnicode_FromFormat("CBORSchema(%R, fields=%R)",
+                self->type, fields);
+        Py_DECREF(fields);
+    }
+    return ret;
+}
+
+
+// C API /////////////////////////////////////////////////////////////////////
+
+// Compiles the schema for type, whose fields are given by the sequence of
+// strs fields, or discovered from type if fields is None
+PyObject *
+CBORSchema_New(PyTypeObject *type, PyObject *fields)
+{
+    CBORSchemaObject *ret;
+    PyObject *pairs, *pair, *seen;
+    Py_ssize_t i;
+    bool is_tuple = false;
+
+    if (fields == Py_None) {
+        pairs = discover_fields(type, &is_tuple);
+        if (pairs && !PyList_GET_SIZE(pairs)) {
+            PyErr_Format(PyExc_TypeError,
+                    "unable to determine the fields of %R; it must be a "
+                    "namedtuple, dataclass or __slots__ class, or the fields "
+                    "must be given", type);
+            Py_CLEAR(pairs);
+        }
+    } else {
+        pairs = PySequence_List(fields);
+        for (i = 0; pairs && i < PyList_GET_SIZE(pairs); ++i) {
+            pair = PyTuple_Pack(2,
+                    PyList_GET_ITEM(pairs, i), PyList_GET_ITEM(pairs, i));
+            if (pair)
+                PyList_SetItem(pairs, i, pair);
+            else
+                Py_CLEAR(pairs);
+        }
+    }
+    if (!pairs)
+        return NULL;
+
+    ret = (CBORSchemaObject *) CBORSchemaType.tp_alloc(&CBORSchemaType, 0);
+    if (ret) {
+        Py_INCREF(type);
+        ret->type = type;
+        ret->fields = PyMem_Calloc(PyList_GET_SIZE(pairs), sizeof(SchemaField));
+        ret->canonical = PyMem_Calloc(PyList_GET_SIZE(pairs), sizeof(Py_ssize_t));
+        seen = PySet_New(NULL);
+        if (!ret->fields || !ret->canonical) {
+            PyErr_NoMemory();
+            Py_CLEAR(ret);
+        } else if (seen) {
+            for (i = 0; i < PyList_GET_SIZE(pairs); ++i) {
+                ret->length++;
+                if (init_field(ret, &ret->fields[i],
+                            PyList_GET_ITEM(pairs, i), i, is_tuple) == -1)
+                    break;
+                switch (PySet_Contains(seen, ret->fields[i].name)) {
+                    case 0:
+                        if (PySet_Add(seen, ret->fields[i].name) == 0)
+                            continue;
+                        break;
+                    case 1:
+                        PyErr_Format(PyExc_ValueError,
+                                "duplicate field %R", ret->fields[i].name);
+                        break;
+                }
+                break;
+            }
+            if (PyErr_Occurred())
+                Py_CLEAR(ret);
+            else
+                sort_canonical(ret);
+        } else
+            Py_CLEAR(ret);
+        Py_XDECREF(seen);
+    }
+    Py_DECREF(pairs);
+    return (PyObject *) ret;
+}
+
+
+// Returns a new instance of the schema's type with the values of its fields
+// taken from the tuple values (in the order of the fields). Instances are
+// created as pickle does: namedtuples as tuple.__new__(type, values) would,
+// and other classes by their __new__ without arguments (bypassing __init__),
+// before their fields are stored. Returns NULL without an exception set if
+// the type can't be created this way (a tuple type with fields which aren't
+// its items)
+PyObject *
+CBORSchema_Build(CBORSchemaObject *self, PyObject *values)
+{
+    PyObject *args, *ret = NULL;
+    SchemaField *field;
+    Py_ssize_t i;
+
+    if (PyType_IsSubtype(self->type, &PyTuple_Type)) {
+        for (i = 0; i < self->length; ++i)
+            if (self->fields[i].access != FIELD_INDEX ||
+                    self->fields[i].index != i)
+                return NULL;
+#if PY_VERSION_HEX < 0x030E0000
+        // This is tuple.__new__ for a subtype, without the tuple it copies
+        ret = self->type->tp_alloc(self->type, self->length);
+        for (i = 0; ret && i < self->length; ++i) {
+            Py_INCREF(PyTuple_GET_ITEM(values, i));
+            PyTuple_SET_ITEM(ret, i, PyTuple_GET_ITEM(values, i));
+        }
+#else
+        // Tuples cache their hash from 3.14, so are left to tuple.__new__
+        args = PyTuple_Pack(1, values);
+        if (args) {
+            ret = PyTuple_Type.tp_new(self->type, args, NULL);
+            Py_DECREF(args);
+        }
+#endif
+        return ret;
+    }
+    args = PyTuple_New(0);
+    if (!args)
+        return NULL;
+    ret = self->type->tp_new(self->type, args, NULL);
+    Py_DECREF(args);
+    // Slots are written at their offsets, so __new__ must really have
+    // returned an instance of the type
+    if (ret && !PyObject_TypeCheck(ret, self->type)) {
+        PyErr_Format(PyExc_TypeError, "%R.__new__ returned %R",
+                self->type, Py_TYPE(ret));
+        Py_CLEAR(ret);
+    }
+    for (i = 0; ret && i < self->length; ++i) {
+        field = &self->fields[i];
+        if (field->access == FIELD_SLOT) {
+            Py_INCREF(PyTuple_GET_ITEM(values, i));
+            Py_XSETREF(*(PyObject **)((char *)ret + field->index),
+                    PyTuple_GET_ITEM(values, i));
+        } else if (PyObject_GenericSetAttr(
+                    ret, field->attr, PyTuple_GET_ITEM(values, i)) == -1)
+            Py_CLEAR(ret);
+    }
+    return ret;
+}
+
+
+// Schema class definition ///////////////////////////////////////////////////
+
+static PyMemberDef CBORSchema_members[] = {
+    {"type", T_OBJECT, offsetof(CBORSchemaObject, type), READONLY,
+        "the class whose instances are encoded by the schema"},
+    {NULL}
+};
+
+static PyGetSetDef CBORSchema_getsetters[] = {
+    {"fields", (getter) CBORSchema_get_fields, NULL,
+        "the names of the fields encoded, in the order they're written", NULL},
+    {NULL}
+};
+
+PyDoc_STRVAR(CBORSchema__doc__,
+"The CBORSchema class holds the compiled encoding plan for a record type:\n"
+"a namedtuple, dataclass, or class with :attr:`__slots__`. Instances of\n"
+":attr:`type` are encoded as maps of the :attr:`fields`, with the keys\n"
+"encoded in advance and the values read directly from the object where\n"
+"possible. A schema may be used anywhere an encoder function is accepted,\n"
+"e.g. in :attr:`CBOREncoder.encoders`; see :func:`compile_schema`.\n"
+);
+
+PyTypeObject CBORSchemaType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_cboar.CBORSchema",
+    .tp_doc = CBORSchema__doc__,
+    .tp_basicsize = sizeof(CBORSchemaObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    .tp_new = CBORSchema_new,
+    .tp_dealloc = (destructor) CBORSchema_dealloc,
+    .tp_traverse = (traverseproc) CBORSchema_traverse,
+    .tp_clear = (inquiry) CBORSchema_clear,
+    .tp_call = (ternaryfunc) CBORSchema_call,
+    .tp_members = CBORSchema_members,
+    .tp_getset = CBORSchema_getsetters,
+    .tp_repr = (reprfunc) CBORSchema_repr,
+};
@@ -0,0 +1,61 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+// How the value of a field is read from a record
+typedef enum {
+    FIELD_INDEX,  // an item of a tuple (namedtuples); index is its position
+    FIELD_SLOT,   // a __slots__ member; index is its offset in the object
+    FIELD_ATTR,   // any other attribute, looked up by name
+} FieldAccess;
+
+typedef struct {
+    PyObject *name;     // the field's (interned) name, used as its key
+    PyObject *attr;     // the attribute holding it (name, mangled if private)
+    PyObject *key;      // name encoded as a CBOR text string
+    FieldAccess access;
+    Py_ssize_t index;
+} SchemaField;
+
+typedef struct {
+    PyObject_HEAD
+    PyTypeObject *type;
+    Py_ssize_t length;
+    SchemaField *fields;
+    Py_ssize_t *canonical;  // indexes of fields in canonical key order
+} CBORSchemaObject;
+
+PyTypeObject CBORSchemaType;
+
+PyObject * CBORSchema_New(PyTypeObject *, PyObject *);
+PyObject * CBORSchema_Build(CBORSchemaObject *, PyObject *);
+
+#define CBORSchema_CheckExact(op) (Py_TYPE(op) == &CBORSchemaType)
+
+// Returns a new reference to the value of field in obj (an instance of the
+// schema's type), or NULL on error
+static inline PyObject *
+CBORSchema_GetField(SchemaField *field, PyObject *obj)
+{
+    PyObject *ret;
+
+    switch (field->access) {
+        case FIELD_INDEX:
+            if (field->index < PyTuple_GET_SIZE(obj)) {
+                ret = PyTuple_GET_ITEM(obj, field->index);
+                Py_INCREF(ret);
+                return ret;
+            }
+            break;
+        case FIELD_SLOT:
+            ret = *(PyObject **)((char *)obj + field->index);
+            if (ret) {
+                Py_INCREF(ret);
+                return ret;
+            }
+            break;
+        case FIELD_ATTR:
+            break;
+    }
+    // Let getattr raise the appropriate error for missing values
+    return PyObject_GetAttr(obj, field->attr);
+}
@@ -0,0 +1,473 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <pthread.h>
+#include "halffloat.h"
+#include "tape.h"
+
+
+// Scanning //////////////////////////////////////////////////////////////////
+
+// Scanning is iterative; each open container (or tag, or indefinite length
+// string) has a frame on an explicit stack tracking how many items it has
+// left (or, if it's indefinite, how many it has seen so far)
+typedef struct {
+    uint64_t remaining;
+    uint64_t items;
+    size_t index;       // tape index of the container
+    uint8_t major;
+    bool indefinite;
+    bool record;        // whether items within are recorded on the tape
+} TapeFrame;
+
+typedef struct {
+    Tape *tape;
+    size_t pos;
+    TapeFrame *frames;
+    size_t depth;
+    size_t allocated;
+} TapeScanner;
+
+
+void
+tape_init(Tape *tape, const char *buf, size_t size)
+{
+    tape->buf = buf;
+    tape->size = size;
+    tape->length = 0;
+    tape->items = NULL;
+    tape->count = 0;
+    tape->allocated = 0;
+    tape->error[0] = '\0';
+}
+
+
+void
+tape_free(Tape *tape)
+{
+    free(tape->items);
+    tape->items = NULL;
+    tape->count = 0;
+    tape->allocated = 0;
+}
+
+
+static int
+premature_end(TapeScanner *scanner, const uint64_t size)
+{
+    snprintf(scanner->tape->error, sizeof(scanner->tape->error),
+            "premature end of stream (expected to read %llu bytes, got %zu "
+            "instead)", (unsigned long long) size,
+            scanner->tape->size - scanner->pos);
+    return TAPE_ERROR;
+}
+
+
+static int
+emit(TapeScanner *scanner, const uint8_t kind, const size_t offset,
+     const uint64_t value)
+{
+    Tape *tape = scanner->tape;
+    TapeItem *items;
+    size_t allocated;
+
+    if (tape->count == tape->allocated) {
+        allocated = tape->allocated ? tape->allocated * 2 : 64;
+        items = realloc(tape->items, allocated * sizeof(TapeItem));
+        if (!items)
+            return TAPE_NOMEM;
+        tape->items = items;
+        tape->allocated = allocated;
+    }
+    items = &tape->items[tape->count++];
+    items->kind = kind;
+    items->ascii = false;
+    items->offset = offset;
+    items->value = value;
+    return TAPE_OK;
+}
+
+
+static int
+push(TapeScanner *scanner, const uint8_t major, const bool indefinite,
+     const uint64_t remaining, const bool record)
+{
+    TapeFrame *frames;
+    size_t allocated;
+
+    if (scanner->depth == scanner->allocated) {
+        allocated = scanner->allocated * 2;
+        frames = realloc(scanner->frames, allocated * sizeof(TapeFrame));
+        if (!frames)
+            return TAPE_NOMEM;
+        scanner->frames = frames;
+        scanner->allocated = allocated;
+    }
+    scanner->frames[scanner->depth++] = (TapeFrame) {
+        .remaining = remaining,
+        .items = 0,
+        .index = scanner->tape->count - 1,
+        .major = major,
+        .indefinite = indefinite,
+        .record = record,
+    };
+    return TAPE_OK;
+}
+
+
+// Reads the argument following a lead byte with the specified subtype into
+// length (as decode_length does in the decoder); indefinite is set if the
+// subtype is 31 and allowed is true
+static int
+read_length(TapeScanner *scanner, const uint8_t subtype, uint64_t *length,
+            const bool allowed, bool *indefinite)
+{
+    const char *buf = scanner->tape->buf + scanner->pos;
+    union {
+        uint64_t u64;
+        uint32_t u32;
+        uint16_t u16;
+        uint8_t u8;
+    } value;
+    size_t size;
+
+    *indefinite = false;
+    *length = 0;
+    if (subtype < 24) {
+        *length = subtype;
+        return TAPE_OK;
+    } else if (subtype < 28) {
+        size = (size_t) 1 << (subtype - 24);
+        if (scanner->tape->size - scanner->pos < size)
+            return premature_end(scanner, size);
+        memcpy(&value, buf, size);
+        switch (subtype) {
+            case 24: *length = value.u8; break;
+            case 25: *length = be16toh(value.u16); break;
+            case 26: *length = be32toh(value.u32); break;
+            default: *length = be64toh(value.u64); break;
+        }
+        scanner->pos += size;
+        return TAPE_OK;
+    } else if (subtype == 31 && allowed) {
+        *indefinite = true;
+        return TAPE_OK;
+    }
+    snprintf(scanner->tape->error, sizeof(scanner->tape->error),
+            "unknown unsigned integer subtype 0x%x", subtype);
+    return TAPE_ERROR;
+}
+
+
+static bool
+is_ascii(const char *buf, const size_t size)
+{
+    const uint64_t high = 0x8080808080808080ULL;
+    uint64_t words[4];
+    size_t i = 0;
+
+    for (; i + 32 <= size; i += 32) {
+        memcpy(words, buf + i, 32);
+        if ((words[0] | words[1] | words[2] | words[3]) & high)
+            return false;
+    }
+    for (; i < size; i++)
+        if (buf[i] & 0x80)
+            return false;
+    return true;
+}
+
+
+static int
+scan_special(TapeScanner *scanner, const uint8_t subtype, const size_t start,
+             const bool record)
+{
+    // major type 7
+    union {
+        uint64_t u64;
+        uint32_t u32;
+        uint16_t u16;
+        double f64;
+        float f32;
+    } value;
+    size_t size;
+    double f;
+
+    switch (subtype) {
+        case 20: case 21: case 22: case 23:
+            return record ?
+                emit(scanner, TAPE_FALSE + subtype - 20, start, 0) : TAPE_OK;
+        case 24: case 25: case 26: case 27:
+            size = (size_t) 1 << (subtype - 24);
+            if (scanner->tape->size - scanner->pos < size)
+                return premature_end(scanner, size);
+            memcpy(&value, scanner->tape->buf + scanner->pos, size);
+            scanner->pos += size;
+            if (!record)
+                return TAPE_OK;
+            switch (subtype) {
+                case 24:
+                    // simple value
+                    return emit(scanner, TAPE_OTHER, start, 0);
+                case 25:
+                    f = unpack_float16(value.u16);
+                    break;
+                case 26:
+                    value.u32 = be32toh(value.u32);
+                    f = value.f32;
+                    break;
+                default:
+                    value.u64 = be64toh(value.u64);
+                    f = value.f64;
+                    break;
+            }
+            if (emit(scanner, TAPE_FLOAT, start, 0) == TAPE_NOMEM)
+                return TAPE_NOMEM;
+            scanner->tape->items[scanner->tape->count - 1].f = f;
+            return TAPE_OK;
+        default:
+            // simple values, stray break markers, and reserved subtypes are
+            // left to the decoder
+            return record ? emit(scanner, TAPE_OTHER, start, 0) : TAPE_OK;
+    }
+}
+
+
+static int
+scan_item(TapeScanner *scanner, TapeFrame *frame)
+{
+    Tape *tape = scanner->tape;
+    size_t start = scanner->pos;
+    uint8_t lead, major, subtype;
+    uint64_t length;
+    bool indefinite, record = frame->record;
+    int ret;
+
+    lead = tape->buf[scanner->pos++];
+    major = lead >> 5;
+    subtype = lead & 0x1f;
+    if (frame->indefinite)
+        frame->items++;
+    else
+        frame->remaining--;
+    if ((frame->major == 2 || frame->major == 3) && major != frame->major) {
+        snprintf(tape->error, sizeof(tape->error), frame->major == 2 ?
+                "non-bytestring found in indefinite length bytestring" :
+                "non-string found in indefinite length string");
+        return TAPE_ERROR;
+    }
+    if (major == 7)
+        return scan_special(scanner, subtype, start, record);
+
+    ret = read_length(scanner, subtype, &length, major >= 2 && major <= 5,
+                      &indefinite);
+    if (ret != TAPE_OK)
+        return ret;
+    switch (major) {
+        case 0:
+        case 1:
+            return record ?
+                emit(scanner, major ? TAPE_NEGINT : TAPE_UINT, start, length) :
+                TAPE_OK;
+        case 2:
+        case 3:
+            if (indefinite) {
+                if (record && (ret = emit(scanner, TAPE_OTHER, start, 0)))
+                    return ret;
+                return push(scanner, major, true, 0, false);
+            }
+            if (tape->size - scanner->pos < length)
+                return premature_end(scanner, length);
+            if (record) {
+                ret = emit(scanner, major == 2 ? TAPE_BYTES : TAPE_STRING,
+                           scanner->pos, length);
+                if (ret)
+                    return ret;
+                if (major == 3)
+                    tape->items[tape->count - 1].ascii = is_ascii(
+                            tape->buf + scanner->pos, length);
+            }
+            scanner->pos += length;
+            return TAPE_OK;
+        case 4:
+        case 5:
+            // Doubling the pair count must not wrap; no buffer could hold
+            // that many items anyway
+            if (major == 5 && length > UINT64_MAX / 2)
+                return premature_end(scanner, length);
+            if (record && (ret = emit(scanner,
+                            major == 4 ? TAPE_ARRAY : TAPE_MAP, start, length)))
+                return ret;
+            return push(scanner, major, indefinite,
+                        major == 5 ? length * 2 : length, record);
+        case 6:
+            if (record && (ret = emit(scanner, TAPE_OTHER, start, 0)))
+                return ret;
+            return push(scanner, 6, false, 1, false);
+    }
+    return TAPE_OK;
+}
+
+
+int
+tape_scan(Tape *tape)
+{
+    TapeScanner scanner = {
+        .tape = tape,
+        .pos = 0,
+        .depth = 0,
+        .allocated = 16,
+    };
+    TapeFrame *frame;
+    int ret = TAPE_OK;
+
+    scanner.frames = malloc(scanner.allocated * sizeof(TapeFrame));
+    if (!scanner.frames)
+        return TAPE_NOMEM;
+    // The root frame holds the single top-level item
+    scanner.frames[scanner.depth++] = (TapeFrame) {
+        .remaining = 1,
+        .major = 0,
+        .record = true,
+    };
+    while (ret == TAPE_OK && scanner.depth) {
+        frame = &scanner.frames[scanner.depth - 1];
+        if (!frame->indefinite && !frame->remaining) {
+            scanner.depth--;
+        } else if (scanner.pos >= tape->size) {
+            ret = premature_end(&scanner, 1);
+        } else if ((uint8_t) tape->buf[scanner.pos] == 0xff &&
+                frame->indefinite &&
+                (frame->major != 5 || !(frame->items & 1))) {
+            // A break-code ends an indefinite container, but only in place
+            // of a key within a map (the decoder treats a break in place of
+            // a value as the break_marker value)
+            scanner.pos++;
+            if (frame->record)
+                tape->items[frame->index].value =
+                    frame->major == 5 ? frame->items / 2 : frame->items;
+            scanner.depth--;
+        } else
+            ret = scan_item(&scanner, frame);
+    }
+    tape->length = scanner.pos;
+    free(scanner.frames);
+    return ret;
+}
+
+
+// Batches ///////////////////////////////////////////////////////////////////
+
+#define TAPE_PENDING 1
+
+struct TapeBatch {
+    Tape *tapes;
+    int *results;
+    size_t count;
+    size_t next;
+    bool cancel;
+    int threads;
+    pthread_t *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+};
+
+
+static void *
+tape_worker(void *arg)
+{
+    TapeBatch *batch = arg;
+    size_t index;
+    int result;
+
+    pthread_mutex_lock(&batch->lock);
+    while (!batch->cancel && batch->next < batch->count) {
+        index = batch->next++;
+        pthread_mutex_unlock(&batch->lock);
+        result = tape_scan(&batch->tapes[index]);
+        pthread_mutex_lock(&batch->lock);
+        batch->results[index] = result;
+        pthread_cond_broadcast(&batch->done);
+    }
+    pthread_mutex_unlock(&batch->lock);
+    return NULL;
+}
+
+
+TapeBatch *
+tape_batch_new(Tape *tapes, size_t count, int threads)
+{
+    TapeBatch *batch;
+    size_t i;
+
+    if ((size_t) threads > count)
+        threads = count;
+    batch = malloc(sizeof(TapeBatch));
+    if (!batch)
+        return NULL;
+    batch->tapes = tapes;
+    batch->count = count;
+    batch->next = 0;
+    batch->cancel = false;
+    batch->threads = 0;
+    batch->results = malloc(count * sizeof(int) + 1);
+    batch->workers = malloc(threads * sizeof(pthread_t) + 1);
+    if (!batch->results || !batch->workers) {
+        free(batch->results);
+        free(batch->workers);
+        free(batch);
+        return NULL;
+    }
+    for (i = 0; i < count; i++)
+        batch->results[i] = TAPE_PENDING;
+    pthread_mutex_init(&batch->lock, NULL);
+    pthread_cond_init(&batch->done, NULL);
+    // If fewer threads can be started than requested, the batch simply
+    // proceeds with those it has (or in the waiting thread alone)
+    while (batch->threads < threads && pthread_create(
+                &batch->workers[batch->threads], NULL, tape_worker, batch) == 0)
+        batch->threads++;
+    return batch;
+}
+
+
+int
+tape_batch_wait(TapeBatch *batch, size_t index)
+{
+    int result;
+
+    pthread_mutex_lock(&batch->lock);
+    if (batch->results[index] == TAPE_PENDING && batch->next == index) {
+        batch->next++;
+        pthread_mutex_unlock(&batch->lock);
+        result = tape_scan(&batch->tapes[index]);
+        pthread_mutex_lock(&batch->lock);
+        batch->results[index] = result;
+    }
+    while (batch->results[index] == TAPE_PENDING)
+        pthread_cond_wait(&batch->done, &batch->lock);
+    result = batch->results[index];
+    pthread_mutex_unlock(&batch->lock);
+    return result;
+}
+
+
+void
+tape_batch_free(TapeBatch *batch)
+{
+    int i;
+
+    pthread_mutex_lock(&batch->lock);
+    batch->cancel = true;
+    pthread_mutex_unlock(&batch->lock);
+    for (i = 0; i < batch->threads; i++)
+        pthread_join(batch->workers[i], NULL);
+    pthread_cond_destroy(&batch->done);
+    pthread_mutex_destroy(&batch->lock);
+    free(batch->workers);
+    free(batch->results);
+    free(batch);
+}
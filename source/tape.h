@@ -0,0 +1,66 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A tape is a flat, pre-order list of the items in a single CBOR message. It
+// is produced by tape_scan without reference to any Python objects, so that
+// scanning can happen in other threads without the GIL. The common structural
+// types are recorded directly; tags, simple values, indefinite length strings
+// and anything else unusual are validated, then recorded as a single
+// TAPE_OTHER item (excluding their content) to be decoded from their offset
+// by the regular decoder
+
+typedef enum {
+    TAPE_UINT,       // value is the integer
+    TAPE_NEGINT,     // value is the encoded integer (the item is -1 - value)
+    TAPE_BYTES,      // value is the length, offset points to the content
+    TAPE_STRING,     // as TAPE_BYTES, and ascii is true for 7-bit content
+    TAPE_ARRAY,      // value is the number of items which follow
+    TAPE_MAP,        // value is the number of key, value pairs which follow
+    TAPE_FALSE,
+    TAPE_TRUE,
+    TAPE_NULL,
+    TAPE_UNDEFINED,
+    TAPE_FLOAT,      // f is the value
+    TAPE_OTHER,      // offset points to the lead byte
+} TapeKind;
+
+typedef struct {
+    uint8_t kind;
+    bool ascii;
+    size_t offset;
+    union {
+        uint64_t value;
+        double f;
+    };
+} TapeItem;
+
+typedef struct {
+    const char *buf;
+    size_t size;
+    size_t length;   // length of the message (the input may continue past it)
+    TapeItem *items;
+    size_t count;
+    size_t allocated;
+    char error[128];
+} Tape;
+
+// Results of tape_scan
+#define TAPE_OK 0
+#define TAPE_ERROR -1   // the input is invalid; tape->error describes why
+#define TAPE_NOMEM -2
+
+void tape_init(Tape *tape, const char *buf, size_t size);
+int tape_scan(Tape *tape);
+void tape_free(Tape *tape);
+
+// A batch scans an array of tapes with a pool of worker threads. The tapes
+// are claimed in order, and tape_batch_wait (which should be called without
+// the GIL) returns the result of scanning the specified tape once it's
+// complete, scanning it in the calling thread if no worker has claimed it
+// yet (so a batch with no threads scans each tape as it's waited for)
+typedef struct TapeBatch TapeBatch;
+
+TapeBatch * tape_batch_new(Tape *tapes, size_t count, int threads);
+int tape_batch_wait(TapeBatch *batch, size_t index);
+void tape_batch_free(TapeBatch *batch);
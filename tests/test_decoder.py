@@ -1,7 +1,11 @@
 import math
 import re
 import sys
+import tracemalloc
+from array import array
 from binascii import unhexlify
+from collections import namedtuple
+from dataclasses import dataclass
 from datetime import datetime, timedelta, timezone
 from decimal import Decimal
 from email.message import Message
@@ -62,6 +66,36 @@ def test_str_errors_attr():
             del decoder.str_errors
 
 
+def test_engine_attr():
+    with BytesIO(b'foobar') as stream:
+        with pytest.raises(ValueError):
+            CBORDecoder(stream, engine='foo')
+        with pytest.raises(ValueError):
+            CBORDecoder(stream, engine=1)
+        decoder = CBORDecoder(stream)
+        assert decoder.engine == 'stream'
+        decoder.engine = 'tape'
+        assert decoder.engine == 'tape'
+        decoder.engine = 'iterative'
+        assert decoder.engine == 'iterative'
+        with pytest.raises(TypeError):
+            del decoder.engine
+
+
+def test_max_depth_attr():
+    with BytesIO(b'foobar') as stream:
+        with pytest.raises(ValueError):
+            CBORDecoder(stream, max_depth=0)
+        with pytest.raises(ValueError):
+            CBORDecoder(stream, max_depth='foo')
+        decoder = CBORDecoder(stream)
+        assert decoder.max_depth == 100000
+        decoder.max_depth = 10
+        assert decoder.max_depth == 10
+        with pytest.raises(TypeError):
+            del decoder.max_depth
+
+
 def test_read():
     with BytesIO(b'foobar') as stream:
         decoder = CBORDecoder(stream)
@@ -111,6 +145,21 @@ def test_bad_bigint():
         loads(unhexlify('c269010000000000000000'))
 
 
+@pytest.mark.parametrize('payload, expected', [
+    ('c240', 0),
+    ('c340', -1),
+    ('c24100', 0),
+    ('c241ff', 255),
+    ('c341ff', -256),
+    ('c25f4201024103ff', 0x010203),
+    ('c35f4201024103ff', -0x010204),
+    ('c25821' + 'ff' * 33, 2 ** 264 - 1),
+    ('c35821' + 'ff' * 33, -2 ** 264),
+])
+def test_bigint(payload, expected):
+    assert loads(unhexlify(payload)) == expected
+
+
 def test_invalid_integer_subtype():
     with pytest.raises(CBORDecodeError) as exc:
         loads(b'\x1c')
@@ -160,6 +209,24 @@ def test_special(payload, expected):
     assert decoded is expected
 
 
+@pytest.mark.parametrize('payload', ['fc', 'fd', 'fe'])
+def test_reserved_special(payload):
+    with pytest.raises(CBORDecodeError) as exc:
+        loads(unhexlify(payload))
+    assert 'undefined reserved major type 7' in str(exc.value)
+
+
+@pytest.mark.parametrize('payload, message', [
+    ('5bffffffffffffffff', 'excessive bytestring length'),
+    ('7bffffffffffffffff', 'excessive string length'),
+    ('9bffffffffffffffff', 'excessive array length'),
+])
+def test_excessive_length(payload, message):
+    with pytest.raises(CBORDecodeError) as exc:
+        loads(unhexlify(payload))
+    assert message in str(exc.value)
+
+
 @pytest.mark.parametrize('payload, expected', [
     ('40', b''),
     ('4401020304', b'\x01\x02\x03\x04'),
@@ -182,6 +249,30 @@ def test_string(payload, expected):
     assert decoded == expected
 
 
+@pytest.mark.parametrize('value', [
+    'x' * 100000,
+    'x' * 99999 + '\u00e9',
+    '\U0001f600' * 30000,
+], ids=['ascii', 'latin-1', 'astral'])
+def test_large_string(value):
+    # Strings above the threshold for releasing the GIL
+    data = value.encode('utf-8')
+    assert loads(b'\x7a' + len(data).to_bytes(4, 'big') + data) == value
+
+
+def test_large_string_errors():
+    data = b'x' * 100000 + b'\xff'
+    payload = b'\x7a' + len(data).to_bytes(4, 'big') + data
+    with pytest.raises(UnicodeDecodeError):
+        loads(payload)
+    assert loads(payload, str_errors='replace') == 'x' * 100000 + '\ufffd'
+
+
+def test_large_bytestring():
+    data = bytes(range(256)) * 400
+    assert loads(b'\x5a' + len(data).to_bytes(4, 'big') + data) == data
+
+
 @pytest.mark.parametrize('payload, expected', [
     ('80', []),
     ('83010203', [1, 2, 3]),
@@ -202,6 +293,49 @@ def test_map(payload, expected):
     assert decoded == expected
 
 
+@pytest.mark.parametrize('engine', ['stream', 'tape', 'iterative'])
+def test_map_keys(engine):
+    keys = ['', 'a', 'key', 'x' * 23, 'x' * 24, 'caf\u00e9', '\u00e9', 1, (2, 3)]
+    value = [{key: i for i, key in enumerate(keys)} for _ in range(3)]
+    value.append({'key%d' % i: i for i in range(1000)})
+    decoded = loads(dumps(value), engine=engine)
+    assert decoded == value
+    # short keys repeated between maps are shared
+    assert list(decoded[0])[2] is list(decoded[2])[2]
+    decoded = loads(dumps(value), engine=engine, str_errors='replace')
+    assert decoded == value
+
+
+@pytest.mark.parametrize('payload', [
+    'ba7fffffff01',
+    'bb7fffffffffffffff0102',
+    'a26161',
+])
+def test_map_premature_end(payload):
+    with pytest.raises(CBORDecodeError) as exc:
+        loads(unhexlify(payload))
+    assert 'premature end of stream' in str(exc.value)
+    with BytesIO(unhexlify(payload)) as stream:
+        with pytest.raises(CBORDecodeError) as exc:
+            load(stream)
+        assert 'premature end of stream' in str(exc.value)
+
+
+@pytest.mark.parametrize('engine', ['stream', 'tape', 'iterative'])
+def test_map_nested_presize(engine):
+    # maps claiming 2**31 - 1 pairs, each nested in the last one's first value
+    payload = unhexlify('ba7fffffff00') * 400 + b'\x00'
+    tracemalloc.start()
+    try:
+        with pytest.raises(CBORDecodeError) as exc:
+            loads(payload, engine=engine)
+        peak = tracemalloc.get_traced_memory()[1]
+    finally:
+        tracemalloc.stop()
+    assert 'premature end of stream' in str(exc.value)
+    assert peak < 32 * 1024 * 1024
+
+
 @pytest.mark.parametrize('payload, expected', [
     ('a26161016162820203', {'a': 1, 'b': [2, 3]}),
     ('826161a161626163', ['a', {'b': 'c'}]),
@@ -239,6 +373,43 @@ def test_bad_stream():
         loads(unhexlify('7f657374726561446d696e67ff'))
 
 
+@pytest.mark.parametrize('engine', ['stream', 'tape', 'iterative'])
+@pytest.mark.parametrize('payload, expected', [
+    ('5fff', b''),
+    ('7fff', ''),
+    ('5f5f4101ff40ff', b'\x01'),
+    ('7f62c3a97f6161ff63e282acff', '\xe9a\u20ac'),
+    ('7f' + '7818' + '61' * 24 + '6161ff', 'a' * 25),
+    ('a19f0102ff03', {(1, 2): 3}),
+    ('d901029f9f01ff9fffff', {(1,), ()}),
+])
+def test_streaming_chunks(engine, payload, expected):
+    with BytesIO(unhexlify(payload)) as stream:
+        decoded = CBORDecoder(stream, engine=engine).decode()
+    assert decoded == expected
+    assert type(decoded) is type(expected)
+
+
+@pytest.mark.parametrize('engine', ['stream', 'tape', 'iterative'])
+def test_streaming_split_character(engine):
+    # A character may not be split between the chunks of a string
+    payload = unhexlify('7f61c362a961ff')
+    with BytesIO(payload) as stream:
+        with pytest.raises(UnicodeDecodeError):
+            CBORDecoder(stream, engine=engine).decode()
+    with BytesIO(payload) as stream:
+        decoder = CBORDecoder(stream, engine=engine, str_errors='replace')
+        assert decoder.decode() == '\ufffd\ufffda'
+
+
+@pytest.mark.parametrize('payload', ['7f61ff', '5f5a00000100ff', '9f01'])
+def test_bad_stream_chunk(payload):
+    # Errors within a chunk end decoding rather than reading on
+    with BytesIO(unhexlify(payload)) as stream:
+        with pytest.raises((CBORDecodeError, UnicodeDecodeError)):
+            CBORDecoder(stream).decode()
+
+
 @pytest.mark.parametrize('payload, expected', [
     ('e0', CBORSimpleValue(0)),
     ('e2', CBORSimpleValue(2)),
@@ -290,6 +461,52 @@ def test_datetime(payload, expected):
     assert decoded == expected
 
 
+@pytest.mark.parametrize('value, expected', [
+    ('2013-03-21T20:04:00.3808415Z',
+     datetime(2013, 3, 21, 20, 4, 0, 380841, tzinfo=timezone.utc)),
+    ('2013-03-21T20:04:00.123456789012345678901234567890123456789012345+01:00',
+     datetime(2013, 3, 21, 20, 4, 0, 123456, tzinfo=timezone(timedelta(hours=1)))),
+    ('2013-03-21T12:04:00-08:00',
+     datetime(2013, 3, 21, 12, 4, 0, tzinfo=timezone(timedelta(hours=-8)))),
+    ('2013-03-21T12:04:00-00:30',
+     datetime(2013, 3, 21, 12, 4, 0, tzinfo=timezone(timedelta(minutes=-30)))),
+], ids=[
+    'micro7',
+    'long',
+    'negative-offset',
+    'negative-minutes',
+])
+def test_datetime_strings(value, expected):
+    payload = dumps(CBORTag(0, value))
+    assert loads(payload) == expected
+    # indefinite length strings take the generic path
+    value = value.encode('ascii')
+    payload = b'\xc0\x7f' + dumps(value[:5].decode()) + dumps(value[5:].decode()) + b'\xff'
+    assert loads(payload) == expected
+
+
+def test_datetime_timezone_cache():
+    a = loads(dumps(CBORTag(0, '2013-03-21T12:04:00-08:00')))
+    b = loads(dumps(CBORTag(0, '2014-03-21T12:04:00-08:00')))
+    assert a.tzinfo is b.tzinfo
+
+
+@pytest.mark.parametrize('value', [
+    '2013-03-21T20:04:00',
+    '2013-03-21T20:04:00.Z',
+    '2013-03-21 20:04:00Z',
+    '2013-03-21T20:04:00+0200',
+    '2013-03-21T20:04:00+02:00Z',
+    '2013-03-21T20:04:00ZZ',
+    '2013-03-2lT20:04:00Z',
+    '\u0662013-03-21T20:04:00Z',
+])
+def test_bad_datetime_strings(value):
+    with pytest.raises(CBORDecodeError) as exc:
+        loads(dumps(CBORTag(0, value)))
+    assert str(exc.value).endswith("invalid datetime string %r" % value)
+
+
 def test_bad_datetime():
     with pytest.raises(CBORDecodeError) as exc:
         loads(unhexlify('c06b303030302d3132332d3031'))
@@ -307,11 +524,45 @@ def test_fraction():
     assert decoded == Decimal('273.15')
 
 
+@pytest.mark.parametrize('value', [
+    Decimal('0'),
+    Decimal('-1E-10'),
+    Decimal('123456789012345678901234567890.123456789'),
+    Decimal('-' + '9' * 200 + 'E+100'),
+], ids=['zero', 'small', 'precise', 'bignum'])
+def test_fraction_exact(value):
+    # Decoded fractions aren't subject to the decimal context's precision
+    decoded = loads(dumps(value))
+    assert decoded == value
+    assert decoded.as_tuple() == value.as_tuple()
+
+
+def test_bad_fraction():
+    with pytest.raises(CBORDecodeError) as exc:
+        loads(unhexlify('c482016161'))
+    assert str(exc.value).endswith("invalid decimal fraction value (1, 'a')")
+
+
 def test_bigfloat():
     decoded = loads(unhexlify('c5822003'))
     assert decoded == Decimal('1.5')
 
 
+@pytest.mark.parametrize('payload, expected', [
+    ('c5820403', Decimal(48)),
+    ('c58239043103', Decimal(3 * 2 ** -1074)),
+    ('c5823b7fffffffffffffff03', Decimal(2) ** -(2 ** 63) * 3),
+], ids=['positive', 'subnormal', 'excessive'])
+def test_bigfloat_exact(payload, expected):
+    assert loads(unhexlify(payload)) == expected
+
+
+def test_bad_bigfloat():
+    with pytest.raises(CBORDecodeError) as exc:
+        loads(unhexlify('c58101'))
+    assert str(exc.value).endswith("invalid bigfloat value (1,)")
+
+
 def test_rational():
     decoded = loads(unhexlify('d81e820205'))
     assert decoded == Fraction(2, 5)
@@ -385,6 +636,50 @@ def test_bad_ipnetwork():
         {b'\xc0\xa8\x00d': b'\x01\x02'})
 
 
+@pytest.mark.parametrize('payload, expected', [
+    ('d8404301ff02', array('B', [1, 255, 2])),
+    ('d8444301ff02', array('B', [1, 255, 2])),
+    ('d8484301ff02', array('b', [1, -1, 2])),
+    ('d84144000100ff', array('H', [1, 255])),
+    ('d84544010000ff', array('H', [1, 65280])),
+    ('d84944fffe0002', array('h', [-2, 2])),
+    ('d84d44fefff0ff', array('h', [-2, -16])),
+    ('d84a48fffffffe00000002', array('i', [-2, 2])),
+    ('d84f5000000000000000800100000000000000', array('q', [-2 ** 63, 1])),
+    ('d8435001000000000000000000000000000001', array('Q', [2 ** 56, 1])),
+    ('d850443e00c000', array('f', [1.5, -2.0])),
+    ('d85444003e00c0', array('f', [1.5, -2.0])),
+    ('d851483fc00000c0000000', array('f', [1.5, -2.0])),
+    ('d85548 0000c03f000000c0', array('f', [1.5, -2.0])),
+    ('d852483ff8000000000000', array('d', [1.5])),
+    ('d85648000000000000f83f', array('d', [1.5])),
+    ('d8525f443ff800004400000000ff', array('d', [1.5])),
+], ids=[
+    'uint8', 'uint8-clamped', 'sint8', 'uint16be', 'uint16le', 'sint16be',
+    'sint16le', 'sint32be', 'sint64le', 'uint64be', 'float16be',
+    'float16le', 'float32be', 'float32le', 'float64be', 'float64le',
+    'indefinite'])
+def test_typed_array(payload, expected):
+    decoded = loads(unhexlify(payload.replace(' ', '')))
+    assert decoded.typecode == expected.typecode
+    assert decoded == expected
+
+
+def test_typed_array_unsupported():
+    assert loads(unhexlify('d85350' + '11' * 16)) == CBORTag(83, b'\x11' * 16)
+    assert loads(unhexlify('d84c4101')) == CBORTag(76, b'\x01')
+
+
+@pytest.mark.parametrize('payload, message', [
+    ('d8454301ff02', 'invalid typed array length 3 (must be a multiple of 2)'),
+    ('d8528101', 'invalid typed array value [1]'),
+])
+def test_bad_typed_array(payload, message):
+    with pytest.raises(CBORDecodeError) as exc:
+        loads(unhexlify(payload))
+    assert str(exc.value).endswith(message)
+
+
 def test_bad_shared_reference():
     with pytest.raises(CBORDecodeError) as exc:
         loads(unhexlify('d81d05'))
@@ -394,6 +689,166 @@ def test_bad_shared_reference():
     assert str(exc.value).endswith("invalid shared reference b'\\x01'")
 
 
+@pytest.mark.parametrize('payload', [
+    'd81c82d81c8101d81d01',
+    'd81c82d81c8101d81d1801',
+    'd81c82d81c8101d81d190001',
+    'd81c82d81c8101d81d1a00000001',
+    'd81c82d81c8101d81d1b0000000000000001',
+], ids=['direct', 'uint8', 'uint16', 'uint32', 'uint64'])
+def test_shared_reference(payload):
+    decoded = loads(unhexlify(payload))
+    assert decoded == [[1], [1]]
+    assert decoded[0] is decoded[1]
+
+
+def test_shared_reference_per_message():
+    # each top-level message has its own set of shared values
+    with BytesIO(unhexlify('d81c8101d81c82d81c8102d81d01d81d00')) as stream:
+        decoder = CBORDecoder(stream)
+        assert decoder.decode() == [1]
+        assert decoder.decode() == [[2], [2]]
+        with pytest.raises(CBORDecodeError) as exc:
+            decoder.decode()
+        assert str(exc.value).endswith('shared reference 0 not found')
+
+
+def test_shared_reentrant_finalizer():
+    class Reentrant:
+        def __del__(self):
+            seen.append(decoder.decode())
+
+    seen = []
+    # [shareable([]), shareable(tag 1000)], then shareable([1]) which is
+    # decoded by the finalizer, then shareable([2]) and shareable([3])
+    payload = '82d81c80d81cd903e800 d81c8101 d81c8102 d81c8103'
+    with BytesIO(unhexlify(payload.replace(' ', ''))) as stream:
+        decoder = CBORDecoder(stream, tag_hook=lambda d, tag: Reentrant())
+        value = decoder.decode()
+        assert value[0] == []
+        del value
+        # releasing the first message's values runs the finalizer, whose
+        # value must outlive the release
+        assert decoder.decode() == [2]
+        assert seen == [[1]]
+        assert decoder.decode() == [3]
+        assert seen == [[1]]
+
+
+@pytest.mark.parametrize('engine', ['stream', 'tape', 'iterative'])
+def test_string_reference(engine):
+    # ['aaa', ['bbb', 'aaa'], b'bbb', 'bbb'] with the repeated strings replaced
+    # by references; b'bbb' isn't equal to 'bbb' so it's numbered separately
+    decoded = loads(unhexlify(
+        'd9010084636161618263626262d81900436262'
+        '62d81901'), engine=engine)
+    assert decoded == ['aaa', ['bbb', 'aaa'], b'bbb', 'bbb']
+    assert decoded[1][1] is decoded[0]
+    assert decoded[3] is decoded[1][0]
+
+
+@pytest.mark.parametrize('engine', ['stream', 'tape', 'iterative'])
+def test_string_reference_nested_namespace(engine):
+    # strings in an inner namespace are numbered from 0 and forgotten at its
+    # end
+    decoded = loads(unhexlify(
+        'd9010084636161618263626262d81900d901008263636363d81900'
+        'd81901'), engine=engine)
+    assert decoded == ['aaa', ['bbb', 'aaa'], ['ccc', 'ccc'], 'bbb']
+
+
+@pytest.mark.parametrize('payload, message', [
+    ('d81900', 'string reference 0 outside of a namespace'),
+    ('d9010082626161d81900', 'string reference 0 not found'),
+    ('d901008263616161d81901', 'string reference 1 not found'),
+    ('d9010081d8196161', "invalid string reference 'a'"),
+], ids=['outside', 'too short', 'not found', 'invalid'])
+@pytest.mark.parametrize('engine', ['stream', 'tape', 'iterative'])
+def test_invalid_string_reference(engine, payload, message):
+    with pytest.raises(CBORDecodeError) as exc:
+        loads(unhexlify(payload), engine=engine)
+    assert message in str(exc.value)
+
+
+def test_packed_sharing_attr():
+    with BytesIO() as stream:
+        decoder = CBORDecoder(stream)
+        assert decoder.packed_sharing
+        decoder.packed_sharing = False
+        assert not decoder.packed_sharing
+        assert not CBORDecoder(stream, packed_sharing=False).packed_sharing
+
+
+@pytest.mark.parametrize('payload, expected', [
+    ('d87183816b68656c6c6f20776f726c648083e0e0e0', ['hello world'] * 3),
+    ('d8718392' + ''.join('%02x' % i for i in range(18)) +
+     '8084e0efd80600d80620', [0, 15, 16, 17]),
+    ('d8718381616180 82e0 d8718381616280 82e0e1', ['a', ['b', 'a']]),
+    ('d87183818201028 0a1e0e0', {(1, 2): [1, 2]}),
+], ids=['simple', 'tagged', 'nested', 'immutable'])
+@pytest.mark.parametrize('engine', ['stream', 'tape', 'iterative'])
+def test_packed(engine, payload, expected):
+    assert loads(unhexlify(payload.replace(' ', '')), engine=engine) == expected
+
+
+@pytest.mark.parametrize('engine', ['stream', 'tape', 'iterative'])
+def test_packed_sharing(engine):
+    payload = unhexlify('d8718381830102038082e0e0')
+    decoded = loads(payload, engine=engine)
+    assert decoded == [[1, 2, 3], [1, 2, 3]]
+    assert decoded[0] is decoded[1]
+    decoded = loads(payload, engine=engine, packed_sharing=False)
+    assert decoded == [[1, 2, 3], [1, 2, 3]]
+    assert decoded[0] is not decoded[1]
+
+
+@pytest.mark.parametrize('engine', ['stream', 'tape', 'iterative'])
+def test_packed_expansion(engine):
+    # each shared item is a list of 10 references to the one before it
+    payload = unhexlify(
+        'd871838800' + ''.join('8a' + ('%02x' % (0xe0 + i)) * 10
+                                for i in range(7)) + '80e7')
+    decoded = loads(payload, engine=engine)
+    assert decoded[0][0][0][0][0][0] == [0] * 10
+    with pytest.raises(CBORDecodeError) as exc:
+        loads(payload, engine=engine, packed_sharing=False)
+    assert 'packed CBOR expansion limit exceeded' in str(exc.value)
+    # the same applies to the tuples made for a key
+    with pytest.raises(CBORDecodeError) as exc:
+        loads(payload[:-1] + unhexlify('a1e701'), engine=engine)
+    assert 'packed CBOR expansion limit exceeded' in str(exc.value)
+
+
+@pytest.mark.parametrize('engine', ['stream', 'tape', 'iterative'])
+def test_packed_deep_copy(engine):
+    # each shared item nests the one before it 400 deep
+    payload = unhexlify(
+        'd871839000' + ''.join('81' * 400 + '%02x' % (0xe0 + i)
+                                for i in range(15)) + '80ef')
+    decoded = loads(payload, engine=engine)
+    assert isinstance(decoded, list)
+    with pytest.raises(RecursionError):
+        loads(payload, engine=engine, packed_sharing=False)
+
+
+@pytest.mark.parametrize('payload, message', [
+    ('d871820000', 'invalid packed CBOR table'),
+    ('d871839f01ff80e0', 'invalid packed CBOR table'),
+    ('d87183808100 80', 'packed CBOR argument tables are not supported'),
+    ('d8718381 01 80e1', 'shared item 1 not found'),
+    ('d8718382 81e1 01 80e0', 'shared item 1 has not been defined'),
+    ('d8718381 01 80d8066161', "invalid shared item reference 'a'"),
+    ('d8718381 01 80d8061b7fffffffffffffff',
+     'excessive shared item reference'),
+], ids=['short', 'indefinite', 'arguments', 'not found', 'forward',
+        'invalid', 'excessive'])
+@pytest.mark.parametrize('engine', ['stream', 'tape', 'iterative'])
+def test_invalid_packed(engine, payload, message):
+    with pytest.raises(CBORDecodeError) as exc:
+        loads(unhexlify(payload.replace(' ', '')), engine=engine)
+    assert message in str(exc.value)
+
+
 def test_uninitialized_shared_reference():
     with pytest.raises(CBORDecodeError) as exc:
         # encode a set of a recursive array; the set forces the embedded array
@@ -483,6 +938,14 @@ def test_object_hook():
     assert decoded.state == {'a': 3, 'b': 5}
 
 
+def test_object_hook_exception():
+    def object_hook(decoder, value):
+        raise RuntimeError('foo')
+
+    with pytest.raises(RuntimeError):
+        loads(unhexlify('a2616103616205'), object_hook=object_hook)
+
+
 def test_load_from_file(tmpdir):
     path = tmpdir.join('testdata.cbor')
     path.write_binary(unhexlify('82010a'))
@@ -523,3 +986,353 @@ def test_bad_set():
 def test_immutable_keys(payload, expected):
     value = loads(unhexlify(payload))
     assert value == expected
+
+
+@pytest.mark.parametrize('threads', [0, 1, 4, None])
+def test_loads_many(threads):
+    payloads = [
+        '00', '3903e7', 'c249010000000000000000', '3bffffffffffffffff',
+        '4401020304', '5f42010243030405ff', '6449455446', '7f657374726561646d696e67ff',
+        '83010203', '9f018202039f0405ffff', 'a26161016162820203',
+        'bf61610161629f0203ffff', 'a182010203', 'a1d901028301020304',
+        'f4', 'f5', 'f6', 'f7', 'f0', 'f818', 'ff', 'f93c00', 'fa47c35000',
+        'fb3ff199999999999a', 'c074323031332d30332d32315432303a30343a30305a',
+        'd81c81d81d00', 'd81ca100d81d00', 'd917706548656c6c6f',
+        '98190102030405060708090a0b0c0d0e0f101112131415161718181819',
+    ]
+    buffers = [unhexlify(payload) for payload in payloads]
+    expected = [loads(buf) for buf in buffers]
+    decoded = loads_many(buffers, threads=threads)
+    assert len(decoded) == len(expected)
+    for value, expected_value in zip(decoded, expected):
+        if isinstance(value, list) and value and value[0] is value:
+            # the cyclic structures can't be compared directly
+            assert expected_value[0] is expected_value
+        elif isinstance(value, dict) and value.get(0) is value:
+            assert expected_value[0] is expected_value
+        else:
+            assert value == expected_value
+            assert type(value) is type(expected_value)
+
+
+def test_loads_many_buffers():
+    assert loads_many([]) == []
+    assert loads_many(
+        [b'\x01', bytearray(b'\x02'), memoryview(b'\x03')]) == [1, 2, 3]
+    assert loads_many(b'\x01' * 1000 for _ in range(100)) == [1] * 100
+    with pytest.raises(TypeError):
+        loads_many([b'\x01', 'foo'])
+    with pytest.raises(ValueError):
+        loads_many([b'\x01'], threads=-1)
+
+
+def test_loads_many_options():
+    def tag_hook(decoder, tag):
+        return tag.value[::-1]
+
+    def object_hook(decoder, value):
+        return sorted(value.items())
+
+    buffers = [
+        unhexlify('d917708301020e'), unhexlify('a2616102616201'),
+        unhexlify('62c3a9'), unhexlify('62c328'),
+    ]
+    assert loads_many(
+        buffers, tag_hook=tag_hook, object_hook=object_hook,
+        str_errors='replace') == [
+        [14, 2, 1], [('a', 2), ('b', 1)], 'é', '�('
+    ]
+    with pytest.raises(UnicodeDecodeError):
+        loads_many(buffers)
+
+
+@pytest.mark.parametrize('threads', [0, 2])
+@pytest.mark.parametrize('payload, message', [
+    ('8201', 'premature end of stream'),
+    ('5f4101', 'premature end of stream'),
+    ('bb8000000000000000', 'premature end of stream'),
+    ('bb8000000000000001', 'premature end of stream'),
+    ('5f6161ff', 'non-bytestring found in indefinite length bytestring'),
+    ('7f4161ff', 'non-string found in indefinite length string'),
+    ('1c', 'unknown unsigned integer subtype 0x1c'),
+    ('df00', 'unknown unsigned integer subtype 0x1f'),
+    ('c06161', 'invalid datetime string'),
+])
+def test_loads_many_errors(threads, payload, message):
+    buffers = [b'\x01'] * 10 + [unhexlify(payload)] + [b'\x02'] * 10
+    with pytest.raises(CBORDecodeError) as exc:
+        loads_many(buffers, threads=threads)
+    assert message in str(exc.value)
+
+
+@pytest.mark.parametrize('payload', [
+    '00', '3903e7', 'c249010000000000000000', '3bffffffffffffffff',
+    '4401020304', '5f42010243030405ff', '6449455446', '62c3a9',
+    '7f657374726561646d696e67ff', '83010203', '9f018202039f0405ffff',
+    'a26161016162820203', 'bf61610161629f0203ffff', 'a182010203',
+    'a1d901028301020304', 'f4', 'f5', 'f6', 'f7', 'f0', 'f818', 'ff',
+    'f93c00', 'fa47c35000', 'fb3ff199999999999a',
+    'c074323031332d30332d32315432303a30343a30305a',
+    '82d81c8100d81d00', 'd917706548656c6c6f', '8280a0',
+    '98190102030405060708090a0b0c0d0e0f101112131415161718181819',
+    'd81c81d81d00', '82d81cd90102820102d81d00', '9f9f9f01ffffff',
+    'a18201029f0304ff', 'a1d9010282010203', 'd90102820102',
+    'd901029f0102ff', 'd863d86482d81c01d81d00',
+])
+@pytest.mark.parametrize('engine', ['tape', 'iterative'])
+def test_engines(engine, payload):
+    buf = unhexlify(payload)
+    expected = loads(buf)
+    value = loads(buf, engine=engine)
+    if isinstance(value, list) and value and value[0] is value:
+        # the cyclic structures can't be compared directly
+        assert expected[0] is expected
+        return
+    assert value == expected
+    assert type(value) is type(expected)
+
+
+def test_tape_engine_stream():
+    with BytesIO(unhexlify('0183010203a16161f5')) as stream:
+        decoder = CBORDecoder(stream, engine='tape')
+        assert decoder.decode() == 1
+        assert decoder.decode() == [1, 2, 3]
+        # the stream engine carries on from the same point
+        decoder.engine = 'stream'
+        assert decoder.decode() == {'a': True}
+        with pytest.raises(CBORDecodeError) as exc:
+            decoder.decode()
+        assert 'premature end of stream' in str(exc.value)
+        stream.write(b'\x02')
+        stream.seek(-1, 2)
+        decoder.engine = 'tape'
+        assert decoder.decode() == 2
+        assert decoder.decode_from_bytes(bytearray(b'\x82\x03\x04')) == [3, 4]
+
+
+def test_tape_engine_hook_replaces_fp():
+    def hook(decoder, value):
+        decoder.fp = BytesIO(unhexlify('83070809'))
+        return value
+
+    with BytesIO(unhexlify('82a161610105')) as stream:
+        decoder = CBORDecoder(stream, engine='tape', object_hook=hook)
+        assert decoder.decode() == [{'a': 1}, 5]
+        assert decoder.decode() == [7, 8, 9]
+
+
+def test_tape_engine_hook_decodes():
+    def hook(decoder, tag):
+        # the read-ahead buffer is used up, so this reads fp (which is empty)
+        with pytest.raises(CBORDecodeError):
+            decoder.decode()
+        return tag.value
+
+    with BytesIO(unhexlify('d903e8a1616101')) as stream:
+        decoder = CBORDecoder(stream, engine='tape', tag_hook=hook)
+        assert decoder.decode() == {'a': 1}
+        with pytest.raises(CBORDecodeError):
+            decoder.decode()
+        stream.write(unhexlify('83060708'))
+        stream.seek(-4, 2)
+        assert decoder.decode() == [6, 7, 8]
+
+
+def test_tape_engine_options():
+    def tag_hook(decoder, tag):
+        return tag.value[::-1]
+
+    def object_hook(decoder, value):
+        return sorted(value.items())
+
+    assert loads(
+        unhexlify('82d917708301020ea2616102616201'), engine='tape',
+        tag_hook=tag_hook, object_hook=object_hook) == [
+        [14, 2, 1], [('a', 2), ('b', 1)]
+    ]
+    assert loads(unhexlify('62c328'), engine='tape', str_errors='replace') == '\ufffd('
+
+
+@pytest.mark.parametrize('payload, message', [
+    ('', 'premature end of stream'),
+    ('8201', 'premature end of stream'),
+    ('bb8000000000000000', 'premature end of stream'),
+    ('bb8000000000000001', 'premature end of stream'),
+    ('5f6161ff', 'non-bytestring found in indefinite length bytestring'),
+    ('1c', 'unknown unsigned integer subtype 0x1c'),
+    ('c06161', 'invalid datetime string'),
+])
+def test_tape_engine_errors(payload, message):
+    with pytest.raises(CBORDecodeError) as exc:
+        loads(unhexlify(payload), engine='tape')
+    assert message in str(exc.value)
+
+
+def test_iterative_engine_depth():
+    payload = b'\x81' * 10000 + b'\x00'
+    with pytest.raises(RecursionError):
+        loads(payload)
+    value = loads(payload, engine='iterative')
+    for i in range(10000):
+        value = value[0]
+    assert value == 0
+    with pytest.raises(CBORDecodeError) as exc:
+        loads(payload, engine='iterative', max_depth=9999)
+    assert 'maximum nesting depth 9999 exceeded' in str(exc.value)
+    assert loads(payload, engine='iterative', max_depth=10000) is not None
+
+
+def test_iterative_engine_hooks():
+    def tag_hook(decoder, tag):
+        return tag.value[::-1]
+
+    def object_hook(decoder, value):
+        return sorted(value.items())
+
+    assert loads(
+        unhexlify('82d917708301020ea2616102616201'), engine='iterative',
+        tag_hook=tag_hook, object_hook=object_hook) == [
+        [14, 2, 1], [('a', 2), ('b', 1)]
+    ]
+    with BytesIO(unhexlify('820102a0')) as stream:
+        decoder = CBORDecoder(stream, engine='iterative')
+        assert decoder.decode() == [1, 2]
+        assert decoder.decode() == {}
+
+
+Point = namedtuple('Point', 'x y label')
+
+
+@dataclass(frozen=True)
+class Reading:
+    sensor: str
+    values: list
+
+
+class Slotted:
+    __slots__ = ('name', '__secret')
+
+    def __init__(self):
+        raise AssertionError('__init__ should not be called')
+
+
+def test_schemas_attr():
+    with BytesIO() as stream:
+        decoder = CBORDecoder(stream)
+        assert decoder.schemas is None
+        schema = compile_schema(Point, register=False)
+        decoder.schemas = [schema]
+        assert decoder.schemas == (schema,)
+        decoder.schemas = None
+        assert decoder.schemas is None
+        with pytest.raises(ValueError):
+            decoder.schemas = [Point]
+        with pytest.raises(TypeError):
+            del decoder.schemas
+
+
+@pytest.mark.parametrize('engine', ['stream', 'tape', 'iterative'])
+def test_schemas(engine):
+    schemas = [compile_schema(cls, register=False)
+               for cls in (Point, Reading, Slotted)]
+    payload = dumps([
+        {'x': 1, 'y': 2, 'label': 'a'},
+        {'label': 'b', 'y': [3], 'x': None},
+        {'sensor': 'probe', 'values': [{'x': 1, 'y': 2, 'label': 'c'}]},
+        {'name': 'n', '__secret': 's'},
+        {'x': 1, 'y': 2},
+        {'x': 1, 'y': 2, 'label': 'a', 'extra': True},
+    ])
+    decoded = loads(payload, engine=engine, schemas=schemas,
+                    object_hook=lambda decoder, value: ('hook', value))
+    assert decoded[:3] == [
+        Point(1, 2, 'a'),
+        Point(None, [3], 'b'),
+        Reading('probe', [Point(1, 2, 'c')]),
+    ]
+    assert type(decoded[3]) is Slotted
+    assert decoded[3].name == 'n'
+    assert decoded[3]._Slotted__secret == 's'
+    # maps which don't match any schema are decoded as usual
+    assert decoded[4:] == [
+        ('hook', {'x': 1, 'y': 2}),
+        ('hook', {'x': 1, 'y': 2, 'label': 'a', 'extra': True}),
+    ]
+
+
+@pytest.mark.parametrize('engine', ['stream', 'tape', 'iterative'])
+def test_schemas_foreign_slot(engine):
+    class Foreign:
+        y = Slotted.__dict__['name']
+    with pytest.raises(TypeError):
+        loads(unhexlify('a1617901'), engine=engine,
+              schemas=[compile_schema(Foreign, fields=['y'], register=False)])
+
+
+@pytest.mark.parametrize('engine', ['stream', 'iterative'])
+def test_schemas_shared(engine):
+    # shared maps exist before their values, so they can't become records
+    value = {'x': 1, 'y': 2, 'label': 'a'}
+    decoded = loads(dumps([value, value], value_sharing=True), engine=engine,
+                    schemas=[compile_schema(Point, register=False)])
+    assert decoded == [value, value]
+    assert decoded[0] is decoded[1]
+
+
+@pytest.mark.parametrize('engine', ['stream', 'tape', 'iterative'])
+def test_schemas_roundtrip(engine):
+    schema = compile_schema(Point, register=False)
+    value = [Point(i, str(i), [i] * 3) for i in range(20)]
+    with BytesIO() as stream:
+        encoder = CBOREncoder(stream, canonical=True)
+        encoder.encoders[Point] = schema
+        encoder.encode(value)
+        assert loads(stream.getvalue(), engine=engine,
+                     schemas=[schema]) == value
+
+
+@pytest.mark.parametrize('payload, expected', [
+    ('da00636f6c 83 8261616162 8400010203 84617861786178 6178',
+     [{'a': i, 'b': 'x'} for i in range(4)]),
+    ('da00636f6c 82 816161 d845 48 0000 6400 c800 2c01',
+     [{'a': i * 100} for i in range(4)]),
+    ('da00636f6c 82 816161 d855 50 00000000 0000003f 0000803f 0000c03f',
+     [{'a': i / 2} for i in range(4)]),
+    ('da00636f6c 82 816161 82 da00636f6c 82 816162 820102 80',
+     [{'a': [{'b': 1}, {'b': 2}]}, {'a': []}]),
+    ('da00636f6c 82 816161 80', []),
+], ids=['simple', 'typed', 'float', 'nested', 'empty'])
+@pytest.mark.parametrize('engine', ['stream', 'tape', 'iterative'])
+def test_columnar(engine, payload, expected):
+    assert loads(unhexlify(payload.replace(' ', '')), engine=engine) == expected
+
+
+@pytest.mark.parametrize('engine', ['stream', 'tape', 'iterative'])
+def test_columnar_schemas(engine):
+    schemas = [compile_schema(Point, register=False)]
+    value = [{'x': i, 'y': i * 1000, 'label': 'p'} for i in range(4)]
+    payload = dumps([value, [{'x': 1, 'y': 2}] * 4], columnar=True)
+    decoded = loads(payload, engine=engine, schemas=schemas,
+                    object_hook=lambda decoder, value: ('hook', value))
+    assert decoded == [
+        [Point(i, i * 1000, 'p') for i in range(4)],
+        [('hook', {'x': 1, 'y': 2})] * 4,
+    ]
+
+
+@pytest.mark.parametrize('payload', [
+    'da00636f6c 01',
+    'da00636f6c 81 81 6161',
+    'da00636f6c 83 81 6161 80 80',
+    'da00636f6c 82 81 6161 01',
+    'da00636f6c 83 82 6161 6162 81 01 82 01 02',
+    'da00636f6c 83 82 6161 6162 d81c 82 01 02 d81d 00',
+    '82 d81c 43 010203 da00636f6c 82 81 6161 d840 d81d 00',
+    'da00636f6c 82 81 6161 d8 19 00',
+], ids=['not an array', 'no columns', 'too many columns', 'invalid column',
+        'lengths', 'shared column', 'shared typed array', 'other tag'])
+@pytest.mark.parametrize('engine', ['stream', 'tape', 'iterative'])
+def test_invalid_columnar(engine, payload):
+    with pytest.raises(CBORDecodeError) as exc:
+        loads(unhexlify(payload.replace(' ', '')), engine=engine)
+    assert 'invalid columnar value' in str(exc.value)
@@ -1,9 +1,14 @@
 import re
 import sys
+import math
+import struct
+import hashlib
+from array import array
 from io import BytesIO
 from binascii import unhexlify
-from collections import OrderedDict
-from datetime import datetime, timedelta, date, timezone
+from collections import OrderedDict, namedtuple
+from dataclasses import dataclass
+from datetime import datetime, timedelta, date, timezone, tzinfo
 from decimal import Decimal
 from email.mime.text import MIMEText
 from ipaddress import ip_address, ip_network
@@ -45,6 +50,21 @@ def test_timezone_attr():
             del encoder.timezone
 
 
+def test_engine_attr():
+    with BytesIO() as stream:
+        encoder = CBOREncoder(stream)
+        assert encoder.engine == 'stream'
+        encoder.engine = 'iterative'
+        assert encoder.engine == 'iterative'
+        assert CBOREncoder(stream, engine='iterative').engine == 'iterative'
+        with pytest.raises(ValueError):
+            encoder.engine = 'tape'
+        with pytest.raises(ValueError):
+            CBOREncoder(stream, engine=1)
+        with pytest.raises(TypeError):
+            del encoder.engine
+
+
 def test_write():
     with BytesIO() as stream:
         encoder = CBOREncoder(stream)
@@ -191,6 +211,30 @@ def test_datetime(value, as_timestamp, expected):
     assert dumps(value, datetime_as_timestamp=as_timestamp, timezone=timezone.utc) == expected
 
 
+@pytest.mark.parametrize('value', [
+    datetime(1, 1, 1, 0, 0, 0, tzinfo=timezone.utc),
+    datetime(1969, 12, 31, 23, 59, 59, 999999, tzinfo=timezone.utc),
+    datetime(2000, 2, 29, 12, 0, 0, 1, tzinfo=timezone(timedelta(hours=-5))),
+    datetime(2013, 3, 21, 20, 4, 0, tzinfo=timezone(timedelta(seconds=-3661))),
+    datetime(2013, 3, 21, 20, 4, 0, tzinfo=timezone(timedelta(minutes=1, microseconds=5))),
+    datetime(9999, 12, 31, 23, 59, 59, 999999, tzinfo=timezone(timedelta(hours=14))),
+], ids=[
+    'min',
+    'pre-epoch',
+    'leap-day',
+    'offset+seconds',
+    'offset+micro',
+    'max',
+])
+def test_datetime_native(value):
+    # The datetime encoder formats values natively; check it agrees with the
+    # standard library's isoformat() and timestamp()
+    expected = value.isoformat().replace('+00:00', 'Z').encode('ascii')
+    assert dumps(value)[1:].endswith(expected)
+    expected = value.timestamp()
+    assert loads(dumps(value, datetime_as_timestamp=True)[1:]) == expected
+
+
 def test_date():
     expected = unhexlify('c074323031332d30332d32315430303a30303a30305a')
     assert dumps(date(2013, 3, 21), timezone=timezone.utc) == expected
@@ -208,13 +252,27 @@ def test_naive_datetime():
     (Decimal('-14.123'), 'C4822239372A'),
     (Decimal('NaN'), 'f97e00'),
     (Decimal('Infinity'), 'f97c00'),
-    (Decimal('-Infinity'), 'f9fc00')
-], ids=['normal', 'negative', 'nan', 'inf', 'neginf'])
+    (Decimal('-Infinity'), 'f9fc00'),
+    (Decimal('-0'), 'c4820000'),
+    (Decimal('18446744073709551615'), 'c482001bffffffffffffffff'),
+    (Decimal('-18446744073709551616'), 'c482003bffffffffffffffff'),
+    (Decimal('1.8446744073709551616'), 'c48232c249010000000000000000'),
+], ids=['normal', 'negative', 'nan', 'inf', 'neginf', 'negzero', 'uint64',
+        'negint64', 'bignum'])
 def test_decimal(value, expected):
     expected = unhexlify(expected)
     assert dumps(value) == expected
 
 
+@pytest.mark.parametrize('length', [20, 640, 641, 4300, 5000, 12345])
+def test_decimal_long_significand(length):
+    digits = ''.join(str(i * 7 % 10) for i in range(1, length + 1))
+    value = Decimal('-' + digits + 'E-5')
+    # int(Decimal) isn't subject to the int max str digits limit
+    significand = -int(Decimal(digits))
+    assert dumps(value) == unhexlify('c48224') + dumps(significand)
+
+
 def test_rational():
     expected = unhexlify('d81e820205')
     assert dumps(Fraction(2, 5)) == expected
@@ -263,6 +321,90 @@ def test_ipnetwork(value, expected):
     assert dumps(value) == expected
 
 
+@pytest.mark.parametrize('value, tag', [
+    (array('B', [1, 2, 255]), 64),
+    (array('b', [1, -2, 127]), 72),
+    (array('H', [1, 2, 65535]), 65),
+    (array('h', [1, -2, 32767]), 73),
+    (array('I', [1, 2, 2 ** 32 - 1]), 66),
+    (array('i', [1, -2, 2 ** 31 - 1]), 74),
+    (array('Q', [1, 2, 2 ** 64 - 1]), 67),
+    (array('q', [1, -2, 2 ** 63 - 1]), 75),
+    (array('f', [1.5, -2.0, float('inf')]), 81),
+    (array('d', [1.5, -2.0, 1e300]), 82),
+    (memoryview(b'\x01\x00\x02\x00').cast('h'), 73),
+], ids=['B', 'b', 'H', 'h', 'I', 'i', 'Q', 'q', 'f', 'd', 'memoryview'])
+def test_typed_array(value, tag):
+    view = memoryview(value)
+    data = view.tobytes()
+    if view.itemsize > 1 and sys.byteorder == 'little':
+        native_tag = tag + 4
+    else:
+        native_tag = tag
+    assert dumps(value) == dumps(CBORTag(native_tag, data))
+    # canonical output is always big-endian
+    big = array(view.format, data)
+    if sys.byteorder == 'little':
+        big.byteswap()
+    assert dumps(value, canonical=True) == dumps(CBORTag(tag, big.tobytes()))
+
+
+@pytest.mark.parametrize('typecode', ['h', 'i', 'q', 'd'])
+@pytest.mark.parametrize('length', [0, 1, 3, 4, 15, 16, 17, 33, 1000])
+def test_typed_array_swapped(typecode, length):
+    # Exercise the vectorised byte-swapping (and its scalar tail) by
+    # round-tripping through the canonical (big-endian) encoding
+    value = array(typecode, range(-length, length, 2))
+    big = array(typecode, value)
+    if sys.byteorder == 'little':
+        big.byteswap()
+    encoded = dumps(value, canonical=True)
+    assert encoded.endswith(big.tobytes())
+    assert loads(encoded) == value
+
+
+@pytest.mark.parametrize('typecode', ['f', 'd'])
+@pytest.mark.parametrize('length', [0, 1, 7, 8, 9, 100, 100000])
+def test_typed_array_float16(typecode, length):
+    # Values are rounded to the nearest half as by struct's 'e' format (which
+    # raises on overflow rather than returning infinity); this exercises both
+    # the vectorised conversions and their scalar tail
+    values = [65520.0, -1e-8, float('-inf')] + [
+        (i - 50) * 1.001 ** i for i in range(length)]
+    value = array(typecode, values[:length])
+    rounded = [
+        v if abs(v) < 65520 else math.copysign(math.inf, v) for v in value]
+    native = struct.pack('=%de' % length, *rounded)
+    big = struct.pack('>%de' % length, *rounded)
+    tag = 84 if sys.byteorder == 'little' else 80
+    assert dumps(value, float16_arrays=True) == dumps(CBORTag(tag, native))
+    assert dumps(value, float16_arrays=True, canonical=True) == dumps(
+        CBORTag(80, big))
+    assert loads(dumps(value, float16_arrays=True)) == array(
+        'f', struct.unpack('=%de' % length, native))
+
+
+@pytest.mark.parametrize('canonical', [False, True])
+@pytest.mark.parametrize('value', [
+    b'x' * 100000,
+    bytearray(b'x' * 100000),
+    'x' * 99999 + '\u00e9',
+    array('q', range(100000)),
+], ids=['bytes', 'bytearray', 'str', 'typed array'])
+def test_large_values(value, canonical):
+    # Values above the threshold for releasing the GIL while copying
+    assert loads(dumps(value, canonical=canonical)) == value
+
+
+def test_typed_array_unsupported():
+    with pytest.raises(CBOREncodeError) as exc:
+        dumps(memoryview(b'abcd').cast('B', (2, 2)))
+    assert 'unable to encode 2-dimensional typed array' in str(exc.value)
+    with pytest.raises(CBOREncodeError) as exc:
+        dumps(memoryview(b'abcd').cast('c'))
+    assert "unsupported typed array format 'c'" in str(exc.value)
+
+
 def test_custom_tag():
     expected = unhexlify('d917706548656c6c6f')
     assert dumps(CBORTag(6000, u'Hello')) == expected
@@ -314,6 +456,38 @@ def test_not_cyclic_same_object(value_sharing, expected):
     assert dumps(b, value_sharing=value_sharing) == expected
 
 
+def test_shared_attr():
+    a = [1]
+    with BytesIO() as stream:
+        encoder = CBOREncoder(stream, value_sharing=True)
+        assert encoder.shared == {}
+        b = [a, a]
+        encoder.encode(b)
+        assert encoder.shared == {id(b): (b, 0), id(a): (a, 1)}
+        with pytest.raises(AttributeError):
+            encoder.shared = {}
+        # each top-level value has its own shared values
+        encoder.encode(a)
+        assert encoder.shared == {id(a): (a, 0)}
+        assert stream.getvalue() == unhexlify('d81c82d81c8101d81d01d81c8101')
+
+
+def test_shared_reentrant_finalizer():
+    class Reentrant(list):
+        def __del__(self):
+            encoder.encode([[1], [2]])
+
+    with BytesIO() as stream:
+        encoder = CBOREncoder(stream, value_sharing=True)
+        value = [Reentrant([1]), Reentrant([2])]
+        encoder.encode(value)
+        del value
+        # releasing the shared values runs the finalizers, which encode more
+        encoder.encode([3])
+        encoder.encode([4])
+        assert stream.getvalue().endswith(unhexlify('d81c8103d81c8104'))
+
+
 def test_unsupported_type():
     with pytest.raises(CBOREncodeError) as exc:
         dumps(lambda: None)
@@ -390,17 +564,45 @@ def test_ordered_map(value, expected):
     (float('nan'), 'f97e00'),
     (float('-inf'), 'f9fc00'),
     (float.fromhex('0x1.0p-24'), 'f90001'),
+    (65504.0, 'f97bff'),
+    (65520.0, 'fa477ff000'),
     (float.fromhex('0x1.4p-24'), 'fa33a00000'),
     (float.fromhex('0x1.ff8p-63'), 'fa207fc000'),
     (1e300, 'fb7e37e43c8800759c')
 ], ids=['float 16', 'float 32', 'float 64', 'inf', 'nan', '-inf',
-        'float 16 minimum positive subnormal', 'mantissa o/f to 32',
-        'exponent o/f to 32', 'oversize float'])
+        'float 16 minimum positive subnormal', 'float 16 maximum',
+        'float 16 o/f to 32', 'mantissa o/f to 32', 'exponent o/f to 32',
+        'oversize float'])
 def test_minimal_floats(value, expected):
     expected = unhexlify(expected)
     assert dumps(value, canonical=True) == expected
 
 
+@pytest.mark.parametrize('canonical', [False, True])
+def test_array_runs(canonical):
+    # Arrays pack runs of simple items in bulk; check the result is identical
+    # to encoding each item individually
+    class MyStr(str):
+        pass
+
+    class MyInt(int):
+        pass
+
+    items = (
+        list(range(-1000, 1000, 7)) +
+        [2 ** 63 - 1, -2 ** 63, 2 ** 64, -2 ** 64 - 1, 2 ** 100] +
+        [i / 8 for i in range(-300, 300)] +
+        [1e300, 100000.0, float('inf'), float('-inf'), float('nan')] +
+        ['', 'a', 'x' * 23, 'x' * 24, 'x' * 64, 'x' * 65, 'x' * 1000,
+         '\u00e9' * 40, '\U0001f600' * 17] +
+        [None, True, False, undefined, b'bytes', [1, [2.5, 'three']], (4,)] +
+        [MyStr('sub'), MyInt(5)]
+    ) * 3
+    expected = b''.join(dumps(item, canonical=canonical) for item in items)
+    assert dumps(items, canonical=canonical) == unhexlify('990%x' % len(items)) + expected
+    assert dumps(tuple(items), canonical=canonical) == unhexlify('990%x' % len(items)) + expected
+
+
 def test_tuple_key():
     assert dumps({(2, 1): u''}) == unhexlify('a182020160')
 
@@ -428,3 +630,591 @@ def test_canonical_set(frozen):
 
     serialized = dumps(value, canonical=True)
     assert serialized == unhexlify('d9010284616161786179626161')
+
+
+def test_deterministic_attr():
+    with BytesIO() as stream:
+        encoder = CBOREncoder(stream)
+        assert not encoder.deterministic
+        encoder = CBOREncoder(stream, deterministic=True)
+        assert encoder.deterministic
+        assert encoder.enc_style == 1
+        with pytest.raises(AttributeError):
+            encoder.deterministic = False
+
+
+@pytest.mark.parametrize('value, expected', [
+    ({100: '', -1: ''}, 'a2 1864 60 20 60'),
+    ({'a': 0, b'a': 0}, 'a2 4161 00 6161 00'),
+    ({(1,): 0, 1000: 0}, 'a2 1903e8 00 8101 00'),
+    ({'b': 0, 'a': 0}, 'a2 6161 00 6162 00'),
+    ({255: 0, 2: 0}, 'a2 02 00 18ff 00'),
+    ({'x': {-1: 0, 0: 0}, 'a' * 24: 0},
+     'a2 6178 a2 00 00 20 00 7818' + '61' * 24 + '00'),
+    (OrderedDict([(-1, 0), (100, 0)]), 'a2 1864 00 20 00'),
+    ({100, -1}, 'd90102 82 1864 20'),
+    (frozenset(['aa', 'b']), 'd90102 82 6162 626161'),
+], ids=['integers', 'bytes and text', 'array', 'text', 'length', 'nested',
+        'ordered', 'set', 'frozenset'])
+@pytest.mark.parametrize('engine', ['stream', 'iterative'])
+def test_deterministic(engine, value, expected):
+    expected = unhexlify(expected.replace(' ', ''))
+    assert dumps(value, deterministic=True, engine=engine) == expected
+
+
+@pytest.mark.parametrize('value, expected', [
+    (2 ** 64 - 1, '1bffffffffffffffff'),
+    (-2 ** 64, '3bffffffffffffffff'),
+    (2 ** 64, 'c249010000000000000000'),
+    (Decimal('1.50'), 'c482211896'),
+    (Decimal('-1E+30'), 'c482181e20'),
+    (Decimal('NaN'), 'f97e00'),
+    (datetime(1970, 1, 1, 0, 0, 0, 500000, tzinfo=timezone.utc),
+     'c1f93800'),
+    (datetime(2013, 3, 21, 20, 4, 0, tzinfo=timezone.utc), 'c11a514b67b0'),
+], ids=['uint64', 'negative uint64', 'bignum', 'decimal', 'negative decimal',
+        'decimal nan', 'float timestamp', 'integer timestamp'])
+def test_deterministic_preferred(value, expected):
+    assert dumps(value, deterministic=True, datetime_as_timestamp=True) == \
+        unhexlify(expected)
+
+
+@pytest.mark.parametrize('engine', ['stream', 'iterative'])
+def test_deterministic_duplicates(engine):
+    naive = datetime(2020, 1, 1)
+    aware = datetime(2020, 1, 1, tzinfo=timezone.utc)
+    with pytest.raises(CBOREncodeError) as exc:
+        dumps({naive: 1, aware: 2}, deterministic=True, engine=engine,
+              timezone=timezone.utc)
+    assert 'duplicate map key' in str(exc.value)
+    with pytest.raises(CBOREncodeError) as exc:
+        dumps({naive, aware}, deterministic=True, engine=engine,
+              timezone=timezone.utc)
+    assert 'duplicate set item' in str(exc.value)
+
+
+def test_deterministic_local_timestamp():
+    class LocalTime(tzinfo):
+        def utcoffset(self, dt):
+            return None
+
+    value = datetime(2020, 1, 1, tzinfo=LocalTime())
+    with pytest.raises(CBOREncodeError):
+        dumps(value, datetime_as_timestamp=True, deterministic=True)
+
+
+@pytest.mark.parametrize('string_referencing', [False, True])
+@pytest.mark.parametrize('engine', ['stream', 'iterative'])
+def test_deterministic_roundtrip(engine, string_referencing):
+    value = {
+        'docs': [{'id': i, 'name': 'doc-%d' % i, i: [i / 4]} for i in range(30)],
+        (1, 'key'): {'nested': {2: 'two', 'two': 2}},
+        b'tags': {'red', 'green', 'blue'},
+    }
+    reordered = dict(reversed(list(value.items())))
+    encoded = dumps(value, deterministic=True, engine=engine,
+                    string_referencing=string_referencing)
+    assert encoded == dumps(reordered, deterministic=True, engine=engine,
+                            string_referencing=string_referencing)
+    assert loads(encoded) == value
+
+
+class DummyList(list):
+    pass
+
+
+@pytest.mark.parametrize('options', [
+    {},
+    {'canonical': True},
+    {'value_sharing': True},
+    {'canonical': True, 'value_sharing': True},
+], ids=['regular', 'canonical', 'sharing', 'canonical-sharing'])
+@pytest.mark.parametrize('value', [
+    [],
+    {},
+    [1, -1, 2 ** 64, 1.5, 0.1, u'foo', u'x' * 100, b'bar', None, True, False],
+    (1, (2, (3, [4, {5: 6}]))),
+    {u'b': [1.0, 2.5, float('inf')], u'a': {(1, 2): u'c', 3: [None]}},
+    [[1.0] * 40, [u'y' * 64] * 100, list(range(1000))],
+    [CBORTag(3000, [1, {u'a': 2}]), {1, 2}, DummyList([[1], [2]])],
+    [Decimal('1.5'), datetime(2013, 3, 21, tzinfo=timezone.utc), undefined],
+], ids=['empty-array', 'empty-map', 'simple', 'nested', 'map', 'long', 'tags',
+        'other'])
+def test_iterative_engine(value, options):
+    value = [value, value, [value]]
+    assert dumps(value, engine='iterative', **options) == dumps(value, **options)
+
+
+def test_iterative_engine_deep():
+    value = []
+    for i in range(100000):
+        value = [value, {u'a': i}]
+    with pytest.raises(RecursionError):
+        dumps(value)
+    assert dumps(value, engine='iterative').startswith(
+        unhexlify('82' * 100000 + '80a1616100'))
+
+
+def test_iterative_engine_cyclic():
+    a = [1, {u'a': [2]}]
+    a[1][u'a'].append(a)
+    with pytest.raises(CBOREncodeError) as exc:
+        dumps(a, engine='iterative')
+    exc.match('cyclic data structure detected but value_sharing is False')
+    assert dumps(a, engine='iterative', value_sharing=True) == unhexlify(
+        'd81c8201d81ca16161d81c8202d81d00')
+    b = DummyList([a])
+    a[1][u'a'][1] = b
+    with pytest.raises(CBOREncodeError):
+        dumps(b, engine='iterative')
+
+
+def test_iterative_engine_default():
+    class DummyType(object):
+        def __init__(self, value):
+            self.value = value
+
+    def default_encoder(encoder, value):
+        encoder.encode(value.value)
+
+    a = [1]
+    a.append(DummyType(a))
+    assert dumps([DummyType([1, 2])], engine='iterative',
+                 default=default_encoder) == unhexlify('81820102')
+    with pytest.raises(CBOREncodeError):
+        dumps(a, engine='iterative', default=default_encoder)
+
+
+def test_string_referencing_attr():
+    with BytesIO() as stream:
+        encoder = CBOREncoder(stream)
+        assert not encoder.string_referencing
+        encoder.string_referencing = True
+        assert encoder.string_referencing
+        assert CBOREncoder(stream, string_referencing=True).string_referencing
+
+
+@pytest.mark.parametrize('value, expected', [
+    ('aaa', 'd9010063616161'),
+    (['aaa', 'aaa'], 'd901008263616161d81900'),
+    (['aa', 'aa'], 'd9010082626161626161'),
+    (['aaa', b'aaa', 'aaa', b'aaa'], 'd90100846361616143616161d81900d81901'),
+    ({'aaa': 'aaa'}, 'd90100a163616161d81900'),
+], ids=['single', 'repeated', 'short', 'bytes', 'map'])
+@pytest.mark.parametrize('engine', ['stream', 'iterative'])
+def test_string_referencing(engine, value, expected):
+    assert dumps(value, string_referencing=True, engine=engine) == \
+        unhexlify(expected)
+
+
+@pytest.mark.parametrize('canonical', [False, True])
+@pytest.mark.parametrize('engine', ['stream', 'iterative'])
+def test_string_referencing_roundtrip(engine, canonical):
+    value = [
+        {'name': 'first', 'tags': ['alpha', 'beta'], b'raw': b'bytes'},
+        {'name': 'second', 'tags': ['beta', 'alpha'], b'raw': b'bytes'},
+        frozenset(['alpha', 'gamma']),
+        datetime(2020, 1, 1, tzinfo=timezone.utc),
+        array('h', [1, 2, 3]),
+        'alpha', 'second', b'bytes',
+    ]
+    encoded = dumps(value, string_referencing=True, engine=engine,
+                    canonical=canonical)
+    assert len(encoded) < len(dumps(value, canonical=canonical))
+    decoded = loads(encoded)
+    assert decoded[:4] == value[:4]
+    assert decoded[5:] == value[5:]
+    assert decoded[5] is decoded[0]['tags'][0]
+
+
+def test_string_referencing_per_message():
+    # each top-level value has its own namespace
+    with BytesIO() as stream:
+        encoder = CBOREncoder(stream, string_referencing=True)
+        encoder.encode('aaa')
+        encoder.encode(['aaa', 'aaa'])
+        assert stream.getvalue() == unhexlify(
+            'd9010063616161d901008263616161d81900')
+
+
+def test_packed_attr():
+    with BytesIO() as stream:
+        encoder = CBOREncoder(stream)
+        assert not encoder.packed
+        encoder.packed = True
+        assert encoder.packed
+        assert CBOREncoder(stream, packed=True).packed
+
+
+@pytest.mark.parametrize('value, expected', [
+    (['hello world'] * 3, 'd87183816b68656c6c6f20776f726c648083e0e0e0'),
+    ([[1, 2, 3, 4, 5, 6]] * 4, 'd8718381860102030405068084e0e0e0e0'),
+    ([[1, 2, 3], [1, 2, 3]], '828301020383010203'),
+    (['aa', 'aa'], '82626161626161'),
+], ids=['strings', 'arrays', 'too small', 'too short'])
+def test_packed(value, expected):
+    assert dumps(value, packed=True) == unhexlify(expected)
+
+
+@pytest.mark.parametrize('string_referencing', [False, True])
+@pytest.mark.parametrize('canonical', [False, True])
+@pytest.mark.parametrize('engine', ['stream', 'iterative'])
+def test_packed_roundtrip(engine, canonical, string_referencing):
+    meta = {'kind': 'sensor', 'unit': 'celsius', 'tags': ['indoor', 'east']}
+    value = [
+        {'name': 'probe-%d' % (i % 3), 'meta': meta, 'value': i % 4,
+         'range': [0, 100], 'seen': frozenset(['east', 'indoor'])}
+        for i in range(20)
+    ]
+    encoded = dumps(value, packed=True, engine=engine, canonical=canonical,
+                    string_referencing=string_referencing)
+    assert len(encoded) < len(dumps(value, canonical=canonical)) // 4
+    assert loads(encoded) == value
+    decoded = loads(encoded, packed_sharing=True)
+    assert decoded == value
+    assert decoded[0]['meta'] is decoded[1]['meta']
+
+
+def test_packed_cyclic():
+    # cyclic values are left to value sharing, which disables packing
+    value = [['repeated', 'repeated']]
+    value.append(value)
+    with pytest.raises(CBOREncodeError):
+        dumps(value, packed=True)
+    encoded = dumps(value, packed=True, value_sharing=True)
+    assert encoded == dumps(value, value_sharing=True)
+
+
+Point = namedtuple('Point', 'x y label')
+
+
+@dataclass
+class Reading:
+    sensor: str
+    values: list
+
+
+class Slotted:
+    __slots__ = ('name', '__secret')
+
+    def __init__(self, name, secret):
+        self.name = name
+        self.__secret = secret
+
+
+class SlottedChild(Slotted):
+    __slots__ = 'extra'
+
+    def __init__(self, name, secret, extra):
+        super().__init__(name, secret)
+        self.extra = extra
+
+
+@pytest.mark.parametrize('value, fields, expected', [
+    (Point(1, 2.5, 'a'), ('x', 'y', 'label'),
+     {'x': 1, 'y': 2.5, 'label': 'a'}),
+    (Reading('probe', [1, 2]), ('sensor', 'values'),
+     {'sensor': 'probe', 'values': [1, 2]}),
+    (SlottedChild('n', None, ['e']), ('name', '__secret', 'extra'),
+     {'name': 'n', '__secret': None, 'extra': ['e']}),
+], ids=['namedtuple', 'dataclass', 'slots'])
+@pytest.mark.parametrize('canonical', [False, True])
+def test_compile_schema(value, fields, expected, canonical):
+    schema = compile_schema(type(value), register=False)
+    assert schema.type is type(value)
+    assert schema.fields == fields
+    with BytesIO() as stream:
+        encoder = CBOREncoder(stream, canonical=canonical)
+        encoder.encoders[type(value)] = schema
+        encoder.encode([value, value])
+        assert stream.getvalue() == dumps([expected, expected],
+                                          canonical=canonical)
+
+
+def test_compile_schema_register():
+    Local = namedtuple('Local', 'a b')
+    schema = compile_schema(Local)
+    assert default_encoders[Local] is schema
+    assert dumps(Local(1, 'x' * 100)) == dumps({'a': 1, 'b': 'x' * 100})
+    assert dumps(Local('abc', 'abc'), string_referencing=True) == \
+        dumps({'a': 'abc', 'b': 'abc'}, string_referencing=True)
+    assert CBORSchema(Local, fields=['b']).fields == ('b',)
+
+
+def test_compile_schema_errors():
+    with pytest.raises(TypeError):
+        compile_schema(int)
+    with pytest.raises(TypeError):
+        compile_schema(Point, fields=[1])
+    with pytest.raises(ValueError):
+        compile_schema(Point, fields=['x', 'x'])
+    schema = compile_schema(Point, register=False)
+    with BytesIO() as stream:
+        with pytest.raises(CBOREncodeError):
+            schema(CBOREncoder(stream), Reading('probe', []))
+    with pytest.raises(AttributeError):
+        dumps(Slotted.__new__(Slotted),
+              default=compile_schema(Slotted, register=False))
+
+
+def test_compile_schema_foreign_slot():
+    # a slot of another class is only an attribute here, which getattr
+    # refuses to read
+    class Foreign:
+        y = Slotted.__dict__['name']
+    schema = compile_schema(Foreign, fields=['y'], register=False)
+    with pytest.raises(TypeError):
+        dumps(Foreign(), default=schema)
+
+
+def test_compile_schema_cyclic():
+    value = SlottedChild('n', None, None)
+    value.extra = value
+    schema = compile_schema(SlottedChild, register=False)
+    with BytesIO() as stream:
+        encoder = CBOREncoder(stream)
+        encoder.encoders[SlottedChild] = schema
+        with pytest.raises(CBOREncodeError):
+            encoder.encode(value)
+    with BytesIO() as stream:
+        encoder = CBOREncoder(stream, value_sharing=True)
+        encoder.encoders[SlottedChild] = schema
+        encoder.encode(value)
+        decoded = loads(stream.getvalue())
+        assert decoded['extra'] is decoded
+
+
+def test_columnar_attr():
+    with BytesIO() as stream:
+        encoder = CBOREncoder(stream)
+        assert not encoder.columnar
+        encoder.columnar = True
+        assert encoder.columnar
+        assert CBOREncoder(stream, columnar=True).columnar
+
+
+@pytest.mark.parametrize('value, expected', [
+    ([{'a': i, 'b': 'x'} for i in range(4)],
+     'da00636f6c 83 8261616162 8400010203 84617861786178 6178'),
+    ([{'a': i * 100} for i in range(4)],
+     'da00636f6c 82 816161 d845 48 0000 6400 c800 2c01'),
+    ([{'a': i * -100} for i in range(4)],
+     'da00636f6c 82 816161 d84d 48 0000 9cff 38ff d4fe'),
+    ([{'a': i * 70000} for i in range(4)],
+     'da00636f6c 82 816161 d846 50 00000000 70110100 e0220200 50340300'),
+    ([{'a': i / 2} for i in range(4)],
+     'da00636f6c 82 816161 d855 50 00000000 0000003f 0000803f 0000c03f'),
+    ([{'a': i / 10} for i in range(4)],
+     'da00636f6c 82 816161 d856 5820 0000000000000000 9a9999999999b93f '
+     '9a9999999999c93f 333333333333d33f'),
+    ([{'a': i, 'b': i * 1000} for i in range(4)],
+     'da00636f6c 83 8261616162 8400010203 d845 48 0000 e803 d007 b80b'),
+], ids=['simple', 'uint16', 'int16', 'uint32', 'float32', 'float64',
+        'mixed'])
+def test_columnar(value, expected):
+    assert dumps(value, columnar=True) == unhexlify(expected.replace(' ', ''))
+
+
+@pytest.mark.parametrize('value, options', [
+    ([{'a': 1}] * 3, {}),
+    ([{'a': 1}, {'a': 1}, {'b': 1}, {'a': 1}], {}),
+    ([{'a': 1, 'b': 2}] * 3 + [{'b': 2, 'a': 1}], {}),
+    ([{'a': 1}] * 3 + [{'a': 1, 'b': 2}], {}),
+    ([{1: 1}] * 4, {}),
+    ([{}] * 4, {}),
+    ([{'a': 1}] * 3 + [[('a', 1)]], {}),
+    ([{'a': 1}] * 4, {'canonical': True}),
+    ([{'a': 1}] * 4, {'value_sharing': True}),
+    ([{'a': 1}] * 4, {'packed': True}),
+], ids=['too short', 'keys', 'order', 'length', 'non-str', 'empty', 'types',
+        'canonical', 'value_sharing', 'packed'])
+def test_columnar_unchanged(value, options):
+    assert dumps(value, columnar=True, **options) == dumps(value, **options)
+
+
+@pytest.mark.parametrize('engine', ['stream', 'iterative'])
+def test_columnar_records(engine):
+    schema = compile_schema(Point, register=False)
+    value = [Point(i, 'p', None) for i in range(4)]
+    with BytesIO() as stream:
+        encoder = CBOREncoder(stream, columnar=True, engine=engine)
+        encoder.encoders[Point] = schema
+        encoder.encoders[Reading] = compile_schema(Reading, register=False)
+        encoder.encode(value)
+        assert stream.getvalue() == unhexlify(
+            'da00636f6c 84 83 6178 6179 656c6162656c 84 00 01 02 03'
+            '84 6170 6170 6170 6170 84 f6 f6 f6 f6'.replace(' ', ''))
+        # A record of another type means the list is encoded as usual
+        value.append(Reading('probe', []))
+        stream.seek(0)
+        stream.truncate()
+        encoder.encode(value)
+        assert stream.getvalue() == dumps([
+            {'x': i, 'y': 'p', 'label': None} for i in range(4)
+        ] + [{'sensor': 'probe', 'values': []}])
+
+
+@pytest.mark.parametrize('string_referencing', [False, True])
+@pytest.mark.parametrize('engine', ['stream', 'iterative'])
+def test_columnar_roundtrip(engine, string_referencing):
+    value = {
+        'docs': [
+            {'id': i, 'title': 'doc %d' % (i % 3), 'rank': i / 7,
+             'size': i * 1000, 'tags': [{'tag': 'x', 'weight': i}] * 4}
+            for i in range(20)
+        ],
+        'short': [{'a': 1}] * 2,
+    }
+    encoded = dumps(value, columnar=True, engine=engine,
+                    string_referencing=string_referencing)
+    assert len(encoded) < len(dumps(value))
+    assert loads(encoded) == value
+
+
+@pytest.mark.parametrize('engine', ['stream', 'iterative'])
+def test_columnar_cyclic(engine):
+    value = {'a': 1}
+    value['b'] = value
+    with pytest.raises(CBOREncodeError):
+        dumps([value] * 4, columnar=True, engine=engine)
+    value = [{'a': 1} for i in range(4)]
+    value[2]['a'] = value
+    with pytest.raises(CBOREncodeError):
+        dumps(value, columnar=True, engine=engine)
+
+
+@pytest.mark.parametrize('engine', ['stream', 'iterative'])
+def test_digest(engine):
+    value = {
+        'large': b'\x01' * 200000,
+        'items': [{'id': i, 'name': 'item %d' % i} for i in range(5000)],
+        'set': {3, 1, 2},
+    }
+    assert digest(value, engine=engine) == hashlib.sha256(
+        dumps(value, canonical=True)).digest()
+    assert digest({}, engine=engine) == hashlib.sha256(b'\xa0').digest()
+
+
+def test_digest_options():
+    value = {'b': [1, 2.5], 'a': 'text', 'c': datetime(2013, 3, 21)}
+    expected = dumps(value, canonical=True, timezone=timezone.utc)
+    assert digest(obj=value, algorithm='md5', timezone=timezone.utc) == \
+        hashlib.md5(expected).digest()
+    assert digest(value, hashlib.blake2b, timezone=timezone.utc) == \
+        hashlib.blake2b(expected).digest()
+    assert digest(value, canonical=False, timezone=timezone.utc) == \
+        hashlib.sha256(dumps(value, timezone=timezone.utc)).digest()
+    assert digest(value, deterministic=True, timezone=timezone.utc) == \
+        hashlib.sha256(dumps(value, deterministic=True,
+                             timezone=timezone.utc)).digest()
+    assert digest(Decimal('1.5'), default=lambda e, v: None) == \
+        hashlib.sha256(dumps(Decimal('1.5'), canonical=True)).digest()
+
+
+def test_digest_errors():
+    with pytest.raises(ValueError):
+        digest(1, 'no-such-hash')
+    with pytest.raises(TypeError):
+        digest(1, 'sha256', True)
+    with pytest.raises(TypeError):
+        digest()
+    with pytest.raises(CBOREncodeError):
+        digest(object())
+
+
+def test_digest_retained_chunk():
+    class Hash:
+        def __init__(self):
+            self.chunks = []
+        def update(self, data):
+            self.chunks.append((data, data[:]))
+        def digest(self):
+            return b''
+    value = ['x' * 100] * 2000 + [b'y' * 100000, 'z' * 100000]
+    h = Hash()
+    digest(value, algorithm=lambda: h, canonical=False)
+    expected = dumps(value)
+    # the chunks, and slices of them, are unaffected by later output
+    assert len(h.chunks) > 1
+    assert b''.join(bytes(chunk) for chunk, _ in h.chunks) == expected
+    assert b''.join(bytes(piece) for _, piece in h.chunks) == expected
+
+
+@pytest.mark.parametrize('engine', ['stream', 'iterative'])
+def test_encode_iter(engine):
+    with BytesIO() as stream:
+        encoder = CBOREncoder(stream, engine=engine)
+        def rows():
+            for i in range(3):
+                # Each item is written before the next is produced
+                assert len(stream.getvalue()) == 1 + i * 2
+                yield [i]
+        encoder.encode_iter(rows())
+        assert stream.getvalue() == unhexlify('9f810081018102ff')
+    assert dumps(iter([]), default=CBOREncoder.encode_iter) == b'\x9f\xff'
+
+
+@pytest.mark.parametrize('engine', ['stream', 'iterative'])
+def test_encode_items(engine):
+    with BytesIO() as stream:
+        encoder = CBOREncoder(stream, engine=engine)
+        encoder.encode_items((k, [v]) for k, v in [('a', 1), ('b', 2)])
+        assert stream.getvalue() == unhexlify('bf61618101616281' '02ff')
+        assert loads(stream.getvalue()) == {'a': [1], 'b': [2]}
+    with BytesIO() as stream:
+        encoder = CBOREncoder(stream)
+        with pytest.raises(CBOREncodeError):
+            encoder.encode_items([('a', 1, 2)])
+        with pytest.raises(TypeError):
+            encoder.encode_items([1])
+        with pytest.raises(TypeError):
+            encoder.encode_items(1)
+
+
+def test_begin_end():
+    with BytesIO() as stream:
+        encoder = CBOREncoder(stream)
+        encoder.begin_map()
+        encoder.encode('a')
+        encoder.begin_array()
+        encoder.encode(1)
+        encoder.encode_iter(range(2))
+        encoder.end()
+        encoder.end()
+        assert stream.getvalue() == unhexlify('bf61619f019f0001ffffff')
+        assert loads(stream.getvalue()) == {'a': [1, [0, 1]]}
+        with pytest.raises(CBOREncodeError):
+            encoder.end()
+
+
+def test_streaming_shared():
+    shared = ['x']
+    with BytesIO() as stream:
+        encoder = CBOREncoder(stream, value_sharing=True,
+                              string_referencing=True)
+        encoder.begin_array()
+        encoder.encode(['shared', shared])
+        encoder.encode(['shared', shared])
+        encoder.end()
+        encoded = stream.getvalue()
+    result = loads(encoded)
+    assert result == [['shared', ['x']], ['shared', ['x']]]
+    assert result[0][1] is result[1][1]
+    assert encoded == unhexlify(
+        'd901009fd81c8266736861726564d81c816178d81c82d81900d81d01ff')
+
+
+@pytest.mark.parametrize('options', [
+    {'canonical': True},
+    {'deterministic': True},
+])
+def test_streaming_canonical(options):
+    with BytesIO() as stream:
+        encoder = CBOREncoder(stream, **options)
+        with pytest.raises(CBOREncodeError):
+            encoder.encode_iter([1])
+        with pytest.raises(CBOREncodeError):
+            encoder.encode_items({})
+        with pytest.raises(CBOREncodeError):
+            encoder.begin_array()
+        assert stream.getvalue() == b''